@@ -0,0 +1,575 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+// Load test of test_broker over the loopback interface.
+//
+// The broker runs on its own thread behind one of the test servers. N publishers
+// publish to one topic, and M subscribers subscribe to it, so each message is
+// delivered M times. The result of each scenario is printed as a JSON object.
+//
+// usage: broker_bench [--transport tcp,ws,tls,tls_ws] [--version v3.1.1,v5] [--qos 0,1,2]
+//                     [--publishers 1,4] [--subscribers 1,4] [--messages N] [--payload bytes]
+//                     [--inflight N] [--timeout sec]
+// Each list option runs all the given values, so a matrix of scenarios is run.
+
+#include <mqtt/variant.hpp> // should be top to configure variant limit
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(MQTT_USE_TLS)
+#include <boost/test/framework.hpp>
+#include <boost/test/tree/test_unit.hpp>
+#endif // defined(MQTT_USE_TLS)
+
+#include <mqtt/async_client.hpp>
+#include <mqtt/four_byte_util.hpp>
+
+#include "../test/test_settings.hpp"
+#include "../test/test_broker.hpp"
+#include "../test/test_server_no_tls.hpp"
+#if defined(MQTT_USE_TLS)
+#include "../test/test_server_tls.hpp"
+#endif // defined(MQTT_USE_TLS)
+#if defined(MQTT_USE_WS)
+#include "../test/test_server_no_tls_ws.hpp"
+#if defined(MQTT_USE_TLS)
+#include "../test/test_server_tls_ws.hpp"
+#endif // defined(MQTT_USE_TLS)
+#endif // defined(MQTT_USE_WS)
+
+namespace as = boost::asio;
+
+namespace {
+
+struct options {
+    std::vector<std::string> transports { "tcp" };
+    std::vector<MQTT_NS::protocol_version> versions { MQTT_NS::protocol_version::v3_1_1, MQTT_NS::protocol_version::v5 };
+    std::vector<MQTT_NS::qos> qoss { MQTT_NS::qos::at_most_once, MQTT_NS::qos::at_least_once, MQTT_NS::qos::exactly_once };
+    std::vector<std::size_t> publishers { 1 };
+    std::vector<std::size_t> subscribers { 1 };
+    std::size_t messages = 10000;     // per publisher
+    std::size_t payload = 64;         // bytes, at least the size of the timestamp
+    std::size_t inflight = 32;        // per publisher
+    std::chrono::seconds timeout { 60 };
+    std::string base;                 // directory of the certificates
+};
+
+struct scenario {
+    std::string transport;
+    MQTT_NS::protocol_version version;
+    MQTT_NS::qos qos_value;
+    std::size_t publishers;
+    std::size_t subscribers;
+};
+
+struct result {
+    std::size_t expected = 0;
+    std::size_t received = 0;
+    std::chrono::steady_clock::duration elapsed { 0 };
+    std::vector<std::uint64_t> latencies; // nanoseconds
+};
+
+constexpr char const* topic = "bench/topic";
+constexpr std::size_t timestamp_size = 8;
+
+std::uint64_t now_ns() {
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()
+        ).count()
+    );
+}
+
+MQTT_NS::buffer make_payload(std::size_t size) {
+    std::string s;
+    auto ts = now_ns();
+    MQTT_NS::add_uint32_t_to_buf(s, static_cast<std::uint32_t>(ts >> 32));
+    MQTT_NS::add_uint32_t_to_buf(s, static_cast<std::uint32_t>(ts));
+    s.resize(std::max(size, timestamp_size), 'x');
+    return MQTT_NS::allocate_buffer(s);
+}
+
+std::uint64_t payload_timestamp(MQTT_NS::buffer const& contents) {
+    if (contents.size() < timestamp_size) return 0;
+    auto p = contents.data();
+    return
+        (static_cast<std::uint64_t>(MQTT_NS::make_uint32_t(p, p + 4)) << 32) |
+        MQTT_NS::make_uint32_t(p + 4, p + 8);
+}
+
+// Drives the clients of one scenario on ioc. Client is the shared_ptr type of the client.
+template <typename Client>
+class runner {
+public:
+    runner(as::io_context& ioc, scenario const& sc, options const& opts)
+        :ioc_(ioc), sc_(sc), opts_(opts), tim_(ioc) {
+        res_.expected = sc.publishers * opts.messages * sc.subscribers;
+        res_.latencies.reserve(res_.expected);
+    }
+
+    template <typename Factory>
+    result run(Factory const& make_client) {
+        // The handlers refer to the elements, so the vectors must not be reallocated.
+        subs_.reserve(sc_.subscribers);
+        pubs_.reserve(sc_.publishers);
+        for (std::size_t i = 0; i != sc_.subscribers; ++i) {
+            subs_.emplace_back(make_client());
+            setup_subscriber(subs_.back(), "sub" + std::to_string(i));
+        }
+        for (std::size_t i = 0; i != sc_.publishers; ++i) {
+            pubs_.emplace_back(make_client());
+            setup_publisher(pubs_.back(), "pub" + std::to_string(i));
+        }
+        tim_.expires_after(opts_.timeout);
+        tim_.async_wait(
+            [this](MQTT_NS::error_code ec) {
+                if (!ec) finish();
+            }
+        );
+        for (auto& c : subs_) c->async_connect();
+        ioc_.run();
+        return MQTT_NS::force_move(res_);
+    }
+
+private:
+    struct publisher_state {
+        std::size_t sent = 0;
+        std::size_t pending = 0;
+    };
+
+    void setup_common(Client& c, std::string const& client_id) {
+        c->set_client_id(client_id);
+        c->set_clean_session(true);
+        c->set_error_handler([](MQTT_NS::error_code) {});
+        c->set_close_handler([] {});
+    }
+
+    void setup_subscriber(Client& c, std::string const& client_id) {
+        setup_common(c, client_id);
+        auto on_connack =
+            [this, &c] {
+                c->async_subscribe(std::string(topic), sc_.qos_value);
+            };
+        auto on_suback =
+            [this] {
+                if (++subscribed_ == subs_.size()) {
+                    for (auto& p : pubs_) p->async_connect();
+                }
+            };
+        auto on_publish =
+            [this](MQTT_NS::buffer const& contents) {
+                auto ts = payload_timestamp(contents);
+                res_.latencies.push_back(now_ns() - ts);
+                if (++res_.received == res_.expected) finish();
+            };
+        if (sc_.version == MQTT_NS::protocol_version::v5) {
+            c->set_v5_connack_handler(
+                [on_connack](bool, MQTT_NS::v5::connect_reason_code, MQTT_NS::v5::properties) {
+                    on_connack();
+                    return true;
+                }
+            );
+            c->set_v5_suback_handler(
+                [on_suback](std::uint16_t, std::vector<MQTT_NS::v5::suback_reason_code>, MQTT_NS::v5::properties) {
+                    on_suback();
+                    return true;
+                }
+            );
+            c->set_v5_publish_handler(
+                [on_publish]
+                (MQTT_NS::optional<std::uint16_t>, MQTT_NS::publish_options, MQTT_NS::buffer, MQTT_NS::buffer contents, MQTT_NS::v5::properties) {
+                    on_publish(contents);
+                    return true;
+                }
+            );
+        }
+        else {
+            c->set_connack_handler(
+                [on_connack](bool, MQTT_NS::connect_return_code) {
+                    on_connack();
+                    return true;
+                }
+            );
+            c->set_suback_handler(
+                [on_suback](std::uint16_t, std::vector<MQTT_NS::suback_return_code>) {
+                    on_suback();
+                    return true;
+                }
+            );
+            c->set_publish_handler(
+                [on_publish]
+                (MQTT_NS::optional<std::uint16_t>, MQTT_NS::publish_options, MQTT_NS::buffer, MQTT_NS::buffer contents) {
+                    on_publish(contents);
+                    return true;
+                }
+            );
+        }
+    }
+
+    void setup_publisher(Client& c, std::string const& client_id) {
+        setup_common(c, client_id);
+        states_.emplace_back();
+        auto idx = states_.size() - 1;
+        auto on_connack =
+            [this] {
+                if (++connected_ == pubs_.size()) {
+                    start_ = std::chrono::steady_clock::now();
+                    for (std::size_t i = 0; i != pubs_.size(); ++i) send(i);
+                }
+            };
+        // QoS 0 publishes are completed when they are written, the others when they are acknowledged.
+        auto on_ack =
+            [this, idx] {
+                --states_[idx].pending;
+                send(idx);
+            };
+        if (sc_.version == MQTT_NS::protocol_version::v5) {
+            c->set_v5_connack_handler(
+                [on_connack](bool, MQTT_NS::v5::connect_reason_code, MQTT_NS::v5::properties) {
+                    on_connack();
+                    return true;
+                }
+            );
+            c->set_v5_puback_handler(
+                [on_ack](std::uint16_t, MQTT_NS::v5::puback_reason_code, MQTT_NS::v5::properties) {
+                    on_ack();
+                    return true;
+                }
+            );
+            c->set_v5_pubcomp_handler(
+                [on_ack](std::uint16_t, MQTT_NS::v5::pubcomp_reason_code, MQTT_NS::v5::properties) {
+                    on_ack();
+                    return true;
+                }
+            );
+        }
+        else {
+            c->set_connack_handler(
+                [on_connack](bool, MQTT_NS::connect_return_code) {
+                    on_connack();
+                    return true;
+                }
+            );
+            c->set_puback_handler(
+                [on_ack](std::uint16_t) {
+                    on_ack();
+                    return true;
+                }
+            );
+            c->set_pubcomp_handler(
+                [on_ack](std::uint16_t) {
+                    on_ack();
+                    return true;
+                }
+            );
+        }
+    }
+
+    void send(std::size_t idx) {
+        auto& st = states_[idx];
+        auto& c = pubs_[idx];
+        while (!finished_ && st.pending < opts_.inflight && st.sent < opts_.messages) {
+            ++st.pending;
+            ++st.sent;
+            if (sc_.qos_value == MQTT_NS::qos::at_most_once) {
+                c->async_publish(
+                    MQTT_NS::allocate_buffer(topic),
+                    make_payload(opts_.payload),
+                    sc_.qos_value,
+                    MQTT_NS::any(),
+                    [this, idx](MQTT_NS::error_code ec) {
+                        if (ec) return;
+                        --states_[idx].pending;
+                        send(idx);
+                    }
+                );
+            }
+            else {
+                c->async_publish(
+                    MQTT_NS::allocate_buffer(topic),
+                    make_payload(opts_.payload),
+                    sc_.qos_value
+                );
+            }
+        }
+    }
+
+    void finish() {
+        if (finished_) return;
+        finished_ = true;
+        res_.elapsed = std::chrono::steady_clock::now() - start_;
+        tim_.cancel();
+        for (auto& c : pubs_) c->force_disconnect();
+        for (auto& c : subs_) c->force_disconnect();
+    }
+
+    as::io_context& ioc_;
+    scenario const& sc_;
+    options const& opts_;
+    as::steady_timer tim_;
+    std::vector<Client> subs_;
+    std::vector<Client> pubs_;
+    std::vector<publisher_state> states_;
+    std::size_t subscribed_ = 0;
+    std::size_t connected_ = 0;
+    bool finished_ = false;
+    std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+    result res_;
+};
+
+// Run the broker behind Server on its own thread while the clients run.
+template <typename Server, typename Run>
+result with_broker(Run const& run) {
+    as::io_context iocb;
+    test_broker b(iocb);
+    MQTT_NS::optional<Server> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto res = run();
+    as::post(
+        iocb,
+        [&] {
+            s->close();
+        }
+    );
+    th.join();
+    return res;
+}
+
+template <typename Factory>
+result run_clients(scenario const& sc, options const& opts, Factory const& factory) {
+    as::io_context ioc;
+    using client_t = decltype(factory(ioc));
+    runner<client_t> r(ioc, sc, opts);
+    return r.run([&] { return factory(ioc); });
+}
+
+result run_scenario(scenario const& sc, options const& opts) {
+    if (sc.transport == "tcp") {
+        return with_broker<test_server_no_tls>(
+            [&] {
+                return run_clients(
+                    sc, opts,
+                    [&](as::io_context& ioc) {
+                        return MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port, sc.version);
+                    }
+                );
+            }
+        );
+    }
+#if defined(MQTT_USE_TLS)
+    if (sc.transport == "tls") {
+        return with_broker<test_server_tls>(
+            [&] {
+                return run_clients(
+                    sc, opts,
+                    [&](as::io_context& ioc) {
+                        auto c = MQTT_NS::make_tls_async_client(ioc, broker_url, broker_tls_port, sc.version);
+                        c->get_ssl_context().load_verify_file(opts.base + "cacert.pem");
+                        return c;
+                    }
+                );
+            }
+        );
+    }
+#endif // defined(MQTT_USE_TLS)
+#if defined(MQTT_USE_WS)
+    if (sc.transport == "ws") {
+        return with_broker<test_server_no_tls_ws>(
+            [&] {
+                return run_clients(
+                    sc, opts,
+                    [&](as::io_context& ioc) {
+                        return MQTT_NS::make_async_client_ws(ioc, broker_url, broker_notls_ws_port, "/", sc.version);
+                    }
+                );
+            }
+        );
+    }
+#if defined(MQTT_USE_TLS)
+    if (sc.transport == "tls_ws") {
+        return with_broker<test_server_tls_ws>(
+            [&] {
+                return run_clients(
+                    sc, opts,
+                    [&](as::io_context& ioc) {
+                        auto c = MQTT_NS::make_tls_async_client_ws(ioc, broker_url, broker_tls_ws_port, "/", sc.version);
+                        c->get_ssl_context().load_verify_file(opts.base + "cacert.pem");
+                        return c;
+                    }
+                );
+            }
+        );
+    }
+#endif // defined(MQTT_USE_TLS)
+#endif // defined(MQTT_USE_WS)
+    throw std::runtime_error("transport " + sc.transport + " is not available in this build");
+}
+
+double percentile_us(std::vector<std::uint64_t> const& sorted, double q) {
+    if (sorted.empty()) return 0;
+    auto idx = std::min(sorted.size() - 1, static_cast<std::size_t>(q * static_cast<double>(sorted.size())));
+    return static_cast<double>(sorted[idx]) / 1000.0;
+}
+
+void print_json(std::ostream& os, scenario const& sc, options const& opts, result res) {
+    std::sort(res.latencies.begin(), res.latencies.end());
+    auto sec = std::chrono::duration<double>(res.elapsed).count();
+    auto msgs_per_sec = sec > 0 ? static_cast<double>(res.received) / sec : 0;
+    auto bytes = static_cast<double>(res.received) * static_cast<double>(std::max(opts.payload, timestamp_size));
+    os << std::fixed << std::setprecision(3)
+       << "{"
+       << "\"transport\":\"" << sc.transport << "\","
+       << "\"version\":\"" << (sc.version == MQTT_NS::protocol_version::v5 ? "v5" : "v3.1.1") << "\","
+       << "\"qos\":" << static_cast<int>(sc.qos_value) << ","
+       << "\"publishers\":" << sc.publishers << ","
+       << "\"subscribers\":" << sc.subscribers << ","
+       << "\"messages_per_publisher\":" << opts.messages << ","
+       << "\"payload_bytes\":" << std::max(opts.payload, timestamp_size) << ","
+       << "\"expected\":" << res.expected << ","
+       << "\"received\":" << res.received << ","
+       << "\"elapsed_sec\":" << sec << ","
+       << "\"msgs_per_sec\":" << msgs_per_sec << ","
+       << "\"mb_per_sec\":" << (sec > 0 ? bytes / sec / (1024 * 1024) : 0) << ","
+       << "\"latency_us\":{"
+       << "\"p50\":" << percentile_us(res.latencies, 0.5) << ","
+       << "\"p99\":" << percentile_us(res.latencies, 0.99) << ","
+       << "\"p999\":" << percentile_us(res.latencies, 0.999) << ","
+       << "\"max\":" << (res.latencies.empty() ? 0 : static_cast<double>(res.latencies.back()) / 1000.0)
+       << "}"
+       << "}";
+}
+
+std::vector<std::string> split(std::string const& s) {
+    std::vector<std::string> ret;
+    std::stringstream ss(s);
+    std::string e;
+    while (std::getline(ss, e, ',')) {
+        if (!e.empty()) ret.push_back(e);
+    }
+    return ret;
+}
+
+std::vector<std::size_t> split_num(std::string const& s) {
+    std::vector<std::size_t> ret;
+    for (auto const& e : split(s)) ret.push_back(static_cast<std::size_t>(std::stoul(e)));
+    return ret;
+}
+
+options parse(int argc, char** argv) {
+    options opts;
+    std::string path = argv[0];
+    std::size_t pos = path.find_last_of("/\\");
+    opts.base = (pos == std::string::npos) ? "" : path.substr(0, pos + 1);
+
+    for (int i = 1; i < argc; ++i) {
+        std::string name = argv[i];
+        if (i + 1 == argc) throw std::runtime_error("missing value of " + name);
+        std::string val = argv[++i];
+        if (name == "--transport") {
+            opts.transports = split(val);
+        }
+        else if (name == "--version") {
+            opts.versions.clear();
+            for (auto const& e : split(val)) {
+                if (e == "v3.1.1") opts.versions.push_back(MQTT_NS::protocol_version::v3_1_1);
+                else if (e == "v5") opts.versions.push_back(MQTT_NS::protocol_version::v5);
+                else throw std::runtime_error("unknown version " + e);
+            }
+        }
+        else if (name == "--qos") {
+            opts.qoss.clear();
+            for (auto q : split_num(val)) {
+                if (q > 2) throw std::runtime_error("invalid qos " + std::to_string(q));
+                opts.qoss.push_back(static_cast<MQTT_NS::qos>(q));
+            }
+        }
+        else if (name == "--publishers") {
+            opts.publishers = split_num(val);
+        }
+        else if (name == "--subscribers") {
+            opts.subscribers = split_num(val);
+        }
+        else if (name == "--messages") {
+            opts.messages = static_cast<std::size_t>(std::stoul(val));
+        }
+        else if (name == "--payload") {
+            opts.payload = static_cast<std::size_t>(std::stoul(val));
+        }
+        else if (name == "--inflight") {
+            opts.inflight = std::max<std::size_t>(1, static_cast<std::size_t>(std::stoul(val)));
+        }
+        else if (name == "--timeout") {
+            opts.timeout = std::chrono::seconds(std::stoul(val));
+        }
+        else {
+            throw std::runtime_error("unknown option " + name);
+        }
+    }
+    return opts;
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv) {
+    options opts;
+    try {
+        opts = parse(argc, argv);
+    }
+    catch (std::exception const& e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+#if defined(MQTT_USE_TLS)
+    // The TLS test servers find their certificates next to the test executable.
+    boost::unit_test::framework::master_test_suite().argc = argc;
+    boost::unit_test::framework::master_test_suite().argv = argv;
+#endif // defined(MQTT_USE_TLS)
+
+    bool first = true;
+    std::cout << "[" << std::endl;
+    for (auto const& transport : opts.transports) {
+        for (auto version : opts.versions) {
+            for (auto qos_value : opts.qoss) {
+                for (auto publishers : opts.publishers) {
+                    for (auto subscribers : opts.subscribers) {
+                        scenario sc { transport, version, qos_value, publishers, subscribers };
+                        try {
+                            auto res = run_scenario(sc, opts);
+                            if (!first) std::cout << "," << std::endl;
+                            first = false;
+                            print_json(std::cout, sc, opts, MQTT_NS::force_move(res));
+                        }
+                        catch (std::exception const& e) {
+                            std::cerr << e.what() << std::endl;
+                            return EXIT_FAILURE;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    std::cout << std::endl << "]" << std::endl;
+}
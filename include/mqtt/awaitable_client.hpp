@@ -0,0 +1,609 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_AWAITABLE_CLIENT_HPP)
+#define MQTT_AWAITABLE_CLIENT_HPP
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/system/error_code.hpp>
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#endif // defined(BOOST_ASIO_HAS_CO_AWAIT)
+
+#include <mqtt/namespace.hpp>
+#include <mqtt/any.hpp>
+#include <mqtt/buffer.hpp>
+#include <mqtt/connect_return_code.hpp>
+#include <mqtt/error_code.hpp>
+#include <mqtt/exception.hpp>
+#include <mqtt/move.hpp>
+#include <mqtt/property_variant.hpp>
+#include <mqtt/publish.hpp>
+#include <mqtt/reason_code.hpp>
+#include <mqtt/subscribe_options.hpp>
+
+namespace MQTT_NS {
+
+namespace as = boost::asio;
+
+namespace detail {
+
+// Completion of an operation whose handler type is erased.
+template <typename... Args>
+class awaitable_op {
+public:
+    virtual ~awaitable_op() = default;
+    virtual void complete(Args... args) = 0;
+};
+
+template <typename Handler, typename Executor, typename... Args>
+class awaitable_op_impl : public awaitable_op<Args...> {
+public:
+    awaitable_op_impl(Handler h, Executor const& ex)
+        :h_(force_move(h)),
+         ex_(as::get_associated_executor(h_, ex)) {}
+
+    // The handler is always posted to its executor, so it is never called
+    // inside the handlers of the client.
+    void complete(Args... args) override {
+        as::post(
+            ex_,
+            [h = force_move(h_), t = std::make_tuple(force_move(args)...)]
+            () mutable {
+                invoke(h, t, std::index_sequence_for<Args...>());
+            }
+        );
+    }
+
+private:
+    template <typename Tuple, std::size_t... Is>
+    static void invoke(Handler& h, Tuple& t, std::index_sequence<Is...>) {
+        h(force_move(std::get<Is>(t))...);
+    }
+
+    Handler h_;
+    as::associated_executor_t<Handler, Executor> ex_;
+};
+
+} // namespace detail
+
+/**
+ * @brief Client operations that complete by asio completion tokens.
+ *
+ * The operations of the client complete when the broker has answered, not when the packet
+ * has been written. async_connect() completes on CONNACK, async_publish() on PUBACK for QoS1
+ * and on PUBCOMP for QoS2, async_subscribe() on SUBACK and async_disconnect() on close.
+ * async_receive() completes with the next received PUBLISH message.
+ *
+ * The operations accept any completion token, e.g. a callback or as::use_future.
+ * If the compiler supports coroutines (BOOST_ASIO_HAS_CO_AWAIT), as::use_awaitable
+ * makes them awaitable from C++20 coroutines:
+ * @code
+ * co_await ac->async_connect(as::use_awaitable);
+ * co_await ac->async_publish("topic1"_mb, "contents"_mb, qos::at_least_once, as::use_awaitable);
+ * auto msg = co_await ac->async_receive(as::use_awaitable);
+ * @endcode
+ * The errors are reported as the error_code of the completion. An awaitable throws it
+ * as system_error.
+ *
+ * Each pending operation is allocated on the heap by the default allocator, and its handler
+ * type is erased, because the operations of any handler type wait in the same containers
+ * until the broker answers. So every operation costs one allocation and one virtual call
+ * in addition to the packet that it sends.
+ *
+ * This object sets the connack, puback, pubrec, pubcomp, suback, publish, close and error handlers
+ * of the client (v3.1.1 and v5), so don't set them after constructing it.
+ * It must be owned by std::shared_ptr. The operations are run on the io_context of the client,
+ * and the completions are posted to the executors that are associated with the handlers.
+ * @tparam Client client type. e.g. callable_overlay<async_client<...>>
+ */
+template <typename Client>
+class awaitable_client : public std::enable_shared_from_this<awaitable_client<Client>> {
+public:
+    using packet_id_t = typename Client::packet_id_t;
+
+    /**
+     * @brief Received PUBLISH message
+     */
+    struct message {
+        buffer topic;
+        buffer contents;
+        publish_options pubopts;
+        /// empty on MQTT v3.1.1
+        v5::properties props;
+    };
+
+    /**
+     * @brief Constructor
+     * @param ioc io_context that runs the client
+     * @param client client. Its handlers are overwritten.
+     */
+    awaitable_client(as::io_context& ioc, std::shared_ptr<Client> client)
+        :ioc_(ioc),
+         client_(force_move(client)) {
+        set_handlers();
+    }
+
+    ~awaitable_client() {
+        // The handlers capture this.
+        client_->set_connack_handler({});
+        client_->set_v5_connack_handler({});
+        client_->set_puback_handler({});
+        client_->set_v5_puback_handler({});
+        client_->set_pubrec_handler({});
+        client_->set_v5_pubrec_handler({});
+        client_->set_pubcomp_handler({});
+        client_->set_v5_pubcomp_handler({});
+        client_->set_suback_handler({});
+        client_->set_v5_suback_handler({});
+        client_->set_publish_handler({});
+        client_->set_v5_publish_handler({});
+        client_->set_close_handler({});
+        client_->set_error_handler({});
+    }
+
+    awaitable_client(awaitable_client const&) = delete;
+    awaitable_client& operator=(awaitable_client const&) = delete;
+
+    /**
+     * @brief Get the client
+     * @return the client
+     */
+    std::shared_ptr<Client> const& client() const {
+        return client_;
+    }
+
+    /**
+     * @brief Connect to the broker
+     * @param token completion token of the signature void(error_code ec, bool session_present).
+     *        ec is connection_refused if the broker rejects the connection.
+     */
+    template <typename CompletionToken>
+    auto async_connect(CompletionToken&& token) {
+        return as::async_initiate<CompletionToken, void(error_code, bool)>(
+            [this](auto handler) {
+                auto op = make_op<error_code, bool>(force_move(handler));
+                as::dispatch(
+                    ioc_,
+                    [this, wp = weak_self(), op = force_move(op)] () mutable {
+                        auto sp = wp.lock();
+                        if (!sp) return;
+                        if (connect_op_) {
+                            op->complete(make_error(boost::system::errc::operation_in_progress), false);
+                            return;
+                        }
+                        connect_op_ = force_move(op);
+                        client_->async_connect(
+                            [wp = force_move(wp)](error_code ec) {
+                                if (!ec) return;
+                                if (auto sp = wp.lock()) sp->complete_connect(ec, false);
+                            }
+                        );
+                    }
+                );
+            },
+            token
+        );
+    }
+
+    /**
+     * @brief Publish a message
+     * @param topic topic name
+     * @param contents contents
+     * @param pubopts qos and retain flag
+     * @param props properties. They are ignored on MQTT v3.1.1.
+     * @param token completion token of the signature void(error_code ec).
+     *        It completes when QoS0 is written, on PUBACK for QoS1 and on PUBCOMP for QoS2.
+     *        ec is operation_not_permitted if the broker answers an error reason code.
+     */
+    template <typename CompletionToken>
+    auto async_publish(
+        buffer topic,
+        buffer contents,
+        publish_options pubopts,
+        v5::properties props,
+        CompletionToken&& token) {
+        return as::async_initiate<CompletionToken, void(error_code)>(
+            [this](auto handler, buffer topic, buffer contents, publish_options pubopts, v5::properties props) {
+                auto op = make_op<error_code>(force_move(handler));
+                as::dispatch(
+                    ioc_,
+                    [this,
+                     wp = weak_self(),
+                     op = force_move(op),
+                     topic = force_move(topic),
+                     contents = force_move(contents),
+                     pubopts,
+                     props = force_move(props)] () mutable {
+                        auto sp = wp.lock();
+                        if (!sp) return;
+                        if (pubopts.get_qos() == qos::at_most_once) {
+                            client_->async_publish(
+                                0,
+                                force_move(topic),
+                                force_move(contents),
+                                pubopts,
+                                force_move(props),
+                                any(),
+                                [op = std::shared_ptr<op_t<error_code>>(force_move(op))](error_code ec) {
+                                    op->complete(ec);
+                                }
+                            );
+                            return;
+                        }
+                        packet_id_t packet_id;
+                        try {
+                            packet_id = client_->acquire_unique_packet_id();
+                        }
+                        catch (packet_id_exhausted_error const&) {
+                            op->complete(make_error(boost::system::errc::no_buffer_space));
+                            return;
+                        }
+                        acks_.emplace(packet_id, force_move(op));
+                        client_->async_publish(
+                            packet_id,
+                            force_move(topic),
+                            force_move(contents),
+                            pubopts,
+                            force_move(props),
+                            any(),
+                            [wp = force_move(wp), packet_id](error_code ec) {
+                                if (!ec) return;
+                                if (auto sp = wp.lock()) sp->complete_ack(packet_id, ec);
+                            }
+                        );
+                    }
+                );
+            },
+            token,
+            force_move(topic),
+            force_move(contents),
+            pubopts,
+            force_move(props)
+        );
+    }
+
+    /**
+     * @brief Publish a message
+     * @param topic topic name
+     * @param contents contents
+     * @param pubopts qos and retain flag
+     * @param token completion token of the signature void(error_code ec). See the overload with props.
+     */
+    template <typename CompletionToken>
+    auto async_publish(
+        buffer topic,
+        buffer contents,
+        publish_options pubopts,
+        CompletionToken&& token) {
+        return async_publish(
+            force_move(topic),
+            force_move(contents),
+            pubopts,
+            v5::properties(),
+            std::forward<CompletionToken>(token)
+        );
+    }
+
+    /**
+     * @brief Subscribe a topic filter
+     * @param topic_filter topic filter
+     * @param option subscription options
+     * @param token completion token of the signature void(error_code ec, qos granted).
+     *        ec is operation_not_permitted if the broker rejects the subscription.
+     */
+    template <typename CompletionToken>
+    auto async_subscribe(
+        std::string topic_filter,
+        subscribe_options option,
+        CompletionToken&& token) {
+        return as::async_initiate<CompletionToken, void(error_code, qos)>(
+            [this](auto handler, std::string topic_filter, subscribe_options option) {
+                auto op = make_op<error_code, qos>(force_move(handler));
+                as::dispatch(
+                    ioc_,
+                    [this,
+                     wp = weak_self(),
+                     op = force_move(op),
+                     topic_filter = force_move(topic_filter),
+                     option] () mutable {
+                        auto sp = wp.lock();
+                        if (!sp) return;
+                        packet_id_t packet_id;
+                        try {
+                            packet_id = client_->acquire_unique_packet_id();
+                        }
+                        catch (packet_id_exhausted_error const&) {
+                            op->complete(make_error(boost::system::errc::no_buffer_space), qos::at_most_once);
+                            return;
+                        }
+                        subacks_.emplace(packet_id, force_move(op));
+                        client_->async_subscribe(
+                            packet_id,
+                            force_move(topic_filter),
+                            option,
+                            [wp = force_move(wp), packet_id](error_code ec) {
+                                if (!ec) return;
+                                if (auto sp = wp.lock()) sp->complete_suback(packet_id, ec, 0);
+                            }
+                        );
+                    }
+                );
+            },
+            token,
+            force_move(topic_filter),
+            option
+        );
+    }
+
+    /**
+     * @brief Receive the next PUBLISH message
+     * The messages that arrive while nobody waits are kept in order.
+     * @param token completion token of the signature void(error_code ec, message msg).
+     *        ec is set if the connection is closed while waiting.
+     */
+    template <typename CompletionToken>
+    auto async_receive(CompletionToken&& token) {
+        return as::async_initiate<CompletionToken, void(error_code, message)>(
+            [this](auto handler) {
+                auto op = make_op<error_code, message>(force_move(handler));
+                as::dispatch(
+                    ioc_,
+                    [this, wp = weak_self(), op = force_move(op)] () mutable {
+                        auto sp = wp.lock();
+                        if (!sp) return;
+                        if (received_.empty()) {
+                            receivers_.push_back(force_move(op));
+                            return;
+                        }
+                        auto msg = force_move(received_.front());
+                        received_.pop_front();
+                        op->complete(error_code(), force_move(msg));
+                    }
+                );
+            },
+            token
+        );
+    }
+
+    /**
+     * @brief Disconnect from the broker
+     * @param token completion token of the signature void(error_code ec).
+     *        It completes when the connection is closed.
+     */
+    template <typename CompletionToken>
+    auto async_disconnect(CompletionToken&& token) {
+        return as::async_initiate<CompletionToken, void(error_code)>(
+            [this](auto handler) {
+                auto op = make_op<error_code>(force_move(handler));
+                as::dispatch(
+                    ioc_,
+                    [this, wp = weak_self(), op = force_move(op)] () mutable {
+                        auto sp = wp.lock();
+                        if (!sp) return;
+                        if (!client_->connected()) {
+                            op->complete(make_error(boost::system::errc::not_connected));
+                            return;
+                        }
+                        disconnect_ops_.push_back(force_move(op));
+                        client_->async_disconnect();
+                    }
+                );
+            },
+            token
+        );
+    }
+
+private:
+    template <typename... Args>
+    using op_t = detail::awaitable_op<Args...>;
+
+    // One heap allocation per operation. See the class comment.
+    template <typename... Args, typename Handler>
+    std::unique_ptr<op_t<Args...>> make_op(Handler h) {
+        using impl_t = detail::awaitable_op_impl<Handler, as::io_context::executor_type, Args...>;
+        return std::make_unique<impl_t>(force_move(h), ioc_.get_executor());
+    }
+
+    std::weak_ptr<awaitable_client> weak_self() {
+        return this->shared_from_this();
+    }
+
+    static error_code make_error(boost::system::errc::errc_t e) {
+        return boost::system::errc::make_error_code(e);
+    }
+
+    static error_code reason_to_error(std::uint8_t reason) {
+        // The reason codes that are 0x80 or greater are errors on MQTT v5.
+        if (reason < 0x80) return error_code();
+        return make_error(boost::system::errc::operation_not_permitted);
+    }
+
+    void set_handlers() {
+        client_->set_connack_handler(
+            [this](bool session_present, connect_return_code return_code) {
+                complete_connect(
+                    return_code == connect_return_code::accepted
+                    ? error_code()
+                    : make_error(boost::system::errc::connection_refused),
+                    session_present
+                );
+                return true;
+            }
+        );
+        client_->set_v5_connack_handler(
+            [this](bool session_present, v5::connect_reason_code reason_code, v5::properties /*props*/) {
+                complete_connect(
+                    reason_code == v5::connect_reason_code::success
+                    ? error_code()
+                    : make_error(boost::system::errc::connection_refused),
+                    session_present
+                );
+                return true;
+            }
+        );
+        client_->set_puback_handler(
+            [this](packet_id_t packet_id) {
+                complete_ack(packet_id, error_code());
+                return true;
+            }
+        );
+        client_->set_v5_puback_handler(
+            [this](packet_id_t packet_id, v5::puback_reason_code reason_code, v5::properties /*props*/) {
+                complete_ack(packet_id, reason_to_error(static_cast<std::uint8_t>(reason_code)));
+                return true;
+            }
+        );
+        client_->set_pubrec_handler(
+            [](packet_id_t /*packet_id*/) {
+                return true;
+            }
+        );
+        client_->set_v5_pubrec_handler(
+            [this](packet_id_t packet_id, v5::pubrec_reason_code reason_code, v5::properties /*props*/) {
+                // PUBCOMP doesn't follow the error PUBREC.
+                auto ec = reason_to_error(static_cast<std::uint8_t>(reason_code));
+                if (ec) complete_ack(packet_id, ec);
+                return true;
+            }
+        );
+        client_->set_pubcomp_handler(
+            [this](packet_id_t packet_id) {
+                complete_ack(packet_id, error_code());
+                return true;
+            }
+        );
+        client_->set_v5_pubcomp_handler(
+            [this](packet_id_t packet_id, v5::pubcomp_reason_code reason_code, v5::properties /*props*/) {
+                complete_ack(packet_id, reason_to_error(static_cast<std::uint8_t>(reason_code)));
+                return true;
+            }
+        );
+        client_->set_suback_handler(
+            [this](packet_id_t packet_id, std::vector<suback_return_code> results) {
+                complete_suback(
+                    packet_id,
+                    error_code(),
+                    results.empty() ? 0x80 : static_cast<std::uint8_t>(results.front())
+                );
+                return true;
+            }
+        );
+        client_->set_v5_suback_handler(
+            [this](packet_id_t packet_id, std::vector<v5::suback_reason_code> reasons, v5::properties /*props*/) {
+                complete_suback(
+                    packet_id,
+                    error_code(),
+                    reasons.empty() ? 0x80 : static_cast<std::uint8_t>(reasons.front())
+                );
+                return true;
+            }
+        );
+        client_->set_publish_handler(
+            [this](optional<packet_id_t> /*packet_id*/, publish_options pubopts, buffer topic, buffer contents) {
+                deliver(message { force_move(topic), force_move(contents), pubopts, v5::properties() });
+                return true;
+            }
+        );
+        client_->set_v5_publish_handler(
+            [this](optional<packet_id_t> /*packet_id*/,
+                   publish_options pubopts,
+                   buffer topic,
+                   buffer contents,
+                   v5::properties props) {
+                deliver(message { force_move(topic), force_move(contents), pubopts, force_move(props) });
+                return true;
+            }
+        );
+        client_->set_close_handler(
+            [this] {
+                fail_all(make_error(boost::system::errc::connection_aborted));
+                auto ops = force_move(disconnect_ops_);
+                for (auto& op : ops) op->complete(error_code());
+            }
+        );
+        client_->set_error_handler(
+            [this](error_code ec) {
+                fail_all(ec);
+                auto ops = force_move(disconnect_ops_);
+                for (auto& op : ops) op->complete(ec);
+            }
+        );
+    }
+
+    void complete_connect(error_code ec, bool session_present) {
+        if (!connect_op_) return;
+        auto op = force_move(connect_op_);
+        op->complete(ec, session_present);
+    }
+
+    void complete_ack(packet_id_t packet_id, error_code ec) {
+        auto it = acks_.find(packet_id);
+        if (it == acks_.end()) return;
+        auto op = force_move(it->second);
+        acks_.erase(it);
+        op->complete(ec);
+    }
+
+    void complete_suback(packet_id_t packet_id, error_code ec, std::uint8_t reason) {
+        auto it = subacks_.find(packet_id);
+        if (it == subacks_.end()) return;
+        auto op = force_move(it->second);
+        subacks_.erase(it);
+        if (!ec) ec = reason_to_error(reason);
+        op->complete(ec, ec ? qos::at_most_once : static_cast<qos>(reason));
+    }
+
+    void deliver(message msg) {
+        if (receivers_.empty()) {
+            received_.push_back(force_move(msg));
+            return;
+        }
+        auto op = force_move(receivers_.front());
+        receivers_.pop_front();
+        op->complete(error_code(), force_move(msg));
+    }
+
+    void fail_all(error_code ec) {
+        complete_connect(ec, false);
+        auto acks = force_move(acks_);
+        acks_.clear();
+        for (auto& e : acks) e.second->complete(ec);
+        auto subacks = force_move(subacks_);
+        subacks_.clear();
+        for (auto& e : subacks) e.second->complete(ec, qos::at_most_once);
+        auto receivers = force_move(receivers_);
+        receivers_.clear();
+        for (auto& op : receivers) op->complete(ec, message());
+    }
+
+    as::io_context& ioc_;
+    std::shared_ptr<Client> client_;
+    std::unique_ptr<op_t<error_code, bool>> connect_op_;
+    std::unordered_map<packet_id_t, std::unique_ptr<op_t<error_code>>> acks_;
+    std::unordered_map<packet_id_t, std::unique_ptr<op_t<error_code, qos>>> subacks_;
+    std::deque<std::unique_ptr<op_t<error_code, message>>> receivers_;
+    std::deque<message> received_;
+    std::vector<std::unique_ptr<op_t<error_code>>> disconnect_ops_;
+};
+
+} // namespace MQTT_NS
+
+#endif // MQTT_AWAITABLE_CLIENT_HPP
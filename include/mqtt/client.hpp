@@ -11,6 +11,7 @@
 
 #include <string>
 #include <vector>
+#include <atomic>
 #include <functional>
 #include <type_traits>
 
@@ -35,6 +36,10 @@
 #include <mqtt/move.hpp>
 
 #include <mqtt/callable_overlay.hpp>
+#include <mqtt/timer_wheel.hpp>
+#include <mqtt/resolver_cache.hpp>
+#include <mqtt/happy_eyeballs.hpp>
+#include <mqtt/reconnect_policy.hpp>
 
 namespace MQTT_NS {
 
@@ -354,17 +359,107 @@ public:
      * When the broker receives a ping packet, timeout timer is reset.
      * If the broker doesn't receive a ping packet within keep_alive_sec, the endpoint
      * is disconnected.<BR>
+     * Any packet that the endpoint sends pushes back the next ping packet, so the ping
+     * packet is sent only while the connection is idle.
+     * The round trip time of the ping can be got by get_ping_rtt().<BR>
      * See https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc464635115<BR>
      * 3.1.2.10 Keep Alive
      */
     void set_keep_alive_sec(std::uint16_t keep_alive_sec, std::chrono::steady_clock::duration ping) {
         if ((ping_duration_ != std::chrono::steady_clock::duration::zero()) && base::connected() && (ping == std::chrono::steady_clock::duration::zero())) {
-            tim_ping_.cancel();
+            cancel_timer();
         }
         keep_alive_sec_ = keep_alive_sec;
         ping_duration_ = force_move(ping);
     }
 
+    /**
+     * @brief Drive the ping timer by a timer wheel that is shared with other clients.
+     * @param wheel timer wheel that runs on the io_context of this client.
+     *              nullptr means that the client uses its own timer.
+     *
+     * A process that has a lot of clients on one io_context can share one wheel, so that
+     * the clients don't arm their own timers.
+     * The wheel is not thread safe, so the io_context must be run by one thread.
+     * Call this function before connecting.
+     */
+    void set_keep_alive_scheduler(std::shared_ptr<timer_wheel> wheel) {
+        BOOST_ASSERT(!ping_handle_);
+        keep_alive_wheel_ = force_move(wheel);
+    }
+
+    /**
+     * @brief Resolve the host by a cache that is shared with other clients.
+     * @param cache resolver cache. nullptr means that the host is resolved on each connect.
+     *
+     * When many clients reconnect to the same broker at once, the host is resolved only once.
+     * When no endpoint could be connected by async_connect(), the cached endpoints are dropped.
+     */
+    void set_resolver_cache(std::shared_ptr<resolver_cache> cache) {
+        resolver_cache_ = force_move(cache);
+    }
+
+    /**
+     * @brief Set the delay between the connection attempts to the resolved endpoints.
+     * @param delay zero means that the endpoints are tried one after another.
+     *
+     * If it is not zero, async_connect() starts an attempt to the next endpoint when the
+     * previous attempt isn't finished within delay, or fails, alternating the IPv6 and IPv4
+     * addresses. The first established connection is used.
+     * It is not applied to the socket that is passed to async_connect().<BR>
+     * See https://tools.ietf.org/html/rfc8305 (250ms is recommended)
+     */
+    void set_connect_attempt_delay(std::chrono::steady_clock::duration delay) {
+        connect_attempt_delay_ = delay;
+    }
+
+    /**
+     * @brief Set the socket options of the connection attempts.
+     * @param options socket options
+     *
+     * The staggered connection (see set_connect_attempt_delay()) makes a socket for each
+     * attempt, so the options are set to them before connecting instead of to the socket of the client.
+     */
+    void set_tcp_socket_options(tcp_socket_options options) {
+        tcp_socket_options_ = force_move(options);
+    }
+
+    /**
+     * @brief Reconnect automatically when the connection is lost.
+     * @param policy delays of the reconnection. nullopt disables the reconnection,
+     *               and cancels the pending one.
+     *
+     * When the error handler is called, or a reconnection attempt fails, async_connect() is
+     * called after a delay that is chosen by decorrelated_jitter_backoff. The properties, the
+     * session_life_keeper and the handler that were passed to the last connect are used again,
+     * and the handler is called for each attempt. If the last connect was given a socket, the
+     * socket is connected again, so it must be reusable after it is closed.
+     * The session state is reused as it is. If clean_session is false, the stored messages are
+     * resent after the accepted CONNACK (by async_send_store() if the client is an async_client).
+     * disconnect() and async_disconnect() don't cause the reconnection, but force_disconnect() does.
+     * The latencies can be got by get_reconnect_statistics().
+     */
+    void set_reconnect_policy(optional<reconnect_policy> policy) {
+        if (backoff_) {
+            tim_reconnect_.cancel();
+            disconnected_at_ = nullopt;
+        }
+        if (policy) {
+            backoff_.emplace(policy.value());
+        }
+        else {
+            backoff_ = nullopt;
+        }
+    }
+
+    /**
+     * @brief Get the statistics of the automatic reconnection.
+     * @return statistics
+     */
+    reconnect_statistics const& get_reconnect_statistics() const {
+        return reconnect_statistics_;
+    }
+
     /**
      * @brief Set a keep alive second and a ping milli seconds.
      * @param keep_alive_sec keep alive seconds
@@ -426,8 +521,8 @@ public:
      * @param session_life_keeper the passed object lifetime will be kept during the session.
      */
     void connect(v5::properties props, any session_life_keeper = any()) {
-        as::ip::tcp::resolver r(ioc_);
-        auto eps = r.resolve(host_, port_);
+        save_connect(props, session_life_keeper, async_handler_t(), false);
+        auto eps = resolve();
         setup_socket(socket_);
         connect_impl(*socket_, eps.begin(), eps.end(), force_move(props), force_move(session_life_keeper));
     }
@@ -445,8 +540,8 @@ public:
         v5::properties props,
         boost::system::error_code& ec,
         any session_life_keeper = any()) {
-        as::ip::tcp::resolver r(ioc_);
-        auto eps = r.resolve(host_, port_, ec);
+        save_connect(props, session_life_keeper, async_handler_t(), false);
+        auto eps = resolve(ec);
         if (ec) return;
         setup_socket(socket_);
         connect_impl(*socket_, eps.begin(), eps.end(), force_move(props), force_move(session_life_keeper), ec);
@@ -492,8 +587,8 @@ public:
         std::shared_ptr<Socket>&& socket,
         v5::properties props,
         any session_life_keeper = any()) {
-        as::ip::tcp::resolver r(ioc_);
-        auto eps = r.resolve(host_, port_);
+        save_connect(props, session_life_keeper, async_handler_t(), true);
+        auto eps = resolve();
         socket_ = force_move(socket);
         base::socket_optional().emplace(socket_);
         connect_impl(*socket_, eps.begin(), eps.end(), force_move(props), force_move(session_life_keeper));
@@ -515,8 +610,8 @@ public:
         v5::properties props,
         boost::system::error_code& ec,
         any session_life_keeper = any()) {
-        as::ip::tcp::resolver r(ioc_);
-        auto eps = r.resolve(host_, port_, ec);
+        save_connect(props, session_life_keeper, async_handler_t(), true);
+        auto eps = resolve(ec);
         if (ec) return;
         socket_ = force_move(socket);
         base::socket_optional().emplace(socket_);
@@ -604,30 +699,8 @@ public:
      * @param func finish handler that is called when the underlying connection process is finished
      */
     void async_connect(v5::properties props, any session_life_keeper, async_handler_t func) {
-        auto r = std::make_shared<as::ip::tcp::resolver>(ioc_);
-        auto p = r.get();
-        p->async_resolve(
-            host_,
-            port_,
-            [
-                this,
-                props = force_move(props),
-                session_life_keeper = force_move(session_life_keeper),
-                func = force_move(func),
-                r = force_move(r)
-            ]
-            (
-                error_code ec,
-                as::ip::tcp::resolver::results_type eps
-            ) mutable {
-                if (ec) {
-                    if (func) func(ec);
-                    return;
-                }
-                setup_socket(socket_);
-                async_connect_impl(*socket_, eps.begin(), eps.end(), force_move(props), force_move(session_life_keeper), force_move(func));
-            }
-        );
+        save_connect(props, session_life_keeper, func, false);
+        do_async_connect(force_move(props), force_move(session_life_keeper), force_move(func));
     }
 
     /**
@@ -737,32 +810,8 @@ public:
      * @param func finish handler that is called when the underlying connection process is finished
      */
     void async_connect(std::shared_ptr<Socket>&& socket, v5::properties props, any session_life_keeper, async_handler_t func) {
-        auto r = std::make_shared<as::ip::tcp::resolver>(ioc_);
-        auto p = r.get();
-        p->async_resolve(
-            host_,
-            port_,
-            [
-                this,
-                socket = force_move(socket),
-                props = force_move(props),
-                session_life_keeper = force_move(session_life_keeper),
-                func = force_move(func),
-                r = force_move(r)
-            ]
-            (
-                error_code ec,
-                as::ip::tcp::resolver::results_type eps
-            ) mutable {
-                if (ec) {
-                    if (func) func(ec);
-                    return;
-                }
-                socket_ = force_move(socket);
-                base::socket_optional().emplace(socket_);
-                async_connect_impl(*socket_, eps.begin(), eps.end(), force_move(props), force_move(session_life_keeper), force_move(func));
-            }
-        );
+        save_connect(props, session_life_keeper, func, true);
+        do_async_connect(force_move(socket), force_move(props), force_move(session_life_keeper), force_move(func));
     }
 
     /**
@@ -786,7 +835,8 @@ public:
         v5::disconnect_reason_code reason_code = v5::disconnect_reason_code::normal_disconnection,
         v5::properties props = {}
     ) {
-        if (ping_duration_ != std::chrono::steady_clock::duration::zero()) tim_ping_.cancel();
+        cancel_timer();
+        cancel_reconnect();
         if (base::connected()) {
             std::weak_ptr<this_type> wp(std::static_pointer_cast<this_type>(this->shared_from_this()));
             tim_close_.expires_after(force_move(timeout));
@@ -822,7 +872,8 @@ public:
         v5::disconnect_reason_code reason_code = v5::disconnect_reason_code::normal_disconnection,
         v5::properties props = {}
     ) {
-        if (ping_duration_ != std::chrono::steady_clock::duration::zero()) tim_ping_.cancel();
+        cancel_timer();
+        cancel_reconnect();
         if (base::connected()) {
             base::disconnect(reason_code, force_move(props));
         }
@@ -840,7 +891,8 @@ public:
     void async_disconnect(
         std::chrono::steady_clock::duration timeout,
         async_handler_t func = async_handler_t()) {
-        if (ping_duration_ != std::chrono::steady_clock::duration::zero()) tim_ping_.cancel();
+        cancel_timer();
+        cancel_reconnect();
         if (base::connected()) {
             std::weak_ptr<this_type> wp(std::static_pointer_cast<this_type>(this->shared_from_this()));
             tim_close_.expires_after(force_move(timeout));
@@ -879,7 +931,8 @@ public:
         v5::disconnect_reason_code reason_code,
         v5::properties props,
         async_handler_t func = async_handler_t()) {
-        if (ping_duration_ != std::chrono::steady_clock::duration::zero()) tim_ping_.cancel();
+        cancel_timer();
+        cancel_reconnect();
         if (base::connected()) {
             std::weak_ptr<this_type> wp(std::static_pointer_cast<this_type>(this->shared_from_this()));
             tim_close_.expires_after(force_move(timeout));
@@ -906,7 +959,8 @@ public:
      */
     void async_disconnect(
         async_handler_t func = async_handler_t()) {
-        if (ping_duration_ != std::chrono::steady_clock::duration::zero()) tim_ping_.cancel();
+        cancel_timer();
+        cancel_reconnect();
         if (base::connected()) {
             base::async_disconnect(force_move(func));
         }
@@ -932,7 +986,8 @@ public:
         v5::disconnect_reason_code reason_code,
         v5::properties props,
         async_handler_t func = async_handler_t()) {
-        if (ping_duration_ != std::chrono::steady_clock::duration::zero()) tim_ping_.cancel();
+        cancel_timer();
+        cancel_reconnect();
         if (base::connected()) {
             base::async_disconnect(reason_code, force_move(props), force_move(func));
         }
@@ -944,7 +999,7 @@ public:
      * When the endpoint disconnects using force_disconnect(), a will will send.<BR>
      */
     void force_disconnect() {
-        if (ping_duration_ != std::chrono::steady_clock::duration::zero()) tim_ping_.cancel();
+        cancel_timer();
         tim_close_.cancel();
         base::force_disconnect();
     }
@@ -982,6 +1037,7 @@ protected:
          ioc_(ioc),
          tim_ping_(ioc_),
          tim_close_(ioc_),
+         tim_reconnect_(ioc_),
          host_(force_move(host)),
          port_(force_move(port))
 #if defined(MQTT_USE_WS)
@@ -1285,16 +1341,69 @@ private:
         handshake_socket(socket, force_move(props), force_move(session_life_keeper), ec);
     }
 
-    template <typename Iterator>
+    // The reconnection connects in the same way as the last connect.
+    void save_connect(v5::properties const& props, any const& session_life_keeper, async_handler_t const& func, bool user_socket) {
+        connect_props_ = props;
+        connect_session_life_keeper_ = session_life_keeper;
+        connect_handler_ = func;
+        connect_with_user_socket_ = user_socket;
+    }
+
+    void do_async_connect(v5::properties props, any session_life_keeper, async_handler_t func) {
+        async_resolve(
+            [
+                this,
+                props = force_move(props),
+                session_life_keeper = force_move(session_life_keeper),
+                func = force_move(func)
+            ]
+            (
+                error_code ec,
+                std::vector<as::ip::tcp::endpoint> eps
+            ) mutable {
+                if (ec) {
+                    if (func) func(ec);
+                    return;
+                }
+                setup_socket(socket_);
+                async_connect_impl(*socket_, force_move(eps), true, force_move(props), force_move(session_life_keeper), force_move(func));
+            }
+        );
+    }
+
+    void do_async_connect(std::shared_ptr<Socket>&& socket, v5::properties props, any session_life_keeper, async_handler_t func) {
+        async_resolve(
+            [
+                this,
+                socket = force_move(socket),
+                props = force_move(props),
+                session_life_keeper = force_move(session_life_keeper),
+                func = force_move(func)
+            ]
+            (
+                error_code ec,
+                std::vector<as::ip::tcp::endpoint> eps
+            ) mutable {
+                if (ec) {
+                    if (func) func(ec);
+                    return;
+                }
+                socket_ = force_move(socket);
+                base::socket_optional().emplace(socket_);
+                // The socket that is configured by the user is connected as it is.
+                async_connect_impl(*socket_, force_move(eps), false, force_move(props), force_move(session_life_keeper), force_move(func));
+            }
+        );
+    }
+
     void async_connect_impl(
         Socket& socket,
-        Iterator it,
-        Iterator end,
+        std::vector<as::ip::tcp::endpoint> eps,
+        bool staggered,
         v5::properties props,
         any session_life_keeper,
         async_handler_t func) {
-        as::async_connect(
-            socket.lowest_layer(), it, end,
+        auto handler =
             [
                 this,
                 self = this->shared_from_this(),
@@ -1303,8 +1412,10 @@ private:
                 props = force_move(props),
                 func = force_move(func)
             ]
-            (error_code ec, Iterator) mutable {
+            (error_code ec) mutable {
                 if (ec) {
+                    // The cached endpoints might be stale.
+                    if (resolver_cache_) resolver_cache_->erase(host_, port_);
                     if (func) func(ec);
                     return;
                 }
@@ -1313,53 +1424,226 @@ private:
                     set_timer();
                 }
                 async_handshake_socket(socket, force_move(props), force_move(session_life_keeper), force_move(func));
+            };
+        if (staggered && connect_attempt_delay_ != std::chrono::steady_clock::duration::zero()) {
+            async_happy_eyeballs_connect(socket.lowest_layer(), force_move(eps), connect_attempt_delay_, tcp_socket_options_, force_move(handler));
+            return;
+        }
+        as::async_connect(
+            socket.lowest_layer(), eps,
+            [handler = force_move(handler)]
+            (error_code ec, as::ip::tcp::endpoint const&) mutable {
+                handler(ec);
             });
     }
 
+    std::vector<as::ip::tcp::endpoint> resolve() {
+        boost::system::error_code ec;
+        auto eps = resolve(ec);
+        if (ec) throw boost::system::system_error(ec);
+        return eps;
+    }
+
+    std::vector<as::ip::tcp::endpoint> resolve(boost::system::error_code& ec) {
+        if (resolver_cache_) return resolver_cache_->resolve(ioc_, host_, port_, ec);
+        as::ip::tcp::resolver r(ioc_);
+        auto results = r.resolve(host_, port_, ec);
+        return std::vector<as::ip::tcp::endpoint>(results.begin(), results.end());
+    }
+
+    template <typename Handler>
+    void async_resolve(Handler&& h) {
+        if (resolver_cache_) {
+            resolver_cache_->async_resolve(ioc_, host_, port_, std::forward<Handler>(h));
+            return;
+        }
+        auto r = std::make_shared<as::ip::tcp::resolver>(ioc_);
+        auto p = r.get();
+        p->async_resolve(
+            host_,
+            port_,
+            [h = std::forward<Handler>(h), r = force_move(r)]
+            (error_code ec, as::ip::tcp::resolver::results_type results) mutable {
+                h(ec, std::vector<as::ip::tcp::endpoint>(results.begin(), results.end()));
+            }
+        );
+    }
+
 protected:
     void on_pre_send() noexcept override {
-        if (ping_duration_ != std::chrono::steady_clock::duration::zero()) {
-            reset_timer();
-        }
+        // The ping timer isn't re-armed here. It is checked against this when it expires.
+        // So a busy connection doesn't send PINGREQ, and doesn't re-arm the timer for each packet.
+        // This is called on the thread that writes, which can differ from the one that runs the timer.
+        last_send_.store(std::chrono::steady_clock::now());
     }
 
 private:
-    void handle_timer(error_code ec) {
-        if (!ec) {
-            if (async_pingreq_) {
-                base::async_pingreq();
-            }
-            else {
-                base::pingreq();
-            }
+    void send_pingreq() {
+        if (async_pingreq_) {
+            base::async_pingreq();
+        }
+        else {
+            base::pingreq();
         }
     }
 
     void set_timer() {
-        tim_ping_.expires_after(ping_duration_);
+        last_send_.store(std::chrono::steady_clock::now());
+        schedule_timer(ping_duration_);
+    }
+
+    void schedule_timer(std::chrono::steady_clock::duration after) {
         std::weak_ptr<this_type> wp(std::static_pointer_cast<this_type>(this->shared_from_this()));
+        if (keep_alive_wheel_) {
+            // The wheel is not thread safe, and connect() and disconnect() can be called
+            // from the thread of the user. So the wheel is accessed on the io_context.
+            as::dispatch(
+                ioc_,
+                [wp = force_move(wp), after] {
+                    if (auto sp = wp.lock()) {
+                        sp->schedule_wheel_timer(after);
+                    }
+                }
+            );
+            return;
+        }
+        tim_ping_.expires_after(after);
         tim_ping_.async_wait(
             [wp = force_move(wp)](error_code ec) {
+                if (ec) return;
                 if (auto sp = wp.lock()) {
-                    sp->handle_timer(ec);
+                    sp->handle_timer();
                 }
             }
         );
     }
 
-    void reset_timer() {
+    void schedule_wheel_timer(std::chrono::steady_clock::duration after) {
+        // Unlike expires_after() of the timer, add() doesn't replace the previous timer.
+        cancel_wheel_timer();
+        std::weak_ptr<this_type> wp(std::static_pointer_cast<this_type>(this->shared_from_this()));
+        ping_handle_ = keep_alive_wheel_->add(
+            after,
+            [wp = force_move(wp)] {
+                if (auto sp = wp.lock()) {
+                    sp->ping_handle_ = nullopt;
+                    sp->handle_timer();
+                }
+            }
+        );
+    }
+
+    void cancel_timer() {
+        if (ping_duration_ == std::chrono::steady_clock::duration::zero()) return;
+        if (keep_alive_wheel_) {
+            std::weak_ptr<this_type> wp(std::static_pointer_cast<this_type>(this->shared_from_this()));
+            as::dispatch(
+                ioc_,
+                [wp = force_move(wp)] {
+                    if (auto sp = wp.lock()) {
+                        sp->cancel_wheel_timer();
+                    }
+                }
+            );
+            return;
+        }
         tim_ping_.cancel();
-        set_timer();
+    }
+
+    void cancel_wheel_timer() {
+        if (!ping_handle_) return;
+        keep_alive_wheel_->cancel(ping_handle_.value());
+        ping_handle_ = nullopt;
+    }
+
+    void handle_timer() {
+        auto idle = std::chrono::steady_clock::now() - last_send_.load();
+        if (idle >= ping_duration_) {
+            send_pingreq();
+            idle = std::chrono::steady_clock::now() - last_send_.load();
+        }
+        // The connection could have been closed by the ping.
+        if (!base::connected()) return;
+        schedule_timer(ping_duration_ - std::min(idle, ping_duration_));
+    }
+
+    void schedule_reconnect() {
+        if (!backoff_) return;
+        if (!disconnected_at_) disconnected_at_.emplace(std::chrono::steady_clock::now());
+        std::weak_ptr<this_type> wp(std::static_pointer_cast<this_type>(this->shared_from_this()));
+        tim_reconnect_.expires_after(backoff_->next());
+        tim_reconnect_.async_wait(
+            [wp = force_move(wp)](error_code ec) {
+                if (ec) return;
+                if (auto sp = wp.lock()) {
+                    sp->reconnect();
+                }
+            }
+        );
+    }
+
+    void reconnect() {
+        ++reconnect_statistics_.attempts;
+        std::weak_ptr<this_type> wp(std::static_pointer_cast<this_type>(this->shared_from_this()));
+        auto func =
+            [wp = force_move(wp), func = connect_handler_](error_code ec) {
+                if (func) func(ec);
+                if (!ec) return;
+                if (auto sp = wp.lock()) {
+                    sp->schedule_reconnect();
+                }
+            };
+        if (connect_with_user_socket_) {
+            // The socket of the user is connected again.
+            do_async_connect(std::shared_ptr<Socket>(socket_), connect_props_, connect_session_life_keeper_, force_move(func));
+        }
+        else {
+            do_async_connect(connect_props_, connect_session_life_keeper_, force_move(func));
+        }
+    }
+
+    void cancel_reconnect() {
+        // The client disconnects by itself, so the objects of the last connect are not kept any more.
+        connect_session_life_keeper_ = any();
+        connect_handler_ = async_handler_t();
+        if (!backoff_) return;
+        tim_reconnect_.cancel();
+        disconnected_at_ = nullopt;
+        backoff_->reset();
     }
 
 protected:
     void on_close() noexcept override {
-        if (ping_duration_ != std::chrono::steady_clock::duration::zero()) tim_ping_.cancel();
+        cancel_timer();
     }
 
     void on_error(error_code ec) noexcept override {
         (void)ec;
-        if (ping_duration_ != std::chrono::steady_clock::duration::zero()) tim_ping_.cancel();
+        cancel_timer();
+        if (!backoff_) return;
+        // schedule_reconnect() can throw, so it is not called in this noexcept function.
+        std::weak_ptr<this_type> wp(std::static_pointer_cast<this_type>(this->shared_from_this()));
+        as::post(
+            ioc_,
+            [wp = force_move(wp)] {
+                if (auto sp = wp.lock()) {
+                    sp->schedule_reconnect();
+                }
+            }
+        );
+    }
+
+    void on_connack_received(bool accepted) noexcept override {
+        if (!accepted || !backoff_) return;
+        backoff_->reset();
+        if (disconnected_at_) {
+            auto latency = std::chrono::steady_clock::now() - disconnected_at_.value();
+            disconnected_at_ = nullopt;
+            ++reconnect_statistics_.reconnects;
+            reconnect_statistics_.last_latency = latency;
+            reconnect_statistics_.max_latency = std::max(reconnect_statistics_.max_latency, latency);
+            reconnect_statistics_.total_latency += latency;
+        }
     }
 
     // Ensure that only code that knows the *exact* type of an object
@@ -1393,6 +1677,7 @@ private:
     as::io_context& ioc_;
     as::steady_timer tim_ping_;
     as::steady_timer tim_close_;
+    as::steady_timer tim_reconnect_;
     std::string host_;
     std::string port_;
     std::uint16_t keep_alive_sec_{0};
@@ -1402,6 +1687,19 @@ private:
     optional<std::string> user_name_;
     optional<std::string> password_;
     bool async_pingreq_ = false;
+    std::shared_ptr<timer_wheel> keep_alive_wheel_;
+    optional<timer_wheel::handle> ping_handle_;
+    std::atomic<std::chrono::steady_clock::time_point> last_send_{std::chrono::steady_clock::time_point()};
+    std::shared_ptr<resolver_cache> resolver_cache_;
+    std::chrono::steady_clock::duration connect_attempt_delay_{std::chrono::steady_clock::duration::zero()};
+    tcp_socket_options tcp_socket_options_;
+    optional<decorrelated_jitter_backoff> backoff_;
+    optional<std::chrono::steady_clock::time_point> disconnected_at_;
+    reconnect_statistics reconnect_statistics_;
+    v5::properties connect_props_;
+    any connect_session_life_keeper_;
+    async_handler_t connect_handler_;
+    bool connect_with_user_socket_ = false;
 #if defined(MQTT_USE_TLS)
     as::ssl::context ctx_{as::ssl::context::tlsv12};
 #endif // defined(MQTT_USE_TLS)
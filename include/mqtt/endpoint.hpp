@@ -18,6 +18,7 @@
 #include <mutex>
 #include <atomic>
 #include <algorithm>
+#include <chrono>
 
 #include <boost/any.hpp>
 #include <boost/lexical_cast.hpp>
@@ -62,6 +63,8 @@
 #include <mqtt/deprecated.hpp>
 #include <mqtt/deprecated_msg.hpp>
 #include <mqtt/error_code.hpp>
+#include <mqtt/offline_publish_queue.hpp>
+#include <mqtt/visitor_util.hpp>
 
 #if defined(MQTT_USE_WS)
 #include <mqtt/ws_endpoint.hpp>
@@ -748,6 +751,16 @@ protected:
      */
     virtual void on_pre_send() noexcept = 0;
 
+    /**
+     * @brief Connack received handler
+     *        This handler is called when CONNACK is received, before the stored messages are sent
+     *        and the connack handler is called.
+     * @param accepted true if the connection is accepted
+     */
+    virtual void on_connack_received(bool accepted) noexcept {
+        (void)accepted;
+    }
+
 private:
     /**
      * @brief is valid length handler
@@ -817,6 +830,25 @@ public:
         return total_bytes_sent_;
     }
 
+    /**
+     * @brief get_ping_rtt
+     * @return The round trip time of the last PINGREQ and PINGRESP.
+     *         nullopt if no PINGRESP has been received.
+     */
+    optional<std::chrono::steady_clock::duration> get_ping_rtt() const {
+        return ticks_to_duration(ping_rtt_.load());
+    }
+
+    /**
+     * @brief get_smoothed_ping_rtt
+     * @return The moving average of the round trip times of PINGREQ and PINGRESP.
+     *         Each new sample is weighted by 1/8 (the same as TCP's smoothed RTT).
+     *         nullopt if no PINGRESP has been received.
+     */
+    optional<std::chrono::steady_clock::duration> get_smoothed_ping_rtt() const {
+        return ticks_to_duration(smoothed_ping_rtt_.load());
+    }
+
     /**
      * @brief Set auto publish response mode.
      * @param b set value
@@ -1214,6 +1246,58 @@ public:
         );
     }
 
+    /**
+     * @brief Publish with already acquired packet identifier
+     * @param packet_id
+     *        packet identifier. It should be acquired by acquire_unique_packet_id, or register_packet_id.
+     *        The ownership of  the packet_id moves to the library.
+     *        If qos == qos::at_most_once, packet_id must be 0. But not checked in release mode due to performance.
+     * @param topic_name
+     *        A topic name to publish
+     * @param contents
+     *        The contents to publish
+     * @param pubopts
+     *        qos, retain flag, and dup flag.
+     * @param props
+     *        Properties that are encoded once and shared with the other publishes.<BR>
+     *        It is useful to publish the same properties to many endpoints.<BR>
+     *        See https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc3901109<BR>
+     *        3.3.2.3 PUBLISH Properties
+     * @param life_keeper
+     *        An object that stays alive as long as the library holds a reference to any other parameters.
+     *        If topic_name, contents, or props do not have built-in lifetime management, (e.g. MQTT_NS::buffer)
+     *        use this parameter to manage their lifetime.
+     *
+     * @note If your QOS level is exactly_once or at_least_once, then the library will store this publish
+     *       internally until the broker has confirmed delivery, which may involve resends, and as such the
+     *       life_keeper parameter is important.
+     */
+    void publish(
+        packet_id_t packet_id,
+        buffer topic_name,
+        buffer contents,
+        publish_options pubopts,
+        v5::shared_properties props,
+        any life_keeper = {}
+    ) {
+        BOOST_ASSERT((pubopts.get_qos() == qos::at_most_once && packet_id == 0) || (pubopts.get_qos() != qos::at_most_once && packet_id != 0));
+
+        auto topic_name_buf = as::buffer(topic_name);
+        auto contents_buf   = as::buffer(contents);
+        send_publish(
+            packet_id,
+            topic_name_buf,
+            contents_buf,
+            pubopts,
+            force_move(props),
+            std::make_tuple(
+                force_move(life_keeper),
+                force_move(topic_name),
+                force_move(contents)
+            )
+        );
+    }
+
     /**
      * @brief Subscribe with already acquired packet identifier
      * @param packet_id
@@ -2213,6 +2297,64 @@ public:
             force_move(func)
         );
     }
+
+    /**
+     * @brief Publish with a manual set packet identifier
+     * @param packet_id
+     *        packet identifier. It should be acquired by acquire_unique_packet_id, or register_packet_id.
+     *        The ownership of  the packet_id moves to the library.
+     *        If qos == qos::at_most_once, packet_id must be 0. But not checked in release mode due to performance.
+     * @param topic_name
+     *        A topic name to publish
+     * @param contents
+     *        The contents to publish
+     * @param pubopts
+     *        qos, retain flag, and dup flag.
+     * @param props
+     *        Properties that are encoded once and shared with the other publishes.<BR>
+     *        It is useful to publish the same properties to many endpoints.<BR>
+     *        See https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc3901109<BR>
+     *        3.3.2.3 PUBLISH Properties
+     * @param life_keeper
+     *        An object that stays alive as long as the library holds a reference to any other parameters.
+     *        If topic_name, contents, or props do not have built-in lifetime management, (e.g. MQTT_NS::buffer)
+     *        use this parameter to manage their lifetime.
+     * @param func
+     *        functor object who's operator() will be called when the async operation completes.
+     *
+     * @note If your QOS level is exactly_once or at_least_once, then the library will store this publish
+     *       internally until the broker has confirmed delivery, which may involve resends, and as such the
+     *       life_keeper parameter is important.
+     */
+    void async_publish(
+        packet_id_t packet_id,
+        buffer topic_name,
+        buffer contents,
+        publish_options pubopts,
+        v5::shared_properties props,
+        any life_keeper = {},
+        async_handler_t func = {}
+    ) {
+        BOOST_ASSERT((pubopts.get_qos() == qos::at_most_once && packet_id == 0) || (pubopts.get_qos() != qos::at_most_once && packet_id != 0));
+
+        auto topic_name_buf = as::buffer(topic_name);
+        auto contents_buf   = as::buffer(contents);
+
+        async_send_publish(
+            packet_id,
+            topic_name_buf,
+            contents_buf,
+            pubopts,
+            force_move(props),
+            std::make_tuple(
+                force_move(life_keeper),
+                force_move(topic_name),
+                force_move(contents)
+            ),
+            force_move(func)
+        );
+    }
+
     /**
      * @brief Subscribe
      * @param packet_id
@@ -3921,6 +4063,26 @@ public:
         max_queue_send_size_ = size;
     }
 
+    /**
+     * @brief Keep the messages that are published while disconnected, and send them after reconnecting.
+     *        Without the queue, async publish while disconnected finishes successfully, and QoS0
+     *        messages are lost. QoS1 and QoS2 messages are resent from the store only if
+     *        clean_session is false.
+     *        With the queue, the messages of all QoS levels are kept, and are sent in one write
+     *        just after the accepted CONNACK. If clean_session is false, QoS1 and QoS2 messages
+     *        are left to the store.
+     *        The handler of the publish is called when the message is written. It is called with
+     *        no_buffer_space if the message is dropped by the limits, or timed_out if the message
+     *        expires. The MESSAGE_EXPIRY_INTERVAL property is used as the expiry if it exists.
+     *        Only the async publish functions use the queue.
+     *
+     * @param limits limits of the queue. nullopt disables the queue. The default is nullopt.
+     *
+     */
+    void set_offline_publish_queue(optional<offline_publish_queue_limits> limits) {
+        offline_publish_queue_limits_ = force_move(limits);
+    }
+
     protocol_version get_protocol_version() const {
         return version_;
     }
@@ -3999,6 +4161,8 @@ protected:
 
     void set_connect() {
         connected_ = true;
+        // The PINGREQ of the previous connection is never answered.
+        pingreq_sent_ = no_ticks;
     }
 
     void set_protocol_version(protocol_version version) {
@@ -6241,15 +6405,22 @@ private:
             break;
         case connack_phase::finish: {
             mqtt_connected_ = true;
+            auto accepted =
+                   (   (0 == variant_idx(info.reason_code))
+                    && (connect_return_code::accepted == variant_get<connect_return_code>(info.reason_code)))
+                || (   (1 == variant_idx(info.reason_code))
+                    && (v5::connect_reason_code::success == variant_get<v5::connect_reason_code>(info.reason_code)));
             // I use rvalue reference parameter to reduce move constructor calling.
             // This is a local lambda expression invoked from this function, so
             // I can control all callers.
             auto connack_proc =
-                [this]
+                [this, accepted]
                 (
                     any&& session_life_keeper,
                     connack_info&& info
                 ) mutable {
+                    // The messages published while disconnected follow the stored messages.
+                    if (accepted) flush_offline_publish_queue();
                     switch (version_) {
                     case protocol_version::v3_1_1:
                         if(on_connack(info.session_present,
@@ -6272,14 +6443,31 @@ private:
             // Note: boost:variant has no featue to query if the variant currently holds a specific type.
             // MQTT_CPP could create a type traits function to match the provided type to the index in
             // the boost::variant type list, but for now it does not appear to be needed.
-            if (   (   (0 == variant_idx(info.reason_code))
-                    && (connect_return_code::accepted == variant_get<connect_return_code>(info.reason_code)))
-                || (   (1 == variant_idx(info.reason_code))
-                    && (v5::connect_reason_code::success == variant_get<v5::connect_reason_code>(info.reason_code)))) {
+            on_connack_received(accepted);
+            if (accepted) {
                 if (clean_session_) {
                     LockGuard<Mutex> lck (store_mtx_);
-                    store_.clear();
-                    packet_id_.clear();
+                    if (offline_publish_queue_.empty()) {
+                        store_.clear();
+                        packet_id_.clear();
+                    }
+                    else {
+                        // The messages in the offline publish queue keep their packet ids,
+                        // and are sent after this.
+                        std::set<packet_id_t> queued;
+                        for (auto const& e : offline_publish_queue_) {
+                            if (e.packet_id != 0) queued.insert(e.packet_id);
+                        }
+                        auto& idx = store_.template get<tag_packet_id>();
+                        for (auto it = idx.begin(); it != idx.end();) {
+                            if (queued.count(it->packet_id()) == 0) it = idx.erase(it);
+                            else ++it;
+                        }
+                        for (auto it = packet_id_.begin(); it != packet_id_.end();) {
+                            if (queued.count(*it) == 0) it = packet_id_.erase(it);
+                            else ++it;
+                        }
+                    }
                 }
                 else {
                     if (async_send_store_) {
@@ -7900,6 +8088,14 @@ private:
             call_protocol_error_handlers();
             return;
         }
+        auto sent = pingreq_sent_.exchange(no_ticks);
+        if (sent != no_ticks) {
+            auto rtt = std::chrono::steady_clock::now().time_since_epoch().count() - sent;
+            ping_rtt_ = rtt;
+            // Only the receiving handler updates the average, so load and store need not be a single operation.
+            auto smoothed = smoothed_ping_rtt_.load();
+            smoothed_ping_rtt_ = smoothed == no_ticks ? rtt : smoothed + (rtt - smoothed) / 8;
+        }
         if (on_pingresp()) {
             on_mqtt_message_processed(force_move(session_life_keeper));
         }
@@ -8208,12 +8404,14 @@ private:
         }
     }
 
+    // Props is v5::properties or v5::shared_properties.
+    template <typename Props>
     void send_publish(
         packet_id_t      packet_id,
         as::const_buffer topic_name,
         as::const_buffer payload,
         publish_options  pubopts,
-        v5::properties   props,
+        Props            props,
         any              life_keeper) {
 
         auto do_send_publish =
@@ -8524,7 +8722,22 @@ private:
         }
     }
 
+    void mark_pingreq_sent() {
+        auto expected = no_ticks;
+        pingreq_sent_.compare_exchange_strong(
+            expected,
+            std::chrono::steady_clock::now().time_since_epoch().count()
+        );
+    }
+
+    static optional<std::chrono::steady_clock::duration> ticks_to_duration(std::chrono::steady_clock::rep ticks) {
+        if (ticks == no_ticks) return nullopt;
+        return std::chrono::steady_clock::duration(ticks);
+    }
+
     void send_pingreq() {
+        // PINGRESPs are returned in order. The RTT is measured from the oldest outstanding PINGREQ.
+        mark_pingreq_sent();
         switch (version_) {
         case protocol_version::v3_1_1:
             do_sync_write(v3_1_1::pingreq_message());
@@ -8682,12 +8895,14 @@ private:
         }
     }
 
+    // Props is v5::properties or v5::shared_properties.
+    template <typename Props>
     void async_send_publish(
         packet_id_t packet_id,
         as::const_buffer topic_name,
         as::const_buffer payload,
         publish_options pubopts,
-        v5::properties props,
+        Props props,
         any life_keeper,
         async_handler_t func
     ) {
@@ -9060,6 +9275,7 @@ private:
     }
 
     void async_send_pingreq(async_handler_t func) {
+        mark_pingreq_sent();
         switch (version_) {
         case protocol_version::v3_1_1:
             do_async_write(v3_1_1::pingreq_message(), force_move(func));
@@ -9236,10 +9452,11 @@ private:
         std::size_t bytes_to_transfer_;
     };
 
-    void do_async_write() {
+    // If unlimited is true, all queued messages are sent regardless of the maximum count and size.
+    void do_async_write(bool unlimited = false) {
         // Only attempt to send up to the user specified maximum items
         using difference_t = typename decltype(queue_)::difference_type;
-        std::size_t iterator_count =   (max_queue_send_count_ == 0)
+        std::size_t iterator_count =   (unlimited || max_queue_send_count_ == 0)
                                 ? queue_.size()
                                 : std::min(max_queue_send_count_, queue_.size());
         auto const& start = queue_.cbegin();
@@ -9254,7 +9471,7 @@ private:
             std::size_t const size = MQTT_NS::size<PacketIdBytes>(mv);
 
             // If we hit the byte limit, we don't include this buffer for this send.
-            if (max_queue_send_size_ != 0 && max_queue_send_size_ < total_bytes + size) {
+            if (!unlimited && max_queue_send_size_ != 0 && max_queue_send_size_ < total_bytes + size) {
                 end = it;
                 iterator_count = boost::numeric_cast<std::size_t>(std::distance(start, end));
                 break;
@@ -9301,6 +9518,7 @@ private:
             [this, self = this->shared_from_this(), mv = force_move(mv), func = force_move(func)]
             () mutable {
                 if (!connected_) {
+                    if (offline_publish_queue_limits_ && enqueue_offline_publish(mv, func)) return;
                     // offline async publish is successfully finished, because there's nothing to do.
                     if (func) func(boost::system::errc::make_error_code(boost::system::errc::success));
                     return;
@@ -9313,6 +9531,179 @@ private:
         );
     }
 
+    // Returns false if mv is not queued. Otherwise mv and func are moved.
+    bool enqueue_offline_publish(basic_message_variant<PacketIdBytes>& mv, async_handler_t& func) {
+        struct publish_attr {
+            qos qos_value;
+            packet_id_t packet_id;
+            optional<std::uint32_t> expiry_interval;
+        };
+        // QoS0 PUBLISH doesn't have a packet id.
+        auto packet_id_of =
+            [](auto const& m) -> packet_id_t {
+                return m.get_qos() == qos::at_most_once ? 0 : m.packet_id();
+            };
+        auto attr = MQTT_NS::visit(
+            make_lambda_visitor(
+                [&](v3_1_1::basic_publish_message<PacketIdBytes> const& m) -> optional<publish_attr> {
+                    return publish_attr { m.get_qos(), packet_id_of(m), nullopt };
+                },
+                [&](v5::basic_publish_message<PacketIdBytes> const& m) -> optional<publish_attr> {
+                    publish_attr ret { m.get_qos(), packet_id_of(m), nullopt };
+                    for (auto const& p : m.props()) {
+                        MQTT_NS::visit(
+                            make_lambda_visitor(
+                                [&](v5::property::message_expiry_interval const& t) {
+                                    ret.expiry_interval.emplace(t.val());
+                                },
+                                [](auto const&) {}
+                            ),
+                            p
+                        );
+                    }
+                    return ret;
+                },
+                [](auto const&) -> optional<publish_attr> {
+                    return nullopt;
+                }
+            ),
+            mv
+        );
+        if (!attr) return false;
+        // QoS1 and QoS2 messages are resent from the store.
+        if (attr.value().qos_value != qos::at_most_once && !clean_session_) return false;
+
+        auto const& limits = offline_publish_queue_limits_.value();
+        auto now = std::chrono::steady_clock::now();
+        expire_offline_publishes(now);
+
+        offline_publish e { force_move(mv), force_move(func), 0, attr.value().packet_id, nullopt };
+        e.size = MQTT_NS::size<PacketIdBytes>(e.mv);
+        if (attr.value().expiry_interval) {
+            e.expiry.emplace(now + std::chrono::seconds(attr.value().expiry_interval.value()));
+        }
+        else if (limits.expiry) {
+            e.expiry.emplace(now + limits.expiry.value());
+        }
+
+        auto full =
+            [&] {
+                return
+                    (limits.max_messages != 0 && offline_publish_queue_.size() + 1 > limits.max_messages) ||
+                    (limits.max_bytes != 0 && offline_publish_queue_bytes_ + e.size > limits.max_bytes);
+            };
+        if (limits.policy == offline_publish_overflow::drop_oldest) {
+            while (!offline_publish_queue_.empty() && full()) {
+                auto oldest = force_move(offline_publish_queue_.front());
+                offline_publish_queue_.pop_front();
+                offline_publish_queue_bytes_ -= oldest.size;
+                drop_offline_publish(oldest, boost::system::errc::no_buffer_space);
+            }
+        }
+        // The new message is dropped by drop_newest, or is larger than the limit by itself.
+        if (full()) {
+            drop_offline_publish(e, boost::system::errc::no_buffer_space);
+            return true;
+        }
+        offline_publish_queue_bytes_ += e.size;
+        offline_publish_queue_.push_back(force_move(e));
+        return true;
+    }
+
+    void expire_offline_publishes(std::chrono::steady_clock::time_point now) {
+        for (auto it = offline_publish_queue_.begin(); it != offline_publish_queue_.end();) {
+            if (it->expiry && it->expiry.value() <= now) {
+                auto e = force_move(*it);
+                it = offline_publish_queue_.erase(it);
+                offline_publish_queue_bytes_ -= e.size;
+                drop_offline_publish(e, boost::system::errc::timed_out);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+
+    template <typename Offline>
+    void drop_offline_publish(Offline& e, boost::system::errc::errc_t ec) {
+        if (e.packet_id != 0) {
+            clear_stored_publish(e.packet_id);
+            on_serialize_remove(e.packet_id);
+        }
+        if (e.func) e.func(boost::system::errc::make_error_code(ec));
+    }
+
+    void flush_offline_publish_queue() {
+        socket_->post(
+            [this, self = this->shared_from_this()]
+            () {
+                if (!connected_ || offline_publish_queue_.empty()) return;
+                auto now = std::chrono::steady_clock::now();
+                expire_offline_publishes(now);
+                auto idle = queue_.empty();
+                for (auto& e : offline_publish_queue_) {
+                    if (e.expiry) update_message_expiry_interval(e.mv, e.expiry.value() - now);
+                    queue_.emplace_back(force_move(e.mv), force_move(e.func));
+                }
+                offline_publish_queue_.clear();
+                offline_publish_queue_bytes_ = 0;
+                // If a write is in progress, the rest is sent when it finishes.
+                if (idle && !queue_.empty()) do_async_write(true);
+            }
+        );
+    }
+
+    // The MESSAGE_EXPIRY_INTERVAL of the queued message is set to the time that remains.
+    // http://docs.oasis-open.org/mqtt/mqtt/v5.0/cs02/mqtt-v5.0-cs02.html#_Toc514345348 [MQTT-3.3.2-6]
+    static void update_message_expiry_interval(
+        basic_message_variant<PacketIdBytes>& mv,
+        std::chrono::steady_clock::duration remaining) {
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(
+            remaining + std::chrono::seconds(1) - std::chrono::steady_clock::duration(1)
+        ).count();
+        MQTT_NS::visit(
+            make_lambda_visitor(
+                [&](v5::basic_publish_message<PacketIdBytes>& m) {
+                    v5::properties props;
+                    props.reserve(m.props().size());
+                    bool found = false;
+                    for (auto const& p : m.props()) {
+                        MQTT_NS::visit(
+                            make_lambda_visitor(
+                                [&](v5::property::message_expiry_interval const&) {
+                                    found = true;
+                                    props.emplace_back(
+                                        v5::property::message_expiry_interval(
+                                            static_cast<std::uint32_t>(std::max<decltype(seconds)>(seconds, 1))
+                                        )
+                                    );
+                                },
+                                [&](auto const&) {
+                                    props.push_back(p);
+                                }
+                            ),
+                            p
+                        );
+                    }
+                    // The expiry comes from offline_publish_queue_limits. Nothing to send.
+                    if (!found) return;
+                    // The topic and the payload are kept alive by the life keeper of the message.
+                    auto topic = m.topic();
+                    auto payload = m.payload();
+                    m = v5::basic_publish_message<PacketIdBytes>(
+                        m.get_qos() == qos::at_most_once ? 0 : m.packet_id(),
+                        as::buffer(topic.data(), topic.size()),
+                        as::buffer(payload.data(), payload.size()),
+                        m.get_options(),
+                        force_move(props)
+                    );
+                },
+                [](auto&) {}
+            ),
+            mv
+        );
+    }
+
     static constexpr std::uint16_t make_uint16_t(char b1, char b2) {
         return
             static_cast<std::uint16_t>(
@@ -9360,6 +9751,18 @@ private:
     mi_store store_;
     std::set<packet_id_t> qos2_publish_handled_;
     std::deque<async_packet> queue_;
+
+    struct offline_publish {
+        basic_message_variant<PacketIdBytes> mv;
+        async_handler_t func;
+        std::size_t size;
+        // 0 if QoS0
+        packet_id_t packet_id;
+        optional<std::chrono::steady_clock::time_point> expiry;
+    };
+    optional<offline_publish_queue_limits> offline_publish_queue_limits_;
+    std::deque<offline_publish> offline_publish_queue_;
+    std::size_t offline_publish_queue_bytes_ = 0;
     packet_id_t packet_id_master_{0};
     std::set<packet_id_t> packet_id_;
     Mutex sub_unsub_inflight_mtx_;
@@ -9377,6 +9780,12 @@ private:
     std::size_t props_bulk_read_limit_ = packet_bulk_read_limit_;
     std::size_t total_bytes_sent_ = 0;
     std::size_t total_bytes_received_ = 0;
+    // The ping times are read by the getters from any thread, so they are kept as atomic tick counts.
+    // no_ticks means not set.
+    static constexpr std::chrono::steady_clock::rep no_ticks = std::numeric_limits<std::chrono::steady_clock::rep>::min();
+    std::atomic<std::chrono::steady_clock::rep> pingreq_sent_{no_ticks};
+    std::atomic<std::chrono::steady_clock::rep> ping_rtt_{no_ticks};
+    std::atomic<std::chrono::steady_clock::rep> smoothed_ping_rtt_{no_ticks};
     static constexpr std::uint8_t variable_length_continue_flag = 0b10000000;
 };
 
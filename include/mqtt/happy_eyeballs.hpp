@@ -0,0 +1,224 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_HAPPY_EYEBALLS_HPP)
+#define MQTT_HAPPY_EYEBALLS_HPP
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include <mqtt/namespace.hpp>
+#include <mqtt/error_code.hpp>
+#include <mqtt/move.hpp>
+#include <mqtt/optional.hpp>
+
+namespace MQTT_NS {
+
+namespace as = boost::asio;
+
+/**
+ * @brief Socket options that are set to the sockets of the connection attempts.
+ *
+ * The values are set as they are recorded here. The options that are not set are left
+ * as the defaults of the system. The buffer sizes are not read back from a socket,
+ * because the system can adjust them. e.g. Linux doubles them (see socket(7)).
+ */
+struct tcp_socket_options {
+    optional<bool> no_delay; ///< TCP_NODELAY
+    optional<bool> keep_alive; ///< SO_KEEPALIVE
+    optional<as::socket_base::linger> linger; ///< SO_LINGER
+    optional<int> send_buffer_size; ///< SO_SNDBUF
+    optional<int> receive_buffer_size; ///< SO_RCVBUF
+};
+
+namespace detail {
+
+// Alternate the address families, starting with the family of the first endpoint.
+// See https://tools.ietf.org/html/rfc8305#section-4
+inline std::vector<as::ip::tcp::endpoint> interleave_families(std::vector<as::ip::tcp::endpoint> const& eps) {
+    std::vector<as::ip::tcp::endpoint> first;
+    std::vector<as::ip::tcp::endpoint> second;
+    for (auto const& ep : eps) {
+        if (ep.address().is_v6() == eps.front().address().is_v6()) first.push_back(ep);
+        else second.push_back(ep);
+    }
+    std::vector<as::ip::tcp::endpoint> ret;
+    ret.reserve(eps.size());
+    for (std::size_t i = 0; i < first.size() || i < second.size(); ++i) {
+        if (i < first.size()) ret.push_back(first[i]);
+        if (i < second.size()) ret.push_back(second[i]);
+    }
+    return ret;
+}
+
+template <typename Socket, typename Option, typename T>
+inline void set_socket_option(Socket& s, optional<T> const& value) {
+    if (!value) return;
+    error_code ignored;
+    s.set_option(Option(value.value()), ignored);
+}
+
+template <typename Socket>
+inline void set_socket_options(Socket& s, tcp_socket_options const& options) {
+    set_socket_option<Socket, as::ip::tcp::no_delay>(s, options.no_delay);
+    set_socket_option<Socket, as::socket_base::keep_alive>(s, options.keep_alive);
+    set_socket_option<Socket, as::socket_base::linger>(s, options.linger);
+    set_socket_option<Socket, as::socket_base::send_buffer_size>(s, options.send_buffer_size);
+    set_socket_option<Socket, as::socket_base::receive_buffer_size>(s, options.receive_buffer_size);
+}
+
+template <typename LowestLayer, typename Handler>
+class happy_eyeballs_op : public std::enable_shared_from_this<happy_eyeballs_op<LowestLayer, Handler>> {
+    using socket_t = as::basic_stream_socket<as::ip::tcp, typename LowestLayer::executor_type>;
+
+public:
+    happy_eyeballs_op(
+        LowestLayer& lowest,
+        std::vector<as::ip::tcp::endpoint> eps,
+        std::chrono::steady_clock::duration delay,
+        tcp_socket_options options,
+        Handler h)
+        :lowest_(lowest),
+         eps_(force_move(eps)),
+         delay_(delay),
+         tim_(lowest.get_executor()),
+         h_(force_move(h)),
+         options_(force_move(options)) {}
+
+    void start() {
+        if (eps_.empty()) {
+            complete(as::error::host_not_found);
+            return;
+        }
+        attempt();
+    }
+
+private:
+    void attempt() {
+        auto i = next_++;
+        sockets_.emplace_back(std::make_unique<socket_t>(lowest_.get_executor()));
+        auto& s = *sockets_.back();
+        ++pending_;
+        // The buffer sizes take effect only if they are set before connecting.
+        error_code ec;
+        s.open(eps_[i].protocol(), ec);
+        if (!ec) set_socket_options(s, options_);
+        s.async_connect(
+            eps_[i],
+            [self = this->shared_from_this(), &s](error_code ec) {
+                self->handle_connect(s, ec);
+            }
+        );
+        if (next_ == eps_.size()) return;
+        tim_.expires_after(delay_);
+        tim_.async_wait(
+            [self = this->shared_from_this()](error_code ec) {
+                if (ec || self->done_ || self->next_ == self->eps_.size()) return;
+                self->attempt();
+            }
+        );
+    }
+
+    void handle_connect(socket_t& s, error_code ec) {
+        --pending_;
+        if (done_) return;
+        if (!ec) {
+            tim_.cancel();
+            for (auto& other : sockets_) {
+                if (other.get() != &s) {
+                    error_code ignored;
+                    other->close(ignored);
+                }
+            }
+            lowest_ = force_move(s);
+            complete(ec);
+            return;
+        }
+        ec_ = ec;
+        // A failure starts the next attempt without waiting for the delay.
+        if (next_ != eps_.size()) {
+            tim_.cancel();
+            attempt();
+            return;
+        }
+        if (pending_ == 0) complete(ec_);
+    }
+
+    void complete(error_code ec) {
+        done_ = true;
+        h_(ec);
+    }
+
+    LowestLayer& lowest_;
+    std::vector<as::ip::tcp::endpoint> eps_;
+    std::chrono::steady_clock::duration delay_;
+    as::steady_timer tim_;
+    Handler h_;
+    tcp_socket_options options_;
+    std::vector<std::unique_ptr<socket_t>> sockets_;
+    std::size_t next_ = 0;
+    std::size_t pending_ = 0;
+    bool done_ = false;
+    error_code ec_;
+};
+
+} // namespace detail
+
+/**
+ * @brief Connect to one of the endpoints, trying them in parallel with staggered starts.
+ *
+ * The endpoints are reordered so that the address families alternate.
+ * An attempt is started for the first endpoint. If it is not connected within delay,
+ * or if it fails, an attempt for the next endpoint is started while the previous
+ * attempts continue. The first connected socket is moved into lowest, and the
+ * other attempts are closed.
+ * Each attempt uses its own socket, so the options are passed as options instead of
+ * being set to lowest. They are set before connecting, so the connected socket has them.<BR>
+ * See https://tools.ietf.org/html/rfc8305
+ * @param lowest the lowest layer of the socket. It must be closed, and outlive the operation.
+ * @param eps endpoints
+ * @param delay delay between the attempts
+ * @param options socket options that are set to the socket of each attempt
+ * @param h handler that is called as h(ec). ec is the error of the last attempt if all attempts fail.
+ */
+template <typename LowestLayer, typename Handler>
+inline void async_happy_eyeballs_connect(
+    LowestLayer& lowest,
+    std::vector<as::ip::tcp::endpoint> eps,
+    std::chrono::steady_clock::duration delay,
+    tcp_socket_options options,
+    Handler&& h) {
+    if (!eps.empty()) eps = detail::interleave_families(eps);
+    std::make_shared<detail::happy_eyeballs_op<LowestLayer, std::decay_t<Handler>>>(
+        lowest, force_move(eps), delay, force_move(options), std::forward<Handler>(h)
+    )->start();
+}
+
+/**
+ * @brief Connect to one of the endpoints, trying them in parallel with staggered starts.
+ *
+ * The sockets of the attempts have the default options of the system.
+ * See the overload that takes tcp_socket_options.
+ * @param lowest the lowest layer of the socket. It must be closed, and outlive the operation.
+ * @param eps endpoints
+ * @param delay delay between the attempts
+ * @param h handler that is called as h(ec). ec is the error of the last attempt if all attempts fail.
+ */
+template <typename LowestLayer, typename Handler>
+inline void async_happy_eyeballs_connect(
+    LowestLayer& lowest,
+    std::vector<as::ip::tcp::endpoint> eps,
+    std::chrono::steady_clock::duration delay,
+    Handler&& h) {
+    async_happy_eyeballs_connect(lowest, force_move(eps), delay, tcp_socket_options(), std::forward<Handler>(h));
+}
+
+} // namespace MQTT_NS
+
+#endif // MQTT_HAPPY_EYEBALLS_HPP
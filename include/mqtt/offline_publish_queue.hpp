@@ -0,0 +1,43 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_OFFLINE_PUBLISH_QUEUE_HPP)
+#define MQTT_OFFLINE_PUBLISH_QUEUE_HPP
+
+#include <chrono>
+#include <cstddef>
+
+#include <mqtt/namespace.hpp>
+#include <mqtt/optional.hpp>
+
+namespace MQTT_NS {
+
+/**
+ * @brief Message that is dropped when the offline publish queue is full.
+ */
+enum class offline_publish_overflow {
+    drop_oldest, ///< The oldest queued message is dropped to make room for the new one.
+    drop_newest, ///< The new message is dropped.
+};
+
+/**
+ * @brief Limits of the queue that keeps the messages published while disconnected.
+ */
+struct offline_publish_queue_limits {
+    /// The maximum number of the queued messages. 0 means no limit.
+    std::size_t max_messages = 1000;
+    /// The maximum total size in bytes of the queued messages. 0 means no limit.
+    std::size_t max_bytes = 1024 * 1024;
+    /// The expiry of the messages that don't have a MESSAGE_EXPIRY_INTERVAL property.
+    /// nullopt means that they don't expire.
+    optional<std::chrono::steady_clock::duration> expiry;
+    /// The message that is dropped when a limit is exceeded.
+    offline_publish_overflow policy = offline_publish_overflow::drop_oldest;
+};
+
+} // namespace MQTT_NS
+
+#endif // MQTT_OFFLINE_PUBLISH_QUEUE_HPP
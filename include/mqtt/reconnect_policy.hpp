@@ -0,0 +1,98 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_RECONNECT_POLICY_HPP)
+#define MQTT_RECONNECT_POLICY_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <random>
+
+#include <boost/assert.hpp>
+
+#include <mqtt/namespace.hpp>
+
+namespace MQTT_NS {
+
+/**
+ * @brief Delays of the automatic reconnection.
+ */
+struct reconnect_policy {
+    /// The first delay, and the lower bound of the following delays.
+    std::chrono::steady_clock::duration base_delay = std::chrono::seconds(1);
+    /// The upper bound of the delays.
+    std::chrono::steady_clock::duration max_delay = std::chrono::seconds(60);
+};
+
+/**
+ * @brief Statistics of the automatic reconnection.
+ */
+struct reconnect_statistics {
+    /// The number of the reconnection attempts.
+    std::size_t attempts = 0;
+    /// The number of the reconnections that received the accepted CONNACK.
+    std::size_t reconnects = 0;
+    /// The time from the disconnection to the accepted CONNACK of the last reconnection.
+    std::chrono::steady_clock::duration last_latency = std::chrono::steady_clock::duration::zero();
+    /// The longest latency.
+    std::chrono::steady_clock::duration max_latency = std::chrono::steady_clock::duration::zero();
+    /// The sum of the latencies. Divide it by reconnects to get the average.
+    std::chrono::steady_clock::duration total_latency = std::chrono::steady_clock::duration::zero();
+};
+
+/**
+ * @brief Exponential backoff with decorrelated jitter.
+ *
+ * Each delay is chosen at random between base_delay and three times the previous delay,
+ * and capped by max_delay. The clients that are disconnected at the same time spread
+ * their reconnections instead of retrying in lockstep.<BR>
+ * See https://aws.amazon.com/blogs/architecture/exponential-backoff-and-jitter/
+ */
+class decorrelated_jitter_backoff {
+public:
+    using duration = std::chrono::steady_clock::duration;
+
+    /**
+     * @brief Constructor
+     * @param policy delays
+     * @param seed seed of the random number generator
+     */
+    explicit decorrelated_jitter_backoff(reconnect_policy policy, std::uint32_t seed = std::random_device()())
+        :policy_(policy),
+         prev_(policy.base_delay),
+         rng_(seed) {
+        BOOST_ASSERT(policy_.base_delay > duration::zero());
+        BOOST_ASSERT(policy_.base_delay <= policy_.max_delay);
+    }
+
+    /**
+     * @brief Get the next delay
+     * @return delay between base_delay and max_delay
+     */
+    duration next() {
+        auto upper = std::max(policy_.base_delay, std::min(policy_.max_delay, prev_ * 3));
+        std::uniform_int_distribution<duration::rep> dist(policy_.base_delay.count(), upper.count());
+        prev_ = duration(dist(rng_));
+        return prev_;
+    }
+
+    /**
+     * @brief Start from base_delay again. Call this when the connection is established.
+     */
+    void reset() {
+        prev_ = policy_.base_delay;
+    }
+
+private:
+    reconnect_policy policy_;
+    duration prev_;
+    std::mt19937 rng_;
+};
+
+} // namespace MQTT_NS
+
+#endif // MQTT_RECONNECT_POLICY_HPP
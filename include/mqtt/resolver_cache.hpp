@@ -0,0 +1,192 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_RESOLVER_CACHE_HPP)
+#define MQTT_RESOLVER_CACHE_HPP
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include <mqtt/namespace.hpp>
+#include <mqtt/error_code.hpp>
+#include <mqtt/move.hpp>
+#include <mqtt/optional.hpp>
+
+namespace MQTT_NS {
+
+namespace as = boost::asio;
+
+/**
+ * @brief Cache of the resolved endpoints that is shared by clients.
+ *
+ * The resolved endpoints are kept for the TTL that is given to the constructor.
+ * The resolver doesn't report the TTL of the DNS records, so it is configured here.
+ * While a host is being resolved, the other requests for the same host wait for the
+ * result instead of sending their own queries, so a mass reconnect sends one query per host.
+ * The cache is thread safe. The handlers are called on the io_context that is passed
+ * with each request.
+ */
+class resolver_cache : public std::enable_shared_from_this<resolver_cache> {
+public:
+    using endpoints = std::vector<as::ip::tcp::endpoint>;
+    using handler = std::function<void(error_code ec, endpoints eps)>;
+
+    /**
+     * @brief Constructor
+     * @param ttl duration that the resolved endpoints are used for
+     */
+    explicit resolver_cache(std::chrono::steady_clock::duration ttl = std::chrono::seconds(60))
+        :ttl_(ttl) {}
+
+    resolver_cache(resolver_cache const&) = delete;
+    resolver_cache& operator=(resolver_cache const&) = delete;
+
+    /**
+     * @brief Get the cached endpoints
+     * @param host host name
+     * @param port port number or service name
+     * @return endpoints if they are cached and not expired, otherwise nullopt
+     */
+    optional<endpoints> find(std::string const& host, std::string const& port) {
+        std::lock_guard<std::mutex> g(mtx_);
+        return find_locked(key(host, port));
+    }
+
+    /**
+     * @brief Store the endpoints
+     * @param host host name
+     * @param port port number or service name
+     * @param eps endpoints that are used until the TTL elapses
+     */
+    void store(std::string const& host, std::string const& port, endpoints eps) {
+        std::lock_guard<std::mutex> g(mtx_);
+        entries_[key(host, port)] = entry { force_move(eps), std::chrono::steady_clock::now() + ttl_ };
+    }
+
+    /**
+     * @brief Remove the endpoints. The next request resolves the host again.
+     *        Call this when no endpoint could be connected.
+     * @param host host name
+     * @param port port number or service name
+     */
+    void erase(std::string const& host, std::string const& port) {
+        std::lock_guard<std::mutex> g(mtx_);
+        entries_.erase(key(host, port));
+    }
+
+    /**
+     * @brief Resolve the host synchronously
+     * @param ioc io_context that runs the resolver
+     * @param host host name
+     * @param port port number or service name
+     * @param ec error code
+     * @return resolved endpoints
+     */
+    endpoints resolve(as::io_context& ioc, std::string const& host, std::string const& port, error_code& ec) {
+        if (auto eps = find(host, port)) return force_move(eps.value());
+        as::ip::tcp::resolver r(ioc);
+        auto results = r.resolve(host, port, ec);
+        if (ec) return endpoints();
+        endpoints eps(results.begin(), results.end());
+        store(host, port, eps);
+        return eps;
+    }
+
+    /**
+     * @brief Resolve the host asynchronously
+     * @param ioc io_context that runs the resolver, and calls the handler
+     * @param host host name
+     * @param port port number or service name
+     * @param h handler that is called as h(ec, endpoints)
+     */
+    void async_resolve(as::io_context& ioc, std::string const& host, std::string const& port, handler h) {
+        auto k = key(host, port);
+        {
+            std::lock_guard<std::mutex> g(mtx_);
+            if (auto eps = find_locked(k)) {
+                as::post(
+                    ioc,
+                    [h = force_move(h), eps = force_move(eps.value())] () mutable {
+                        h(error_code(), force_move(eps));
+                    }
+                );
+                return;
+            }
+            auto& waiters = waiting_[k];
+            waiters.emplace_back(&ioc, force_move(h));
+            // Another request is resolving the host.
+            if (waiters.size() != 1) return;
+        }
+        auto r = std::make_shared<as::ip::tcp::resolver>(ioc);
+        auto p = r.get();
+        p->async_resolve(
+            host,
+            port,
+            [self = shared_from_this(), k = force_move(k), r = force_move(r)]
+            (error_code ec, as::ip::tcp::resolver::results_type results) {
+                endpoints eps;
+                if (!ec) eps.assign(results.begin(), results.end());
+                std::vector<std::pair<as::io_context*, handler>> waiters;
+                {
+                    std::lock_guard<std::mutex> g(self->mtx_);
+                    if (!ec) {
+                        self->entries_[k] = entry { eps, std::chrono::steady_clock::now() + self->ttl_ };
+                    }
+                    auto it = self->waiting_.find(k);
+                    waiters = force_move(it->second);
+                    self->waiting_.erase(it);
+                }
+                for (auto& w : waiters) {
+                    as::post(
+                        *w.first,
+                        [h = force_move(w.second), ec, eps] () mutable {
+                            h(ec, force_move(eps));
+                        }
+                    );
+                }
+            }
+        );
+    }
+
+private:
+    using key_t = std::pair<std::string, std::string>;
+
+    struct entry {
+        endpoints eps;
+        std::chrono::steady_clock::time_point expiry;
+    };
+
+    static key_t key(std::string const& host, std::string const& port) {
+        return key_t(host, port);
+    }
+
+    optional<endpoints> find_locked(key_t const& k) {
+        auto it = entries_.find(k);
+        if (it == entries_.end()) return nullopt;
+        if (it->second.expiry <= std::chrono::steady_clock::now()) {
+            entries_.erase(it);
+            return nullopt;
+        }
+        return it->second.eps;
+    }
+
+    std::mutex mtx_;
+    std::chrono::steady_clock::duration ttl_;
+    std::map<key_t, entry> entries_;
+    std::map<key_t, std::vector<std::pair<as::io_context*, handler>>> waiting_;
+};
+
+} // namespace MQTT_NS
+
+#endif // MQTT_RESOLVER_CACHE_HPP
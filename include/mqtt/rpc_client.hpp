@@ -0,0 +1,214 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_RPC_CLIENT_HPP)
+#define MQTT_RPC_CLIENT_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <boost/assert.hpp>
+
+#include <mqtt/namespace.hpp>
+#include <mqtt/buffer.hpp>
+#include <mqtt/error_code.hpp>
+#include <mqtt/move.hpp>
+#include <mqtt/optional.hpp>
+#include <mqtt/property_variant.hpp>
+#include <mqtt/publish.hpp>
+#include <mqtt/string_view.hpp>
+#include <mqtt/timer_wheel.hpp>
+#include <mqtt/visitor_util.hpp>
+
+namespace MQTT_NS {
+
+/**
+ * @brief Request/response over MQTT v5 RESPONSE_TOPIC and CORRELATION_DATA.
+ *
+ * Each request is published with the response topic of this object and a correlation id.
+ * The id is a counter that is encoded in a few characters. The pending requests are looked
+ * up by the id when the responses arrive on the response topic, and are timed out by a
+ * timer_wheel, so a request doesn't arm its own timer.
+ * The responder publishes the response to the RESPONSE_TOPIC of the request with the same
+ * CORRELATION_DATA.
+ *
+ * The client must be connected by MQTT v5. Pass the received PUBLISH messages to
+ * handle_publish() from the publish handler of the client.
+ * The object must be used on the thread that runs the io_context of the client and the wheel.
+ * @tparam Client client type. e.g. callable_overlay<async_client<...>>
+ */
+template <typename Client>
+class rpc_client : public std::enable_shared_from_this<rpc_client<Client>> {
+public:
+    /**
+     * @brief Response handler
+     * @param ec error code. timed_out if the response doesn't arrive in time.
+     * @param contents contents of the response
+     * @param props properties of the response
+     */
+    using response_handler = std::function<void(error_code ec, buffer contents, v5::properties props)>;
+
+    /**
+     * @brief Constructor
+     * @param client client that sends the requests and receives the responses
+     * @param wheel timer wheel that times out the requests. It can be shared with the keep alive.
+     * @param response_topic topic that the responses are published to. It should be unique to the client.
+     */
+    rpc_client(std::shared_ptr<Client> client, std::shared_ptr<timer_wheel> wheel, std::string response_topic)
+        :client_(force_move(client)),
+         wheel_(force_move(wheel)),
+         response_topic_(allocate_buffer(response_topic)) {}
+
+    rpc_client(rpc_client const&) = delete;
+    rpc_client& operator=(rpc_client const&) = delete;
+
+    /**
+     * @brief Subscribe to the response topic. Call this after connecting.
+     * @param qos_value QoS of the responses
+     */
+    void async_start(qos qos_value = qos::at_most_once) {
+        client_->async_subscribe(response_topic_, qos_value);
+    }
+
+    /**
+     * @brief Send a request
+     * @param topic topic of the request
+     * @param contents contents of the request
+     * @param timeout the handler is called with timed_out if the response doesn't arrive within timeout
+     * @param h handler that is called once with the response or the error
+     * @param pubopts qos and retain of the request
+     */
+    void async_call(
+        buffer topic,
+        buffer contents,
+        std::chrono::steady_clock::duration timeout,
+        response_handler h,
+        publish_options pubopts = {}) {
+        auto id = next_id_++;
+        std::weak_ptr<rpc_client> wp(this->shared_from_this());
+        auto timer = wheel_->add(
+            timeout,
+            [wp, id] {
+                if (auto sp = wp.lock()) {
+                    sp->complete(id, boost::system::errc::make_error_code(boost::system::errc::timed_out), buffer(), v5::properties());
+                }
+            }
+        );
+        pending_.emplace(id, pending_request { force_move(h), timer });
+        client_->async_publish(
+            force_move(topic),
+            force_move(contents),
+            pubopts,
+            v5::properties {
+                v5::property::response_topic(response_topic_, true),
+                v5::property::correlation_data(allocate_buffer(encode(id)), true)
+            },
+            any(),
+            [wp = force_move(wp), id](error_code ec) {
+                if (!ec) return;
+                if (auto sp = wp.lock()) {
+                    sp->complete(id, ec, buffer(), v5::properties());
+                }
+            }
+        );
+    }
+
+    /**
+     * @brief Pass a received PUBLISH message
+     * @param topic topic of the message
+     * @param contents contents of the message
+     * @param props properties of the message
+     * @return true if the message is a response of this object, otherwise false
+     */
+    bool handle_publish(buffer const& topic, buffer contents, v5::properties props) {
+        if (topic != response_topic_) return false;
+        optional<std::uint64_t> id;
+        for (auto const& p : props) {
+            MQTT_NS::visit(
+                make_lambda_visitor(
+                    [&](v5::property::correlation_data const& t) {
+                        id = decode(t.val());
+                    },
+                    [](auto const&) {}
+                ),
+                p
+            );
+        }
+        // The response whose request has timed out is consumed too.
+        if (id) complete(id.value(), error_code(), force_move(contents), force_move(props));
+        return true;
+    }
+
+    /**
+     * @brief Get the number of the requests that wait for the responses
+     * @return the number of the pending requests
+     */
+    std::size_t pending() const {
+        return pending_.size();
+    }
+
+private:
+    struct pending_request {
+        response_handler handler;
+        timer_wheel::handle timer;
+    };
+
+    // The characters are valid in UTF-8, because CORRELATION_DATA is checked as a string.
+    static constexpr char const* digits() {
+        return "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz-_";
+    }
+
+    static std::string encode(std::uint64_t id) {
+        std::string ret;
+        do {
+            ret.push_back(digits()[id & 0x3f]);
+            id >>= 6;
+        } while (id != 0);
+        return ret;
+    }
+
+    static optional<std::uint64_t> decode(string_view s) {
+        if (s.empty() || s.size() > 11) return nullopt;
+        std::uint64_t id = 0;
+        for (auto it = s.rbegin(); it != s.rend(); ++it) {
+            auto c = *it;
+            std::uint64_t v;
+            if (c >= '0' && c <= '9') v = static_cast<std::uint64_t>(c - '0');
+            else if (c >= 'A' && c <= 'Z') v = static_cast<std::uint64_t>(c - 'A' + 10);
+            else if (c >= 'a' && c <= 'z') v = static_cast<std::uint64_t>(c - 'a' + 36);
+            else if (c == '-') v = 62;
+            else if (c == '_') v = 63;
+            else return nullopt;
+            id = (id << 6) | v;
+        }
+        return id;
+    }
+
+    void complete(std::uint64_t id, error_code ec, buffer contents, v5::properties props) {
+        auto it = pending_.find(id);
+        if (it == pending_.end()) return;
+        auto req = force_move(it->second);
+        pending_.erase(it);
+        // The publish can fail with timed_out too, so the timer is always cancelled.
+        // It is a no-op if the timer has fired.
+        wheel_->cancel(req.timer);
+        if (req.handler) req.handler(ec, force_move(contents), force_move(props));
+    }
+
+    std::shared_ptr<Client> client_;
+    std::shared_ptr<timer_wheel> wheel_;
+    buffer response_topic_;
+    std::unordered_map<std::uint64_t, pending_request> pending_;
+    std::uint64_t next_id_ = 0;
+};
+
+} // namespace MQTT_NS
+
+#endif // MQTT_RPC_CLIENT_HPP
@@ -28,6 +28,7 @@
 #include <mqtt/null_strand.hpp>
 #include <mqtt/move.hpp>
 #include <mqtt/callable_overlay.hpp>
+#include <mqtt/token_bucket.hpp>
 
 namespace MQTT_NS {
 
@@ -45,6 +46,68 @@ protected:
     ~server_endpoint() = default;
 };
 
+/**
+ * @brief Delays accepting connections while the connection rate is over the budget.
+ *
+ * The connections that are not accepted wait in the listen backlog of the kernel,
+ * so the accepted connections can finish their handshakes during a reconnect storm.
+ */
+class accept_throttle {
+public:
+    /**
+     * @brief Set the token buckets
+     * @param ioc      io_context that runs the acceptor
+     * @param listener the bucket of this listener. nullptr means no limit.
+     * @param global   the bucket that is shared by listeners. nullptr means no limit.
+     */
+    void set(
+        as::io_context& ioc,
+        std::shared_ptr<token_bucket> listener,
+        std::shared_ptr<token_bucket> global) {
+        listener_ = force_move(listener);
+        global_ = force_move(global);
+        if (!tim_) tim_.emplace(ioc);
+    }
+
+    /**
+     * @brief Take a token for the next connection
+     * @param retry called after the delay if no token is available now
+     * @return true if the connection can be accepted now
+     */
+    template <typename Retry>
+    bool admit(Retry&& retry) {
+        if (!listener_ && !global_) return true;
+        // The listener bucket is only used by this listener, so the token is surely
+        // taken after the global one is taken.
+        auto d = listener_ ? listener_->delay() : token_bucket::clock::duration::zero();
+        if (d == token_bucket::clock::duration::zero()) {
+            if (!global_ || global_->try_consume()) {
+                if (listener_) listener_->consume(1);
+                return true;
+            }
+            d = global_->delay();
+        }
+        tim_.value().expires_after(d);
+        tim_.value().async_wait(
+            [retry = std::forward<Retry>(retry)]
+            (error_code ec) mutable {
+                if (ec) return;
+                retry();
+            }
+        );
+        return false;
+    }
+
+    void cancel() {
+        if (tim_) tim_.value().cancel();
+    }
+
+private:
+    std::shared_ptr<token_bucket> listener_;
+    std::shared_ptr<token_bucket> global_;
+    optional<as::steady_timer> tim_;
+};
+
 template <
     typename Strand = as::io_context::strand,
     typename Mutex = std::mutex,
@@ -127,6 +190,7 @@ public:
 
     void close() {
         close_request_ = true;
+        accept_throttle_.cancel();
         acceptor_.reset();
     }
 
@@ -169,9 +233,23 @@ public:
         return ioc_accept_;
     }
 
+    /**
+     * @brief Limit the rate of accepting connections
+     * When no token is available, the next accept is delayed until a token is added.
+     * The limit is applied from the next accept.
+     * @param listener the bucket of this server. nullptr means no limit.
+     * @param global   the bucket that is shared with other servers. nullptr means no limit.
+     */
+    void set_accept_rate_limit(
+        std::shared_ptr<token_bucket> listener,
+        std::shared_ptr<token_bucket> global = nullptr) {
+        accept_throttle_.set(ioc_accept_, force_move(listener), force_move(global));
+    }
+
 private:
     void do_accept() {
         if (close_request_) return;
+        if (!accept_throttle_.admit([this] { do_accept(); })) return;
         auto socket = std::make_shared<socket_t>(ioc_con_);
         acceptor_.value().async_accept(
             socket->lowest_layer(),
@@ -199,6 +277,7 @@ private:
     accept_handler h_accept_;
     error_handler h_error_;
     protocol_version version_ = protocol_version::undetermined;
+    accept_throttle accept_throttle_;
 };
 
 #if defined(MQTT_USE_TLS)
@@ -290,6 +369,7 @@ public:
 
     void close() {
         close_request_ = true;
+        accept_throttle_.cancel();
         acceptor_.reset();
     }
 
@@ -360,9 +440,23 @@ public:
         return ctx_;
     }
 
+    /**
+     * @brief Limit the rate of accepting connections
+     * When no token is available, the next accept is delayed until a token is added.
+     * The limit is applied from the next accept.
+     * @param listener the bucket of this server. nullptr means no limit.
+     * @param global   the bucket that is shared with other servers. nullptr means no limit.
+     */
+    void set_accept_rate_limit(
+        std::shared_ptr<token_bucket> listener,
+        std::shared_ptr<token_bucket> global = nullptr) {
+        accept_throttle_.set(ioc_accept_, force_move(listener), force_move(global));
+    }
+
 private:
     void do_accept() {
         if (close_request_) return;
+        if (!accept_throttle_.admit([this] { do_accept(); })) return;
         auto socket = std::make_shared<socket_t>(ioc_con_, ctx_);
         auto ps = socket.get();
         acceptor_.value().async_accept(
@@ -416,6 +510,7 @@ private:
     error_handler h_error_;
     as::ssl::context ctx_;
     protocol_version version_ = protocol_version::undetermined;
+    accept_throttle accept_throttle_;
     std::chrono::steady_clock::duration underlying_connect_timeout_ = std::chrono::seconds(10);
 };
 
@@ -505,6 +600,7 @@ public:
 
     void close() {
         close_request_ = true;
+        accept_throttle_.cancel();
         acceptor_.reset();
     }
 
@@ -559,9 +655,23 @@ public:
         underlying_connect_timeout_ = force_move(timeout);
     }
 
+    /**
+     * @brief Limit the rate of accepting connections
+     * When no token is available, the next accept is delayed until a token is added.
+     * The limit is applied from the next accept.
+     * @param listener the bucket of this server. nullptr means no limit.
+     * @param global   the bucket that is shared with other servers. nullptr means no limit.
+     */
+    void set_accept_rate_limit(
+        std::shared_ptr<token_bucket> listener,
+        std::shared_ptr<token_bucket> global = nullptr) {
+        accept_throttle_.set(ioc_accept_, force_move(listener), force_move(global));
+    }
+
 private:
     void do_accept() {
         if (close_request_) return;
+        if (!accept_throttle_.admit([this] { do_accept(); })) return;
         auto socket = std::make_shared<socket_t>(ioc_con_);
         auto ps = socket.get();
         acceptor_.value().async_accept(
@@ -678,6 +788,7 @@ private:
     accept_handler h_accept_;
     error_handler h_error_;
     protocol_version version_ = protocol_version::undetermined;
+    accept_throttle accept_throttle_;
     std::chrono::steady_clock::duration underlying_connect_timeout_ = std::chrono::seconds(10);
 };
 
@@ -771,6 +882,7 @@ public:
 
     void close() {
         close_request_ = true;
+        accept_throttle_.cancel();
         acceptor_.reset();
     }
 
@@ -841,9 +953,23 @@ public:
         return ctx_;
     }
 
+    /**
+     * @brief Limit the rate of accepting connections
+     * When no token is available, the next accept is delayed until a token is added.
+     * The limit is applied from the next accept.
+     * @param listener the bucket of this server. nullptr means no limit.
+     * @param global   the bucket that is shared with other servers. nullptr means no limit.
+     */
+    void set_accept_rate_limit(
+        std::shared_ptr<token_bucket> listener,
+        std::shared_ptr<token_bucket> global = nullptr) {
+        accept_throttle_.set(ioc_accept_, force_move(listener), force_move(global));
+    }
+
 private:
     void do_accept() {
         if (close_request_) return;
+        if (!accept_throttle_.admit([this] { do_accept(); })) return;
         auto socket = std::make_shared<socket_t>(ioc_con_, ctx_);
         auto ps = socket.get();
         acceptor_.value().async_accept(
@@ -976,6 +1102,7 @@ private:
     error_handler h_error_;
     as::ssl::context ctx_;
     protocol_version version_ = protocol_version::undetermined;
+    accept_throttle accept_throttle_;
     std::chrono::steady_clock::duration underlying_connect_timeout_ = std::chrono::seconds(10);
 };
 
@@ -0,0 +1,103 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_SHARED_PROPERTIES_HPP)
+#define MQTT_SHARED_PROPERTIES_HPP
+
+#include <memory>
+#include <numeric>
+#include <string>
+
+#include <boost/asio/buffer.hpp>
+
+#include <mqtt/namespace.hpp>
+#include <mqtt/property_variant.hpp>
+#include <mqtt/move.hpp>
+
+namespace MQTT_NS {
+
+namespace as = boost::asio;
+
+namespace v5 {
+
+/**
+ * @brief Immutable properties that are encoded once.
+ *
+ * A message that is sent to many endpoints can refer to the same encoded_properties
+ * via shared_properties, instead of copying the properties vector for each message.
+ * The encoded bytes are sent as one buffer.
+ */
+class encoded_properties {
+public:
+    /**
+     * @brief Constructor
+     * @param props properties to encode
+     */
+    explicit encoded_properties(properties props)
+        : props_(force_move(props)) {
+        encoded_.resize(
+            std::accumulate(
+                props_.begin(),
+                props_.end(),
+                std::size_t(0U),
+                [](std::size_t total, property_variant const& pv) {
+                    return total + v5::size(pv);
+                }
+            )
+        );
+        auto it = encoded_.begin();
+        auto end = encoded_.end();
+        for (auto const& p : props_) {
+            v5::fill(p, it, end);
+            it += static_cast<std::string::difference_type>(v5::size(p));
+        }
+    }
+
+    /**
+     * @brief Get properties
+     * @return properties
+     */
+    properties const& get() const {
+        return props_;
+    }
+
+    /**
+     * @brief Get the encoded properties. The property length is not included.
+     * @return const buffer of the encoded properties
+     */
+    as::const_buffer encoded() const {
+        return as::buffer(encoded_);
+    }
+
+    /**
+     * @brief Get the size of the encoded properties
+     * @return size
+     */
+    std::size_t size() const {
+        return encoded_.size();
+    }
+
+private:
+    properties props_;
+    std::string encoded_;
+};
+
+using shared_properties = std::shared_ptr<encoded_properties const>;
+
+/**
+ * @brief Encode the properties, and make shared_properties.
+ * @param props properties
+ * @return shared_properties
+ */
+inline shared_properties make_shared_properties(properties props) {
+    return std::make_shared<encoded_properties const>(force_move(props));
+}
+
+} // namespace v5
+
+} // namespace MQTT_NS
+
+#endif // MQTT_SHARED_PROPERTIES_HPP
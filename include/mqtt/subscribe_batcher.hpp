@@ -0,0 +1,322 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_SUBSCRIBE_BATCHER_HPP)
+#define MQTT_SUBSCRIBE_BATCHER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+
+#include <mqtt/namespace.hpp>
+#include <mqtt/buffer.hpp>
+#include <mqtt/error_code.hpp>
+#include <mqtt/exception.hpp>
+#include <mqtt/move.hpp>
+#include <mqtt/property_variant.hpp>
+#include <mqtt/protocol_version.hpp>
+#include <mqtt/reason_code.hpp>
+#include <mqtt/subscribe_options.hpp>
+#include <mqtt/variable_length.hpp>
+#include <mqtt/visitor_util.hpp>
+
+namespace MQTT_NS {
+
+namespace as = boost::asio;
+
+/**
+ * @brief Coalescing of subscribe and unsubscribe requests into multi-entry packets.
+ *
+ * The requests that are made in the same turn of the io_context are sent together as
+ * SUBSCRIBE (or UNSUBSCRIBE) packets that have many entries in the order of the requests, so thousands of subscriptions
+ * at startup cost a few packet identifiers and round trips instead of one each.
+ * A packet is filled up to the maximum packet size of the broker, and the reason codes of
+ * SUBACK (or UNSUBACK) are fanned out to the handler of each request.
+ *
+ * Pass CONNACK properties to handle_connack(), the acknowledgements to handle_suback() and
+ * handle_unsuback(), and the close and the error to handle_close() from the handlers of the client.
+ * The requests can't have SUBSCRIBE properties. Use the client directly for them.
+ * The object must be owned by std::shared_ptr and used on the thread that runs the io_context.
+ * @tparam Client client type. e.g. callable_overlay<async_client<...>>
+ */
+template <typename Client>
+class subscribe_batcher : public std::enable_shared_from_this<subscribe_batcher<Client>> {
+public:
+    using packet_id_t = typename Client::packet_id_t;
+
+    /**
+     * @brief Completion handler of a request
+     * @param ec error code. Set if the packet can't be sent, or the connection is closed before
+     *        the acknowledgement.
+     * @param reason_code the SUBACK return code / reason code of the entry. For UNSUBSCRIBE on
+     *        MQTT v3.1.1 it is always 0 (success).
+     */
+    using handler = std::function<void(error_code ec, std::uint8_t reason_code)>;
+
+    /// The largest packet that MQTT allows.
+    static constexpr std::size_t protocol_maximum_packet_size = 1 + 4 + 268435455;
+
+    /**
+     * @brief Constructor
+     * @param ioc io_context that runs the client
+     * @param client client that sends the packets
+     */
+    subscribe_batcher(as::io_context& ioc, std::shared_ptr<Client> client)
+        :ioc_(ioc),
+         client_(force_move(client)) {}
+
+    subscribe_batcher(subscribe_batcher const&) = delete;
+    subscribe_batcher& operator=(subscribe_batcher const&) = delete;
+
+    /**
+     * @brief Subscribe a topic filter
+     * @param topic_filter topic filter
+     * @param option subscription options
+     * @param h handler that is called when the SUBACK arrives
+     */
+    void async_subscribe(buffer topic_filter, subscribe_options option, handler h) {
+        entries_.push_back(entry { true, force_move(topic_filter), option, force_move(h) });
+        schedule_flush();
+    }
+
+    /**
+     * @brief Unsubscribe a topic filter
+     * @param topic_filter topic filter
+     * @param h handler that is called when the UNSUBACK arrives
+     */
+    void async_unsubscribe(buffer topic_filter, handler h) {
+        entries_.push_back(entry { false, force_move(topic_filter), qos::at_most_once, force_move(h) });
+        schedule_flush();
+    }
+
+    /**
+     * @brief Set the maximum packet size of the broker
+     * @param size the maximum size of a packet including the fixed header
+     */
+    void set_maximum_packet_size(std::size_t size) {
+        maximum_packet_size_ = size;
+    }
+
+    /**
+     * @brief Pass the properties of the v5 CONNACK. MAXIMUM_PACKET_SIZE is applied.
+     * @param props properties of the CONNACK
+     */
+    void handle_connack(v5::properties const& props) {
+        auto size = protocol_maximum_packet_size;
+        for (auto const& p : props) {
+            MQTT_NS::visit(
+                make_lambda_visitor(
+                    [&](v5::property::maximum_packet_size const& t) {
+                        size = t.val();
+                    },
+                    [](auto const&) {}
+                ),
+                p
+            );
+        }
+        maximum_packet_size_ = size;
+    }
+
+    /**
+     * @brief Pass a received SUBACK
+     * @param packet_id packet identifier of the SUBACK
+     * @param codes return codes (v3.1.1) or reason codes (v5) of the SUBACK
+     * @return true if the SUBACK answers a packet of this object, otherwise false
+     */
+    template <typename Code>
+    bool handle_suback(packet_id_t packet_id, std::vector<Code> const& codes) {
+        return complete(packet_id, codes);
+    }
+
+    /**
+     * @brief Pass a received v3.1.1 UNSUBACK
+     * @param packet_id packet identifier of the UNSUBACK
+     * @return true if the UNSUBACK answers a packet of this object, otherwise false
+     */
+    bool handle_unsuback(packet_id_t packet_id) {
+        auto it = inflight_.find(packet_id);
+        if (it == inflight_.end()) return false;
+        return complete(packet_id, std::vector<std::uint8_t>(it->second.size(), 0));
+    }
+
+    /**
+     * @brief Pass a received v5 UNSUBACK
+     * @param packet_id packet identifier of the UNSUBACK
+     * @param reasons reason codes of the UNSUBACK
+     * @return true if the UNSUBACK answers a packet of this object, otherwise false
+     */
+    bool handle_unsuback(packet_id_t packet_id, std::vector<v5::unsuback_reason_code> const& reasons) {
+        return complete(packet_id, reasons);
+    }
+
+    /**
+     * @brief Fail the requests that wait for the acknowledgements
+     * Call this from the close handler and the error handler of the client.
+     * @param ec error code that is passed to the handlers
+     */
+    void handle_close(error_code ec = boost::system::errc::make_error_code(boost::system::errc::connection_aborted)) {
+        auto inflight = force_move(inflight_);
+        inflight_.clear();
+        for (auto& e : inflight) {
+            for (auto& h : e.second) {
+                if (h) h(ec, 0);
+            }
+        }
+    }
+
+    /**
+     * @brief Get the number of the requests that wait for being sent or for the acknowledgements
+     * @return the number of the requests
+     */
+    std::size_t pending() const {
+        std::size_t n = entries_.size();
+        for (auto const& e : inflight_) n += e.second.size();
+        return n;
+    }
+
+private:
+    struct entry {
+        // SUBSCRIBE or UNSUBSCRIBE
+        bool subscribe;
+        buffer topic_filter;
+        subscribe_options option;
+        handler h;
+    };
+
+    void schedule_flush() {
+        if (flush_scheduled_) return;
+        flush_scheduled_ = true;
+        std::weak_ptr<subscribe_batcher> wp(this->shared_from_this());
+        as::post(
+            ioc_,
+            [wp = force_move(wp)] {
+                if (auto sp = wp.lock()) sp->flush();
+            }
+        );
+    }
+
+    // Split the entries into the packets that fit in the maximum packet size.
+    // The order of the requests is kept, so a packet ends where SUBSCRIBE and UNSUBSCRIBE alternate.
+    void flush() {
+        flush_scheduled_ = false;
+        auto entries = force_move(entries_);
+        entries_.clear();
+        // packet identifier, and the property length on v5
+        std::size_t const header_size =
+            sizeof(packet_id_t) +
+            (client_->get_protocol_version() == protocol_version::v5 ? 1 : 0);
+        std::vector<entry> batch;
+        std::size_t remaining_length = header_size;
+        for (auto& e : entries) {
+            // topic filter length, topic filter, and the subscription options byte
+            auto size = 2 + e.topic_filter.size() + (e.subscribe ? 1 : 0);
+            if (packet_size(header_size + size) > maximum_packet_size_) {
+                if (e.h) e.h(boost::system::errc::make_error_code(boost::system::errc::message_size), 0);
+                continue;
+            }
+            if (!batch.empty() &&
+                (batch.front().subscribe != e.subscribe ||
+                 packet_size(remaining_length + size) > maximum_packet_size_)) {
+                send(batch);
+                batch.clear();
+                remaining_length = header_size;
+            }
+            remaining_length += size;
+            batch.push_back(force_move(e));
+        }
+        if (!batch.empty()) send(batch);
+    }
+
+    static std::size_t packet_size(std::size_t remaining_length) {
+        auto bytes = variable_bytes(remaining_length).size();
+        // The remaining length is too large to be encoded.
+        if (bytes == 0) return protocol_maximum_packet_size + 1;
+        return 1 + bytes + remaining_length;
+    }
+
+    void send(std::vector<entry>& batch) {
+        packet_id_t packet_id;
+        try {
+            packet_id = client_->acquire_unique_packet_id();
+        }
+        catch (packet_id_exhausted_error const&) {
+            for (auto& e : batch) {
+                if (e.h) e.h(boost::system::errc::make_error_code(boost::system::errc::no_buffer_space), 0);
+            }
+            return;
+        }
+        std::vector<handler> handlers;
+        handlers.reserve(batch.size());
+        for (auto& e : batch) handlers.push_back(force_move(e.h));
+        inflight_.emplace(packet_id, force_move(handlers));
+
+        std::weak_ptr<subscribe_batcher> wp(this->shared_from_this());
+        auto on_write =
+            [wp = force_move(wp), packet_id](error_code ec) {
+                if (!ec) return;
+                if (auto sp = wp.lock()) sp->fail(packet_id, ec);
+            };
+        if (batch.front().subscribe) {
+            std::vector<std::tuple<buffer, subscribe_options>> params;
+            params.reserve(batch.size());
+            for (auto& e : batch) params.emplace_back(force_move(e.topic_filter), e.option);
+            client_->async_subscribe(packet_id, force_move(params), force_move(on_write));
+        }
+        else {
+            std::vector<buffer> params;
+            params.reserve(batch.size());
+            for (auto& e : batch) params.push_back(force_move(e.topic_filter));
+            client_->async_unsubscribe(packet_id, force_move(params), force_move(on_write));
+        }
+    }
+
+    template <typename Code>
+    bool complete(packet_id_t packet_id, std::vector<Code> const& codes) {
+        auto it = inflight_.find(packet_id);
+        if (it == inflight_.end()) return false;
+        auto handlers = force_move(it->second);
+        inflight_.erase(it);
+        for (std::size_t i = 0; i != handlers.size(); ++i) {
+            if (!handlers[i]) continue;
+            if (i < codes.size()) {
+                handlers[i](error_code(), static_cast<std::uint8_t>(codes[i]));
+            }
+            else {
+                // The broker answered fewer codes than the entries.
+                handlers[i](boost::system::errc::make_error_code(boost::system::errc::protocol_error), 0);
+            }
+        }
+        return true;
+    }
+
+    void fail(packet_id_t packet_id, error_code ec) {
+        auto it = inflight_.find(packet_id);
+        if (it == inflight_.end()) return;
+        auto handlers = force_move(it->second);
+        inflight_.erase(it);
+        for (auto& h : handlers) {
+            if (h) h(ec, 0);
+        }
+    }
+
+    as::io_context& ioc_;
+    std::shared_ptr<Client> client_;
+    std::size_t maximum_packet_size_ = protocol_maximum_packet_size;
+    std::vector<entry> entries_;
+    std::unordered_map<packet_id_t, std::vector<handler>> inflight_;
+    bool flush_scheduled_ = false;
+};
+
+} // namespace MQTT_NS
+
+#endif // MQTT_SUBSCRIBE_BATCHER_HPP
@@ -0,0 +1,228 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_TIMER_WHEEL_HPP)
+#define MQTT_TIMER_WHEEL_HPP
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <unordered_map>
+
+#include <boost/asio.hpp>
+#include <boost/assert.hpp>
+
+#include <mqtt/namespace.hpp>
+#include <mqtt/error_code.hpp>
+#include <mqtt/move.hpp>
+
+namespace MQTT_NS {
+
+namespace as = boost::asio;
+
+/**
+ * @brief Hierarchical timer wheel that drives many timers with one steady_timer.
+ *
+ * Time is divided into ticks of the given resolution. The wheel has four levels of
+ * 64 slots. A timer is placed on the lowest level whose range covers it, and is moved
+ * down a level each time the level above it rotates to its slot. Adding and cancelling
+ * a timer is O(1). Timers are fired at most one tick late.
+ *
+ * The wheel is not thread safe. All the member functions must be called from the
+ * thread that runs the io_context, and the handlers are called from that thread.
+ */
+class timer_wheel {
+public:
+    using handle = std::uint64_t;
+    using duration = std::chrono::steady_clock::duration;
+    using time_point = std::chrono::steady_clock::time_point;
+
+    /**
+     * @brief Constructor
+     * @param ioc io_context that runs the underlying timer
+     * @param resolution duration of one tick
+     */
+    explicit timer_wheel(as::io_context& ioc, duration resolution = std::chrono::milliseconds(100))
+        :tim_(ioc),
+         resolution_(resolution),
+         origin_(std::chrono::steady_clock::now()) {
+        BOOST_ASSERT(resolution_ > duration::zero());
+    }
+
+    timer_wheel(timer_wheel const&) = delete;
+    timer_wheel& operator=(timer_wheel const&) = delete;
+
+    /**
+     * @brief Add a timer.
+     * @param after duration until the handler is called
+     * @param h handler that is called as h() when the timer expires
+     * @return handle to cancel the timer
+     */
+    handle add(duration after, std::function<void()> h) {
+        auto now = std::chrono::steady_clock::now();
+        // The wheel doesn't advance while it is empty. Catch up so that the timer
+        // isn't placed far from the current tick.
+        if (index_.empty()) current_ = std::max(current_, ticks(now));
+        auto expiry = ticks(now + after + resolution_ - duration(1));
+        // The slot of the current tick has already been processed.
+        if (expiry <= current_) expiry = current_ + 1;
+        auto id = next_id_++;
+        place(entry(id, expiry, force_move(h)));
+        if (!running_) schedule();
+        return id;
+    }
+
+    /**
+     * @brief Cancel the timer. The handler is not called.
+     * @param h handle that is returned by add()
+     * @return true if the timer was cancelled, false if it has already expired or been cancelled.
+     */
+    bool cancel(handle h) {
+        auto it = index_.find(h);
+        if (it == index_.end()) return false;
+        it->second.slot->erase(it->second.it);
+        index_.erase(it);
+        return true;
+    }
+
+    /**
+     * @brief Cancel all the timers. The underlying timer is also cancelled,
+     *        so the wheel doesn't keep the io_context running.
+     */
+    void clear() {
+        for (auto& level : wheel_) {
+            for (auto& slot : level) slot.clear();
+        }
+        index_.clear();
+        running_ = false;
+        tim_.cancel();
+    }
+
+    // Number of the pending timers.
+    std::size_t size() const {
+        return index_.size();
+    }
+
+    duration resolution() const {
+        return resolution_;
+    }
+
+private:
+    static constexpr std::size_t slot_bits = 6;
+    static constexpr std::size_t slots = 1 << slot_bits;
+    static constexpr std::size_t levels = 4;
+    static constexpr std::uint64_t slot_mask = slots - 1;
+    static constexpr std::uint64_t max_ticks = std::uint64_t(1) << (slot_bits * levels);
+
+    struct entry {
+        entry(handle id, std::uint64_t expiry, std::function<void()> h)
+            :id(id), expiry(expiry), h(force_move(h)) {}
+        handle id;
+        std::uint64_t expiry;
+        std::function<void()> h;
+    };
+    using slot_t = std::list<entry>;
+
+    struct location {
+        slot_t* slot;
+        slot_t::iterator it;
+    };
+
+    std::uint64_t ticks(time_point tp) const {
+        return static_cast<std::uint64_t>((tp - origin_) / resolution_);
+    }
+
+    // Get the slot for the expiry tick.
+    // Timers beyond the range of the wheel are parked on the top level,
+    // and placed again when the top level rotates to them.
+    slot_t& slot_for(std::uint64_t expiry) {
+        BOOST_ASSERT(expiry >= current_);
+        auto pos = expiry - current_ < max_ticks ? expiry : current_ + max_ticks - 1;
+        std::size_t level = 0;
+        while (level + 1 < levels && pos - current_ >= (std::uint64_t(1) << (slot_bits * (level + 1)))) {
+            ++level;
+        }
+        return wheel_[level][(pos >> (slot_bits * level)) & slot_mask];
+    }
+
+    void place(entry e) {
+        auto& slot = slot_for(e.expiry);
+        auto id = e.id;
+        slot.emplace_back(force_move(e));
+        index_[id] = location { &slot, std::prev(slot.end()) };
+    }
+
+    // Move the timers of the slot of the current tick on the level to the lower levels.
+    void cascade(std::size_t level) {
+        auto& slot = wheel_[level][(current_ >> (slot_bits * level)) & slot_mask];
+        slot_t moving;
+        moving.splice(moving.end(), slot);
+        while (!moving.empty()) {
+            auto it = moving.begin();
+            auto& to = slot_for(it->expiry);
+            // Re-link the node instead of copying the handler.
+            to.splice(to.end(), moving, it);
+            index_[it->id] = location { &to, it };
+        }
+    }
+
+    // Advance the wheel by one tick, and fire the expired timers.
+    void advance() {
+        ++current_;
+        for (std::size_t level = levels - 1; level != 0; --level) {
+            if ((current_ & ((std::uint64_t(1) << (slot_bits * level)) - 1)) == 0) cascade(level);
+        }
+        auto& slot = wheel_[0][current_ & slot_mask];
+        // The handlers can add or cancel timers, so the expired ones are taken out first.
+        // They stay cancellable until they are fired.
+        slot_t expired;
+        expired.splice(expired.end(), slot);
+        for (auto const& e : expired) index_.find(e.id)->second.slot = &expired;
+        while (!expired.empty()) {
+            auto h = force_move(expired.front().h);
+            index_.erase(expired.front().id);
+            expired.pop_front();
+            h();
+        }
+    }
+
+    void schedule() {
+        running_ = true;
+        tim_.expires_at(origin_ + resolution_ * static_cast<duration::rep>(current_ + 1));
+        tim_.async_wait(
+            [this](error_code ec) {
+                // The wheel could have been destroyed. Don't touch it.
+                if (ec) return;
+                auto now = ticks(std::chrono::steady_clock::now());
+                while (current_ < now && !index_.empty()) advance();
+                // Nothing is pending on the skipped ticks.
+                if (current_ < now) current_ = now;
+                if (index_.empty()) {
+                    running_ = false;
+                }
+                else {
+                    schedule();
+                }
+            }
+        );
+    }
+
+    as::steady_timer tim_;
+    duration resolution_;
+    time_point origin_;
+    std::uint64_t current_ = 0;
+    handle next_id_ = 0;
+    bool running_ = false;
+    std::array<std::array<slot_t, slots>, levels> wheel_;
+    std::unordered_map<handle, location> index_;
+};
+
+} // namespace MQTT_NS
+
+#endif // MQTT_TIMER_WHEEL_HPP
@@ -0,0 +1,120 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_TOKEN_BUCKET_HPP)
+#define MQTT_TOKEN_BUCKET_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+
+#include <boost/assert.hpp>
+
+#include <mqtt/namespace.hpp>
+
+namespace MQTT_NS {
+
+/**
+ * @brief Token bucket rate limiter.
+ *
+ * The bucket holds up to burst tokens, and is refilled at rate tokens per second.
+ * An operation is admitted if the bucket has the tokens that it costs.
+ * The bucket is thread safe, so one bucket can be shared by the listeners
+ * that run on different threads.
+ */
+class token_bucket {
+public:
+    using clock = std::chrono::steady_clock;
+
+    /**
+     * @brief Constructor
+     * @param rate  tokens that are added per second. It must be positive.
+     * @param burst the capacity of the bucket. The bucket is full at first.
+     */
+    token_bucket(double rate, double burst)
+        :rate_(rate),
+         burst_(burst),
+         tokens_(burst),
+         last_(clock::now()) {
+        BOOST_ASSERT(rate_ > 0);
+        BOOST_ASSERT(burst_ > 0);
+    }
+
+    token_bucket(token_bucket const&) = delete;
+    token_bucket& operator=(token_bucket const&) = delete;
+
+    /**
+     * @brief Take tokens from the bucket
+     * @param n the number of tokens
+     * @return true if the bucket had n tokens and they are taken, otherwise false.
+     *         The bucket is not changed if false is returned.
+     */
+    bool try_consume(double n = 1) {
+        std::lock_guard<std::mutex> g(mtx_);
+        refill(clock::now());
+        if (tokens_ < n) return false;
+        tokens_ -= n;
+        return true;
+    }
+
+    /**
+     * @brief Take tokens from the bucket even if it doesn't have enough tokens.
+     *
+     * The bucket goes into debt, and the following operations are delayed until it is paid back.
+     * This is useful when the cost is known only after the operation.
+     * @param n the number of tokens
+     */
+    void consume(double n) {
+        std::lock_guard<std::mutex> g(mtx_);
+        refill(clock::now());
+        tokens_ -= n;
+    }
+
+    /**
+     * @brief Get the time until the bucket has n tokens.
+     * @param n the number of tokens. If it is greater than burst, burst is used.
+     * @return zero if the bucket has n tokens now
+     */
+    clock::duration delay(double n = 1) {
+        std::lock_guard<std::mutex> g(mtx_);
+        refill(clock::now());
+        auto lack = std::min(n, burst_) - tokens_;
+        if (lack <= 0) return clock::duration::zero();
+        return
+            std::max<clock::duration>(
+                std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(lack / rate_)),
+                clock::duration(1)
+            );
+    }
+
+    /**
+     * @brief Get the tokens in the bucket
+     * @return the number of the tokens. It is negative while the bucket is in debt.
+     */
+    double tokens() {
+        std::lock_guard<std::mutex> g(mtx_);
+        refill(clock::now());
+        return tokens_;
+    }
+
+private:
+    void refill(clock::time_point now) {
+        if (now <= last_) return;
+        tokens_ = std::min(burst_, tokens_ + std::chrono::duration<double>(now - last_).count() * rate_);
+        last_ = now;
+    }
+
+private:
+    std::mutex mtx_;
+    double const rate_;
+    double const burst_;
+    double tokens_;
+    clock::time_point last_;
+};
+
+} // namespace MQTT_NS
+
+#endif // MQTT_TOKEN_BUCKET_HPP
@@ -0,0 +1,302 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_TOPIC_ROUTER_HPP)
+#define MQTT_TOPIC_ROUTER_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/assert.hpp>
+
+#include <mqtt/namespace.hpp>
+#include <mqtt/optional.hpp>
+#include <mqtt/string_view.hpp>
+#include <mqtt/property_variant.hpp>
+#include <mqtt/visitor_util.hpp>
+#include <mqtt/move.hpp>
+
+namespace MQTT_NS {
+
+/**
+ * @brief Dispatcher of the received PUBLISH messages to the handlers of topic filters.
+ *
+ * The topic filters, including the wildcards `+` and `#`, are compiled into a trie of
+ * topic levels, so a topic is matched by one walk of its levels.
+ * A registration can have a v5 subscription identifier. If the PUBLISH has the identifiers
+ * and all of them are known, the matching registrations of the other identifiers are skipped.
+ * Call this from the publish handler of the client. The router is not thread safe.
+ * @tparam Handler handler type. It is called with the arguments of dispatch().
+ */
+template <typename Handler>
+class topic_router {
+public:
+    using id_type = std::size_t;
+
+    /**
+     * @brief Register a handler
+     * @param filter topic filter
+     * @param h handler
+     * @param subscription_id the subscription identifier that is set to the SUBSCRIBE of the filter
+     * @return the id of the registration
+     */
+    id_type add(string_view filter, Handler h, optional<std::size_t> subscription_id = nullopt) {
+        auto node = root;
+        bool multi = false;
+        for_each_level(
+            filter,
+            [&](string_view level, bool last) {
+                BOOST_ASSERT(!multi);
+                if (level == "#") {
+                    BOOST_ASSERT(last);
+                    (void)last;
+                    multi = true;
+                    return true;
+                }
+                node = child(node, level);
+                return true;
+            }
+        );
+        auto id = next_id_++;
+        if (multi) nodes_[node].multi.push_back(id);
+        else nodes_[node].exact.push_back(id);
+        registrations_.emplace(
+            id,
+            registration { force_move(h), node, multi, subscription_id, std::string(filter.data(), filter.size()) }
+        );
+        if (subscription_id) by_subscription_id_[subscription_id.value()].push_back(id);
+        else ++without_subscription_id_;
+        return id;
+    }
+
+    /**
+     * @brief Remove a registration
+     * @param id the id that is returned by add()
+     * @return true if the registration is removed, false if it is not found
+     */
+    bool remove(id_type id) {
+        auto it = registrations_.find(id);
+        if (it == registrations_.end()) return false;
+        auto& r = it->second;
+        erase_id(r.multi ? nodes_[r.node].multi : nodes_[r.node].exact, id);
+        if (r.subscription_id) {
+            auto sit = by_subscription_id_.find(r.subscription_id.value());
+            erase_id(sit->second, id);
+            if (sit->second.empty()) by_subscription_id_.erase(sit);
+        }
+        else {
+            --without_subscription_id_;
+        }
+        registrations_.erase(it);
+        return true;
+    }
+
+    /**
+     * @brief Call the handlers whose filters match the topic
+     * @param topic topic name of the PUBLISH
+     * @param args arguments of the handlers
+     * @return the number of the called handlers
+     */
+    template <typename... Args>
+    std::size_t dispatch(string_view topic, Args&&... args) const {
+        std::size_t called = 0;
+        for_each_match(topic, [&](registration const& r) {
+            r.handler(args...);
+            ++called;
+        });
+        return called;
+    }
+
+    /**
+     * @brief Call the handlers whose filters match the topic, and that belong to the subscription
+     *        identifiers of the PUBLISH. The handlers without an identifier are called if they match.
+     *        If the PUBLISH doesn't have the identifiers or one of them is not registered,
+     *        all handlers that match the topic are called.
+     * @param props properties of the v5 PUBLISH
+     * @param topic topic name of the PUBLISH
+     * @param args arguments of the handlers
+     * @return the number of the called handlers
+     */
+    template <typename... Args>
+    std::size_t dispatch(v5::properties const& props, string_view topic, Args&&... args) const {
+        std::vector<std::size_t> subscription_ids;
+        bool unknown = false;
+        for (auto const& p : props) {
+            MQTT_NS::visit(
+                make_lambda_visitor(
+                    [&](v5::property::subscription_identifier const& t) {
+                        if (by_subscription_id_.find(t.val()) == by_subscription_id_.end()) unknown = true;
+                        else subscription_ids.push_back(t.val());
+                    },
+                    [](auto const&) {}
+                ),
+                p
+            );
+        }
+        if (subscription_ids.empty() || unknown) return dispatch(topic, std::forward<Args>(args)...);
+        std::sort(subscription_ids.begin(), subscription_ids.end());
+        subscription_ids.erase(std::unique(subscription_ids.begin(), subscription_ids.end()), subscription_ids.end());
+        std::size_t called = 0;
+        // One identifier can be shared by all filters of a SUBSCRIBE, so the topic is matched too.
+        // Only the filters of the identifiers are matched.
+        for (auto subscription_id : subscription_ids) {
+            for (auto id : by_subscription_id_.at(subscription_id)) {
+                auto const& r = registrations_.at(id);
+                if (!matches(r.filter, topic)) continue;
+                r.handler(args...);
+                ++called;
+            }
+        }
+        // The trie is walked only for the registrations without an identifier.
+        if (without_subscription_id_ != 0) {
+            for_each_match(topic, [&](registration const& r) {
+                if (r.subscription_id) return;
+                r.handler(args...);
+                ++called;
+            });
+        }
+        return called;
+    }
+
+    /**
+     * @brief Get the number of the registrations
+     * @return the number of the registrations
+     */
+    std::size_t size() const {
+        return registrations_.size();
+    }
+
+private:
+    static constexpr std::size_t root = 0;
+
+    struct node {
+        std::map<std::string, std::size_t, std::less<>> children;
+        optional<std::size_t> plus;
+        // registrations whose filter ends at this node
+        std::vector<id_type> exact;
+        // registrations whose filter ends with '#' after this node
+        std::vector<id_type> multi;
+    };
+
+    struct registration {
+        Handler handler;
+        std::size_t node;
+        bool multi;
+        optional<std::size_t> subscription_id;
+        std::string filter;
+    };
+
+    // f(level, last) is called for each level that is separated by '/'.
+    template <typename F>
+    static void for_each_level(string_view s, F&& f) {
+        while (true) {
+            auto pos = s.find('/');
+            if (pos == string_view::npos) {
+                f(s, true);
+                return;
+            }
+            f(s.substr(0, pos), false);
+            s.remove_prefix(pos + 1);
+        }
+    }
+
+    // Match one filter against the topic, without the trie.
+    static bool matches(string_view filter, string_view topic) {
+        // Topics that start with '$' are not matched by the wildcards at the first level.
+        if (!topic.empty() && topic.front() == '$' &&
+            !filter.empty() && (filter.front() == '+' || filter.front() == '#')) {
+            return false;
+        }
+        while (true) {
+            auto fpos = filter.find('/');
+            auto flevel = filter.substr(0, fpos);
+            if (flevel == "#") return true;
+            auto tpos = topic.find('/');
+            if (flevel != "+" && flevel != topic.substr(0, tpos)) return false;
+            if (fpos == string_view::npos) return tpos == string_view::npos;
+            filter.remove_prefix(fpos + 1);
+            // '#' matches the parent level too.
+            if (tpos == string_view::npos) return filter == "#";
+            topic.remove_prefix(tpos + 1);
+        }
+    }
+
+    std::size_t child(std::size_t parent, string_view level) {
+        if (level == "+") {
+            if (!nodes_[parent].plus) {
+                nodes_.emplace_back();
+                nodes_[parent].plus.emplace(nodes_.size() - 1);
+            }
+            return nodes_[parent].plus.value();
+        }
+        auto& children = nodes_[parent].children;
+        auto it = children.find(level);
+        if (it != children.end()) return it->second;
+        auto index = nodes_.size();
+        nodes_[parent].children.emplace(std::string(level.data(), level.size()), index);
+        nodes_.emplace_back();
+        return index;
+    }
+
+    // f(registration) is called for each registration whose filter matches the topic.
+    template <typename F>
+    void for_each_match(string_view topic, F&& f) const {
+        std::vector<string_view> levels;
+        for_each_level(
+            topic,
+            [&](string_view level, bool) {
+                levels.push_back(level);
+                return true;
+            }
+        );
+        // Topics that start with '$' are not matched by the wildcards at the first level.
+        bool system = !topic.empty() && topic.front() == '$';
+        match(root, levels, 0, system, [&](id_type id) {
+            f(registrations_.at(id));
+        });
+    }
+
+    template <typename F>
+    void match(std::size_t n, std::vector<string_view> const& levels, std::size_t i, bool system, F&& f) const {
+        auto const& nd = nodes_[n];
+        bool wildcard_allowed = !(i == 0 && system);
+        // '#' matches the parent level too.
+        if (wildcard_allowed) {
+            for (auto id : nd.multi) f(id);
+        }
+        if (i == levels.size()) {
+            for (auto id : nd.exact) f(id);
+            return;
+        }
+        auto it = nd.children.find(levels[i]);
+        if (it != nd.children.end()) match(it->second, levels, i + 1, system, f);
+        if (wildcard_allowed && nd.plus) match(nd.plus.value(), levels, i + 1, system, f);
+    }
+
+    static void erase_id(std::vector<id_type>& ids, id_type id) {
+        for (auto it = ids.begin(); it != ids.end(); ++it) {
+            if (*it == id) {
+                ids.erase(it);
+                return;
+            }
+        }
+    }
+
+    std::vector<node> nodes_ { node() };
+    std::unordered_map<id_type, registration> registrations_;
+    std::unordered_map<std::size_t, std::vector<id_type>> by_subscription_id_;
+    std::size_t without_subscription_id_ = 0;
+    id_type next_id_ = 0;
+};
+
+} // namespace MQTT_NS
+
+#endif // MQTT_TOPIC_ROUTER_HPP
@@ -33,6 +33,7 @@
 #include <mqtt/property.hpp>
 #include <mqtt/property_variant.hpp>
 #include <mqtt/property_parse.hpp>
+#include <mqtt/shared_properties.hpp>
 #include <mqtt/reason_code.hpp>
 
 #include <mqtt/packet_id_type.hpp>
@@ -591,24 +592,46 @@ public:
               1                     // payload
           )
     {
-        utf8string_check(topic_name_);
-
-        auto pb = variable_bytes(property_length_);
-        for (auto e : pb) {
-            property_length_buf_.push_back(e);
-        }
-
-        remaining_length_ += property_length_buf_.size() + property_length_;
+        init(packet_id, pubopts);
+    }
 
-        auto rb = remaining_bytes(remaining_length_);
-        for (auto e : rb) {
-            remaining_length_buf_.push_back(e);
-        }
-        if (pubopts.get_qos() == qos::at_least_once ||
-            pubopts.get_qos() == qos::exactly_once) {
-            packet_id_.reserve(PacketIdBytes);
-            add_packet_id_to_buf<PacketIdBytes>::apply(packet_id_, packet_id);
-        }
+    /**
+     * @brief Create publish message that refers to the shared properties.
+     *        The encoded properties are sent as is, and the message copies share them.
+     */
+    basic_publish_message(
+        typename packet_id_type<PacketIdBytes>::type packet_id,
+        as::const_buffer topic_name,
+        as::const_buffer payload,
+        publish_options pubopts,
+        shared_properties props
+    )
+        : fixed_header_(make_fixed_header(control_packet_type::publish, 0b0000) | pubopts.operator std::uint8_t()),
+          topic_name_(topic_name),
+          topic_name_length_buf_ { num_to_2bytes(boost::numeric_cast<std::uint16_t>(topic_name_.size())) },
+          property_length_(props ? props->size() : 0U),
+          shared_props_(force_move(props)),
+          payload_(payload),
+          remaining_length_(
+              2                      // topic name length
+              + topic_name_.size()   // topic name
+              + payload_.size()      // payload
+              + (  (pubopts.get_qos() == qos::at_least_once || pubopts.get_qos() == qos::exactly_once)
+                 ? PacketIdBytes // packet_id
+                 : 0)
+          ),
+          num_of_const_buffer_sequence_(
+              1 +                   // fixed header
+              1 +                   // remaining length
+              1 +                   // topic name length
+              1 +                   // topic name
+              ((pubopts.get_qos() == qos::at_most_once) ? 0U : 1U) + // packet id
+              1 +                   // property length
+              (shared_props_ ? 1U : 0U) + // encoded properties
+              1                     // payload
+          )
+    {
+        init(packet_id, pubopts);
     }
 
     basic_publish_message(buffer buf) {
@@ -708,8 +731,13 @@ public:
         }
 
         ret.emplace_back(as::buffer(property_length_buf_.data(), property_length_buf_.size()));
-        for (auto const& p : props_) {
-            v5::add_const_buffer_sequence(ret, p);
+        if (shared_props_) {
+            ret.emplace_back(shared_props_->encoded());
+        }
+        else {
+            for (auto const& p : props_) {
+                v5::add_const_buffer_sequence(ret, p);
+            }
         }
 
         ret.emplace_back(as::buffer(payload_));
@@ -757,12 +785,18 @@ public:
 
         ret.append(property_length_buf_.data(), property_length_buf_.size());
 
-        auto it = ret.end();
-        ret.resize(ret.size() + property_length_);
-        auto end = ret.end();
-        for (auto const& p : props_) {
-            v5::fill(p, it, end);
-            it += static_cast<std::string::difference_type>(v5::size(p));
+        if (shared_props_) {
+            auto encoded = shared_props_->encoded();
+            ret.append(get_pointer(encoded), get_size(encoded));
+        }
+        else {
+            auto it = ret.end();
+            ret.resize(ret.size() + property_length_);
+            auto end = ret.end();
+            for (auto const& p : props_) {
+                v5::fill(p, it, end);
+                it += static_cast<std::string::difference_type>(v5::size(p));
+            }
         }
 
         ret.append(get_pointer(payload_), get_size(payload_));
@@ -831,7 +865,7 @@ public:
      * @return properties
      */
     properties const& props() const {
-        return props_;
+        return shared_props_ ? shared_props_->get() : props_;
     }
 
     /**
@@ -843,6 +877,30 @@ public:
     }
 
 private:
+    void init(
+        typename packet_id_type<PacketIdBytes>::type packet_id,
+        publish_options pubopts
+    ) {
+        utf8string_check(topic_name_);
+
+        auto pb = variable_bytes(property_length_);
+        for (auto e : pb) {
+            property_length_buf_.push_back(e);
+        }
+
+        remaining_length_ += property_length_buf_.size() + property_length_;
+
+        auto rb = remaining_bytes(remaining_length_);
+        for (auto e : rb) {
+            remaining_length_buf_.push_back(e);
+        }
+        if (pubopts.get_qos() == qos::at_least_once ||
+            pubopts.get_qos() == qos::exactly_once) {
+            packet_id_.reserve(PacketIdBytes);
+            add_packet_id_to_buf<PacketIdBytes>::apply(packet_id_, packet_id);
+        }
+    }
+
     std::uint8_t fixed_header_;
     as::const_buffer topic_name_;
     boost::container::static_vector<char, 2> topic_name_length_buf_;
@@ -850,6 +908,7 @@ private:
     std::size_t property_length_;
     boost::container::static_vector<char, 4> property_length_buf_;
     properties props_;
+    shared_properties shared_props_;
     as::const_buffer payload_;
     std::size_t remaining_length_;
     boost::container::static_vector<char, 4> remaining_length_buf_;
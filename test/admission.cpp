@@ -0,0 +1,269 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "test_main.hpp"
+#include "test_settings.hpp"
+#include "test_broker.hpp"
+#include "test_server_no_tls.hpp"
+#include "checker.hpp"
+
+#include <mqtt/client.hpp>
+
+BOOST_AUTO_TEST_SUITE(test_admission)
+
+using namespace MQTT_NS::literals;
+
+namespace {
+
+// Run the broker on its own thread while the clients run on ioc.
+// config is called on the broker thread before the clients start.
+template <typename Config, typename Start>
+void run(Config&& config, boost::asio::io_context& ioc, Start&& start) {
+    boost::asio::io_context iocb;
+    test_broker b(iocb);
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            config(b, s.value());
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    start(
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        }
+    );
+    ioc.run();
+    th.join();
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE( token_bucket ) {
+    MQTT_NS::token_bucket bucket(1000, 2);
+    BOOST_TEST(bucket.try_consume());
+    BOOST_TEST(bucket.try_consume());
+    BOOST_TEST(!bucket.try_consume(2));
+    BOOST_TEST((bucket.delay(1) > std::chrono::steady_clock::duration::zero()));
+    BOOST_TEST((bucket.delay(1) <= std::chrono::milliseconds(1)));
+    // The debt is paid back before the next token is available.
+    bucket.consume(10);
+    BOOST_TEST(bucket.tokens() < 0);
+    BOOST_TEST((bucket.delay(1) > std::chrono::milliseconds(5)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    BOOST_TEST(bucket.try_consume());
+}
+
+BOOST_AUTO_TEST_CASE( connect_rate_limit ) {
+    boost::asio::io_context ioc;
+    auto c1 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port);
+    auto c2 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+    auto c3 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port);
+    c1->set_client_id("cid1");
+    c1->set_clean_session(true);
+    c2->set_client_id("cid2");
+    c2->set_clean_session(true);
+    c3->set_client_id("cid3");
+    c3->set_clean_session(true);
+
+    checker chk = {
+        cont("h_connack_1"),
+        // The bucket is empty, so the next CONNECTs are rejected.
+        cont("h_connack_2"),
+        cont("h_closed_2"),
+        cont("h_connack_3"),
+        cont("h_closed_3"),
+        cont("h_close_1"),
+    };
+
+    run(
+        [](test_broker& b, test_server_no_tls&) {
+            b.set_connect_rate_limit(std::make_shared<MQTT_NS::token_bucket>(0.001, 1));
+        },
+        ioc,
+        [&](auto finish) {
+            c1->set_connack_handler(
+                [&chk, &c2]
+                (bool /*sp*/, MQTT_NS::connect_return_code connack_return_code) {
+                    MQTT_CHK("h_connack_1");
+                    BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+                    c2->connect();
+                    return true;
+                });
+            c1->set_close_handler(
+                [&chk, finish]
+                () {
+                    MQTT_CHK("h_close_1");
+                    finish();
+                });
+
+            c2->set_v5_connack_handler(
+                [&chk]
+                (bool /*sp*/, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+                    MQTT_CHK("h_connack_2");
+                    BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::server_busy);
+                    return true;
+                });
+            auto closed_2 =
+                [&chk, &c3] {
+                    MQTT_CHK("h_closed_2");
+                    c3->connect();
+                };
+            c2->set_close_handler(closed_2);
+            c2->set_error_handler([closed_2](MQTT_NS::error_code) { closed_2(); });
+
+            c3->set_connack_handler(
+                [&chk]
+                (bool /*sp*/, MQTT_NS::connect_return_code connack_return_code) {
+                    MQTT_CHK("h_connack_3");
+                    BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::server_unavailable);
+                    return true;
+                });
+            auto closed_3 =
+                [&chk, &c1] {
+                    MQTT_CHK("h_closed_3");
+                    c1->disconnect();
+                };
+            c3->set_close_handler(closed_3);
+            c3->set_error_handler([closed_3](MQTT_NS::error_code) { closed_3(); });
+
+            c1->connect();
+        }
+    );
+    BOOST_TEST(chk.all());
+}
+
+BOOST_AUTO_TEST_CASE( max_pending_connects ) {
+    boost::asio::io_context ioc;
+    auto c1 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port);
+    auto c2 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port);
+    c1->set_client_id("cid1");
+    c1->set_clean_session(true);
+    c2->set_client_id("cid2");
+    c2->set_clean_session(true);
+
+    // The connection that never sends CONNECT.
+    as::ip::tcp::socket idle(ioc);
+    as::steady_timer tim(ioc);
+
+    checker chk = {
+        // The idle connection occupies the only pending slot.
+        cont("h_closed_1"),
+        // The slot is released when the idle connection is closed.
+        cont("h_connack_2"),
+        cont("h_close_2"),
+    };
+
+    run(
+        [](test_broker& b, test_server_no_tls&) {
+            b.set_max_pending_connects(1);
+        },
+        ioc,
+        [&](auto finish) {
+            auto closed_1 =
+                [&chk, &idle, &tim, &c2] {
+                    MQTT_CHK("h_closed_1");
+                    idle.close();
+                    // Wait for the broker to notice the close.
+                    tim.expires_after(std::chrono::milliseconds(100));
+                    tim.async_wait(
+                        [&c2](MQTT_NS::error_code) {
+                            c2->connect();
+                        }
+                    );
+                };
+            c1->set_close_handler(closed_1);
+            c1->set_error_handler([closed_1](MQTT_NS::error_code) { closed_1(); });
+            c1->set_connack_handler(
+                []
+                (bool /*sp*/, MQTT_NS::connect_return_code /*connack_return_code*/) {
+                    BOOST_CHECK(false);
+                    return true;
+                });
+
+            c2->set_connack_handler(
+                [&chk, &c2]
+                (bool /*sp*/, MQTT_NS::connect_return_code connack_return_code) {
+                    MQTT_CHK("h_connack_2");
+                    BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+                    c2->disconnect();
+                    return true;
+                });
+            c2->set_close_handler(
+                [&chk, finish]
+                () {
+                    MQTT_CHK("h_close_2");
+                    finish();
+                });
+
+            idle.async_connect(
+                as::ip::tcp::endpoint(as::ip::make_address("127.0.0.1"), broker_notls_port),
+                [&c1](MQTT_NS::error_code ec) {
+                    BOOST_TEST(!ec);
+                    // The broker accepts the connections in order.
+                    c1->connect();
+                }
+            );
+        }
+    );
+    BOOST_TEST(chk.all());
+}
+
+BOOST_AUTO_TEST_CASE( accept_rate_limit ) {
+    boost::asio::io_context ioc;
+    std::vector<decltype(MQTT_NS::make_client(ioc, broker_url, broker_notls_port))> cs;
+    for (std::size_t i = 0; i != 3; ++i) {
+        cs.push_back(MQTT_NS::make_client(ioc, broker_url, broker_notls_port));
+        cs.back()->set_client_id("cid" + std::to_string(i));
+        cs.back()->set_clean_session(true);
+    }
+    std::vector<std::chrono::steady_clock::time_point> connacks;
+
+    run(
+        [](test_broker&, test_server_no_tls& s) {
+            // One connection per 200ms
+            s.server().set_accept_rate_limit(std::make_shared<MQTT_NS::token_bucket>(5, 1));
+        },
+        ioc,
+        [&](auto finish) {
+            for (std::size_t i = 0; i != cs.size(); ++i) {
+                cs[i]->set_connack_handler(
+                    [&, i]
+                    (bool /*sp*/, MQTT_NS::connect_return_code connack_return_code) {
+                        BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+                        connacks.push_back(std::chrono::steady_clock::now());
+                        if (i + 1 == cs.size()) {
+                            for (auto& c : cs) c->disconnect();
+                        }
+                        else {
+                            cs[i + 1]->connect();
+                        }
+                        return true;
+                    });
+            }
+            cs.back()->set_close_handler(finish);
+            cs.front()->connect();
+        }
+    );
+    BOOST_TEST(connacks.size() == 3);
+    if (connacks.size() == 3) {
+        // The first accept had been started before the limit was set, and the second
+        // one takes the token in the bucket. The third one waits for a new token.
+        BOOST_TEST((connacks[2] - connacks[1] >= std::chrono::milliseconds(150)));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,192 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "test_main.hpp"
+#include "test_settings.hpp"
+#include "test_broker.hpp"
+#include "test_server_no_tls.hpp"
+#include "checker.hpp"
+
+#include <mqtt/async_client.hpp>
+#include <mqtt/awaitable_client.hpp>
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#elif defined(MQTT_TEST_REQUIRE_CO_AWAIT)
+#error "The coroutine test is not compiled. Coroutines are not enabled."
+#endif // defined(BOOST_ASIO_HAS_CO_AWAIT)
+
+BOOST_AUTO_TEST_SUITE(test_awaitable_client)
+
+using namespace MQTT_NS::literals;
+
+namespace {
+
+template <typename Test>
+void run_with_broker(Test const& test) {
+    boost::asio::io_context iocb;
+    test_broker b(iocb);
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    test();
+    as::post(
+        iocb,
+        [&] {
+            s->close();
+        }
+    );
+    th.join();
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE( callback ) {
+    run_with_broker(
+        [] {
+            boost::asio::io_context ioc;
+            auto c = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port);
+            c->set_client_id("cid1");
+            c->set_clean_session(true);
+            using client_t = std::remove_reference_t<decltype(*c)>;
+            using message_t = MQTT_NS::awaitable_client<client_t>::message;
+            auto ac = std::make_shared<MQTT_NS::awaitable_client<client_t>>(ioc, c);
+
+            checker chk = {
+                cont("connected"),
+                cont("subscribed"),
+                // QoS2 is completed on PUBCOMP after the broker has delivered the message
+                cont("received"),
+                cont("published"),
+                cont("disconnected"),
+            };
+
+            ac->async_connect(
+                [&](MQTT_NS::error_code ec, bool sp) {
+                    MQTT_CHK("connected");
+                    BOOST_TEST(!ec);
+                    BOOST_TEST(!sp);
+                    ac->async_subscribe(
+                        "topic1",
+                        MQTT_NS::qos::exactly_once,
+                        [&](MQTT_NS::error_code ec, MQTT_NS::qos granted) {
+                            MQTT_CHK("subscribed");
+                            BOOST_TEST(!ec);
+                            BOOST_TEST(granted == MQTT_NS::qos::exactly_once);
+                            ac->async_receive(
+                                [&](MQTT_NS::error_code ec, message_t msg) {
+                                    MQTT_CHK("received");
+                                    BOOST_TEST(!ec);
+                                    BOOST_TEST(msg.topic == "topic1");
+                                    BOOST_TEST(msg.contents == "topic1_contents");
+                                    BOOST_TEST(msg.pubopts.get_qos() == MQTT_NS::qos::exactly_once);
+                                }
+                            );
+                            ac->async_publish(
+                                "topic1"_mb,
+                                "topic1_contents"_mb,
+                                MQTT_NS::qos::exactly_once,
+                                [&](MQTT_NS::error_code ec) {
+                                    MQTT_CHK("published");
+                                    BOOST_TEST(!ec);
+                                    ac->async_disconnect(
+                                        [&](MQTT_NS::error_code ec) {
+                                            MQTT_CHK("disconnected");
+                                            BOOST_TEST(!ec);
+                                        }
+                                    );
+                                }
+                            );
+                        }
+                    );
+                }
+            );
+            ioc.run();
+            BOOST_TEST(chk.all());
+        }
+    );
+}
+
+BOOST_AUTO_TEST_CASE( fail_pending_on_close ) {
+    run_with_broker(
+        [] {
+            boost::asio::io_context ioc;
+            auto c = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+            c->set_client_id("cid1");
+            c->set_clean_start(true);
+            using client_t = std::remove_reference_t<decltype(*c)>;
+            using message_t = MQTT_NS::awaitable_client<client_t>::message;
+            auto ac = std::make_shared<MQTT_NS::awaitable_client<client_t>>(ioc, c);
+
+            checker chk = {
+                cont("connected"),
+                cont("received"),
+            };
+
+            ac->async_connect(
+                [&](MQTT_NS::error_code ec, bool /*sp*/) {
+                    MQTT_CHK("connected");
+                    BOOST_TEST(!ec);
+                    ac->async_receive(
+                        [&](MQTT_NS::error_code ec, message_t /*msg*/) {
+                            MQTT_CHK("received");
+                            BOOST_TEST(ec == boost::system::errc::connection_aborted);
+                        }
+                    );
+                    c->async_disconnect();
+                }
+            );
+            ioc.run();
+            BOOST_TEST(chk.all());
+        }
+    );
+}
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+
+BOOST_AUTO_TEST_CASE( coroutine ) {
+    run_with_broker(
+        [] {
+            boost::asio::io_context ioc;
+            auto c = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+            c->set_client_id("cid1");
+            c->set_clean_start(true);
+            using client_t = std::remove_reference_t<decltype(*c)>;
+            auto ac = std::make_shared<MQTT_NS::awaitable_client<client_t>>(ioc, c);
+
+            bool finished = false;
+            as::co_spawn(
+                ioc,
+                [&]() -> as::awaitable<void> {
+                    co_await ac->async_connect(as::use_awaitable);
+                    auto granted = co_await ac->async_subscribe("topic1", MQTT_NS::qos::at_least_once, as::use_awaitable);
+                    BOOST_TEST(granted == MQTT_NS::qos::at_least_once);
+                    co_await ac->async_publish("topic1"_mb, "topic1_contents"_mb, MQTT_NS::qos::at_least_once, as::use_awaitable);
+                    auto msg = co_await ac->async_receive(as::use_awaitable);
+                    BOOST_TEST(msg.contents == "topic1_contents");
+                    co_await ac->async_disconnect(as::use_awaitable);
+                    finished = true;
+                },
+                as::detached
+            );
+            ioc.run();
+            BOOST_TEST(finished);
+        }
+    );
+}
+
+#endif // defined(BOOST_ASIO_HAS_CO_AWAIT)
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,169 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "test_main.hpp"
+#include "broker_snapshot.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+BOOST_AUTO_TEST_SUITE(test_broker_snapshot)
+
+using namespace MQTT_NS::literals;
+
+namespace {
+
+wal_record make_record(wal_record_type type, MQTT_NS::buffer client_id, MQTT_NS::buffer topic = MQTT_NS::buffer()) {
+    wal_record rec;
+    rec.type = type;
+    rec.client_id = MQTT_NS::force_move(client_id);
+    rec.topic = MQTT_NS::force_move(topic);
+    rec.props = MQTT_NS::v5::make_shared_properties({});
+    return rec;
+}
+
+wal_record make_publish(MQTT_NS::buffer topic, MQTT_NS::buffer contents, MQTT_NS::publish_options pubopts) {
+    auto rec = make_record(wal_record_type::publish, "pub"_mb, MQTT_NS::force_move(topic));
+    rec.options = static_cast<std::uint8_t>(pubopts);
+    rec.contents = MQTT_NS::force_move(contents);
+    return rec;
+}
+
+snapshot_session const* find_session(broker_snapshot const& snap, MQTT_NS::string_view client_id) {
+    auto it = std::find_if(
+        snap.sessions.begin(),
+        snap.sessions.end(),
+        [&](snapshot_session const& s) { return s.client_id == client_id; });
+    return it == snap.sessions.end() ? nullptr : &*it;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE( round_trip ) {
+    std::string path = "./snapshot_round_trip.snap";
+    std::remove(path.c_str());
+
+    broker_snapshot snap;
+    snap.wal_offset = 0x123456789aULL;
+    for (std::size_t i = 0; i != 10; ++i) {
+        snapshot_session s{ MQTT_NS::allocate_buffer("cid" + std::to_string(i)), MQTT_NS::nullopt, {}, {} };
+        if (i % 2) s.session_expiry_interval.emplace(std::chrono::seconds(i));
+        s.subscriptions.push_back(snapshot_subscription{ "topic1"_mb, MQTT_NS::qos::exactly_once, MQTT_NS::rap::retain });
+        s.messages.emplace_back(
+            "topic1"_mb,
+            MQTT_NS::allocate_buffer(std::to_string(i)),
+            MQTT_NS::v5::make_shared_properties(
+                MQTT_NS::v5::properties{ MQTT_NS::v5::property::content_type("text"_mb) }
+            ),
+            MQTT_NS::qos::at_least_once | MQTT_NS::retain::yes,
+            std::chrono::steady_clock::now() + std::chrono::hours(1)
+        );
+        snap.sessions.emplace_back(MQTT_NS::force_move(s));
+    }
+    snap.retains.push_back(
+        snapshot_retain{ "topic1"_mb, "r"_mb, MQTT_NS::v5::make_shared_properties({}), MQTT_NS::qos::at_least_once }
+    );
+    BOOST_TEST(snapshot_store::write(path, snapshot_store::encode(snap)));
+
+    auto read = snapshot_store::read(path, 3);
+    BOOST_TEST(read.has_value());
+    auto const& r = read.value();
+    BOOST_TEST(r.wal_offset == snap.wal_offset);
+    BOOST_TEST(r.sessions.size() == 10);
+    for (std::size_t i = 0; i != r.sessions.size(); ++i) {
+        auto const& s = r.sessions[i];
+        BOOST_TEST(s.client_id == "cid" + std::to_string(i));
+        BOOST_TEST(s.session_expiry_interval.has_value() == (i % 2 == 1));
+        BOOST_TEST(s.subscriptions.size() == 1);
+        BOOST_TEST(s.subscriptions[0].topic == "topic1");
+        BOOST_TEST(s.subscriptions[0].qos_value == MQTT_NS::qos::exactly_once);
+        BOOST_TEST(s.subscriptions[0].rap_value == MQTT_NS::rap::retain);
+        BOOST_TEST(s.messages.size() == 1);
+        BOOST_TEST(s.messages[0].contents == std::to_string(i));
+        BOOST_TEST(s.messages[0].pubopts.get_retain() == MQTT_NS::retain::yes);
+        BOOST_TEST(s.messages[0].props->get().size() == 1);
+        BOOST_TEST(s.messages[0].expiry.has_value());
+    }
+    BOOST_TEST(r.retains.size() == 1);
+    BOOST_TEST(r.retains[0].contents == "r");
+
+    // A broken snapshot is not read.
+    {
+        std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+        auto data = snapshot_store::encode(snap);
+        ofs.write(data.data(), static_cast<std::streamsize>(data.size() - 1));
+    }
+    BOOST_TEST(!snapshot_store::read(path, 3).has_value());
+    std::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE( replay ) {
+    broker_snapshot snap;
+    snap.sessions.push_back(
+        snapshot_session{
+            "cid1"_mb,
+            MQTT_NS::nullopt,
+            { snapshot_subscription{ "topic1"_mb, MQTT_NS::qos::at_least_once, MQTT_NS::rap::dont } },
+            {}
+        }
+    );
+    snap.retains.push_back(
+        snapshot_retain{ "topic2"_mb, "old"_mb, MQTT_NS::v5::make_shared_properties({}), MQTT_NS::qos::at_least_once }
+    );
+
+    std::vector<wal_record> records;
+    // cid2 starts a persistent session, and subscribes topic1.
+    auto session = make_record(wal_record_type::session, "cid2"_mb);
+    session.options = wal_session_persistent;
+    session.contents = MQTT_NS::allocate_buffer(std::string("\x00\x00\x00\x3c", 4));
+    records.push_back(session);
+    auto subscribe = make_record(wal_record_type::subscribe, "cid2"_mb, "topic1"_mb);
+    subscribe.options = static_cast<std::uint8_t>(MQTT_NS::qos::exactly_once | MQTT_NS::rap::dont);
+    records.push_back(subscribe);
+    // cid3 connects without a persistent session. Its subscription is discarded.
+    auto clean = make_record(wal_record_type::session, "cid3"_mb);
+    clean.options = wal_session_clean;
+    records.push_back(clean);
+    auto subscribe3 = make_record(wal_record_type::subscribe, "cid3"_mb, "topic1"_mb);
+    subscribe3.options = static_cast<std::uint8_t>(MQTT_NS::qos::at_least_once);
+    records.push_back(subscribe3);
+
+    records.push_back(make_publish("topic1"_mb, "1"_mb, MQTT_NS::qos::exactly_once));
+    // cid1 unsubscribes. The next message is queued only for cid2.
+    records.push_back(make_record(wal_record_type::unsubscribe, "cid1"_mb, "topic1"_mb));
+    records.push_back(make_publish("topic1"_mb, "2"_mb, MQTT_NS::qos::at_least_once));
+    // Retained messages
+    records.push_back(make_publish("topic2"_mb, ""_mb, MQTT_NS::qos::at_least_once | MQTT_NS::retain::yes));
+    records.push_back(make_publish("topic3"_mb, "new"_mb, MQTT_NS::qos::at_least_once | MQTT_NS::retain::yes));
+
+    snapshot_store::replay(snap, records, 4);
+
+    BOOST_TEST(snap.sessions.size() == 2);
+    auto cid1 = find_session(snap, "cid1");
+    BOOST_TEST(cid1);
+    if (cid1) {
+        BOOST_TEST(cid1->subscriptions.empty());
+        BOOST_TEST(cid1->messages.size() == 1);
+        BOOST_TEST(cid1->messages[0].contents == "1");
+        // The qos of the subscription
+        BOOST_TEST(cid1->messages[0].pubopts.get_qos() == MQTT_NS::qos::at_least_once);
+    }
+    auto cid2 = find_session(snap, "cid2");
+    BOOST_TEST(cid2);
+    if (cid2) {
+        BOOST_TEST((cid2->session_expiry_interval == std::chrono::steady_clock::duration(std::chrono::seconds(60))));
+        BOOST_TEST(cid2->subscriptions.size() == 1);
+        BOOST_TEST(cid2->messages.size() == 2);
+        BOOST_TEST(cid2->messages[0].contents == "1");
+        BOOST_TEST(cid2->messages[0].pubopts.get_qos() == MQTT_NS::qos::exactly_once);
+        BOOST_TEST(cid2->messages[1].contents == "2");
+    }
+    BOOST_TEST(!find_session(snap, "cid3"));
+    BOOST_TEST(snap.retains.size() == 1);
+    BOOST_TEST(snap.retains[0].topic == "topic3");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,559 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_TEST_BROKER_SNAPSHOT_HPP)
+#define MQTT_TEST_BROKER_SNAPSHOT_HPP
+
+#include <mqtt/variant.hpp> // should be top to configure variant limit
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <mqtt/buffer.hpp>
+#include <mqtt/four_byte_util.hpp>
+#include <mqtt/optional.hpp>
+#include <mqtt/property_parse.hpp>
+#include <mqtt/publish.hpp>
+#include <mqtt/shared_properties.hpp>
+#include <mqtt/subscribe_options.hpp>
+#include <mqtt/visitor_util.hpp>
+
+#include "offline_message_queue.hpp"
+#include "write_ahead_log.hpp"
+
+struct snapshot_subscription {
+    MQTT_NS::buffer topic;
+    MQTT_NS::qos qos_value;
+    MQTT_NS::rap rap_value;
+};
+
+// A persistent session. The session is restored as not active.
+struct snapshot_session {
+    MQTT_NS::buffer client_id;
+    MQTT_NS::optional<std::chrono::steady_clock::duration> session_expiry_interval;
+    std::vector<snapshot_subscription> subscriptions;
+    std::vector<offline_message> messages;
+};
+
+struct snapshot_retain {
+    MQTT_NS::buffer topic;
+    MQTT_NS::buffer contents;
+    MQTT_NS::v5::shared_properties props;
+    MQTT_NS::qos qos_value;
+};
+
+/**
+ * @brief The state of the broker that outlives the connections.
+ *
+ * wal_offset is the position of the write ahead log when the snapshot was taken.
+ * The records after it are not included in the snapshot, and are replayed on recovery.
+ */
+struct broker_snapshot {
+    std::uint64_t wal_offset = 0;
+    std::vector<snapshot_session> sessions;
+    std::vector<snapshot_retain> retains;
+};
+
+/**
+ * @brief Serialization of broker_snapshot, and the replay of the write ahead log on it.
+ *
+ * File format (integers are big endian):
+ *   magic(8) wal_offset(8) session_count(4) retain_count(4)
+ *   session_count * (length(4) session) retain_count * (length(4) retain)
+ * session:
+ *   client_id_len(4) client_id has_expiry(1) expiry_seconds(4)
+ *   sub_count(4) sub_count * (topic_len(4) topic qos(1) rap(1))
+ *   msg_count(4) msg_count * (pubopts(1) remaining_ms(8) topic_len(4) topic props_len(4) props contents_len(4) contents)
+ * retain:
+ *   topic_len(4) topic qos(1) props_len(4) props contents_len(4) contents
+ * remaining_ms is the time until the message expires, or 0 if the message doesn't expire.
+ *
+ * Each entry is length prefixed, so the reader finds the entries by a cheap sequential scan
+ * over the memory mapped file, and decodes them on the threads in parallel.
+ * The file is written to a temporary file and renamed, so a torn snapshot is never read.
+ */
+class snapshot_store {
+public:
+    /**
+     * @brief Encode the snapshot.
+     * @param snap snapshot to encode
+     * @return the contents of the snapshot file
+     */
+    static std::string encode(broker_snapshot const& snap) {
+        auto now = std::chrono::steady_clock::now();
+        std::string ret(magic().data(), magic().size());
+        add_uint64(ret, snap.wal_offset);
+        MQTT_NS::add_uint32_t_to_buf(ret, static_cast<std::uint32_t>(snap.sessions.size()));
+        MQTT_NS::add_uint32_t_to_buf(ret, static_cast<std::uint32_t>(snap.retains.size()));
+
+        std::string body;
+        for (auto const& s : snap.sessions) {
+            body.clear();
+            add_field(body, s.client_id);
+            body.push_back(s.session_expiry_interval ? 1 : 0);
+            MQTT_NS::add_uint32_t_to_buf(
+                body,
+                s.session_expiry_interval
+                ? static_cast<std::uint32_t>(
+                    std::chrono::duration_cast<std::chrono::seconds>(s.session_expiry_interval.value()).count()
+                )
+                : 0
+            );
+            MQTT_NS::add_uint32_t_to_buf(body, static_cast<std::uint32_t>(s.subscriptions.size()));
+            for (auto const& sub : s.subscriptions) {
+                add_field(body, sub.topic);
+                body.push_back(static_cast<char>(sub.qos_value));
+                body.push_back(static_cast<char>(sub.rap_value));
+            }
+            MQTT_NS::add_uint32_t_to_buf(body, static_cast<std::uint32_t>(s.messages.size()));
+            for (auto const& msg : s.messages) {
+                body.push_back(static_cast<char>(static_cast<std::uint8_t>(msg.pubopts)));
+                std::uint64_t remaining = 0;
+                if (msg.expiry) {
+                    // At least 1ms, because 0 means that the message doesn't expire.
+                    remaining = static_cast<std::uint64_t>(
+                        std::max<std::chrono::milliseconds::rep>(
+                            1,
+                            std::chrono::duration_cast<std::chrono::milliseconds>(msg.expiry.value() - now).count()
+                        )
+                    );
+                }
+                add_uint64(body, remaining);
+                add_field(body, msg.topic);
+                add_props(body, msg.props);
+                add_field(body, msg.contents);
+            }
+            MQTT_NS::add_uint32_t_to_buf(ret, static_cast<std::uint32_t>(body.size()));
+            ret += body;
+        }
+        for (auto const& r : snap.retains) {
+            body.clear();
+            add_field(body, r.topic);
+            body.push_back(static_cast<char>(r.qos_value));
+            add_props(body, r.props);
+            add_field(body, r.contents);
+            MQTT_NS::add_uint32_t_to_buf(ret, static_cast<std::uint32_t>(body.size()));
+            ret += body;
+        }
+        return ret;
+    }
+
+    /**
+     * @brief Write the encoded snapshot to the file, and sync it.
+     *        The file is replaced atomically.
+     * @param path path of the snapshot file
+     * @param data the return value of encode()
+     * @return true if success
+     */
+    static bool write(std::string const& path, std::string const& data) {
+        auto tmp = path + ".tmp";
+        std::FILE* fp = std::fopen(tmp.c_str(), "wb");
+        if (!fp) return false;
+        bool ok = std::fwrite(data.data(), 1, data.size(), fp) == data.size() && std::fflush(fp) == 0;
+#if defined(_WIN32)
+        ok = ok && _commit(_fileno(fp)) == 0;
+#else  // defined(_WIN32)
+        ok = ok && ::fsync(fileno(fp)) == 0;
+#endif // defined(_WIN32)
+        std::fclose(fp);
+#if defined(_WIN32)
+        // rename() on Windows fails if the destination exists.
+        if (ok) std::remove(path.c_str());
+#endif // defined(_WIN32)
+        if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Read the snapshot file using memory mapping. The entries are decoded in parallel.
+     * @param path path of the snapshot file
+     * @param threads number of the threads that decode the entries
+     * @return the snapshot. nullopt if the file doesn't exist or it is broken.
+     */
+    static MQTT_NS::optional<broker_snapshot> read(std::string const& path, std::size_t threads) {
+        namespace ip = boost::interprocess;
+
+        {
+            std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+            if (!ifs || ifs.tellg() < static_cast<std::streamoff>(header_size())) return MQTT_NS::nullopt;
+        }
+        ip::file_mapping fm(path.c_str(), ip::read_only);
+        ip::mapped_region region(fm, ip::read_only);
+        auto data = static_cast<char const*>(region.get_address());
+        auto size = region.get_size();
+        if (MQTT_NS::string_view(data, magic().size()) != magic()) return MQTT_NS::nullopt;
+
+        broker_snapshot snap;
+        snap.wal_offset = make_uint64(data + 8);
+        std::size_t session_count = MQTT_NS::make_uint32_t(data + 16, data + 20);
+        std::size_t retain_count = MQTT_NS::make_uint32_t(data + 20, data + 24);
+
+        // Find the entries.
+        std::vector<MQTT_NS::string_view> entries;
+        entries.reserve(session_count + retain_count);
+        std::size_t pos = header_size();
+        for (std::size_t i = 0; i != session_count + retain_count; ++i) {
+            if (size - pos < 4) return MQTT_NS::nullopt;
+            auto len = MQTT_NS::make_uint32_t(data + pos, data + pos + 4);
+            if (size - pos - 4 < len) return MQTT_NS::nullopt;
+            entries.emplace_back(data + pos + 4, len);
+            pos += 4 + len;
+        }
+
+        std::vector<MQTT_NS::optional<snapshot_session>> sessions(session_count);
+        std::vector<MQTT_NS::optional<snapshot_retain>> retains(retain_count);
+        auto now = std::chrono::steady_clock::now();
+        write_ahead_log::parallel_for(
+            entries.size(),
+            threads,
+            [&](std::size_t i) {
+                if (i < session_count) {
+                    sessions[i] = decode_session(entries[i], now);
+                }
+                else {
+                    retains[i - session_count] = decode_retain(entries[i]);
+                }
+            }
+        );
+
+        snap.sessions.reserve(session_count);
+        for (auto& s : sessions) {
+            if (!s) return MQTT_NS::nullopt;
+            snap.sessions.emplace_back(MQTT_NS::force_move(s.value()));
+        }
+        snap.retains.reserve(retain_count);
+        for (auto& r : retains) {
+            if (!r) return MQTT_NS::nullopt;
+            snap.retains.emplace_back(MQTT_NS::force_move(r.value()));
+        }
+        return snap;
+    }
+
+    /**
+     * @brief Apply the records of the write ahead log to the snapshot.
+     *
+     * The sessions are partitioned by the hash of the client id. Each thread applies the
+     * session, subscribe and unsubscribe records of its own clients, and queues the published
+     * messages for its own subscribers, in the order of the log. The retained messages are
+     * applied by one more thread. The QoS 2 messages that are received by the broker are not
+     * held by the session state, so their PUBREL is not logged.
+     *
+     * The messages that were delivered to the connected subscribers are queued again,
+     * so they are delivered at least once after the recovery.
+     *
+     * @param snap snapshot to update. wal_offset is not changed.
+     * @param records records after wal_offset of the snapshot, in order
+     * @param threads number of the partitions
+     */
+    static void replay(broker_snapshot& snap, std::vector<wal_record> const& records, std::size_t threads) {
+        threads = std::max<std::size_t>(1, threads);
+        std::vector<partition> parts(threads);
+        auto part_of =
+            [&](MQTT_NS::buffer const& client_id) {
+                return boost::hash_range(client_id.begin(), client_id.end()) % threads;
+            };
+        auto now = std::chrono::steady_clock::now();
+
+        std::thread retain_thread(
+            [&] {
+                std::unordered_map<std::string, snapshot_retain> retains;
+                for (auto& r : snap.retains) {
+                    std::string key(r.topic);
+                    retains.emplace(MQTT_NS::force_move(key), MQTT_NS::force_move(r));
+                }
+                for (auto const& rec : records) {
+                    if (rec.type != wal_record_type::publish) continue;
+                    MQTT_NS::publish_options pubopts(rec.options);
+                    if (pubopts.get_retain() != MQTT_NS::retain::yes) continue;
+                    std::string key(rec.topic);
+                    if (rec.contents.empty()) {
+                        retains.erase(key);
+                    }
+                    else {
+                        retains[MQTT_NS::force_move(key)] =
+                            snapshot_retain{ rec.topic, rec.contents, rec.props, pubopts.get_qos() };
+                    }
+                }
+                snap.retains.clear();
+                for (auto& r : retains) snap.retains.emplace_back(MQTT_NS::force_move(r.second));
+            }
+        );
+
+        write_ahead_log::parallel_for(
+            threads,
+            threads,
+            [&](std::size_t p) {
+                auto& part = parts[p];
+                for (auto& s : snap.sessions) {
+                    if (part_of(s.client_id) != p) continue;
+                    std::string key(s.client_id);
+                    for (auto const& sub : s.subscriptions) part.subscribers.emplace(std::string(sub.topic), key);
+                    part.sessions.emplace(MQTT_NS::force_move(key), MQTT_NS::force_move(s));
+                }
+                for (auto const& rec : records) {
+                    if (rec.type == wal_record_type::publish) {
+                        part.publish(rec, now);
+                    }
+                    else if (part_of(rec.client_id) == p) {
+                        part.apply(rec);
+                    }
+                }
+            }
+        );
+        retain_thread.join();
+
+        snap.sessions.clear();
+        for (auto& part : parts) {
+            for (auto& s : part.sessions) snap.sessions.emplace_back(MQTT_NS::force_move(s.second));
+        }
+    }
+
+private:
+    // The sessions of the clients whose client ids have the same hash.
+    struct partition {
+        void apply(wal_record const& rec) {
+            std::string key(rec.client_id);
+            switch (rec.type) {
+            case wal_record_type::session: {
+                auto it = sessions.find(key);
+                if (it != sessions.end() && (rec.options & wal_session_clean)) {
+                    erase_subscribers(it->second);
+                    it->second.subscriptions.clear();
+                    it->second.messages.clear();
+                }
+                if (!(rec.options & wal_session_persistent)) {
+                    // The session ends with the connection.
+                    if (it != sessions.end()) {
+                        erase_subscribers(it->second);
+                        sessions.erase(it);
+                    }
+                    break;
+                }
+                if (it == sessions.end()) {
+                    it = sessions.emplace(key, snapshot_session{ rec.client_id, MQTT_NS::nullopt, {}, {} }).first;
+                }
+                auto expiry_seconds =
+                    rec.contents.size() == 4 ? MQTT_NS::make_uint32_t(rec.contents.begin(), rec.contents.end()) : 0;
+                it->second.session_expiry_interval = MQTT_NS::nullopt;
+                if (expiry_seconds != 0) it->second.session_expiry_interval.emplace(std::chrono::seconds(expiry_seconds));
+            } break;
+            case wal_record_type::session_end: {
+                auto it = sessions.find(key);
+                if (it == sessions.end()) break;
+                erase_subscribers(it->second);
+                sessions.erase(it);
+            } break;
+            case wal_record_type::subscribe: {
+                auto it = sessions.find(key);
+                if (it == sessions.end()) break;
+                auto& subs = it->second.subscriptions;
+                // The first subscription of the topic is kept, the same as the broker.
+                if (std::any_of(
+                        subs.begin(), subs.end(),
+                        [&](snapshot_subscription const& sub) { return sub.topic == rec.topic; })) break;
+                MQTT_NS::subscribe_options opts(rec.options);
+                subs.push_back(snapshot_subscription{ rec.topic, opts.get_qos(), opts.get_rap() });
+                subscribers.emplace(std::string(rec.topic), key);
+            } break;
+            case wal_record_type::unsubscribe: {
+                auto it = sessions.find(key);
+                if (it == sessions.end()) break;
+                auto& subs = it->second.subscriptions;
+                auto sub_it = std::find_if(
+                    subs.begin(), subs.end(),
+                    [&](snapshot_subscription const& sub) { return sub.topic == rec.topic; });
+                if (sub_it == subs.end()) break;
+                erase_subscriber(std::string(rec.topic), key);
+                subs.erase(sub_it);
+            } break;
+            default:
+                break;
+            }
+        }
+
+        void publish(wal_record const& rec, std::chrono::steady_clock::time_point now) {
+            auto range = subscribers.equal_range(std::string(rec.topic));
+            if (range.first == range.second) return;
+            MQTT_NS::publish_options pubopts(rec.options);
+            MQTT_NS::optional<std::chrono::steady_clock::time_point> expiry;
+            if (rec.props) {
+                for (auto const& p : rec.props->get()) {
+                    MQTT_NS::visit(
+                        MQTT_NS::make_lambda_visitor(
+                            [&](MQTT_NS::v5::property::message_expiry_interval const& t) {
+                                expiry.emplace(now + std::chrono::seconds(t.val()));
+                            },
+                            [](auto&& ...) {
+                            }
+                        ),
+                        p
+                    );
+                }
+            }
+            for (auto it = range.first; it != range.second; ++it) {
+                auto& s = sessions.at(it->second);
+                auto sub = std::find_if(
+                    s.subscriptions.begin(), s.subscriptions.end(),
+                    [&](snapshot_subscription const& sub) { return sub.topic == rec.topic; });
+                BOOST_ASSERT(sub != s.subscriptions.end());
+                // The same options as the messages that the broker queues for the non active sessions.
+                s.messages.emplace_back(
+                    rec.topic,
+                    rec.contents,
+                    rec.props,
+                    std::min(sub->qos_value, pubopts.get_qos()) | MQTT_NS::retain::yes,
+                    expiry
+                );
+            }
+        }
+
+        void erase_subscribers(snapshot_session const& s) {
+            std::string key(s.client_id);
+            for (auto const& sub : s.subscriptions) erase_subscriber(std::string(sub.topic), key);
+        }
+
+        void erase_subscriber(std::string const& topic, std::string const& client_id) {
+            auto range = subscribers.equal_range(topic);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second == client_id) {
+                    subscribers.erase(it);
+                    return;
+                }
+            }
+        }
+
+        std::unordered_map<std::string, snapshot_session> sessions;
+        // topic to client id
+        std::unordered_multimap<std::string, std::string> subscribers;
+    };
+
+    static MQTT_NS::string_view magic() {
+        return MQTT_NS::string_view("MQSNAP01", 8);
+    }
+
+    // magic(8) wal_offset(8) session_count(4) retain_count(4)
+    static std::size_t header_size() {
+        return 8 + 8 + 4 + 4;
+    }
+
+    static void add_uint64(std::string& buf, std::uint64_t val) {
+        MQTT_NS::add_uint32_t_to_buf(buf, static_cast<std::uint32_t>(val >> 32));
+        MQTT_NS::add_uint32_t_to_buf(buf, static_cast<std::uint32_t>(val));
+    }
+
+    static std::uint64_t make_uint64(char const* p) {
+        return
+            (static_cast<std::uint64_t>(MQTT_NS::make_uint32_t(p, p + 4)) << 32) |
+            MQTT_NS::make_uint32_t(p + 4, p + 8);
+    }
+
+    static void add_field(std::string& buf, MQTT_NS::string_view field) {
+        MQTT_NS::add_uint32_t_to_buf(buf, static_cast<std::uint32_t>(field.size()));
+        buf.append(field.data(), field.size());
+    }
+
+    static void add_props(std::string& buf, MQTT_NS::v5::shared_properties const& props) {
+        // The properties are already encoded.
+        if (!props) {
+            add_field(buf, MQTT_NS::string_view());
+            return;
+        }
+        auto encoded = props->encoded();
+        add_field(buf, MQTT_NS::string_view(static_cast<char const*>(encoded.data()), encoded.size()));
+    }
+
+    static MQTT_NS::optional<MQTT_NS::buffer> read_field(MQTT_NS::string_view& body) {
+        if (body.size() < 4) return MQTT_NS::nullopt;
+        auto len = MQTT_NS::make_uint32_t(body.data(), body.data() + 4);
+        body.remove_prefix(4);
+        if (body.size() < len) return MQTT_NS::nullopt;
+        // Copied, because the mapping is released after the snapshot is read.
+        auto ret = MQTT_NS::allocate_buffer(body.substr(0, len));
+        body.remove_prefix(len);
+        return ret;
+    }
+
+    static MQTT_NS::optional<snapshot_session> decode_session(
+        MQTT_NS::string_view body,
+        std::chrono::steady_clock::time_point now) {
+        auto client_id = read_field(body);
+        if (!client_id || body.size() < 1 + 4 + 4) return MQTT_NS::nullopt;
+        snapshot_session s{ MQTT_NS::force_move(client_id.value()), MQTT_NS::nullopt, {}, {} };
+        if (body[0]) s.session_expiry_interval.emplace(std::chrono::seconds(MQTT_NS::make_uint32_t(body.data() + 1, body.data() + 5)));
+        std::size_t sub_count = MQTT_NS::make_uint32_t(body.data() + 5, body.data() + 9);
+        body.remove_prefix(9);
+        for (std::size_t i = 0; i != sub_count; ++i) {
+            auto topic = read_field(body);
+            if (!topic || body.size() < 2) return MQTT_NS::nullopt;
+            s.subscriptions.push_back(
+                snapshot_subscription{
+                    MQTT_NS::force_move(topic.value()),
+                    static_cast<MQTT_NS::qos>(body[0]),
+                    static_cast<MQTT_NS::rap>(body[1])
+                }
+            );
+            body.remove_prefix(2);
+        }
+        if (body.size() < 4) return MQTT_NS::nullopt;
+        std::size_t msg_count = MQTT_NS::make_uint32_t(body.data(), body.data() + 4);
+        body.remove_prefix(4);
+        s.messages.reserve(msg_count);
+        for (std::size_t i = 0; i != msg_count; ++i) {
+            if (body.size() < 9) return MQTT_NS::nullopt;
+            MQTT_NS::publish_options pubopts(static_cast<std::uint8_t>(body[0]));
+            auto remaining = make_uint64(body.data() + 1);
+            body.remove_prefix(9);
+            auto topic = read_field(body);
+            if (!topic) return MQTT_NS::nullopt;
+            auto props = read_field(body);
+            if (!props) return MQTT_NS::nullopt;
+            auto contents = read_field(body);
+            if (!contents) return MQTT_NS::nullopt;
+            MQTT_NS::optional<std::chrono::steady_clock::time_point> expiry;
+            if (remaining != 0) expiry.emplace(now + std::chrono::milliseconds(remaining));
+            s.messages.emplace_back(
+                MQTT_NS::force_move(topic.value()),
+                MQTT_NS::force_move(contents.value()),
+                MQTT_NS::v5::make_shared_properties(MQTT_NS::v5::property::parse(MQTT_NS::force_move(props.value()))),
+                pubopts,
+                expiry
+            );
+        }
+        return s;
+    }
+
+    static MQTT_NS::optional<snapshot_retain> decode_retain(MQTT_NS::string_view body) {
+        auto topic = read_field(body);
+        if (!topic || body.size() < 1) return MQTT_NS::nullopt;
+        auto qos_value = static_cast<MQTT_NS::qos>(body[0]);
+        body.remove_prefix(1);
+        auto props = read_field(body);
+        if (!props) return MQTT_NS::nullopt;
+        auto contents = read_field(body);
+        if (!contents) return MQTT_NS::nullopt;
+        return snapshot_retain{
+            MQTT_NS::force_move(topic.value()),
+            MQTT_NS::force_move(contents.value()),
+            MQTT_NS::v5::make_shared_properties(MQTT_NS::v5::property::parse(MQTT_NS::force_move(props.value()))),
+            qos_value
+        };
+    }
+};
+
+#endif // MQTT_TEST_BROKER_SNAPSHOT_HPP
@@ -8,6 +8,8 @@
 #include "combi_test.hpp"
 #include "checker.hpp"
 
+#include <deque>
+
 BOOST_AUTO_TEST_SUITE(test_connect)
 
 using namespace MQTT_NS::literals;
@@ -193,9 +195,13 @@ BOOST_AUTO_TEST_CASE( keep_alive ) {
             [&chk, &c]
             () {
                 MQTT_CHK("h_pingresp");
+                // The round trip time is measured before the handler is called.
+                BOOST_TEST(c->get_ping_rtt().has_value());
+                BOOST_TEST((c->get_ping_rtt() == c->get_smoothed_ping_rtt()));
                 c->disconnect();
                 return true;
             });
+        BOOST_TEST(!c->get_ping_rtt().has_value());
         c->set_keep_alive_sec(3);
         c->connect();
         ioc.run();
@@ -303,6 +309,341 @@ BOOST_AUTO_TEST_CASE( keep_alive_and_send_control_packet ) {
     do_combi_test_sync(test);
 }
 
+BOOST_AUTO_TEST_CASE( keep_alive_scheduler ) {
+    auto test = [](boost::asio::io_context& ioc, auto& c, auto finish, auto& /*b*/) {
+        c->set_client_id("cid1");
+        c->set_clean_session(true);
+
+        checker chk = {
+            // connect
+            cont("h_connack"),
+            cont("500ms"),
+            cont("h_pingresp"),
+            // disconnect
+            cont("h_close"),
+        };
+
+        boost::asio::steady_timer tim(ioc);
+        std::chrono::steady_clock::time_point connected;
+        auto connack =
+            [&] {
+                MQTT_CHK("h_connack");
+                connected = std::chrono::steady_clock::now();
+                tim.expires_after(std::chrono::milliseconds(500));
+                tim.async_wait(
+                    [&chk, &c](MQTT_NS::error_code ec) {
+                        MQTT_CHK("500ms");
+                        BOOST_CHECK(!ec);
+                        // This pushes back the next PINGREQ.
+                        c->publish("topic1", "timer_reset", MQTT_NS::qos::at_most_once);
+                    }
+                );
+            };
+        switch (c->get_protocol_version()) {
+        case MQTT_NS::protocol_version::v3_1_1:
+            c->set_connack_handler(
+                [&connack]
+                (bool /*sp*/, MQTT_NS::connect_return_code connack_return_code) {
+                    BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+                    connack();
+                    return true;
+                });
+            break;
+        case MQTT_NS::protocol_version::v5:
+            c->set_v5_connack_handler(
+                [&connack]
+                (bool /*sp*/, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+                    BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+                    connack();
+                    return true;
+                });
+            break;
+        default:
+            BOOST_CHECK(false);
+            break;
+        }
+
+        c->set_close_handler(
+            [&chk, &finish]
+            () {
+                MQTT_CHK("h_close");
+                finish();
+            });
+        c->set_error_handler(
+            []
+            (MQTT_NS::error_code) {
+                BOOST_CHECK(false);
+            });
+        c->set_pingresp_handler(
+            [&chk, &c, &connected]
+            () {
+                MQTT_CHK("h_pingresp");
+                // 1 second after the publish
+                BOOST_TEST((std::chrono::steady_clock::now() - connected >= std::chrono::milliseconds(1400)));
+                c->disconnect();
+                return true;
+            });
+        c->set_keep_alive_scheduler(std::make_shared<MQTT_NS::timer_wheel>(ioc, std::chrono::milliseconds(10)));
+        c->set_keep_alive_sec(3, std::chrono::seconds(1));
+        c->connect();
+        ioc.run();
+        BOOST_TEST(chk.all());
+    };
+    do_combi_test_sync(test);
+}
+
+BOOST_AUTO_TEST_CASE( keep_alive_suppressed_by_traffic ) {
+    auto test = [](boost::asio::io_context& ioc, auto& c, auto finish, auto& /*b*/) {
+        c->set_client_id("cid1");
+        c->set_clean_session(true);
+
+        checker chk = {
+            // connect
+            cont("h_connack"),
+            // publish every 300ms that is shorter than the keep alive
+            cont("traffic_done"),
+            cont("h_pingresp"),
+            // disconnect
+            cont("h_close"),
+        };
+
+        boost::asio::steady_timer tim(ioc);
+        std::size_t published = 0;
+        std::chrono::steady_clock::time_point last_publish;
+        std::function<void()> publish_periodically =
+            [&] {
+                tim.expires_after(std::chrono::milliseconds(300));
+                tim.async_wait(
+                    [&](MQTT_NS::error_code ec) {
+                        BOOST_CHECK(!ec);
+                        c->publish("topic1", "timer_reset", MQTT_NS::qos::at_most_once);
+                        last_publish = std::chrono::steady_clock::now();
+                        if (++published == 6) {
+                            MQTT_CHK("traffic_done");
+                            return;
+                        }
+                        publish_periodically();
+                    }
+                );
+            };
+        switch (c->get_protocol_version()) {
+        case MQTT_NS::protocol_version::v3_1_1:
+            c->set_connack_handler(
+                [&chk, &publish_periodically]
+                (bool /*sp*/, MQTT_NS::connect_return_code connack_return_code) {
+                    MQTT_CHK("h_connack");
+                    BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+                    publish_periodically();
+                    return true;
+                });
+            break;
+        case MQTT_NS::protocol_version::v5:
+            c->set_v5_connack_handler(
+                [&chk, &publish_periodically]
+                (bool /*sp*/, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+                    MQTT_CHK("h_connack");
+                    BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+                    publish_periodically();
+                    return true;
+                });
+            break;
+        default:
+            BOOST_CHECK(false);
+            break;
+        }
+
+        c->set_close_handler(
+            [&chk, &finish]
+            () {
+                MQTT_CHK("h_close");
+                finish();
+            });
+        c->set_error_handler(
+            []
+            (MQTT_NS::error_code) {
+                BOOST_CHECK(false);
+            });
+        c->set_pingresp_handler(
+            [&chk, &c, &last_publish]
+            () {
+                // No PINGREQ is sent while the client publishes, and the first one is
+                // sent 1 second after the last publish.
+                MQTT_CHK("h_pingresp");
+                BOOST_TEST((std::chrono::steady_clock::now() - last_publish >= std::chrono::milliseconds(900)));
+                c->disconnect();
+                return true;
+            });
+        c->set_keep_alive_sec(3, std::chrono::seconds(1));
+        c->connect();
+        ioc.run();
+        BOOST_TEST(chk.all());
+    };
+    do_combi_test_sync(test);
+}
+
+BOOST_AUTO_TEST_CASE( resolver_cache_ttl ) {
+    boost::asio::io_context ioc;
+    auto cache = std::make_shared<MQTT_NS::resolver_cache>(std::chrono::milliseconds(100));
+    auto port = std::to_string(broker_notls_port);
+    std::size_t resolved = 0;
+    for (std::size_t i = 0; i != 2; ++i) {
+        // The second request waits for the result of the first one.
+        cache->async_resolve(
+            ioc, broker_url, port,
+            [&resolved]
+            (MQTT_NS::error_code ec, MQTT_NS::resolver_cache::endpoints eps) {
+                BOOST_TEST(!ec);
+                BOOST_TEST(!eps.empty());
+                ++resolved;
+            }
+        );
+    }
+    ioc.run();
+    BOOST_TEST(resolved == 2);
+    BOOST_TEST(cache->find(broker_url, port).has_value());
+    std::this_thread::sleep_for(std::chrono::milliseconds(150));
+    BOOST_TEST(!cache->find(broker_url, port).has_value());
+}
+
+namespace {
+
+// A listener that never accepts. Its accept queue is filled up, so the SYN of a new
+// connection is dropped and the connection attempt doesn't complete.
+class blocked_listener {
+public:
+    explicit blocked_listener(as::io_context& ioc)
+        :acceptor_(ioc) {
+        as::ip::tcp::endpoint ep(as::ip::make_address("127.0.0.1"), 0);
+        acceptor_.open(ep.protocol());
+        acceptor_.bind(ep);
+        acceptor_.listen(0);
+        // The connections are started on initiation. filler_ioc_ is never run, so they are left pending.
+        for (std::size_t i = 0; i != 4; ++i) {
+            fillers_.emplace_back(filler_ioc_);
+            fillers_.back().async_connect(endpoint(), [](MQTT_NS::error_code) {});
+        }
+        // Wait for the handshakes of the connections that fit in the queue.
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    as::ip::tcp::endpoint endpoint() const {
+        return acceptor_.local_endpoint();
+    }
+
+private:
+    as::ip::tcp::acceptor acceptor_;
+    boost::asio::io_context filler_ioc_;
+    std::deque<as::ip::tcp::socket> fillers_;
+};
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE( connect_attempt_delay ) {
+    auto test = [](boost::asio::io_context& ioc, auto& c, auto finish, auto& /*b*/) {
+        c->set_client_id("cid1");
+        c->set_clean_session(true);
+
+        checker chk = {
+            // connect
+            cont("h_connack"),
+            // disconnect
+            cont("h_close"),
+        };
+
+        blocked_listener blocked(ioc);
+        auto cache = std::make_shared<MQTT_NS::resolver_cache>();
+        auto port = std::to_string(broker_notls_port);
+        // The first endpoint doesn't answer, so the second attempt is started after the delay.
+        cache->store(
+            broker_url,
+            port,
+            {
+                blocked.endpoint(),
+                as::ip::tcp::endpoint(as::ip::make_address("127.0.0.1"), broker_notls_port)
+            }
+        );
+        c->set_resolver_cache(cache);
+        c->set_connect_attempt_delay(std::chrono::milliseconds(50));
+
+        auto start = std::chrono::steady_clock::now();
+        c->set_connack_handler(
+            [&chk, &c, start]
+            (bool /*sp*/, MQTT_NS::connect_return_code connack_return_code) {
+                MQTT_CHK("h_connack");
+                BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+                BOOST_TEST((std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(50)));
+                BOOST_TEST((std::chrono::steady_clock::now() - start < std::chrono::seconds(1)));
+                c->async_disconnect();
+                return true;
+            });
+        c->set_close_handler(
+            [&chk, &finish]
+            () {
+                MQTT_CHK("h_close");
+                finish();
+            });
+        c->set_error_handler(
+            []
+            (MQTT_NS::error_code) {
+                BOOST_CHECK(false);
+            });
+        c->async_connect();
+        ioc.run();
+        BOOST_TEST(chk.all());
+    };
+    do_test(
+        [&](auto&&... args) { return MQTT_NS::make_async_client(std::forward<decltype(args)>(args)...); },
+        test
+    );
+}
+
+BOOST_AUTO_TEST_CASE( happy_eyeballs_socket_options ) {
+    boost::asio::io_context ioc;
+    blocked_listener blocked(ioc);
+    as::ip::tcp::acceptor acceptor(ioc, as::ip::tcp::endpoint(as::ip::make_address("127.0.0.1"), 0));
+    as::ip::tcp::socket accepted(ioc);
+    acceptor.async_accept(
+        accepted,
+        [](MQTT_NS::error_code ec) {
+            BOOST_TEST(!ec);
+        }
+    );
+
+    // The options are set to the socket of each attempt, so the connected socket has them.
+    MQTT_NS::tcp_socket_options options;
+    options.no_delay.emplace(true);
+    options.receive_buffer_size.emplace(32 * 1024);
+    // The system can adjust the size. The connected socket reports the same size as a socket that it is set to.
+    as::socket_base::receive_buffer_size receive_buffer_size;
+    {
+        as::ip::tcp::socket probe(ioc, as::ip::tcp::v4());
+        probe.set_option(as::socket_base::receive_buffer_size(options.receive_buffer_size.value()));
+        probe.get_option(receive_buffer_size);
+    }
+
+    as::ip::tcp::socket s(ioc);
+    bool connected = false;
+    MQTT_NS::async_happy_eyeballs_connect(
+        s,
+        { blocked.endpoint(), acceptor.local_endpoint() },
+        std::chrono::milliseconds(50),
+        options,
+        [&](MQTT_NS::error_code ec) {
+            BOOST_TEST(!ec);
+            connected = true;
+        }
+    );
+    ioc.run();
+    BOOST_TEST(connected);
+    BOOST_TEST(s.remote_endpoint() == acceptor.local_endpoint());
+    as::ip::tcp::no_delay no_delay;
+    s.get_option(no_delay);
+    BOOST_TEST(no_delay.value());
+    as::socket_base::receive_buffer_size connected_receive_buffer_size;
+    s.get_option(connected_receive_buffer_size);
+    BOOST_TEST(connected_receive_buffer_size.value() == receive_buffer_size.value());
+}
+
 BOOST_AUTO_TEST_CASE( connect_again ) {
     auto test = [](boost::asio::io_context& ioc, auto& c, auto finish, auto& /*b*/) {
         c->set_client_id("cid1");
@@ -635,6 +976,96 @@ BOOST_AUTO_TEST_CASE( noclean ) {
     do_combi_test_sync(test);
 }
 
+BOOST_AUTO_TEST_CASE( session_expiry ) {
+    auto test = [](boost::asio::io_context& ioc, auto& c, auto finish, auto& /*b*/) {
+        if (c->get_protocol_version() != MQTT_NS::protocol_version::v5) {
+            finish();
+            return;
+        }
+
+        c->set_client_id("cid1");
+        c->set_clean_session(false);
+
+        checker chk = {
+            // connect
+            cont("h_connack1"),
+            // disconnect
+            cont("h_close1"),
+            // connect before the session expires
+            cont("h_connack2"),
+            // disconnect
+            cont("h_close2"),
+            // connect after the session expires
+            cont("h_connack3"),
+            // disconnect
+            cont("h_close3"),
+        };
+
+        as::steady_timer tim(ioc);
+        MQTT_NS::v5::properties props {
+            MQTT_NS::v5::property::session_expiry_interval(1)
+        };
+
+        int connect = 0;
+        c->set_v5_connack_handler(
+            [&chk, &connect, &c]
+            (bool sp, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+                switch (connect) {
+                case 0:
+                    MQTT_CHK("h_connack1");
+                    BOOST_TEST(sp == false);
+                    break;
+                case 1:
+                    MQTT_CHK("h_connack2");
+                    BOOST_TEST(sp == true);
+                    break;
+                case 2:
+                    MQTT_CHK("h_connack3");
+                    BOOST_TEST(sp == false);
+                    break;
+                }
+                BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+                c->disconnect();
+                return true;
+            });
+        c->set_close_handler(
+            [&chk, &connect, &c, &finish, &tim, &props]
+            () {
+                switch (connect) {
+                case 0:
+                    MQTT_CHK("h_close1");
+                    c->connect(props);
+                    ++connect;
+                    break;
+                case 1:
+                    MQTT_CHK("h_close2");
+                    ++connect;
+                    tim.expires_after(std::chrono::seconds(2));
+                    tim.async_wait(
+                        [&c, &props](MQTT_NS::error_code ec) {
+                            BOOST_TEST(!ec);
+                            c->connect(props);
+                        }
+                    );
+                    break;
+                case 2:
+                    MQTT_CHK("h_close3");
+                    finish();
+                    break;
+                }
+            });
+        c->set_error_handler(
+            []
+            (MQTT_NS::error_code) {
+                BOOST_CHECK(false);
+            });
+        c->connect(props);
+        ioc.run();
+        BOOST_TEST(chk.all());
+    };
+    do_combi_test_sync(test);
+}
+
 BOOST_AUTO_TEST_CASE( disconnect_timeout ) {
     auto test = [](boost::asio::io_context& ioc, auto& c, auto finish, auto& b) {
         c->set_client_id("cid1");
@@ -0,0 +1,404 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "test_main.hpp"
+#include "test_settings.hpp"
+#include "test_broker.hpp"
+#include "test_server_no_tls.hpp"
+#include "checker.hpp"
+
+#include <mqtt/client.hpp>
+
+BOOST_AUTO_TEST_SUITE(test_durability)
+
+using namespace MQTT_NS::literals;
+
+BOOST_AUTO_TEST_CASE( ack_after_commit ) {
+    std::string path = "./durability_ack.log";
+    std::remove(path.c_str());
+
+    boost::asio::io_context iocb;
+    test_broker b(iocb);
+    BOOST_TEST(b.set_write_ahead_log(wal_config{ path, std::chrono::milliseconds(20), 1024 * 1024 }));
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto finish =
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        };
+
+    boost::asio::io_context ioc;
+
+    auto c = MQTT_NS::make_client(ioc, broker_url, broker_notls_port);
+    c->set_client_id("cid1");
+    c->set_clean_session(true);
+
+    using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+
+    checker chk = {
+        // connect
+        cont("h_connack"),
+        // publish topic1 QoS1
+        cont("h_puback"),
+        // publish topic1 QoS2
+        cont("h_pubrec"),
+        cont("h_pubcomp"),
+        // disconnect
+        cont("h_close"),
+    };
+
+    c->set_connack_handler(
+        [&chk, &c]
+        (bool sp, MQTT_NS::connect_return_code connack_return_code) {
+            MQTT_CHK("h_connack");
+            BOOST_TEST(sp == false);
+            BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+            c->publish("topic1", "1", MQTT_NS::qos::at_least_once);
+            return true;
+        });
+    c->set_puback_handler(
+        [&chk, &c]
+        (packet_id_t /*packet_id*/) {
+            MQTT_CHK("h_puback");
+            c->publish("topic1", "2", MQTT_NS::qos::exactly_once);
+            return true;
+        });
+    c->set_pubrec_handler(
+        [&chk]
+        (packet_id_t /*packet_id*/) {
+            MQTT_CHK("h_pubrec");
+            return true;
+        });
+    c->set_pubcomp_handler(
+        [&chk, &c]
+        (packet_id_t /*packet_id*/) {
+            MQTT_CHK("h_pubcomp");
+            c->disconnect();
+            return true;
+        });
+    c->set_close_handler(
+        [&chk, &finish]
+        () {
+            MQTT_CHK("h_close");
+            finish();
+        });
+    c->set_error_handler(
+        []
+        (MQTT_NS::error_code) {
+            BOOST_CHECK(false);
+        });
+
+    c->connect();
+
+    ioc.run();
+    BOOST_TEST(chk.all());
+    th.join();
+
+    // Each response has been sent after its record had been committed.
+    std::vector<wal_record> recs;
+    write_ahead_log::read(
+        path,
+        [&](wal_record rec) {
+            recs.emplace_back(MQTT_NS::force_move(rec));
+        }
+    );
+    BOOST_TEST(recs.size() == 3);
+    if (recs.size() == 3) {
+        BOOST_TEST((recs[0].type == wal_record_type::session));
+        BOOST_TEST((recs[1].type == wal_record_type::publish));
+        BOOST_TEST(recs[1].client_id == "cid1");
+        BOOST_TEST(recs[1].contents == "1");
+        BOOST_TEST((recs[2].type == wal_record_type::publish));
+        BOOST_TEST(recs[2].contents == "2");
+    }
+    std::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE( recover ) {
+    std::string wal_path = "./durability_recover.log";
+    std::string snapshot_path = "./durability_recover.snap";
+    std::remove(wal_path.c_str());
+    std::remove(snapshot_path.c_str());
+
+    // Run the broker on its own thread while the client runs on ioc.
+    auto run =
+        [](test_broker& b, boost::asio::io_context& iocb, boost::asio::io_context& ioc, auto&& start) {
+            MQTT_NS::optional<test_server_no_tls> s;
+            std::promise<void> p;
+            auto f = p.get_future();
+            std::thread th(
+                [&] {
+                    s.emplace(iocb, b);
+                    p.set_value();
+                    iocb.run();
+                }
+            );
+            f.wait();
+            start(
+                [&] {
+                    as::post(
+                        iocb,
+                        [&] {
+                            s->close();
+                        }
+                    );
+                }
+            );
+            ioc.run();
+            th.join();
+        };
+
+    // The broker logs the subscription and the retained message.
+    {
+        boost::asio::io_context iocb;
+        test_broker b(iocb);
+        BOOST_TEST(b.set_write_ahead_log(wal_config{ wal_path, std::chrono::milliseconds(1), 1024 * 1024 }));
+        boost::asio::io_context ioc;
+        auto c = MQTT_NS::make_client(ioc, broker_url, broker_notls_port);
+        using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+        checker chk = {
+            cont("h_connack"),
+            cont("h_suback"),
+            cont("h_publish"),
+            cont("h_close"),
+        };
+        run(
+            b, iocb, ioc,
+            [&](auto finish) {
+                c->set_client_id("cid1");
+                c->set_clean_session(false);
+                c->set_connack_handler(
+                    [&chk, &c]
+                    (bool /*sp*/, MQTT_NS::connect_return_code /*connack_return_code*/) {
+                        MQTT_CHK("h_connack");
+                        c->subscribe("topic1", MQTT_NS::qos::at_least_once);
+                        return true;
+                    });
+                c->set_suback_handler(
+                    [&chk, &c]
+                    (packet_id_t /*packet_id*/, std::vector<MQTT_NS::suback_return_code> /*results*/) {
+                        MQTT_CHK("h_suback");
+                        c->publish("topic1", "1", MQTT_NS::qos::at_least_once | MQTT_NS::retain::yes);
+                        return true;
+                    });
+                c->set_puback_handler(
+                    []
+                    (packet_id_t /*packet_id*/) {
+                        return true;
+                    });
+                c->set_publish_handler(
+                    [&chk, &c]
+                    (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+                     MQTT_NS::publish_options /*pubopts*/,
+                     MQTT_NS::buffer /*topic*/,
+                     MQTT_NS::buffer contents) {
+                        MQTT_CHK("h_publish");
+                        BOOST_TEST(contents == "1");
+                        c->disconnect();
+                        return true;
+                    });
+                c->set_close_handler(
+                    [&chk, finish]
+                    () {
+                        MQTT_CHK("h_close");
+                        finish();
+                    });
+                c->connect();
+            }
+        );
+        BOOST_TEST(chk.all());
+    }
+
+    // A new broker recovers the session and the retained message from the log.
+    {
+        boost::asio::io_context iocb;
+        test_broker b(iocb);
+        BOOST_TEST(b.recover(snapshot_path, wal_path, 2));
+        BOOST_TEST(b.set_write_ahead_log(wal_config{ wal_path, std::chrono::milliseconds(1), 1024 * 1024 }));
+        boost::asio::io_context ioc;
+        auto c1 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port);
+        auto c2 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port);
+        using packet_id_t = typename std::remove_reference_t<decltype(*c1)>::packet_id_t;
+        checker chk = {
+            // The message that had been delivered is delivered again (at least once).
+            cont("h_connack_1"),
+            cont("h_publish_1"),
+            // The retained message
+            cont("h_connack_2"),
+            cont("h_publish_2"),
+            cont("h_close_2"),
+            cont("h_close_1"),
+        };
+        run(
+            b, iocb, ioc,
+            [&](auto finish) {
+                c1->set_client_id("cid1");
+                c1->set_clean_session(false);
+                c1->set_connack_handler(
+                    [&chk]
+                    (bool sp, MQTT_NS::connect_return_code /*connack_return_code*/) {
+                        MQTT_CHK("h_connack_1");
+                        BOOST_TEST(sp == true);
+                        return true;
+                    });
+                c1->set_publish_handler(
+                    [&chk, &c2]
+                    (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+                     MQTT_NS::publish_options /*pubopts*/,
+                     MQTT_NS::buffer topic,
+                     MQTT_NS::buffer contents) {
+                        MQTT_CHK("h_publish_1");
+                        BOOST_TEST(topic == "topic1");
+                        BOOST_TEST(contents == "1");
+                        c2->connect();
+                        return true;
+                    });
+                c1->set_close_handler(
+                    [&chk, finish]
+                    () {
+                        MQTT_CHK("h_close_1");
+                        finish();
+                    });
+
+                c2->set_client_id("cid2");
+                c2->set_clean_session(true);
+                c2->set_connack_handler(
+                    [&chk, &c2]
+                    (bool /*sp*/, MQTT_NS::connect_return_code /*connack_return_code*/) {
+                        MQTT_CHK("h_connack_2");
+                        c2->subscribe("topic1", MQTT_NS::qos::at_most_once);
+                        return true;
+                    });
+                c2->set_suback_handler(
+                    []
+                    (packet_id_t /*packet_id*/, std::vector<MQTT_NS::suback_return_code> /*results*/) {
+                        return true;
+                    });
+                c2->set_publish_handler(
+                    [&chk, &c2]
+                    (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+                     MQTT_NS::publish_options pubopts,
+                     MQTT_NS::buffer /*topic*/,
+                     MQTT_NS::buffer contents) {
+                        MQTT_CHK("h_publish_2");
+                        BOOST_TEST(pubopts.get_retain() == MQTT_NS::retain::yes);
+                        BOOST_TEST(contents == "1");
+                        c2->disconnect();
+                        return true;
+                    });
+                c2->set_close_handler(
+                    [&chk, &c1]
+                    () {
+                        MQTT_CHK("h_close_2");
+                        c1->disconnect();
+                    });
+                c1->connect();
+            }
+        );
+        BOOST_TEST(chk.all());
+    }
+
+    // The recovered state is written as a new snapshot.
+    auto snap = snapshot_store::read(snapshot_path, 1);
+    BOOST_TEST(snap.has_value());
+    std::remove(wal_path.c_str());
+    std::remove(snapshot_path.c_str());
+}
+
+
+#if defined(__linux__)
+
+BOOST_AUTO_TEST_CASE( no_ack_after_failure ) {
+    boost::asio::io_context iocb;
+    test_broker b(iocb);
+    // Every write to /dev/full fails with ENOSPC.
+    BOOST_TEST(b.set_write_ahead_log(wal_config{ "/dev/full", std::chrono::milliseconds(20), 1024 * 1024 }));
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto finish =
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        };
+
+    boost::asio::io_context ioc;
+
+    auto c = MQTT_NS::make_client(ioc, broker_url, broker_notls_port);
+    c->set_client_id("cid1");
+    c->set_clean_session(true);
+
+    using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+
+    checker chk = {
+        // connect
+        cont("h_connack"),
+        // The message is not durable, so it is not acknowledged and the connection is closed.
+        cont("h_error"),
+    };
+
+    c->set_connack_handler(
+        [&chk, &c]
+        (bool /*sp*/, MQTT_NS::connect_return_code connack_return_code) {
+            MQTT_CHK("h_connack");
+            BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+            c->publish("topic1", "1", MQTT_NS::qos::at_least_once);
+            return true;
+        });
+    c->set_puback_handler(
+        []
+        (packet_id_t /*packet_id*/) {
+            BOOST_CHECK(false);
+            return true;
+        });
+    c->set_close_handler(
+        []
+        () {
+            BOOST_CHECK(false);
+        });
+    c->set_error_handler(
+        [&chk, &finish]
+        (MQTT_NS::error_code) {
+            MQTT_CHK("h_error");
+            finish();
+        });
+
+    c->connect();
+
+    ioc.run();
+    BOOST_TEST(chk.all());
+    th.join();
+}
+
+#endif // defined(__linux__)
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,345 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "test_main.hpp"
+#include "test_settings.hpp"
+#include "test_broker.hpp"
+#include "test_server_no_tls.hpp"
+#include "checker.hpp"
+
+#include <mqtt/client.hpp>
+
+BOOST_AUTO_TEST_SUITE(test_flow_control)
+
+using namespace MQTT_NS::literals;
+
+BOOST_AUTO_TEST_CASE( receive_maximum ) {
+    boost::asio::io_context iocb;
+    test_broker b(iocb);
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto finish =
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        };
+
+    boost::asio::io_context ioc;
+
+    auto c = MQTT_NS::make_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+    c->set_client_id("cid1");
+    c->set_clean_session(true);
+    // PUBACK is sent late, so the broker has to hold the next messages.
+    c->set_auto_pub_response(false);
+
+    using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+
+    checker chk = {
+        // connect
+        cont("h_connack"),
+        // subscribe topic1 QoS1
+        cont("h_suback"),
+        // publish topic1 QoS1 three times
+        // Each message arrives after the previous one is acknowledged.
+        cont("h_publish_1"),
+        cont("h_publish_2"),
+        cont("h_publish_3"),
+        // disconnect
+        cont("h_close"),
+    };
+
+    c->set_v5_connack_handler(
+        [&chk, &c]
+        (bool sp, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+            MQTT_CHK("h_connack");
+            BOOST_TEST(sp == false);
+            BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+            c->subscribe("topic1", MQTT_NS::qos::at_least_once);
+            return true;
+        });
+    c->set_v5_suback_handler(
+        [&chk, &c]
+        (packet_id_t /*packet_id*/, std::vector<MQTT_NS::v5::suback_reason_code> /*reasons*/, MQTT_NS::v5::properties /*props*/) {
+            MQTT_CHK("h_suback");
+            c->publish("topic1", "1", MQTT_NS::qos::at_least_once);
+            c->publish("topic1", "2", MQTT_NS::qos::at_least_once);
+            c->publish("topic1", "3", MQTT_NS::qos::at_least_once);
+            return true;
+        });
+    c->set_v5_puback_handler(
+        []
+        (packet_id_t /*packet_id*/, MQTT_NS::v5::puback_reason_code /*reason_code*/, MQTT_NS::v5::properties /*props*/) {
+            return true;
+        });
+
+    as::steady_timer tim(ioc);
+    std::size_t acked = 0;
+    c->set_v5_publish_handler(
+        [&chk, &c, &tim, &acked]
+        (MQTT_NS::optional<packet_id_t> packet_id,
+         MQTT_NS::publish_options pubopts,
+         MQTT_NS::buffer topic,
+         MQTT_NS::buffer contents,
+         MQTT_NS::v5::properties /*props*/) {
+            BOOST_TEST(pubopts.get_qos() == MQTT_NS::qos::at_least_once);
+            BOOST_TEST(topic == "topic1");
+            if (contents == "1") {
+                MQTT_CHK("h_publish_1");
+                BOOST_TEST(acked == 0);
+            }
+            else if (contents == "2") {
+                MQTT_CHK("h_publish_2");
+                BOOST_TEST(acked == 1);
+            }
+            else if (contents == "3") {
+                MQTT_CHK("h_publish_3");
+                BOOST_TEST(acked == 2);
+                c->puback(packet_id.value());
+                c->disconnect();
+                return true;
+            }
+            // Acknowledge later. The next message must not arrive before that.
+            tim.expires_after(std::chrono::milliseconds(100));
+            tim.async_wait(
+                [&c, &acked, packet_id](MQTT_NS::error_code ec) {
+                    BOOST_TEST(!ec);
+                    ++acked;
+                    c->puback(packet_id.value());
+                }
+            );
+            return true;
+        });
+    c->set_close_handler(
+        [&chk, &finish]
+        () {
+            MQTT_CHK("h_close");
+            finish();
+        });
+    c->set_error_handler(
+        []
+        (MQTT_NS::error_code) {
+            BOOST_CHECK(false);
+        });
+
+    c->connect(MQTT_NS::v5::properties{ MQTT_NS::v5::property::receive_maximum(1) });
+
+    ioc.run();
+    BOOST_TEST(chk.all());
+    th.join();
+}
+
+BOOST_AUTO_TEST_CASE( publish_rate_limit ) {
+    boost::asio::io_context iocb;
+    test_broker b(iocb);
+    publish_rate_limits limits;
+    limits.messages_per_second = 20;
+    b.set_publish_rate_limits(limits);
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto finish =
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        };
+
+    boost::asio::io_context ioc;
+
+    auto c = MQTT_NS::make_client(ioc, broker_url, broker_notls_port);
+    c->set_client_id("cid1");
+    c->set_clean_session(true);
+
+    using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+
+    std::size_t const num = 5;
+    std::size_t received = 0;
+    std::chrono::steady_clock::time_point start;
+
+    c->set_connack_handler(
+        [&c]
+        (bool /*sp*/, MQTT_NS::connect_return_code /*connack_return_code*/) {
+            c->subscribe("topic1", MQTT_NS::qos::at_most_once);
+            return true;
+        });
+    c->set_suback_handler(
+        [&c, &start, num]
+        (packet_id_t /*packet_id*/, std::vector<MQTT_NS::suback_return_code> /*results*/) {
+            start = std::chrono::steady_clock::now();
+            for (std::size_t i = 0; i != num; ++i) {
+                c->publish("topic1", std::to_string(i), MQTT_NS::qos::at_most_once);
+            }
+            return true;
+        });
+    c->set_publish_handler(
+        [&c, &received, &start, num]
+        (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+         MQTT_NS::publish_options /*pubopts*/,
+         MQTT_NS::buffer /*topic*/,
+         MQTT_NS::buffer contents) {
+            // The messages are delayed, not dropped.
+            BOOST_TEST(contents == std::to_string(received));
+            if (++received == num) {
+                // The first message takes the burst, and each of the others waits for 50ms.
+                BOOST_TEST((std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(150)));
+                c->disconnect();
+            }
+            return true;
+        });
+    c->set_close_handler(
+        [&finish]
+        () {
+            finish();
+        });
+    c->set_error_handler(
+        []
+        (MQTT_NS::error_code) {
+            BOOST_CHECK(false);
+        });
+
+    c->connect();
+
+    ioc.run();
+    BOOST_TEST(received == num);
+    th.join();
+}
+
+BOOST_AUTO_TEST_CASE( quota_exceeded ) {
+    boost::asio::io_context iocb;
+    test_broker b(iocb);
+    publish_rate_limits limits;
+    limits.messages_per_second = 5;
+    limits.reply_quota_exceeded = true;
+    b.set_publish_rate_limits(limits);
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto finish =
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        };
+
+    boost::asio::io_context ioc;
+
+    auto c = MQTT_NS::make_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+    c->set_client_id("cid1");
+    c->set_clean_session(true);
+
+    using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+
+    checker chk = {
+        // connect
+        cont("h_connack"),
+        // subscribe topic1 QoS0
+        cont("h_suback"),
+        // publish topic1 QoS1 twice
+        cont("h_publish"),
+        cont("h_puback_1"),
+        // The second message exceeds the rate, and is not delivered.
+        cont("h_puback_2"),
+        // disconnect
+        cont("h_close"),
+    };
+
+    packet_id_t pid1 = 0;
+    c->set_v5_connack_handler(
+        [&chk, &c]
+        (bool /*sp*/, MQTT_NS::v5::connect_reason_code /*connack_return_code*/, MQTT_NS::v5::properties /*props*/) {
+            MQTT_CHK("h_connack");
+            c->subscribe("topic1", MQTT_NS::qos::at_most_once);
+            return true;
+        });
+    c->set_v5_suback_handler(
+        [&chk, &c, &pid1]
+        (packet_id_t /*packet_id*/, std::vector<MQTT_NS::v5::suback_reason_code> /*reasons*/, MQTT_NS::v5::properties /*props*/) {
+            MQTT_CHK("h_suback");
+            pid1 = c->publish("topic1", "1", MQTT_NS::qos::at_least_once);
+            c->publish("topic1", "2", MQTT_NS::qos::at_least_once);
+            return true;
+        });
+    c->set_v5_publish_handler(
+        [&chk]
+        (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+         MQTT_NS::publish_options /*pubopts*/,
+         MQTT_NS::buffer /*topic*/,
+         MQTT_NS::buffer contents,
+         MQTT_NS::v5::properties /*props*/) {
+            MQTT_CHK("h_publish");
+            BOOST_TEST(contents == "1");
+            return true;
+        });
+    c->set_v5_puback_handler(
+        [&chk, &c, &pid1]
+        (packet_id_t packet_id, MQTT_NS::v5::puback_reason_code reason_code, MQTT_NS::v5::properties /*props*/) {
+            if (packet_id == pid1) {
+                MQTT_CHK("h_puback_1");
+                BOOST_TEST(reason_code == MQTT_NS::v5::puback_reason_code::success);
+            }
+            else {
+                MQTT_CHK("h_puback_2");
+                BOOST_TEST(reason_code == MQTT_NS::v5::puback_reason_code::quota_exceeded);
+                // The broker reads DISCONNECT after the pause.
+                c->disconnect();
+            }
+            return true;
+        });
+    c->set_close_handler(
+        [&chk, &finish]
+        () {
+            MQTT_CHK("h_close");
+            finish();
+        });
+    c->set_error_handler(
+        []
+        (MQTT_NS::error_code) {
+            BOOST_CHECK(false);
+        });
+
+    c->connect();
+
+    ioc.run();
+    BOOST_TEST(chk.all());
+    th.join();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
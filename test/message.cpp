@@ -290,6 +290,48 @@ BOOST_AUTO_TEST_CASE( publish_get_attributes2 ) {
     }
 }
 
+BOOST_AUTO_TEST_CASE( v5_publish_shared_props ) {
+    static const MQTT_NS::string_view topic("1234");
+    static const MQTT_NS::string_view payload("AB");
+    MQTT_NS::v5::properties props {
+        MQTT_NS::v5::property::content_type("text"_mb),
+        MQTT_NS::v5::property::user_property("key"_mb, "val"_mb)
+    };
+    auto m1 = MQTT_NS::v5::publish_message(
+        0x0102,
+        as::buffer(topic.data(), topic.size()),
+        as::buffer(payload.data(), payload.size()),
+        MQTT_NS::qos::at_least_once | MQTT_NS::retain::yes,
+        props
+    );
+    auto sp_props = MQTT_NS::v5::make_shared_properties(props);
+    auto m2 = MQTT_NS::v5::publish_message(
+        0x0102,
+        as::buffer(topic.data(), topic.size()),
+        as::buffer(payload.data(), payload.size()),
+        MQTT_NS::qos::at_least_once | MQTT_NS::retain::yes,
+        sp_props
+    );
+    BOOST_TEST(m2.size() == m1.size());
+    BOOST_TEST(m2.continuous_buffer() == m1.continuous_buffer());
+    BOOST_TEST(m2.props().size() == 2);
+
+    std::string cbs;
+    for (auto const& cb : m2.const_buffer_sequence()) {
+        cbs.append(MQTT_NS::get_pointer(cb), MQTT_NS::get_size(cb));
+    }
+    BOOST_TEST(m2.const_buffer_sequence().size() == m2.num_of_const_buffer_sequence());
+    BOOST_TEST(cbs == m1.continuous_buffer());
+
+    // The copies of the message refer to the same encoded properties.
+    auto m3 = m2;
+    BOOST_TEST(sp_props.use_count() == 3);
+    auto buf = MQTT_NS::allocate_buffer(m3.continuous_buffer());
+    auto parsed = MQTT_NS::v5::publish_message(buf);
+    BOOST_TEST(parsed.props().size() == 2);
+    BOOST_TEST(parsed.payload() == "AB");
+}
+
 BOOST_AUTO_TEST_CASE( subscribe_cbuf ) {
     static const MQTT_NS::string_view str("tp");
     auto m = MQTT_NS::subscribe_message({ { as::buffer(str.data(), str.size()), MQTT_NS::qos::at_least_once} }, 2);
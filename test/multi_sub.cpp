@@ -627,4 +627,475 @@ BOOST_AUTO_TEST_CASE( multi_client_qos1 ) {
     th.join();
 }
 
+BOOST_AUTO_TEST_CASE( fanout_chunk ) {
+    boost::asio::io_context iocb;
+    test_broker b(iocb);
+    // Each message is delivered to one subscriber at a time.
+    b.set_fanout_chunk_size(1);
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto finish =
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        };
+
+    boost::asio::io_context ioc;
+
+    std::size_t const num_clients = 3;
+    std::size_t const num_messages = 5;
+    std::vector<decltype(MQTT_NS::make_client(ioc, broker_url, broker_notls_port))> cs;
+    // The handlers refer to the elements.
+    cs.reserve(num_clients);
+    std::vector<std::size_t> received(num_clients);
+    std::size_t subscribed = 0;
+    std::size_t closed = 0;
+
+    using packet_id_t = typename std::remove_reference_t<decltype(*cs.front())>::packet_id_t;
+
+    for (std::size_t i = 0; i != num_clients; ++i) {
+        cs.push_back(MQTT_NS::make_client(ioc, broker_url, broker_notls_port));
+        auto& c = cs.back();
+        c->set_client_id("cid" + std::to_string(i));
+        c->set_clean_session(true);
+        c->set_connack_handler(
+            [&c]
+            (bool /*sp*/, MQTT_NS::connect_return_code /*connack_return_code*/) {
+                c->subscribe("topic1", MQTT_NS::qos::at_least_once);
+                return true;
+            });
+        c->set_suback_handler(
+            [&]
+            (packet_id_t /*packet_id*/, std::vector<MQTT_NS::suback_return_code> /*results*/) {
+                if (++subscribed != num_clients) return true;
+                for (std::size_t m = 0; m != num_messages; ++m) {
+                    cs.front()->publish("topic1", std::to_string(m), MQTT_NS::qos::at_least_once);
+                }
+                return true;
+            });
+        c->set_publish_handler(
+            [&, i]
+            (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+             MQTT_NS::publish_options /*pubopts*/,
+             MQTT_NS::buffer /*topic*/,
+             MQTT_NS::buffer contents) {
+                // Every subscriber receives the messages in the published order.
+                BOOST_TEST(contents == std::to_string(received[i]));
+                if (++received[i] == num_messages) cs[i]->disconnect();
+                return true;
+            });
+        c->set_close_handler(
+            [&]
+            () {
+                if (++closed == num_clients) finish();
+            });
+        c->set_error_handler(
+            []
+            (MQTT_NS::error_code) {
+                BOOST_CHECK(false);
+            });
+        c->connect();
+    }
+
+    ioc.run();
+    for (auto r : received) BOOST_TEST(r == num_messages);
+    th.join();
+}
+
+BOOST_AUTO_TEST_CASE( fanout_chunk_disconnect ) {
+    boost::asio::io_context iocb;
+    test_broker b(iocb);
+    // Each message is delivered to one subscriber at a time.
+    b.set_fanout_chunk_size(1);
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto finish =
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        };
+
+    boost::asio::io_context ioc;
+
+    // The subscribers that receive the message before the disconnected one.
+    std::size_t const num_others = 4;
+    std::vector<decltype(MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port))> others;
+    others.reserve(num_others);
+    auto sub = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port);
+    auto pub = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+
+    using packet_id_t = typename std::remove_reference_t<decltype(*sub)>::packet_id_t;
+
+    std::size_t subscribed = 0;
+    std::size_t received = 0;
+    std::size_t closed = 0;
+    bool resumed = false;
+
+    checker chk = {
+        cont("h_disconnected"),
+        cont("h_resumed"),
+        cont("h_queued"),
+        cont("h_marker"),
+    };
+
+    auto close_all =
+        [&] {
+            for (auto& c : others) c->async_disconnect();
+            pub->async_disconnect();
+            sub->async_disconnect();
+        };
+    auto on_close =
+        [&] {
+            if (++closed == num_others + 2) finish();
+        };
+
+    // sub subscribes after the others, so it receives the message in the last chunk.
+    sub->set_client_id("sub");
+    sub->set_clean_session(false);
+    sub->set_connack_handler(
+        [&]
+        (bool sp, MQTT_NS::connect_return_code /*connack_return_code*/) {
+            if (!resumed) {
+                BOOST_TEST(!sp);
+                sub->async_subscribe("topic1", MQTT_NS::qos::at_least_once);
+                return true;
+            }
+            MQTT_CHK("h_resumed");
+            BOOST_TEST(sp);
+            // The marker is delivered after the messages that are kept in the session.
+            sub->async_publish("topic1", "marker", MQTT_NS::qos::at_least_once);
+            return true;
+        });
+    sub->set_suback_handler(
+        [&]
+        (packet_id_t /*packet_id*/, std::vector<MQTT_NS::suback_return_code> /*results*/) {
+            pub->async_connect();
+            return true;
+        });
+    sub->set_publish_handler(
+        [&]
+        (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+         MQTT_NS::publish_options /*pubopts*/,
+         MQTT_NS::buffer /*topic*/,
+         MQTT_NS::buffer contents) {
+            BOOST_TEST(resumed);
+            if (chk.passed("h_queued")) {
+                MQTT_CHK("h_marker");
+                BOOST_TEST(contents == "marker");
+                close_all();
+                return true;
+            }
+            MQTT_CHK("h_queued");
+            BOOST_TEST(contents == "contents");
+            return true;
+        });
+    sub->set_close_handler(
+        [&]
+        () {
+            if (!resumed) {
+                MQTT_CHK("h_disconnected");
+                resumed = true;
+                sub->async_connect();
+                return;
+            }
+            on_close();
+        });
+    sub->set_error_handler(
+        []
+        (MQTT_NS::error_code) {
+            BOOST_CHECK(false);
+        });
+
+    for (std::size_t i = 0; i != num_others; ++i) {
+        others.push_back(MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port));
+        auto& c = others.back();
+        c->set_client_id("cid" + std::to_string(i));
+        c->set_clean_session(true);
+        c->set_connack_handler(
+            [&c]
+            (bool /*sp*/, MQTT_NS::connect_return_code /*connack_return_code*/) {
+                c->async_subscribe("topic1", MQTT_NS::qos::at_least_once);
+                return true;
+            });
+        c->set_suback_handler(
+            [&]
+            (packet_id_t /*packet_id*/, std::vector<MQTT_NS::suback_return_code> /*results*/) {
+                if (++subscribed == num_others) sub->async_connect();
+                return true;
+            });
+        c->set_publish_handler(
+            [&]
+            (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+             MQTT_NS::publish_options /*pubopts*/,
+             MQTT_NS::buffer /*topic*/,
+             MQTT_NS::buffer /*contents*/) {
+                ++received;
+                return true;
+            });
+        c->set_close_handler(on_close);
+        c->set_error_handler(
+            []
+            (MQTT_NS::error_code) {
+                BOOST_CHECK(false);
+            });
+        c->async_connect();
+    }
+
+    pub->set_client_id("pub");
+    pub->set_clean_start(true);
+    pub->set_v5_connack_handler(
+        [&]
+        (bool /*sp*/, MQTT_NS::v5::connect_reason_code /*reason_code*/, MQTT_NS::v5::properties /*props*/) {
+            pub->async_publish("topic1", "contents", MQTT_NS::qos::at_least_once);
+            return true;
+        });
+    pub->set_close_handler(on_close);
+    pub->set_error_handler(
+        []
+        (MQTT_NS::error_code) {
+            BOOST_CHECK(false);
+        });
+
+    // The broker is held before it starts the fan-out, until sub has sent DISCONNECT.
+    // The DISCONNECT is processed while the chunks of the other subscribers are delivered.
+    bool held = false;
+    b.set_publish_props_handler(
+        [&]
+        (MQTT_NS::v5::properties const& /*props*/) {
+            if (held) return;
+            held = true;
+            std::promise<void> sent;
+            as::post(
+                ioc,
+                [&] {
+                    sub->async_disconnect(
+                        [&](MQTT_NS::error_code) {
+                            sent.set_value();
+                        }
+                    );
+                }
+            );
+            sent.get_future().wait();
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        });
+
+    ioc.run();
+    BOOST_TEST(chk.all());
+    // The others receive the message at least.
+    BOOST_TEST(received >= num_others);
+    th.join();
+}
+
+BOOST_AUTO_TEST_CASE( fanout_chunk_reconnect ) {
+    boost::asio::io_context iocb;
+    test_broker b(iocb);
+    // Each message is delivered to one subscriber at a time.
+    b.set_fanout_chunk_size(1);
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto finish =
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        };
+
+    boost::asio::io_context ioc;
+
+    // The subscribers that receive the message before the reconnected one.
+    // The new connection is accepted while their chunks are delivered.
+    std::size_t const num_others = 20;
+    std::vector<decltype(MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port))> others;
+    others.reserve(num_others);
+    auto sub = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port);
+    // It resumes the session of sub on a new connection.
+    auto resumed = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port);
+    auto pub = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+
+    using packet_id_t = typename std::remove_reference_t<decltype(*sub)>::packet_id_t;
+
+    std::size_t subscribed = 0;
+    std::size_t closed = 0;
+    bool taken_over = false;
+
+    checker chk = {
+        cont("h_resumed"),
+        cont("h_delivered"),
+    };
+
+    auto on_close =
+        [&] {
+            if (++closed == num_others + 2) finish();
+        };
+
+    // sub subscribes after the others, so it receives the message in the last chunk.
+    sub->set_client_id("sub");
+    sub->set_clean_session(false);
+    sub->set_connack_handler(
+        [&]
+        (bool /*sp*/, MQTT_NS::connect_return_code /*connack_return_code*/) {
+            sub->async_subscribe("topic1", MQTT_NS::qos::at_least_once);
+            return true;
+        });
+    sub->set_suback_handler(
+        [&]
+        (packet_id_t /*packet_id*/, std::vector<MQTT_NS::suback_return_code> /*results*/) {
+            pub->async_connect();
+            return true;
+        });
+    sub->set_publish_handler(
+        []
+        (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+         MQTT_NS::publish_options /*pubopts*/,
+         MQTT_NS::buffer /*topic*/,
+         MQTT_NS::buffer /*contents*/) {
+            // The session has been taken over before the chunk of sub.
+            BOOST_CHECK(false);
+            return true;
+        });
+    sub->set_close_handler(
+        [&]
+        () {
+            taken_over = true;
+        });
+    sub->set_error_handler(
+        [&]
+        (MQTT_NS::error_code) {
+            taken_over = true;
+        });
+
+    resumed->set_client_id("sub");
+    resumed->set_clean_session(false);
+    resumed->set_connack_handler(
+        [&]
+        (bool sp, MQTT_NS::connect_return_code /*connack_return_code*/) {
+            MQTT_CHK("h_resumed");
+            BOOST_TEST(sp);
+            return true;
+        });
+    resumed->set_publish_handler(
+        [&]
+        (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+         MQTT_NS::publish_options /*pubopts*/,
+         MQTT_NS::buffer /*topic*/,
+         MQTT_NS::buffer contents) {
+            // The message of the fan-out that started before the reconnection is
+            // delivered to the new connection.
+            MQTT_CHK("h_delivered");
+            BOOST_TEST(contents == "contents");
+            for (auto& c : others) c->async_disconnect();
+            pub->async_disconnect();
+            resumed->async_disconnect();
+            return true;
+        });
+    resumed->set_close_handler(on_close);
+    resumed->set_error_handler(
+        []
+        (MQTT_NS::error_code) {
+            BOOST_CHECK(false);
+        });
+
+    for (std::size_t i = 0; i != num_others; ++i) {
+        others.push_back(MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port));
+        auto& c = others.back();
+        c->set_client_id("cid" + std::to_string(i));
+        c->set_clean_session(true);
+        c->set_connack_handler(
+            [&c]
+            (bool /*sp*/, MQTT_NS::connect_return_code /*connack_return_code*/) {
+                c->async_subscribe("topic1", MQTT_NS::qos::at_least_once);
+                return true;
+            });
+        c->set_suback_handler(
+            [&]
+            (packet_id_t /*packet_id*/, std::vector<MQTT_NS::suback_return_code> /*results*/) {
+                if (++subscribed == num_others) sub->async_connect();
+                return true;
+            });
+        c->set_close_handler(on_close);
+        c->set_error_handler(
+            []
+            (MQTT_NS::error_code) {
+                BOOST_CHECK(false);
+            });
+        c->async_connect();
+    }
+
+    pub->set_client_id("pub");
+    pub->set_clean_start(true);
+    pub->set_v5_connack_handler(
+        [&]
+        (bool /*sp*/, MQTT_NS::v5::connect_reason_code /*reason_code*/, MQTT_NS::v5::properties /*props*/) {
+            pub->async_publish("topic1", "contents", MQTT_NS::qos::at_least_once);
+            return true;
+        });
+    pub->set_close_handler(on_close);
+    pub->set_error_handler(
+        []
+        (MQTT_NS::error_code) {
+            BOOST_CHECK(false);
+        });
+
+    // The broker is held before it starts the fan-out, until the CONNECT of the new
+    // connection has been sent. The CONNECT is processed while the chunks of the other
+    // subscribers are delivered.
+    bool held = false;
+    b.set_publish_props_handler(
+        [&]
+        (MQTT_NS::v5::properties const& /*props*/) {
+            if (held) return;
+            held = true;
+            as::post(
+                ioc,
+                [&] {
+                    resumed->async_connect();
+                }
+            );
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        });
+
+    ioc.run();
+    BOOST_TEST(chk.all());
+    BOOST_TEST(taken_over);
+    th.join();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
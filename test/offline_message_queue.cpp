@@ -0,0 +1,316 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "test_main.hpp"
+#include "offline_message_queue.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(test_offline_message_queue)
+
+using namespace MQTT_NS::literals;
+
+namespace {
+
+offline_message make_message(std::string const& contents) {
+    return offline_message(
+        "topic1"_mb,
+        MQTT_NS::allocate_buffer(contents),
+        MQTT_NS::v5::make_shared_properties({}),
+        MQTT_NS::qos::at_least_once
+    );
+}
+
+std::vector<std::string> drain_contents(offline_message_queue& q) {
+    std::vector<std::string> ret;
+    q.drain(
+        [&](offline_message msg) {
+            ret.emplace_back(msg.contents.data(), msg.contents.size());
+        }
+    );
+    return ret;
+}
+
+bool file_exists(std::string const& path) {
+    return std::ifstream(path).good();
+}
+
+std::size_t file_size(std::string const& path) {
+    std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+    return static_cast<std::size_t>(ifs.tellg());
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE( unlimited ) {
+    offline_message_queue q;
+    offline_queue_limits limits;
+    for (auto const& c : { "1", "2", "3" }) q.push(limits, "cid1"_mb, make_message(c));
+    BOOST_TEST(q.size() == 3);
+    BOOST_TEST(q.memory_bytes() == 3 * (6 + 1));
+    BOOST_TEST(drain_contents(q) == (std::vector<std::string>{ "1", "2", "3" }));
+    BOOST_TEST(q.empty());
+    BOOST_TEST(q.memory_bytes() == 0);
+}
+
+BOOST_AUTO_TEST_CASE( max_messages_drop_newest ) {
+    offline_message_queue q;
+    offline_queue_limits limits;
+    limits.max_messages = 2;
+    limits.policy = offline_overflow::drop_newest;
+    for (auto const& c : { "1", "2", "3", "4" }) q.push(limits, "cid1"_mb, make_message(c));
+    BOOST_TEST(q.size() == 2);
+    BOOST_TEST(q.dropped() == 2);
+    BOOST_TEST(drain_contents(q) == (std::vector<std::string>{ "1", "2" }));
+}
+
+BOOST_AUTO_TEST_CASE( max_bytes_drop_oldest ) {
+    offline_message_queue q;
+    offline_queue_limits limits;
+    limits.max_bytes = 20; // topic1 (6 bytes) + contents
+    limits.policy = offline_overflow::drop_oldest;
+    for (auto const& c : { "1", "2", "3", "4" }) q.push(limits, "cid1"_mb, make_message(c));
+    BOOST_TEST(q.size() == 2);
+    BOOST_TEST(q.dropped() == 2);
+    // A message that is larger than the limit is never queued.
+    q.push(limits, "cid1"_mb, make_message("0123456789abcdef"));
+    BOOST_TEST(q.dropped() == 5);
+    BOOST_TEST(drain_contents(q) == std::vector<std::string>{});
+}
+
+BOOST_AUTO_TEST_CASE( spill ) {
+    offline_message_queue q;
+    offline_queue_limits limits;
+    limits.max_messages = 2;
+    limits.spill_dir.emplace(".");
+    q.push(
+        limits,
+        "cid1"_mb,
+        offline_message(
+            "topic1"_mb,
+            "1"_mb,
+            MQTT_NS::v5::make_shared_properties({}),
+            MQTT_NS::qos::at_most_once
+        )
+    );
+    q.push(limits, "cid1"_mb, make_message("2"));
+    q.push(
+        limits,
+        "cid1"_mb,
+        offline_message(
+            "topic2"_mb,
+            "3"_mb,
+            MQTT_NS::v5::make_shared_properties(
+                MQTT_NS::v5::properties{
+                    MQTT_NS::v5::property::content_type("text"_mb),
+                    MQTT_NS::v5::property::user_property("key"_mb, "val"_mb)
+                }
+            ),
+            MQTT_NS::qos::exactly_once | MQTT_NS::retain::yes
+        )
+    );
+    q.push(limits, "cid1"_mb, make_message("4"));
+    BOOST_TEST(q.size() == 4);
+    BOOST_TEST(q.spilled() == 2);
+    BOOST_TEST(q.dropped() == 0);
+    // hex encoded client id
+    BOOST_TEST(file_exists("./63696431.seg"));
+
+    std::vector<offline_message> msgs;
+    q.drain(
+        [&](offline_message msg) {
+            msgs.emplace_back(MQTT_NS::force_move(msg));
+        }
+    );
+    BOOST_TEST(!file_exists("./63696431.seg"));
+    BOOST_TEST(q.empty());
+    BOOST_TEST(msgs.size() == 4);
+    BOOST_TEST(msgs[0].contents == "1");
+    BOOST_TEST(msgs[0].pubopts.get_qos() == MQTT_NS::qos::at_most_once);
+    BOOST_TEST(msgs[1].contents == "2");
+    BOOST_TEST(msgs[2].topic == "topic2");
+    BOOST_TEST(msgs[2].contents == "3");
+    BOOST_TEST(msgs[2].pubopts.get_qos() == MQTT_NS::qos::exactly_once);
+    BOOST_TEST(msgs[2].pubopts.get_retain() == MQTT_NS::retain::yes);
+    BOOST_TEST(msgs[2].props->get().size() == 2);
+    BOOST_TEST(msgs[3].contents == "4");
+}
+
+BOOST_AUTO_TEST_CASE( spill_limit_drop_oldest ) {
+    offline_message_queue q;
+    offline_queue_limits limits;
+    limits.max_messages = 1;
+    limits.policy = offline_overflow::drop_oldest;
+    limits.spill_dir.emplace(".");
+    // One record is 1 + 8 + 4 + 6 + 4 + 0 + 4 + 1 = 28 bytes.
+    limits.max_spill_bytes = 56;
+    for (auto const& c : { "1", "2", "3", "4", "5" }) q.push(limits, "cid2"_mb, make_message(c));
+    BOOST_TEST(q.size() == 3);
+    BOOST_TEST(q.spilled() == 2);
+    BOOST_TEST(q.dropped() == 2);
+    BOOST_TEST(drain_contents(q) == (std::vector<std::string>{ "3", "4", "5" }));
+    BOOST_TEST(!file_exists("./63696432.seg"));
+}
+
+BOOST_AUTO_TEST_CASE( expiry ) {
+    offline_message_queue q;
+    offline_queue_limits limits;
+    limits.max_messages = 2;
+    limits.spill_dir.emplace(".");
+    auto now = std::chrono::steady_clock::now();
+    auto push =
+        [&](std::string const& contents, std::chrono::steady_clock::time_point expiry) {
+            auto msg = make_message(contents);
+            msg.expiry.emplace(expiry);
+            q.push(limits, "cid4"_mb, MQTT_NS::force_move(msg));
+        };
+    push("1", now - std::chrono::seconds(1));
+    push("2", now + std::chrono::hours(1));
+    // spilled
+    push("3", now - std::chrono::seconds(1));
+    push("4", now + std::chrono::hours(2));
+    auto next = q.prune(now);
+    BOOST_TEST(next.has_value());
+    BOOST_TEST((next.value() == now + std::chrono::hours(1)));
+    BOOST_TEST(q.size() == 3);
+
+    std::vector<offline_message> msgs;
+    q.drain(
+        [&](offline_message msg) {
+            msgs.emplace_back(MQTT_NS::force_move(msg));
+        }
+    );
+    BOOST_TEST(msgs.size() == 2);
+    BOOST_TEST(msgs[0].contents == "2");
+    BOOST_TEST(msgs[1].contents == "4");
+    BOOST_TEST(msgs[1].expiry.has_value());
+    BOOST_TEST((msgs[1].expiry.value() == now + std::chrono::hours(2)));
+}
+
+BOOST_AUTO_TEST_CASE( drain_while ) {
+    offline_message_queue q;
+    offline_queue_limits limits;
+    limits.max_messages = 2;
+    limits.spill_dir.emplace(".");
+    for (auto const& c : { "1", "2", "3", "4", "5" }) q.push(limits, "cid5"_mb, make_message(c));
+    BOOST_TEST(q.spilled() == 3);
+
+    std::vector<std::string> ret;
+    std::size_t allowed = 3;
+    auto drain =
+        [&] {
+            q.drain_while(
+                limits,
+                [&](offline_message const&) { return allowed != 0; },
+                [&](offline_message msg) {
+                    --allowed;
+                    ret.emplace_back(msg.contents.data(), msg.contents.size());
+                }
+            );
+        };
+    drain();
+    BOOST_TEST(ret == (std::vector<std::string>{ "1", "2", "3" }));
+    BOOST_TEST(q.size() == 2);
+    BOOST_TEST(q.spilled() == 1);
+
+    allowed = 10;
+    drain();
+    BOOST_TEST(ret == (std::vector<std::string>{ "1", "2", "3", "4", "5" }));
+    BOOST_TEST(q.empty());
+    BOOST_TEST(!file_exists("./63696435.seg"));
+}
+
+BOOST_AUTO_TEST_CASE( clear_removes_segment ) {
+    offline_message_queue q;
+    offline_queue_limits limits;
+    limits.max_messages = 1;
+    limits.spill_dir.emplace(".");
+    for (auto const& c : { "1", "2" }) q.push(limits, "cid3"_mb, make_message(c));
+    BOOST_TEST(file_exists("./63696433.seg"));
+    q.clear();
+    BOOST_TEST(!file_exists("./63696433.seg"));
+    BOOST_TEST(q.empty());
+}
+
+BOOST_AUTO_TEST_CASE( move_takes_segment ) {
+    static_assert(!std::is_copy_constructible<offline_message_queue>::value, "");
+    offline_message_queue q1;
+    offline_queue_limits limits;
+    limits.max_messages = 1;
+    limits.spill_dir.emplace(".");
+    for (auto const& c : { "1", "2" }) q1.push(limits, "cid4"_mb, make_message(c));
+    BOOST_TEST(q1.spilled() == 1);
+
+    auto q2 = MQTT_NS::force_move(q1);
+    // The moved-from queue doesn't refer to the segment file any more.
+    BOOST_TEST(q1.empty());
+    BOOST_TEST(q1.spilled() == 0);
+    BOOST_TEST(q1.memory_bytes() == 0);
+    q1.clear();
+    BOOST_TEST(file_exists("./63696434.seg"));
+
+    // The assigned queue removes its own segment file.
+    offline_message_queue q3;
+    for (auto const& c : { "3", "4" }) q3.push(limits, "cid5"_mb, make_message(c));
+    BOOST_TEST(file_exists("./63696435.seg"));
+    q3 = MQTT_NS::force_move(q2);
+    BOOST_TEST(!file_exists("./63696435.seg"));
+    BOOST_TEST(q2.empty());
+    BOOST_TEST(drain_contents(q3) == (std::vector<std::string>{ "1", "2" }));
+    BOOST_TEST(!file_exists("./63696434.seg"));
+}
+
+BOOST_AUTO_TEST_CASE( spill_compaction ) {
+    offline_message_queue q;
+    offline_queue_limits limits;
+    limits.max_messages = 1;
+    limits.spill_dir.emplace(".");
+    limits.spill_compact_bytes = 100;
+
+    std::vector<std::string> ret;
+    auto drain_one =
+        [&] {
+            bool allowed = true;
+            q.drain_while(
+                limits,
+                [&](offline_message const&) { return allowed; },
+                [&](offline_message msg) {
+                    allowed = false;
+                    ret.emplace_back(msg.contents.data(), msg.contents.size());
+                }
+            );
+        };
+
+    std::vector<std::string> expected;
+    for (int i = 0; i != 3; ++i) {
+        auto c = std::to_string(i);
+        q.push(limits, "cid6"_mb, make_message(c));
+        expected.push_back(c);
+    }
+    std::size_t max_size = 0;
+    // The head of the segment file is consumed as fast as the tail is appended,
+    // so the segment file is never removed.
+    for (int i = 3; i != 200; ++i) {
+        auto c = std::to_string(i);
+        q.push(limits, "cid6"_mb, make_message(c));
+        expected.push_back(c);
+        BOOST_TEST(q.spilled() == 3);
+        max_size = std::max(max_size, file_size("./63696436.seg"));
+        drain_one();
+    }
+    // A record is 30 bytes or so. Without the compaction the file would grow to about 6000 bytes.
+    BOOST_TEST(max_size <= 200);
+    while (!q.empty()) drain_one();
+    BOOST_TEST(ret == expected);
+    BOOST_TEST(q.empty());
+    BOOST_TEST(!file_exists("./63696436.seg"));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,538 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_TEST_OFFLINE_MESSAGE_QUEUE_HPP)
+#define MQTT_TEST_OFFLINE_MESSAGE_QUEUE_HPP
+
+#include <mqtt/variant.hpp> // should be top to configure variant limit
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <mqtt/buffer.hpp>
+#include <mqtt/four_byte_util.hpp>
+#include <mqtt/optional.hpp>
+#include <mqtt/property_parse.hpp>
+#include <mqtt/property_variant.hpp>
+#include <mqtt/publish.hpp>
+#include <mqtt/shared_properties.hpp>
+
+/**
+ * @brief What to do with a message that doesn't fit into an offline queue.
+ */
+enum class offline_overflow {
+    drop_oldest, ///< Discard the oldest queued message to make room for the new one.
+    drop_newest, ///< Discard the new message.
+};
+
+/**
+ * @brief Per session limits of the messages that are held for a disconnected client.
+ *
+ * 0 means unlimited for all of the size limits.
+ * If spill_dir is set, messages that exceed max_messages or max_bytes are appended to
+ * a per session segment file in that directory instead of being dropped. The overflow
+ * policy is applied only when the unread part of the segment file reaches max_spill_bytes.
+ * The consumed head of the segment file is cut off when it reaches spill_compact_bytes and
+ * it is not smaller than the unread part, so the file stays within about
+ * max(2 * max_spill_bytes, spill_compact_bytes + max_spill_bytes).
+ */
+struct offline_queue_limits {
+    std::size_t max_messages = 0;
+    std::size_t max_bytes = 0;
+    offline_overflow policy = offline_overflow::drop_oldest;
+    MQTT_NS::optional<std::string> spill_dir;
+    std::size_t max_spill_bytes = 0;
+    std::size_t spill_compact_bytes = 64 * 1024;
+};
+
+// A message that is waiting for its (currently disconnected) subscriber.
+struct offline_message {
+    offline_message(
+        MQTT_NS::buffer topic,
+        MQTT_NS::buffer contents,
+        MQTT_NS::v5::shared_properties props,
+        MQTT_NS::publish_options pubopts,
+        MQTT_NS::optional<std::chrono::steady_clock::time_point> expiry = MQTT_NS::nullopt)
+        :topic(MQTT_NS::force_move(topic)),
+         contents(MQTT_NS::force_move(contents)),
+         props(MQTT_NS::force_move(props)),
+         pubopts(pubopts),
+         expiry(expiry) {}
+
+    // The accounted size. Properties are shared between the queues, so they are not counted.
+    std::size_t size() const {
+        return topic.size() + contents.size();
+    }
+
+    MQTT_NS::buffer topic;
+    MQTT_NS::buffer contents;
+    MQTT_NS::v5::shared_properties props;
+    MQTT_NS::publish_options pubopts;
+    // The time when the message expires. It comes from the message expiry interval property.
+    MQTT_NS::optional<std::chrono::steady_clock::time_point> expiry;
+};
+
+/**
+ * @brief Bounded queue of the messages for a disconnected session.
+ *
+ * The head of the queue is held in memory. When the limits are exceeded and spilling
+ * is enabled, the tail is appended to a segment file. The order of the messages is
+ * preserved, and drain() streams the segment file record by record.
+ * The segment file is kept open while the queue has spilled messages.
+ *
+ * Segment record format (integers are big endian):
+ *   pubopts(1) expiry(8) topic_len(4) topic props_len(4) props contents_len(4) contents
+ * expiry is the count of steady_clock::duration since the epoch of steady_clock, or 0 if
+ * the message doesn't expire. Segment files are not valid across the processes.
+ */
+class offline_message_queue {
+public:
+    offline_message_queue() = default;
+
+    // The segment file is owned by one queue. A copy would share it.
+    offline_message_queue(offline_message_queue const&) = delete;
+    offline_message_queue& operator=(offline_message_queue const&) = delete;
+
+    // The moved-from queue is left empty without the segment file.
+    offline_message_queue(offline_message_queue&& other)
+        :messages_(MQTT_NS::force_move(other.messages_)),
+         bytes_(std::exchange(other.bytes_, 0)),
+         dropped_(std::exchange(other.dropped_, 0)),
+         spill_path_(MQTT_NS::force_move(other.spill_path_)),
+         spill_(MQTT_NS::force_move(other.spill_)),
+         spill_messages_(std::exchange(other.spill_messages_, 0)),
+         spill_read_pos_(std::exchange(other.spill_read_pos_, 0)),
+         spill_bytes_(std::exchange(other.spill_bytes_, 0)) {
+        other.messages_.clear();
+        other.spill_path_.clear();
+    }
+
+    offline_message_queue& operator=(offline_message_queue&& other) {
+        if (this == &other) return *this;
+        clear();
+        messages_ = MQTT_NS::force_move(other.messages_);
+        other.messages_.clear();
+        bytes_ = std::exchange(other.bytes_, 0);
+        dropped_ = std::exchange(other.dropped_, 0);
+        spill_path_ = MQTT_NS::force_move(other.spill_path_);
+        other.spill_path_.clear();
+        spill_ = MQTT_NS::force_move(other.spill_);
+        spill_messages_ = std::exchange(other.spill_messages_, 0);
+        spill_read_pos_ = std::exchange(other.spill_read_pos_, 0);
+        spill_bytes_ = std::exchange(other.spill_bytes_, 0);
+        return *this;
+    }
+
+    /**
+     * @brief Add a message to the tail of the queue.
+     * @param limits limits that are applied to this queue
+     * @param client_id client id of the owner session. Used to name the segment file.
+     * @param msg message to add
+     */
+    void push(offline_queue_limits const& limits, MQTT_NS::buffer const& client_id, offline_message msg) {
+        if (spill_messages_ == 0 && fits(limits, msg.size())) {
+            push_memory(MQTT_NS::force_move(msg));
+            return;
+        }
+        if (limits.spill_dir) {
+            if (spill_path_.empty()) spill_path_ = make_spill_path(limits.spill_dir.value(), client_id);
+            if (limits.max_spill_bytes == 0 ||
+                spill_bytes_ - spill_read_pos_ + record_size(msg) <= limits.max_spill_bytes) {
+                append_spill(msg);
+                return;
+            }
+        }
+        switch (limits.policy) {
+        case offline_overflow::drop_newest:
+            ++dropped_;
+            break;
+        case offline_overflow::drop_oldest:
+            if (empty()) {
+                // The message doesn't fit even into an empty queue.
+                ++dropped_;
+                break;
+            }
+            drop_front(limits);
+            ++dropped_;
+            refill(limits);
+            push(limits, client_id, MQTT_NS::force_move(msg));
+            break;
+        }
+    }
+
+    /**
+     * @brief Pass all the queued messages that have not expired to the function in order,
+     *        and clear the queue.
+     * @param f function that is called as f(offline_message&&)
+     */
+    template <typename Func>
+    void drain(Func&& f) {
+        auto now = std::chrono::steady_clock::now();
+        while (!messages_.empty()) {
+            auto msg = MQTT_NS::force_move(messages_.front());
+            pop_memory();
+            if (expired(msg, now)) continue;
+            f(MQTT_NS::force_move(msg));
+        }
+        if (spill_messages_ != 0) {
+            seek_read();
+            while (spill_messages_ != 0) {
+                auto msg = read_record(*spill_);
+                if (!msg) break;
+                --spill_messages_;
+                if (expired(msg.value(), now)) continue;
+                f(MQTT_NS::force_move(msg.value()));
+            }
+        }
+        clear();
+    }
+
+    /**
+     * @brief Pass the queued messages that have not expired to the function in order
+     *        as long as the predicate allows, and remove them from the queue.
+     *        The head of the segment file is moved to memory as the queue is consumed.
+     * @param limits limits that are applied to this queue
+     * @param pred predicate that is called as pred(offline_message const&) before each message is passed.
+     *        If it returns false, the message stays at the head of the queue and draining stops.
+     * @param f function that is called as f(offline_message&&)
+     */
+    template <typename Pred, typename Func>
+    void drain_while(offline_queue_limits const& limits, Pred&& pred, Func&& f) {
+        auto now = std::chrono::steady_clock::now();
+        while (true) {
+            if (messages_.empty()) {
+                if (spill_messages_ == 0) break;
+                refill(limits);
+                if (messages_.empty()) {
+                    // The head of the segment file doesn't fit into memory by itself.
+                    auto msg = pop_spill(limits);
+                    if (!msg) break;
+                    push_memory(MQTT_NS::force_move(msg.value()));
+                }
+            }
+            if (expired(messages_.front(), now)) {
+                pop_memory();
+                continue;
+            }
+            if (!pred(static_cast<offline_message const&>(messages_.front()))) break;
+            bytes_ -= messages_.front().size();
+            auto msg = MQTT_NS::force_move(messages_.front());
+            messages_.pop_front();
+            f(MQTT_NS::force_move(msg));
+        }
+    }
+
+    /**
+     * @brief Pass all the queued messages that have not expired to the function in order.
+     *        The queue is not changed.
+     * @param f function that is called as f(offline_message const&)
+     */
+    template <typename Func>
+    void for_each(Func&& f) const {
+        auto now = std::chrono::steady_clock::now();
+        for (auto const& msg : messages_) {
+            if (!expired(msg, now)) f(msg);
+        }
+        if (spill_messages_ != 0) {
+            seek_read();
+            for (std::size_t i = 0; i != spill_messages_; ++i) {
+                auto msg = read_record(*spill_);
+                if (!msg) break;
+                if (!expired(msg.value(), now)) f(static_cast<offline_message const&>(msg.value()));
+            }
+        }
+    }
+
+    /**
+     * @brief Remove the expired messages that are held in memory.
+     *        The expired messages in the segment file are removed by drain().
+     * @param now current time
+     * @return the earliest expiry of the messages that remain in memory
+     */
+    MQTT_NS::optional<std::chrono::steady_clock::time_point> prune(std::chrono::steady_clock::time_point now) {
+        MQTT_NS::optional<std::chrono::steady_clock::time_point> next;
+        auto it = std::remove_if(
+            messages_.begin(),
+            messages_.end(),
+            [&](offline_message const& msg) {
+                if (expired(msg, now)) {
+                    bytes_ -= msg.size();
+                    return true;
+                }
+                if (msg.expiry && (!next || msg.expiry.value() < next.value())) next = msg.expiry;
+                return false;
+            }
+        );
+        messages_.erase(it, messages_.end());
+        return next;
+    }
+
+    /**
+     * @brief Discard all the queued messages including the segment file.
+     */
+    void clear() {
+        messages_.clear();
+        bytes_ = 0;
+        spill_.reset();
+        if (!spill_path_.empty()) {
+            std::remove(spill_path_.c_str());
+            spill_path_.clear();
+        }
+        spill_messages_ = 0;
+        spill_read_pos_ = 0;
+        spill_bytes_ = 0;
+    }
+
+    bool empty() const {
+        return messages_.empty() && spill_messages_ == 0;
+    }
+
+    // Number of the messages, both in memory and in the segment file.
+    std::size_t size() const {
+        return messages_.size() + spill_messages_;
+    }
+
+    // Accounted bytes of the messages in memory.
+    std::size_t memory_bytes() const {
+        return bytes_;
+    }
+
+    std::size_t spilled() const {
+        return spill_messages_;
+    }
+
+    std::size_t dropped() const {
+        return dropped_;
+    }
+
+private:
+    static bool expired(offline_message const& msg, std::chrono::steady_clock::time_point now) {
+        return msg.expiry && msg.expiry.value() <= now;
+    }
+
+    bool fits(offline_queue_limits const& limits, std::size_t size) const {
+        return
+            (limits.max_messages == 0 || messages_.size() < limits.max_messages) &&
+            (limits.max_bytes == 0 || bytes_ + size <= limits.max_bytes);
+    }
+
+    void push_memory(offline_message msg) {
+        bytes_ += msg.size();
+        messages_.emplace_back(MQTT_NS::force_move(msg));
+    }
+
+    void pop_memory() {
+        bytes_ -= messages_.front().size();
+        messages_.pop_front();
+    }
+
+    static std::string make_spill_path(std::string const& dir, MQTT_NS::buffer const& client_id) {
+        // client_id can contain any UTF-8 character, so it is hex encoded to make a portable file name.
+        static constexpr char const hex[] = "0123456789abcdef";
+        std::string path = dir;
+        path.push_back('/');
+        for (auto c : client_id) {
+            path.push_back(hex[(static_cast<unsigned char>(c) >> 4) & 0x0f]);
+            path.push_back(hex[static_cast<unsigned char>(c) & 0x0f]);
+        }
+        path += ".seg";
+        return path;
+    }
+
+    static std::size_t record_size(offline_message const& msg) {
+        return 1 + 8 + 4 + msg.topic.size() + 4 + (msg.props ? msg.props->size() : 0) + 4 + msg.contents.size();
+    }
+
+    void append_spill(offline_message const& msg) {
+        std::string rec;
+        rec.reserve(record_size(msg));
+        rec.push_back(static_cast<char>(static_cast<std::uint8_t>(msg.pubopts)));
+        auto expiry = msg.expiry ? static_cast<std::uint64_t>(msg.expiry.value().time_since_epoch().count()) : 0;
+        MQTT_NS::add_uint32_t_to_buf(rec, static_cast<std::uint32_t>(expiry >> 32));
+        MQTT_NS::add_uint32_t_to_buf(rec, static_cast<std::uint32_t>(expiry));
+        MQTT_NS::add_uint32_t_to_buf(rec, static_cast<std::uint32_t>(msg.topic.size()));
+        rec.append(msg.topic.data(), msg.topic.size());
+        // The properties are already encoded.
+        std::size_t ps = msg.props ? msg.props->size() : 0;
+        MQTT_NS::add_uint32_t_to_buf(rec, static_cast<std::uint32_t>(ps));
+        if (ps != 0) {
+            auto encoded = msg.props->encoded();
+            rec.append(static_cast<char const*>(encoded.data()), encoded.size());
+        }
+        MQTT_NS::add_uint32_t_to_buf(rec, static_cast<std::uint32_t>(msg.contents.size()));
+        rec.append(msg.contents.data(), msg.contents.size());
+
+        if (!spill_) open_spill(std::ios::trunc);
+        spill_->clear();
+        spill_->seekp(static_cast<std::streamoff>(spill_bytes_));
+        if (!spill_->write(rec.data(), static_cast<std::streamsize>(rec.size()))) {
+            ++dropped_;
+            return;
+        }
+        spill_bytes_ += rec.size();
+        ++spill_messages_;
+    }
+
+    // Remove the oldest message. It is in memory unless all the messages are in the segment file.
+    void drop_front(offline_queue_limits const& limits) {
+        if (!messages_.empty()) {
+            pop_memory();
+            return;
+        }
+        pop_spill(limits);
+    }
+
+    // Remove the message at the head of the segment file.
+    MQTT_NS::optional<offline_message> pop_spill(offline_queue_limits const& limits) {
+        seek_read();
+        auto msg = read_record(*spill_);
+        if (!msg) {
+            // The segment file is broken. Nothing can be recovered from it.
+            spill_messages_ = 0;
+        }
+        else {
+            spill_read_pos_ = static_cast<std::uint64_t>(spill_->tellg());
+            --spill_messages_;
+        }
+        consumed_spill(limits);
+        return msg;
+    }
+
+    // Move messages from the head of the segment file to memory as long as they fit.
+    void refill(offline_queue_limits const& limits) {
+        if (spill_messages_ == 0) return;
+        seek_read();
+        while (spill_messages_ != 0) {
+            auto msg = read_record(*spill_);
+            if (!msg) {
+                spill_messages_ = 0;
+                break;
+            }
+            if (!fits(limits, msg.value().size())) break;
+            spill_read_pos_ = static_cast<std::uint64_t>(spill_->tellg());
+            --spill_messages_;
+            push_memory(MQTT_NS::force_move(msg.value()));
+        }
+        consumed_spill(limits);
+    }
+
+    void open_spill(std::ios::openmode mode) {
+        spill_ = std::make_unique<std::fstream>(spill_path_, std::ios::in | std::ios::out | std::ios::binary | mode);
+    }
+
+    // The previous read may have hit the end of the file, so the state is cleared before seeking.
+    void seek_read() const {
+        spill_->clear();
+        spill_->seekg(static_cast<std::streamoff>(spill_read_pos_));
+    }
+
+    // Called after the head of the segment file is consumed.
+    void consumed_spill(offline_queue_limits const& limits) {
+        if (spill_path_.empty()) return;
+        if (spill_messages_ == 0) {
+            spill_.reset();
+            std::remove(spill_path_.c_str());
+            spill_read_pos_ = 0;
+            spill_bytes_ = 0;
+            return;
+        }
+        if (spill_read_pos_ >= limits.spill_compact_bytes &&
+            spill_read_pos_ >= spill_bytes_ - spill_read_pos_) {
+            compact_spill();
+        }
+    }
+
+    // Copy the unread part of the segment file to a new file that replaces it.
+    // If it fails, the current file is used as it is.
+    void compact_spill() {
+        auto tmp_path = spill_path_ + ".tmp";
+        {
+            std::ofstream ofs(tmp_path, std::ios::binary | std::ios::trunc);
+            seek_read();
+            char buf[4096];
+            auto remaining = spill_bytes_ - spill_read_pos_;
+            while (remaining != 0 && ofs) {
+                auto len = static_cast<std::streamsize>(std::min<std::uint64_t>(remaining, sizeof(buf)));
+                if (!spill_->read(buf, len)) break;
+                ofs.write(buf, len);
+                remaining -= static_cast<std::uint64_t>(len);
+            }
+            if (remaining != 0 || !ofs.flush()) {
+                ofs.close();
+                std::remove(tmp_path.c_str());
+                return;
+            }
+        }
+        spill_.reset();
+        if (std::rename(tmp_path.c_str(), spill_path_.c_str()) != 0) {
+            std::remove(tmp_path.c_str());
+        }
+        else {
+            spill_bytes_ -= spill_read_pos_;
+            spill_read_pos_ = 0;
+        }
+        open_spill(std::ios::openmode());
+    }
+
+    static MQTT_NS::optional<MQTT_NS::buffer> read_field(std::istream& ifs) {
+        char len_buf[4];
+        if (!ifs.read(len_buf, sizeof(len_buf))) return MQTT_NS::nullopt;
+        auto len = MQTT_NS::make_uint32_t(std::begin(len_buf), std::end(len_buf));
+        auto spa = MQTT_NS::make_shared_ptr_array(len);
+        auto ptr = spa.get();
+        if (len != 0 && !ifs.read(ptr, static_cast<std::streamsize>(len))) return MQTT_NS::nullopt;
+        return MQTT_NS::buffer(MQTT_NS::string_view(ptr, len), MQTT_NS::force_move(spa));
+    }
+
+    static MQTT_NS::optional<offline_message> read_record(std::istream& ifs) {
+        char pubopts;
+        if (!ifs.get(pubopts)) return MQTT_NS::nullopt;
+        char expiry_buf[8];
+        if (!ifs.read(expiry_buf, sizeof(expiry_buf))) return MQTT_NS::nullopt;
+        auto expiry_count =
+            (static_cast<std::uint64_t>(MQTT_NS::make_uint32_t(expiry_buf, expiry_buf + 4)) << 32) |
+            MQTT_NS::make_uint32_t(expiry_buf + 4, expiry_buf + 8);
+        MQTT_NS::optional<std::chrono::steady_clock::time_point> expiry;
+        if (expiry_count != 0) {
+            expiry.emplace(
+                std::chrono::steady_clock::duration(
+                    static_cast<std::chrono::steady_clock::duration::rep>(expiry_count)
+                )
+            );
+        }
+        auto topic = read_field(ifs);
+        if (!topic) return MQTT_NS::nullopt;
+        auto props_buf = read_field(ifs);
+        if (!props_buf) return MQTT_NS::nullopt;
+        auto contents = read_field(ifs);
+        if (!contents) return MQTT_NS::nullopt;
+        return offline_message(
+            MQTT_NS::force_move(topic.value()),
+            MQTT_NS::force_move(contents.value()),
+            MQTT_NS::v5::make_shared_properties(MQTT_NS::v5::property::parse(MQTT_NS::force_move(props_buf.value()))),
+            MQTT_NS::publish_options(static_cast<std::uint8_t>(pubopts)),
+            expiry
+        );
+    }
+
+    std::deque<offline_message> messages_;
+    std::size_t bytes_ = 0;
+    std::size_t dropped_ = 0;
+    std::string spill_path_;
+    // The stream is held by the pointer, so the moved-from queue doesn't keep it.
+    std::unique_ptr<std::fstream> spill_;
+    std::size_t spill_messages_ = 0;
+    std::uint64_t spill_read_pos_ = 0;
+    std::uint64_t spill_bytes_ = 0;
+};
+
+#endif // MQTT_TEST_OFFLINE_MESSAGE_QUEUE_HPP
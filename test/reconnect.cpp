@@ -0,0 +1,382 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "test_main.hpp"
+#include "combi_test.hpp"
+#include "checker.hpp"
+
+BOOST_AUTO_TEST_SUITE(test_reconnect)
+
+using namespace MQTT_NS::literals;
+
+BOOST_AUTO_TEST_CASE( backoff ) {
+    MQTT_NS::reconnect_policy policy;
+    policy.base_delay = std::chrono::milliseconds(10);
+    policy.max_delay = std::chrono::milliseconds(100);
+    MQTT_NS::decorrelated_jitter_backoff b(policy, 1);
+    auto prev = policy.base_delay;
+    for (std::size_t i = 0; i != 100; ++i) {
+        auto d = b.next();
+        BOOST_TEST((d >= policy.base_delay));
+        BOOST_TEST((d <= policy.max_delay));
+        BOOST_TEST((d <= prev * 3));
+        prev = d;
+    }
+    b.reset();
+    BOOST_TEST((b.next() <= policy.base_delay * 3));
+}
+
+BOOST_AUTO_TEST_CASE( resume_session ) {
+    auto test = [](boost::asio::io_context& ioc, auto& c, auto finish, auto& /*b*/) {
+        c->set_client_id("cid1");
+        c->set_clean_session(false);
+
+        using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+
+        checker chk = {
+            // connect
+            cont("h_connack1"),
+            // the connection is lost while publishing
+            cont("h_error"),
+            // reconnect automatically, and resend the stored message
+            cont("h_connack2"),
+            cont("h_puback"),
+            // disconnect
+            cont("h_close"),
+        };
+
+        c->set_connack_handler(
+            [&chk, &c]
+            (bool sp, MQTT_NS::connect_return_code connack_return_code) {
+                BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+                if (chk.passed("h_error")) {
+                    MQTT_CHK("h_connack2");
+                    BOOST_TEST(sp == true);
+                }
+                else {
+                    MQTT_CHK("h_connack1");
+                    BOOST_TEST(sp == false);
+                    c->async_publish("topic1", "topic1_contents", MQTT_NS::qos::at_least_once);
+                    c->force_disconnect();
+                }
+                return true;
+            });
+        c->set_puback_handler(
+            [&chk, &c]
+            (packet_id_t /*packet_id*/) {
+                MQTT_CHK("h_puback");
+                auto const& stats = c->get_reconnect_statistics();
+                BOOST_TEST(stats.attempts == 1);
+                BOOST_TEST(stats.reconnects == 1);
+                BOOST_TEST((stats.last_latency >= std::chrono::milliseconds(10)));
+                BOOST_TEST((stats.max_latency == stats.last_latency));
+                c->async_disconnect();
+                return true;
+            });
+        c->set_close_handler(
+            [&chk, &finish]
+            () {
+                MQTT_CHK("h_close");
+                finish();
+            });
+        c->set_error_handler(
+            [&chk]
+            (MQTT_NS::error_code) {
+                MQTT_CHK("h_error");
+            });
+
+        MQTT_NS::reconnect_policy policy;
+        policy.base_delay = std::chrono::milliseconds(10);
+        policy.max_delay = std::chrono::milliseconds(100);
+        c->set_reconnect_policy(policy);
+        c->async_connect();
+        ioc.run();
+        BOOST_TEST(chk.all());
+    };
+    do_test(
+        [&](auto&&... args) { return MQTT_NS::make_async_client(std::forward<decltype(args)>(args)...); },
+        test
+    );
+}
+
+BOOST_AUTO_TEST_CASE( keep_connect_arguments ) {
+    auto test = [](boost::asio::io_context& ioc, auto& c, auto finish, auto& /*b*/) {
+        c->set_client_id("cid1");
+        c->set_clean_session(false);
+
+        checker chk = {
+            cont("start"),
+            cont("h_connected1"),
+            cont("h_connack1"),
+            cont("h_error"),
+            // the handler of the connect is called again for the reconnection
+            cont("h_connected2"),
+            cont("h_connack2"),
+            cont("h_close"),
+        };
+
+        auto keeper = std::make_shared<int>(0);
+        std::weak_ptr<int> wp(keeper);
+
+        c->set_connack_handler(
+            [&chk, &c, &wp]
+            (bool /*sp*/, MQTT_NS::connect_return_code connack_return_code) {
+                BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+                if (chk.passed("h_error")) {
+                    MQTT_CHK("h_connack2");
+                    // The session_life_keeper of the connect is kept for the reconnection.
+                    BOOST_TEST(!wp.expired());
+                    c->async_disconnect();
+                }
+                else {
+                    MQTT_CHK("h_connack1");
+                    c->force_disconnect();
+                }
+                return true;
+            });
+        c->set_close_handler(
+            [&chk, &finish]
+            () {
+                MQTT_CHK("h_close");
+                finish();
+            });
+        c->set_error_handler(
+            [&chk]
+            (MQTT_NS::error_code) {
+                MQTT_CHK("h_error");
+            });
+
+        MQTT_NS::reconnect_policy policy;
+        policy.base_delay = std::chrono::milliseconds(10);
+        policy.max_delay = std::chrono::milliseconds(100);
+        c->set_reconnect_policy(policy);
+        MQTT_CHK("start");
+        c->async_connect(
+            MQTT_NS::any(MQTT_NS::force_move(keeper)),
+            [&chk](MQTT_NS::error_code ec) {
+                BOOST_TEST(!ec);
+                auto ret = chk.match(
+                    "start",
+                    [&] {
+                        MQTT_CHK("h_connected1");
+                    },
+                    "h_error",
+                    [&] {
+                        MQTT_CHK("h_connected2");
+                    }
+                );
+                BOOST_TEST(ret);
+            }
+        );
+        ioc.run();
+        BOOST_TEST(chk.all());
+    };
+    do_test(
+        [&](auto&&... args) { return MQTT_NS::make_async_client(std::forward<decltype(args)>(args)...); },
+        test
+    );
+}
+
+BOOST_AUTO_TEST_CASE( offline_publish_queue ) {
+    auto test = [](boost::asio::io_context& ioc, auto& c, auto finish, auto& /*b*/) {
+        c->set_client_id("cid1");
+        c->set_clean_session(false);
+
+        using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+
+        checker chk = {
+            cont("h_connack1"),
+            cont("h_suback"),
+            // publish while disconnected
+            cont("h_error"),
+            cont("h_dropped_1"),
+            // the queued messages are sent after reconnecting
+            cont("h_connack2"),
+            cont("h_publish_2"),
+            cont("h_publish_3"),
+            // disconnect
+            cont("h_close"),
+        };
+
+        MQTT_NS::offline_publish_queue_limits limits;
+        limits.max_messages = 2;
+        limits.policy = MQTT_NS::offline_publish_overflow::drop_oldest;
+        c->set_offline_publish_queue(limits);
+
+        c->set_connack_handler(
+            [&chk, &c]
+            (bool sp, MQTT_NS::connect_return_code connack_return_code) {
+                BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+                if (chk.passed("h_error")) {
+                    MQTT_CHK("h_connack2");
+                    BOOST_TEST(sp == true);
+                }
+                else {
+                    MQTT_CHK("h_connack1");
+                    c->async_subscribe("topic1", MQTT_NS::qos::at_most_once);
+                }
+                return true;
+            });
+        c->set_suback_handler(
+            [&chk, &c]
+            (packet_id_t /*packet_id*/, std::vector<MQTT_NS::suback_return_code> /*results*/) {
+                MQTT_CHK("h_suback");
+                c->force_disconnect();
+                return true;
+            });
+        c->set_error_handler(
+            [&chk, &c]
+            (MQTT_NS::error_code) {
+                MQTT_CHK("h_error");
+                // The oldest message is dropped by the limit.
+                c->async_publish(
+                    "topic1", "1", MQTT_NS::qos::at_most_once,
+                    [&chk](MQTT_NS::error_code ec) {
+                        MQTT_CHK("h_dropped_1");
+                        BOOST_TEST(ec == boost::system::errc::no_buffer_space);
+                    }
+                );
+                c->async_publish("topic1", "2", MQTT_NS::qos::at_most_once);
+                c->async_publish("topic1", "3", MQTT_NS::qos::at_most_once);
+                c->async_connect();
+            });
+        c->set_publish_handler(
+            [&chk, &c]
+            (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+             MQTT_NS::publish_options /*pubopts*/,
+             MQTT_NS::buffer /*topic*/,
+             MQTT_NS::buffer contents) {
+                if (contents == "2") {
+                    MQTT_CHK("h_publish_2");
+                }
+                else {
+                    MQTT_CHK("h_publish_3");
+                    BOOST_TEST(contents == "3");
+                    c->async_disconnect();
+                }
+                return true;
+            });
+        c->set_close_handler(
+            [&chk, &finish]
+            () {
+                MQTT_CHK("h_close");
+                finish();
+            });
+        c->async_connect();
+        ioc.run();
+        BOOST_TEST(chk.all());
+    };
+    do_test(
+        [&](auto&&... args) { return MQTT_NS::make_async_client(std::forward<decltype(args)>(args)...); },
+        test
+    );
+}
+
+BOOST_AUTO_TEST_CASE( offline_publish_expiry ) {
+    auto test = [](boost::asio::io_context& ioc, auto& c, auto finish, auto& b) {
+        c->set_client_id("cid1");
+        c->set_clean_start(true);
+
+        checker chk = {
+            cont("h_connack1"),
+            // publish while disconnected
+            cont("h_error"),
+            // the queued message is sent after reconnecting
+            cont("h_connack2"),
+            cont("h_puback"),
+            // disconnect
+            cont("h_close"),
+        };
+
+        MQTT_NS::offline_publish_queue_limits limits;
+        c->set_offline_publish_queue(limits);
+
+        // The message waits for more than 1 second in the queue.
+        std::uint32_t expiry_interval = 0;
+        b.set_publish_props_handler(
+            [&](MQTT_NS::v5::properties const& props) {
+                for (auto const& p : props) {
+                    MQTT_NS::visit(
+                        MQTT_NS::make_lambda_visitor(
+                            [&](MQTT_NS::v5::property::message_expiry_interval const& t) {
+                                expiry_interval = t.val();
+                            },
+                            [](auto const&) {}
+                        ),
+                        p
+                    );
+                }
+            }
+        );
+
+        as::steady_timer tim(ioc);
+        c->set_v5_connack_handler(
+            [&chk, &c]
+            (bool /*sp*/, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+                BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+                if (chk.passed("h_error")) {
+                    MQTT_CHK("h_connack2");
+                    // The broker has received the queued PUBLISH before this one.
+                    c->async_publish(
+                        "topic1", "2", MQTT_NS::qos::at_least_once,
+                        [](MQTT_NS::error_code ec) {
+                            BOOST_TEST(!ec);
+                        }
+                    );
+                }
+                else {
+                    MQTT_CHK("h_connack1");
+                    c->force_disconnect();
+                }
+                return true;
+            });
+        c->set_v5_puback_handler(
+            [&chk, &c]
+            (typename std::remove_reference_t<decltype(*c)>::packet_id_t /*packet_id*/,
+             MQTT_NS::v5::puback_reason_code /*reason_code*/,
+             MQTT_NS::v5::properties /*props*/) {
+                MQTT_CHK("h_puback");
+                c->async_disconnect();
+                return true;
+            });
+        c->set_error_handler(
+            [&chk, &c, &tim]
+            (MQTT_NS::error_code) {
+                MQTT_CHK("h_error");
+                c->async_publish(
+                    "topic1", "1", MQTT_NS::qos::at_most_once,
+                    MQTT_NS::v5::properties {
+                        MQTT_NS::v5::property::message_expiry_interval(10)
+                    }
+                );
+                tim.expires_after(std::chrono::milliseconds(1500));
+                tim.async_wait(
+                    [&c](MQTT_NS::error_code ec) {
+                        BOOST_TEST(!ec);
+                        c->async_connect();
+                    }
+                );
+            });
+        c->set_close_handler(
+            [&chk, &finish]
+            () {
+                MQTT_CHK("h_close");
+                finish();
+            });
+        c->async_connect();
+        ioc.run();
+        BOOST_TEST(chk.all());
+        // 10 seconds minus the time in the queue, rounded up.
+        BOOST_TEST(expiry_interval == 9);
+    };
+    do_test(
+        [&](auto&&... args) { return MQTT_NS::make_async_client(std::forward<decltype(args)>(args)...); },
+        test,
+        MQTT_NS::protocol_version::v5
+    );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,188 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "test_main.hpp"
+#include "test_settings.hpp"
+#include "test_broker.hpp"
+#include "test_server_no_tls.hpp"
+#include "checker.hpp"
+
+#include <mqtt/async_client.hpp>
+#include <mqtt/rpc_client.hpp>
+
+BOOST_AUTO_TEST_SUITE(test_rpc)
+
+using namespace MQTT_NS::literals;
+
+BOOST_AUTO_TEST_CASE( call_and_timeout ) {
+    boost::asio::io_context iocb;
+    test_broker b(iocb);
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto finish =
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        };
+
+    boost::asio::io_context ioc;
+    auto requester = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+    auto responder = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+    requester->set_client_id("requester");
+    requester->set_clean_start(true);
+    responder->set_client_id("responder");
+    responder->set_clean_start(true);
+
+    using client_t = std::remove_reference_t<decltype(*requester)>;
+    using packet_id_t = typename client_t::packet_id_t;
+
+    auto wheel = std::make_shared<MQTT_NS::timer_wheel>(ioc, std::chrono::milliseconds(10));
+    auto rpc = std::make_shared<MQTT_NS::rpc_client<client_t>>(requester, wheel, "rpc/response/requester");
+
+    checker chk = {
+        cont("h_suback_responder"),
+        cont("h_suback_requester"),
+        cont("h_response_1"),
+        cont("h_response_2"),
+        // nobody answers
+        cont("h_timeout"),
+        cont("h_close_requester"),
+        cont("h_close_responder"),
+    };
+
+    // The responder echoes the request with "re:" prefix.
+    responder->set_v5_connack_handler(
+        [&responder]
+        (bool /*sp*/, MQTT_NS::v5::connect_reason_code /*reason_code*/, MQTT_NS::v5::properties /*props*/) {
+            responder->async_subscribe("rpc/request", MQTT_NS::qos::at_most_once);
+            return true;
+        });
+    responder->set_v5_suback_handler(
+        [&chk, &requester]
+        (packet_id_t /*packet_id*/, std::vector<MQTT_NS::v5::suback_reason_code> /*reasons*/, MQTT_NS::v5::properties /*props*/) {
+            MQTT_CHK("h_suback_responder");
+            requester->async_connect();
+            return true;
+        });
+    responder->set_v5_publish_handler(
+        [&responder]
+        (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+         MQTT_NS::publish_options /*pubopts*/,
+         MQTT_NS::buffer /*topic_name*/,
+         MQTT_NS::buffer contents,
+         MQTT_NS::v5::properties props) {
+            MQTT_NS::optional<MQTT_NS::buffer> response_topic;
+            MQTT_NS::optional<MQTT_NS::buffer> correlation_data;
+            for (auto const& p : props) {
+                MQTT_NS::visit(
+                    MQTT_NS::make_lambda_visitor(
+                        [&](MQTT_NS::v5::property::response_topic const& t) {
+                            response_topic.emplace(t.val());
+                        },
+                        [&](MQTT_NS::v5::property::correlation_data const& t) {
+                            correlation_data.emplace(t.val());
+                        },
+                        [](auto const&) {}
+                    ),
+                    p
+                );
+            }
+            BOOST_TEST(response_topic.has_value());
+            BOOST_TEST(correlation_data.has_value());
+            responder->async_publish(
+                response_topic.value(),
+                MQTT_NS::allocate_buffer("re:" + std::string(contents)),
+                MQTT_NS::qos::at_most_once,
+                MQTT_NS::v5::properties { MQTT_NS::v5::property::correlation_data(correlation_data.value()) }
+            );
+            return true;
+        });
+    responder->set_close_handler(
+        [&chk, &finish]
+        () {
+            MQTT_CHK("h_close_responder");
+            finish();
+        });
+
+    requester->set_v5_connack_handler(
+        [&rpc]
+        (bool /*sp*/, MQTT_NS::v5::connect_reason_code /*reason_code*/, MQTT_NS::v5::properties /*props*/) {
+            rpc->async_start();
+            return true;
+        });
+    requester->set_v5_suback_handler(
+        [&chk, &rpc, &requester]
+        (packet_id_t /*packet_id*/, std::vector<MQTT_NS::v5::suback_reason_code> /*reasons*/, MQTT_NS::v5::properties /*props*/) {
+            MQTT_CHK("h_suback_requester");
+            auto on_response =
+                [&chk, &rpc, &requester]
+                (std::string expected) {
+                    return
+                        [&chk, &rpc, &requester, expected]
+                        (MQTT_NS::error_code ec, MQTT_NS::buffer contents, MQTT_NS::v5::properties /*props*/) {
+                            BOOST_TEST(!ec);
+                            BOOST_TEST(contents == expected);
+                            if (expected == "re:1") {
+                                MQTT_CHK("h_response_1");
+                                return;
+                            }
+                            MQTT_CHK("h_response_2");
+                            rpc->async_call(
+                                "rpc/none"_mb,
+                                "3"_mb,
+                                std::chrono::milliseconds(100),
+                                [&chk, &rpc, &requester]
+                                (MQTT_NS::error_code ec, MQTT_NS::buffer /*contents*/, MQTT_NS::v5::properties /*props*/) {
+                                    MQTT_CHK("h_timeout");
+                                    BOOST_TEST(ec == boost::system::errc::timed_out);
+                                    BOOST_TEST(rpc->pending() == 0);
+                                    requester->async_disconnect();
+                                }
+                            );
+                        };
+                };
+            rpc->async_call("rpc/request"_mb, "1"_mb, std::chrono::seconds(5), on_response("re:1"));
+            rpc->async_call("rpc/request"_mb, "2"_mb, std::chrono::seconds(5), on_response("re:2"));
+            BOOST_TEST(rpc->pending() == 2);
+            return true;
+        });
+    requester->set_v5_publish_handler(
+        [&rpc]
+        (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+         MQTT_NS::publish_options /*pubopts*/,
+         MQTT_NS::buffer topic_name,
+         MQTT_NS::buffer contents,
+         MQTT_NS::v5::properties props) {
+            BOOST_TEST(rpc->handle_publish(topic_name, MQTT_NS::force_move(contents), MQTT_NS::force_move(props)));
+            return true;
+        });
+    requester->set_close_handler(
+        [&chk, &responder]
+        () {
+            MQTT_CHK("h_close_requester");
+            responder->async_disconnect();
+        });
+
+    responder->async_connect();
+    ioc.run();
+    BOOST_TEST(chk.all());
+    th.join();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
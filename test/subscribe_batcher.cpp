@@ -0,0 +1,254 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "test_main.hpp"
+#include "test_settings.hpp"
+#include "test_broker.hpp"
+#include "test_server_no_tls.hpp"
+#include "checker.hpp"
+
+#include <mqtt/async_client.hpp>
+#include <mqtt/subscribe_batcher.hpp>
+
+BOOST_AUTO_TEST_SUITE(test_subscribe_batcher)
+
+using namespace MQTT_NS::literals;
+
+BOOST_AUTO_TEST_CASE( split_by_packet_size ) {
+    boost::asio::io_context iocb;
+    test_broker b(iocb);
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto finish =
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        };
+
+    boost::asio::io_context ioc;
+    auto c = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port);
+    c->set_client_id("cid1");
+    c->set_clean_session(true);
+
+    using client_t = std::remove_reference_t<decltype(*c)>;
+    using packet_id_t = typename client_t::packet_id_t;
+
+    auto batcher = std::make_shared<MQTT_NS::subscribe_batcher<client_t>>(ioc, c);
+    // One SUBSCRIBE entry of "topicN" is 9 bytes, and a packet of two entries is 22 bytes.
+    batcher->set_maximum_packet_size(25);
+
+    std::size_t subacks = 0;
+    std::size_t unsubacks = 0;
+    std::vector<std::string> subscribed;
+    std::vector<std::string> unsubscribed;
+
+    checker chk = {
+        cont("h_too_large"),
+        cont("h_subscribed"),
+        cont("h_unsubscribed"),
+        cont("h_close"),
+    };
+
+    c->set_connack_handler(
+        [&]
+        (bool /*sp*/, MQTT_NS::connect_return_code /*connack_return_code*/) {
+            for (auto const& topic : { "topic1", "topic2", "topic3" }) {
+                batcher->async_subscribe(
+                    MQTT_NS::allocate_buffer(topic),
+                    MQTT_NS::qos::at_least_once,
+                    [&, topic = std::string(topic)](MQTT_NS::error_code ec, std::uint8_t reason_code) {
+                        BOOST_TEST(!ec);
+                        BOOST_TEST(reason_code == static_cast<std::uint8_t>(MQTT_NS::suback_return_code::success_maximum_qos_1));
+                        subscribed.push_back(topic);
+                        if (subscribed.size() != 3) return;
+                        MQTT_CHK("h_subscribed");
+                        for (auto const& topic : { "topic1", "topic2" }) {
+                            batcher->async_unsubscribe(
+                                MQTT_NS::allocate_buffer(topic),
+                                [&, topic = std::string(topic)](MQTT_NS::error_code ec, std::uint8_t /*reason_code*/) {
+                                    BOOST_TEST(!ec);
+                                    unsubscribed.push_back(topic);
+                                    if (unsubscribed.size() != 2) return;
+                                    MQTT_CHK("h_unsubscribed");
+                                    BOOST_TEST(batcher->pending() == 0);
+                                    c->async_disconnect();
+                                }
+                            );
+                        }
+                    }
+                );
+            }
+            batcher->async_subscribe(
+                "this_topic_filter_is_too_long"_mb,
+                MQTT_NS::qos::at_most_once,
+                [&](MQTT_NS::error_code ec, std::uint8_t /*reason_code*/) {
+                    MQTT_CHK("h_too_large");
+                    BOOST_TEST(ec == boost::system::errc::message_size);
+                }
+            );
+            // Nothing is sent until the next turn.
+            BOOST_TEST(batcher->pending() == 4);
+            return true;
+        });
+    c->set_suback_handler(
+        [&]
+        (packet_id_t packet_id, std::vector<MQTT_NS::suback_return_code> results) {
+            ++subacks;
+            BOOST_TEST(batcher->handle_suback(packet_id, results));
+            return true;
+        });
+    c->set_unsuback_handler(
+        [&]
+        (packet_id_t packet_id) {
+            ++unsubacks;
+            BOOST_TEST(batcher->handle_unsuback(packet_id));
+            return true;
+        });
+    c->set_close_handler(
+        [&]
+        () {
+            MQTT_CHK("h_close");
+            batcher->handle_close();
+            finish();
+        });
+    c->set_error_handler(
+        [&]
+        (MQTT_NS::error_code ec) {
+            batcher->handle_close(ec);
+            BOOST_CHECK(false);
+        });
+
+    c->async_connect();
+    ioc.run();
+    BOOST_TEST(chk.all());
+    // three entries in two SUBSCRIBE packets, and two entries in one UNSUBSCRIBE packet
+    BOOST_TEST(subacks == 2);
+    BOOST_TEST(unsubacks == 1);
+    BOOST_TEST((subscribed == std::vector<std::string>{ "topic1", "topic2", "topic3" }));
+    BOOST_TEST((unsubscribed == std::vector<std::string>{ "topic1", "topic2" }));
+    th.join();
+}
+
+BOOST_AUTO_TEST_CASE( keep_order ) {
+    boost::asio::io_context iocb;
+    test_broker b(iocb);
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto finish =
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        };
+
+    boost::asio::io_context ioc;
+    auto c = MQTT_NS::make_async_client(ioc, broker_url, broker_notls_port);
+    c->set_client_id("cid1");
+    c->set_clean_session(true);
+
+    using client_t = std::remove_reference_t<decltype(*c)>;
+    using packet_id_t = typename client_t::packet_id_t;
+
+    auto batcher = std::make_shared<MQTT_NS::subscribe_batcher<client_t>>(ioc, c);
+
+    checker chk = {
+        cont("h_unsubscribed"),
+        cont("h_subscribed"),
+        cont("h_publish"),
+        cont("h_close"),
+    };
+
+    c->set_connack_handler(
+        [&]
+        (bool /*sp*/, MQTT_NS::connect_return_code /*connack_return_code*/) {
+            // The later SUBSCRIBE wins, so the client stays subscribed.
+            batcher->async_unsubscribe(
+                "topic1"_mb,
+                [&](MQTT_NS::error_code ec, std::uint8_t /*reason_code*/) {
+                    MQTT_CHK("h_unsubscribed");
+                    BOOST_TEST(!ec);
+                }
+            );
+            batcher->async_subscribe(
+                "topic1"_mb,
+                MQTT_NS::qos::at_most_once,
+                [&](MQTT_NS::error_code ec, std::uint8_t /*reason_code*/) {
+                    MQTT_CHK("h_subscribed");
+                    BOOST_TEST(!ec);
+                    c->async_publish("topic1", "topic1_contents", MQTT_NS::qos::at_most_once);
+                }
+            );
+            return true;
+        });
+    c->set_suback_handler(
+        [&]
+        (packet_id_t packet_id, std::vector<MQTT_NS::suback_return_code> results) {
+            BOOST_TEST(batcher->handle_suback(packet_id, results));
+            return true;
+        });
+    c->set_unsuback_handler(
+        [&]
+        (packet_id_t packet_id) {
+            BOOST_TEST(batcher->handle_unsuback(packet_id));
+            return true;
+        });
+    c->set_publish_handler(
+        [&]
+        (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+         MQTT_NS::publish_options /*pubopts*/,
+         MQTT_NS::buffer topic,
+         MQTT_NS::buffer /*contents*/) {
+            MQTT_CHK("h_publish");
+            BOOST_TEST(topic == "topic1");
+            c->async_disconnect();
+            return true;
+        });
+    c->set_close_handler(
+        [&]
+        () {
+            MQTT_CHK("h_close");
+            batcher->handle_close();
+            finish();
+        });
+    c->set_error_handler(
+        [&]
+        (MQTT_NS::error_code ec) {
+            batcher->handle_close(ec);
+            BOOST_CHECK(false);
+        });
+
+    c->async_connect();
+    ioc.run();
+    BOOST_TEST(chk.all());
+    th.join();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
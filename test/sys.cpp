@@ -0,0 +1,231 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "test_main.hpp"
+#include "test_settings.hpp"
+#include "test_broker.hpp"
+#include "test_server_no_tls.hpp"
+#include "checker.hpp"
+
+#include <mqtt/client.hpp>
+
+BOOST_AUTO_TEST_SUITE(test_sys)
+
+using namespace MQTT_NS::literals;
+
+BOOST_AUTO_TEST_CASE( stats ) {
+    boost::asio::io_context iocb;
+    test_broker b(iocb);
+    b.set_sys_interval(std::chrono::milliseconds(100));
+    b.set_sys_topic_stats(true);
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto finish =
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        };
+
+    boost::asio::io_context ioc;
+
+    auto c = MQTT_NS::make_client(ioc, broker_url, broker_notls_port);
+    c->set_client_id("cid1");
+    c->set_clean_session(true);
+
+    using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+
+    checker chk = {
+        // connect
+        cont("h_connack"),
+        // subscribe $SYS topics
+        cont("h_suback"),
+        // publish topic1 QoS0 twice
+        deps("h_publish_received", "h_suback"),
+        deps("h_publish_topic", "h_suback"),
+        // disconnect
+        deps("h_close", "h_publish_received", "h_publish_topic"),
+    };
+
+    c->set_connack_handler(
+        [&chk, &c]
+        (bool sp, MQTT_NS::connect_return_code connack_return_code) {
+            MQTT_CHK("h_connack");
+            BOOST_TEST(sp == false);
+            BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+            c->subscribe(
+                std::vector<std::tuple<MQTT_NS::string_view, MQTT_NS::subscribe_options>> {
+                    { "$SYS/broker/messages/received", MQTT_NS::qos::at_most_once },
+                    { "$SYS/broker/topics/topic1/messages/received", MQTT_NS::qos::at_most_once },
+                }
+            );
+            return true;
+        });
+    c->set_suback_handler(
+        [&chk, &c]
+        (packet_id_t /*packet_id*/, std::vector<MQTT_NS::suback_return_code> results) {
+            MQTT_CHK("h_suback");
+            BOOST_TEST(results.size() == 2U);
+            c->publish("topic1", "contents", MQTT_NS::qos::at_most_once);
+            c->publish("topic1", "contents", MQTT_NS::qos::at_most_once);
+            return true;
+        });
+    bool received = false;
+    bool topic = false;
+    c->set_publish_handler(
+        [&chk, &c, &received, &topic]
+        (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+         MQTT_NS::publish_options /*pubopts*/,
+         MQTT_NS::buffer topic_name,
+         MQTT_NS::buffer contents) {
+            // The statistics are published periodically. Wait until they count the publishes.
+            if (contents != "2") return true;
+            if (topic_name == "$SYS/broker/messages/received" && !received) {
+                MQTT_CHK("h_publish_received");
+                received = true;
+            }
+            else if (topic_name == "$SYS/broker/topics/topic1/messages/received" && !topic) {
+                MQTT_CHK("h_publish_topic");
+                topic = true;
+            }
+            if (received && topic) c->disconnect();
+            return true;
+        });
+    c->set_close_handler(
+        [&chk, &finish]
+        () {
+            MQTT_CHK("h_close");
+            finish();
+        });
+    c->set_error_handler(
+        []
+        (MQTT_NS::error_code) {
+            BOOST_CHECK(false);
+        });
+
+    c->connect();
+
+    ioc.run();
+    BOOST_TEST(chk.all());
+    th.join();
+}
+
+BOOST_AUTO_TEST_CASE( topic_stats_limit ) {
+    boost::asio::io_context iocb;
+    test_broker b(iocb);
+    b.set_sys_interval(std::chrono::milliseconds(100));
+    // Only the first topic is counted.
+    b.set_sys_topic_stats(true, 1);
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto finish =
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        };
+
+    boost::asio::io_context ioc;
+
+    auto c = MQTT_NS::make_client(ioc, broker_url, broker_notls_port);
+    c->set_client_id("cid1");
+    c->set_clean_session(true);
+
+    using packet_id_t = typename std::remove_reference_t<decltype(*c)>::packet_id_t;
+
+    checker chk = {
+        // connect
+        cont("h_connack"),
+        // subscribe $SYS topics
+        cont("h_suback"),
+        // publish topic1 and topic2 QoS0
+        cont("h_publish_topic1"),
+        // disconnect
+        cont("h_close"),
+    };
+
+    c->set_connack_handler(
+        [&chk, &c]
+        (bool sp, MQTT_NS::connect_return_code connack_return_code) {
+            MQTT_CHK("h_connack");
+            BOOST_TEST(sp == false);
+            BOOST_TEST(connack_return_code == MQTT_NS::connect_return_code::accepted);
+            c->subscribe(
+                std::vector<std::tuple<MQTT_NS::string_view, MQTT_NS::subscribe_options>> {
+                    { "$SYS/broker/topics/topic1/messages/received", MQTT_NS::qos::at_most_once },
+                    { "$SYS/broker/topics/topic2/messages/received", MQTT_NS::qos::at_most_once },
+                }
+            );
+            return true;
+        });
+    c->set_suback_handler(
+        [&chk, &c]
+        (packet_id_t /*packet_id*/, std::vector<MQTT_NS::suback_return_code> /*results*/) {
+            MQTT_CHK("h_suback");
+            c->publish("topic1", "contents", MQTT_NS::qos::at_most_once);
+            c->publish("topic2", "contents", MQTT_NS::qos::at_most_once);
+            return true;
+        });
+    std::size_t rounds = 0;
+    c->set_publish_handler(
+        [&chk, &c, &rounds]
+        (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+         MQTT_NS::publish_options /*pubopts*/,
+         MQTT_NS::buffer topic_name,
+         MQTT_NS::buffer contents) {
+            BOOST_TEST(topic_name == "$SYS/broker/topics/topic1/messages/received");
+            BOOST_TEST(contents == "1");
+            // The second round is published after topic2 is received by the broker.
+            if (++rounds == 2) {
+                MQTT_CHK("h_publish_topic1");
+                c->disconnect();
+            }
+            return true;
+        });
+    c->set_close_handler(
+        [&chk, &finish]
+        () {
+            MQTT_CHK("h_close");
+            finish();
+        });
+    c->set_error_handler(
+        []
+        (MQTT_NS::error_code) {
+            BOOST_CHECK(false);
+        });
+
+    c->connect();
+
+    ioc.run();
+    BOOST_TEST(chk.all());
+    th.join();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
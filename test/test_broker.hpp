@@ -7,21 +7,37 @@
 #if !defined(MQTT_TEST_BROKER_HPP)
 #define MQTT_TEST_BROKER_HPP
 
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <future>
 #include <iostream>
 #include <set>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 
 #include <boost/lexical_cast.hpp>
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/composite_key.hpp>
 #include <boost/multi_index/sequenced_index.hpp>
 #include <boost/multi_index/member.hpp>
 #include <boost/multi_index/identity.hpp>
 
 #include <mqtt_server_cpp.hpp>
 #include <mqtt/optional.hpp>
+#include <mqtt/timer_wheel.hpp>
+#include <mqtt/token_bucket.hpp>
 #include <mqtt/visitor_util.hpp>
 
 #include "test_settings.hpp"
+#include "offline_message_queue.hpp"
+#include "topic_table.hpp"
+#include "write_ahead_log.hpp"
+#include "broker_snapshot.hpp"
 
 
 namespace mi = boost::multi_index;
@@ -32,11 +48,26 @@ using con_sp_t = std::shared_ptr<endpoint_t>;
 using con_wp_t = std::weak_ptr<endpoint_t>;
 using packet_id_t = endpoint_t::packet_id_t;
 
+/**
+ * @brief Limits of the PUBLISH packets that each client sends.
+ *
+ * 0 means unlimited for the rates. A burst that is less than one message
+ * (or the largest message for the bytes) only delays the client more.
+ */
+struct publish_rate_limits {
+    double messages_per_second = 0;
+    double message_burst = 1;
+    double bytes_per_second = 0;
+    double byte_burst = 0;
+    bool reply_quota_exceeded = false; ///< Reject the message that exceeds the rate with quota exceeded (v5 QoS1 and QoS2 only).
+};
+
 class test_broker {
 public:
     test_broker(as::io_context& ioc)
         :ioc_(ioc),
-         tim_disconnect_(ioc_)
+         tim_disconnect_(ioc_),
+         timers_(ioc_)
     {}
 
     // [begin] for test setting
@@ -54,6 +85,262 @@ public:
     }
     // [end] for test setting
 
+    /**
+     * @brief cancel_timers cancels session expiry, will delay, and message expiry
+     *        of all the non active sessions.
+     *
+     * This is called when the server stops accepting connections. The sessions
+     * themselves are kept, but they no longer expire.
+     */
+    void cancel_timers() {
+        timers_.clear();
+        tim_sys_ = MQTT_NS::nullopt;
+        tim_snapshot_ = MQTT_NS::nullopt;
+        auto & idx = non_active_sessions_.get<tag_client_id>();
+        for (auto it = idx.begin(); it != idx.end(); ++it) {
+            idx.modify(it,
+                       [&](session_state & val) {
+                           val.tim_session_expiry = MQTT_NS::nullopt;
+                           val.tim_will_delay = MQTT_NS::nullopt;
+                           val.tim_message_expiry = MQTT_NS::nullopt;
+                           val.next_message_expiry = MQTT_NS::nullopt;
+                       },
+                       [](session_state&) { BOOST_ASSERT(false); });
+        }
+    }
+
+    /**
+     * @brief set_offline_queue_limits sets the limits of the messages that are held
+     *        for each disconnected session.
+     *
+     * The messages are queued while a client that has a persistent session is disconnected,
+     * and they are delivered when the client reconnects. The same queue holds the messages
+     * that exceed the inflight window of a connected client. By default the queue is unlimited.
+     *
+     * @param limits - the limits that are applied to each session's queue
+     */
+    void set_offline_queue_limits(offline_queue_limits limits) {
+        offline_queue_limits_ = MQTT_NS::force_move(limits);
+    }
+
+    /**
+     * @brief set_max_inflight limits the QoS1 and QoS2 messages that are sent to each client
+     *        and not acknowledged yet.
+     *
+     * The receive maximum that an MQTT v5 client sends in CONNECT lowers the limit further.
+     * The messages that exceed the limit are queued in the session, and sent as the
+     * acknowledgements arrive. The queue is bounded by set_offline_queue_limits.
+     *
+     * @param max - the maximum number of the inflight messages of each client. It must not be 0.
+     */
+    void set_max_inflight(std::uint16_t max) {
+        BOOST_ASSERT(max != 0);
+        max_inflight_ = max;
+    }
+
+    /**
+     * @brief set_write_ahead_log makes the QoS1 and QoS2 messages that the broker accepts durable.
+     *
+     * The accepted PUBLISH packets are appended to the log, and PUBACK and PUBREC are sent
+     * only after the records are synced to the file.
+     * The records of all the connections are synced together (group commit), so one fsync
+     * covers many messages.
+     * If writing the log fails, the broker stops acknowledging. All the connections are closed,
+     * so the clients send the unacknowledged messages again after reconnecting, and the
+     * connections that send QoS1 and QoS2 messages after that are closed too.
+     *
+     * @param config - the path of the log file and the commit policy
+     * @return true if the log file is opened
+     */
+    bool set_write_ahead_log(wal_config config) {
+        wal_.reset();
+        wal_ = std::make_unique<write_ahead_log>(ioc_, MQTT_NS::force_move(config));
+        if (!wal_->is_open()) {
+            wal_.reset();
+            return false;
+        }
+        wal_->set_failure_handler(
+            [this] {
+                std::vector<con_sp_t> cons;
+                for (auto const& sess : active_sessions_) cons.push_back(sess.con);
+                for (auto const& con : cons) con->force_disconnect();
+            }
+        );
+        return true;
+    }
+
+    /**
+     * @brief set_snapshot starts taking snapshots of the persistent state periodically.
+     *
+     * The snapshot contains the persistent sessions with their subscriptions and queued
+     * messages, and the retained messages. It is encoded on the broker's thread, and written
+     * to the file on another thread. If the previous snapshot is still being written, the
+     * snapshot is skipped. The write ahead log records after the snapshot are replayed by recover().
+     * When a snapshot is found written at the next interval, the records before it are removed
+     * from the write ahead log.
+     *
+     * @param path - the path of the snapshot file
+     * @param interval - the interval of the snapshots. zero stops taking snapshots.
+     */
+    void set_snapshot(std::string path, std::chrono::steady_clock::duration interval) {
+        snapshot_path_ = MQTT_NS::force_move(path);
+        snapshot_interval_ = interval;
+        if (tim_snapshot_) {
+            timers_.cancel(tim_snapshot_.value());
+            tim_snapshot_ = MQTT_NS::nullopt;
+        }
+        if (snapshot_interval_ != std::chrono::steady_clock::duration::zero()) {
+            tim_snapshot_ = timers_.add(snapshot_interval_, [this] { periodic_snapshot(); });
+        }
+    }
+
+    /**
+     * @brief take_snapshot writes the snapshot of the persistent state to the file now.
+     *
+     * The records before the snapshot are removed from the write ahead log.
+     *
+     * @param path - the path of the snapshot file
+     * @return true if the snapshot is written
+     */
+    bool take_snapshot(std::string const& path) {
+        auto snap = make_snapshot();
+        if (!snapshot_store::write(path, snapshot_store::encode(snap))) return false;
+        if (wal_) wal_->compact(snap.wal_offset);
+        return true;
+    }
+
+    /**
+     * @brief recover restores the persistent state from the snapshot and the write ahead log.
+     *
+     * Call this before the broker accepts connections, and before set_write_ahead_log().
+     * The snapshot is read with memory mapping, and the log records after the snapshot are
+     * replayed in parallel, partitioned by client id. The torn record at the tail of the log
+     * is cut. Then a new snapshot of the recovered state is written, and the replayed records
+     * are removed from the log, so the next recovery starts from the end of the log.
+     *
+     * The sessions are restored as not active, and their expiry starts from the recovery.
+     * The wills and the QoS 2 messages that were received but not released are not restored.
+     *
+     * @param snapshot_path - the path of the snapshot file. If it doesn't exist, the log is replayed from the beginning.
+     * @param wal_path - the path of the write ahead log
+     * @param threads - the number of the threads to use
+     * @return false if the snapshot file is broken, or the new snapshot can't be written
+     */
+    bool recover(
+        std::string const& snapshot_path,
+        std::string const& wal_path,
+        std::size_t threads = std::max(1u, std::thread::hardware_concurrency())) {
+        auto snap = snapshot_store::read(snapshot_path, threads);
+        if (!snap) {
+            if (std::ifstream(snapshot_path).good()) return false;
+            snap.emplace();
+        }
+        std::uint64_t valid_end = 0;
+        auto records = write_ahead_log::load(wal_path, snap.value().wal_offset, threads, &valid_end);
+        if (std::ifstream(wal_path).good()) write_ahead_log::truncate(wal_path, valid_end);
+        snapshot_store::replay(snap.value(), records, threads);
+        snap.value().wal_offset = valid_end;
+        restore(snap.value());
+        if (!snapshot_store::write(snapshot_path, snapshot_store::encode(snap.value()))) return false;
+        write_ahead_log::compact(wal_path, valid_end);
+        return true;
+    }
+
+    /**
+     * @brief set_sys_interval starts publishing the statistics of the broker on the $SYS topics.
+     *
+     * The statistics are published as retained QoS0 messages on $SYS/broker/... every interval.
+     * The counters are updated on the publish path, and aggregated only when they are published.
+     *
+     * @param interval - the interval of publishing. zero stops publishing.
+     */
+    void set_sys_interval(std::chrono::steady_clock::duration interval) {
+        sys_interval_ = interval;
+        if (tim_sys_) {
+            timers_.cancel(tim_sys_.value());
+            tim_sys_ = MQTT_NS::nullopt;
+        }
+        if (sys_interval_ != std::chrono::steady_clock::duration::zero()) {
+            tim_sys_ = timers_.add(sys_interval_, [this] { publish_sys(); });
+        }
+    }
+
+    /**
+     * @brief set_sys_topic_stats enables the statistics of each topic.
+     *
+     * The number of the received messages and bytes of each topic are published on
+     * $SYS/broker/topics/<topic>/messages/received and .../bytes/received.
+     * The counted topics are kept until the statistics are disabled, so their number is
+     * limited. The topics that appear after the limit is reached are not counted.
+     *
+     * @param enable - true to count each topic
+     * @param max_topics - the maximum number of the counted topics
+     */
+    void set_sys_topic_stats(bool enable, std::size_t max_topics = 1024) {
+        sys_topic_stats_ = enable;
+        max_topic_stats_ = max_topics;
+        if (!enable) topic_stats_.clear();
+    }
+
+    /**
+     * @brief set_connect_rate_limit limits the rate of the CONNECT packets that the broker processes.
+     *
+     * When a lot of clients reconnect at the same time, the CONNECT packets over the budget
+     * are rejected. The rejected clients retry later, and the broker keeps serving the
+     * connected clients. The accept rate of each listener can be limited further by
+     * MQTT_NS::server::set_accept_rate_limit.
+     *
+     * @param bucket - the bucket that a CONNECT takes a token from. nullptr means no limit.
+     * @param reply_server_busy - if true, CONNACK with server busy (v5) or server unavailable (v3.1.1)
+     *                            is sent before the connection is closed. If false, the connection is
+     *                            closed without CONNACK.
+     */
+    void set_connect_rate_limit(std::shared_ptr<MQTT_NS::token_bucket> bucket, bool reply_server_busy = true) {
+        connect_bucket_ = MQTT_NS::force_move(bucket);
+        reply_server_busy_ = reply_server_busy;
+    }
+
+    /**
+     * @brief set_max_pending_connects limits the connections that are accepted but haven't sent CONNECT yet.
+     *
+     * The connections that are accepted over the limit are closed immediately.
+     *
+     * @param max - the maximum number of the pending connections. 0 means no limit.
+     */
+    void set_max_pending_connects(std::size_t max) {
+        max_pending_connects_ = max;
+    }
+
+    /**
+     * @brief set_fanout_chunk_size splits the delivery of a message to many subscribers.
+     *
+     * When a message has more subscribers than the chunk size, the broker delivers it to
+     * chunk size subscribers at a time, and handles the other connections between the chunks.
+     * The messages that are published meanwhile wait for the preceding fan-outs, so the order
+     * of the messages is kept for each subscriber.
+     *
+     * @param size - the number of the subscribers that are delivered at a time. 0 means no split.
+     */
+    void set_fanout_chunk_size(std::size_t size) {
+        fanout_chunk_size_ = size;
+    }
+
+    /**
+     * @brief set_publish_rate_limits limits the PUBLISH packets that each client sends.
+     *
+     * Each connection has its own token buckets. When a client exceeds them, the broker
+     * stops reading from the connection until the buckets are refilled. The received
+     * messages are not dropped; TCP flow control slows down the client instead.
+     * If reply_quota_exceeded is set, the QoS1 or QoS2 message of a v5 client that exceeds
+     * the rate is answered with the quota exceeded reason code and is not delivered.
+     * The limits are applied to the connections that are accepted after the call.
+     *
+     * @param limits - the limits of each client
+     */
+    void set_publish_rate_limits(publish_rate_limits limits) {
+        publish_rate_limits_ = MQTT_NS::force_move(limits);
+    }
+
     /**
      * @brief handle_accept
      *
@@ -74,6 +361,26 @@ public:
         con_wp_t wp(spep);
         endpoint_t& ep = *spep;
 
+        if (max_pending_connects_ != 0 && pending_connects_ >= max_pending_connects_) {
+            boost::system::error_code ec;
+            ep.socket().lowest_layer().close(ec);
+            return;
+        }
+        // The connection is pending until CONNECT is received or it is closed.
+        ++pending_connects_;
+        auto pending = std::make_shared<bool>(true);
+        auto settle =
+            [this, pending] {
+                if (!*pending) return;
+                *pending = false;
+                --pending_connects_;
+            };
+
+        std::shared_ptr<publish_quota> quota;
+        if (publish_rate_limits_.messages_per_second > 0 || publish_rate_limits_.bytes_per_second > 0) {
+            quota = std::make_shared<publish_quota>(publish_rate_limits_);
+        }
+
         ep.socket().lowest_layer().set_option(as::ip::tcp::no_delay(true));
         ep.set_auto_pub_response(false);
         // Pass spep to keep lifetime.
@@ -83,23 +390,25 @@ public:
 
         // set connection (lower than MQTT) level handlers
         ep.set_close_handler(
-            [this, wp]
+            [this, wp, settle]
             (){
                 con_sp_t sp = wp.lock();
                 BOOST_ASSERT(sp);
+                settle();
                 close_proc(MQTT_NS::force_move(sp), true);
             });
         ep.set_error_handler(
-            [this, wp]
+            [this, wp, settle]
             (MQTT_NS::error_code /*ec*/){
                 con_sp_t sp = wp.lock();
                 BOOST_ASSERT(sp);
+                settle();
                 close_proc(MQTT_NS::force_move(sp), true);
             });
 
         // set MQTT level handlers
         ep.set_connect_handler(
-            [this, wp]
+            [this, wp, settle]
             (MQTT_NS::buffer client_id,
              MQTT_NS::optional<MQTT_NS::buffer> username,
              MQTT_NS::optional<MQTT_NS::buffer> password,
@@ -108,6 +417,7 @@ public:
              std::uint16_t keep_alive) {
                 con_sp_t sp = wp.lock();
                 BOOST_ASSERT(sp);
+                settle();
                 return connect_handler(
                     MQTT_NS::force_move(sp),
                     MQTT_NS::force_move(client_id),
@@ -121,7 +431,7 @@ public:
             }
         );
         ep.set_v5_connect_handler(
-            [this, wp]
+            [this, wp, settle]
             (MQTT_NS::buffer client_id,
              MQTT_NS::optional<MQTT_NS::buffer> username,
              MQTT_NS::optional<MQTT_NS::buffer> password,
@@ -131,6 +441,7 @@ public:
              MQTT_NS::v5::properties props) {
                 con_sp_t sp = wp.lock();
                 BOOST_ASSERT(sp);
+                settle();
                 return connect_handler(
                     MQTT_NS::force_move(sp),
                     MQTT_NS::force_move(client_id),
@@ -161,15 +472,21 @@ public:
             }
         );
         ep.set_puback_handler(
-            []
+            [this, wp]
             (packet_id_t /*packet_id*/){
+                con_sp_t sp = wp.lock();
+                BOOST_ASSERT(sp);
+                release_inflight(sp);
                 return true;
             });
         ep.set_v5_puback_handler(
-            []
+            [this, wp]
             (packet_id_t /*packet_id*/,
              MQTT_NS::v5::puback_reason_code /*reason_code*/,
              MQTT_NS::v5::properties /*props*/){
+                con_sp_t sp = wp.lock();
+                BOOST_ASSERT(sp);
+                release_inflight(sp);
                 return true;
             });
         ep.set_pubrec_handler(
@@ -177,7 +494,7 @@ public:
             (packet_id_t packet_id){
                 con_sp_t sp = wp.lock();
                 BOOST_ASSERT(sp);
-                sp->pubrel(packet_id);
+                sp->async_pubrel(packet_id);
                 return true;
             });
         ep.set_v5_pubrec_handler(
@@ -187,15 +504,15 @@ public:
              MQTT_NS::v5::properties /*props*/){
                 con_sp_t sp = wp.lock();
                 BOOST_ASSERT(sp);
-                sp->pubrel(packet_id, MQTT_NS::v5::pubrel_reason_code::success, pubrel_props_);
+                sp->async_pubrel(packet_id, MQTT_NS::v5::pubrel_reason_code::success, pubrel_props_);
                 return true;
             });
         ep.set_pubrel_handler(
-            [wp]
+            [this, wp]
             (packet_id_t packet_id){
                 con_sp_t sp = wp.lock();
                 BOOST_ASSERT(sp);
-                sp->pubcomp(packet_id);
+                pubrel_handler(MQTT_NS::force_move(sp), packet_id);
                 return true;
             });
         ep.set_v5_pubrel_handler(
@@ -205,23 +522,29 @@ public:
              MQTT_NS::v5::properties /*props*/){
                 con_sp_t sp = wp.lock();
                 BOOST_ASSERT(sp);
-                sp->pubcomp(packet_id, MQTT_NS::v5::pubcomp_reason_code::success, pubcomp_props_);
+                pubrel_handler(MQTT_NS::force_move(sp), packet_id);
                 return true;
             });
         ep.set_pubcomp_handler(
-            []
+            [this, wp]
             (packet_id_t /*packet_id*/){
+                con_sp_t sp = wp.lock();
+                BOOST_ASSERT(sp);
+                release_inflight(sp);
                 return true;
             });
         ep.set_v5_pubcomp_handler(
-            []
+            [this, wp]
             (packet_id_t /*packet_id*/,
              MQTT_NS::v5::pubcomp_reason_code /*reason_code*/,
              MQTT_NS::v5::properties /*props*/){
+                con_sp_t sp = wp.lock();
+                BOOST_ASSERT(sp);
+                release_inflight(sp);
                 return true;
             });
         ep.set_publish_handler(
-            [this, wp]
+            [this, wp, quota]
             (MQTT_NS::optional<packet_id_t> packet_id,
              MQTT_NS::publish_options pubopts,
              MQTT_NS::buffer topic_name,
@@ -230,6 +553,7 @@ public:
                 BOOST_ASSERT(sp);
                 return publish_handler(
                     MQTT_NS::force_move(sp),
+                    quota.get(),
                     packet_id,
                     pubopts,
                     MQTT_NS::force_move(topic_name),
@@ -238,7 +562,7 @@ public:
                 );
             });
         ep.set_v5_publish_handler(
-            [this, wp]
+            [this, wp, quota]
             (MQTT_NS::optional<packet_id_t> packet_id,
              MQTT_NS::publish_options pubopts,
              MQTT_NS::buffer topic_name,
@@ -250,6 +574,7 @@ public:
                 BOOST_ASSERT(sp);
                 return publish_handler(
                     MQTT_NS::force_move(sp),
+                    quota.get(),
                     packet_id,
                     pubopts,
                     MQTT_NS::force_move(topic_name),
@@ -321,7 +646,7 @@ public:
             [wp] {
                 con_sp_t sp = wp.lock();
                 BOOST_ASSERT(sp);
-                sp->pingresp();
+                sp->async_pingresp();
                 return true;
             }
         );
@@ -405,6 +730,40 @@ public:
     }
 
 private:
+    // Token buckets of the PUBLISH packets of a connection.
+    struct publish_quota {
+        explicit publish_quota(publish_rate_limits const& limits) {
+            if (limits.messages_per_second > 0) {
+                messages.emplace(limits.messages_per_second, std::max(limits.message_burst, 1.0));
+            }
+            if (limits.bytes_per_second > 0) {
+                bytes.emplace(limits.bytes_per_second, std::max(limits.byte_burst, 1.0));
+            }
+        }
+
+        /**
+         * @brief charge takes the tokens of a message.
+         *
+         * The buckets go into debt if the message exceeds the rate.
+         * @return the time until the debt is paid back. zero if the message is within the rate.
+         */
+        std::chrono::steady_clock::duration charge(std::size_t size) {
+            auto pause = std::chrono::steady_clock::duration::zero();
+            if (messages) {
+                messages.value().consume(1);
+                pause = std::max(pause, messages.value().delay(0));
+            }
+            if (bytes) {
+                bytes.value().consume(static_cast<double>(size));
+                pause = std::max(pause, bytes.value().delay(0));
+            }
+            return pause;
+        }
+
+        MQTT_NS::optional<MQTT_NS::token_bucket> messages;
+        MQTT_NS::optional<MQTT_NS::token_bucket> bytes;
+    };
+
     /**
      * @brief connect_proc Process an incoming CONNECT packet
      *
@@ -435,6 +794,7 @@ private:
         auto& ep = *spep;
 
         MQTT_NS::optional<std::chrono::steady_clock::duration> session_expiry_interval;
+        std::size_t receive_maximum = max_inflight_;
 
         if (ep.get_protocol_version() == MQTT_NS::protocol_version::v5) {
             for (auto const& p : props) {
@@ -445,6 +805,10 @@ private:
                                 session_expiry_interval.emplace(std::chrono::seconds(t.val()));
                             }
                         },
+                        [&receive_maximum](MQTT_NS::v5::property::receive_maximum const& t) {
+                            // 0 is a protocol error. It is ignored here.
+                            if (t.val() != 0) receive_maximum = std::min<std::size_t>(receive_maximum, t.val());
+                        },
                         [](auto&& ...) {
                         }
                     ),
@@ -457,19 +821,37 @@ private:
             }
         }
 
+        MQTT_NS::optional<std::chrono::steady_clock::duration> will_delay;
+        if (will) {
+            for (auto const& p : will.value().props()) {
+                MQTT_NS::visit(
+                    MQTT_NS::make_lambda_visitor(
+                        [&will_delay](MQTT_NS::v5::property::will_delay_interval const& t) {
+                            if (t.val() != 0) {
+                                will_delay.emplace(std::chrono::seconds(t.val()));
+                            }
+                        },
+                        [](auto&& ...) {
+                        }
+                    ),
+                    p
+                );
+            }
+        }
+
         // If the Client supplies a zero-byte ClientId, the Client MUST also set CleanSession to 1 [MQTT-3.1.3-7].
         // If it's a not a clean session, but no client id is provided, we would have no way to map this
         // connection's session to a new connection later. So the connection must be rejected.
         switch (ep.get_protocol_version()) {
         case MQTT_NS::protocol_version::v3_1_1:
             if (client_id.empty() && !clean_session) {
-                ep.connack(false, MQTT_NS::connect_return_code::identifier_rejected);
+                ep.async_connack(false, MQTT_NS::connect_return_code::identifier_rejected);
                 return false;
             }
             break;
         case MQTT_NS::protocol_version::v5:
             if (client_id.empty() && !clean_session) {
-                ep.connack(false, MQTT_NS::v5::connect_reason_code::client_identifier_not_valid);
+                ep.async_connack(false, MQTT_NS::v5::connect_reason_code::client_identifier_not_valid);
                 return false;
             }
             break;
@@ -478,6 +860,31 @@ private:
             break;
         }
 
+        // Reject the CONNECT that is over the budget. The client retries later.
+        if (connect_bucket_ && !connect_bucket_->try_consume()) {
+            if (!reply_server_busy_) {
+                ep.force_disconnect();
+                return false;
+            }
+            auto close =
+                [spep]
+                (MQTT_NS::error_code) {
+                    spep->force_disconnect();
+                };
+            switch (ep.get_protocol_version()) {
+            case MQTT_NS::protocol_version::v3_1_1:
+                ep.async_connack(false, MQTT_NS::connect_return_code::server_unavailable, close);
+                break;
+            case MQTT_NS::protocol_version::v5:
+                ep.async_connack(false, MQTT_NS::v5::connect_reason_code::server_busy, close);
+                break;
+            default:
+                BOOST_ASSERT(false);
+                break;
+            }
+            return false;
+        }
+
         // Find any sessions that have the same client_id
         auto & act_sess_idx = active_sessions_.get<tag_client_id>();
         auto act_sess_it = act_sess_idx.find(client_id);
@@ -492,13 +899,13 @@ private:
         // Reply to the connect message.
         switch (ep.get_protocol_version()) {
         case MQTT_NS::protocol_version::v3_1_1:
-            ep.connack(
+            ep.async_connack(
                 !clean_session && ((act_sess_idx.end() != act_sess_it) || (non_act_sess_idx.end() != non_act_sess_it)),
                 MQTT_NS::connect_return_code::accepted
             );
             break;
         case MQTT_NS::protocol_version::v5:
-            ep.connack(
+            ep.async_connack(
                 !clean_session && ((act_sess_idx.end() != act_sess_it) || (non_act_sess_idx.end() != non_act_sess_it)),
                 MQTT_NS::v5::connect_reason_code::success,
                 connack_props_
@@ -517,12 +924,22 @@ private:
          *  the Session Present flag in CONNACK is always set to 0 if Clean Start is set to 1.
          */
         if(clean_session && (non_act_sess_it != non_act_sess_idx.end())) {
+            non_act_sess_idx.modify(non_act_sess_it,
+                                    [&](session_state & val) {
+                                        cancel_session_timers(val);
+                                        val.offline_messages.clear();
+                                    },
+                                    [](session_state&) { BOOST_ASSERT(false); });
             non_act_sess_idx.erase(non_act_sess_it);
             BOOST_ASSERT(non_act_sess_idx.end() == non_act_sess_idx.find(client_id));
 
             non_act_sess_it = non_act_sess_idx.end();
         }
 
+        // The window is bound to the network connection. The messages that were in flight
+        // on the previous connection are not counted.
+        auto window = std::make_shared<inflight_window>(receive_maximum);
+
         if(act_sess_it == act_sess_idx.end()) {
             // If we have a saved session, we can transfer the state from it
             // to the active_session container.
@@ -530,18 +947,23 @@ private:
                 auto const& ret = active_sessions_.emplace(spep,
                                                            client_id,
                                                            MQTT_NS::force_move(will),
-                                                           MQTT_NS::force_move(session_expiry_interval));
+                                                           MQTT_NS::force_move(session_expiry_interval),
+                                                           MQTT_NS::force_move(will_delay),
+                                                           MQTT_NS::force_move(window));
                 BOOST_ASSERT(ret.second);
                 act_sess_it = active_sessions_.project<tag_client_id>(ret.first);
                 BOOST_ASSERT(act_sess_it->client_id == client_id);
                 BOOST_ASSERT(act_sess_it == act_sess_idx.find(client_id));
             }
             else {
-                session_state state;
-                non_act_sess_idx.modify(non_act_sess_it,
-                                        [&](session_state & val) { state = val; },
-                                        [](session_state&) { BOOST_ASSERT(false); });
+                auto state = take_session_state(non_act_sess_idx, non_act_sess_it);
+                // The client reconnected in time. The session doesn't expire, and the delayed will is not sent.
+                cancel_session_timers(state);
                 state.con = spep;
+                state.window = MQTT_NS::force_move(window);
+                state.will = MQTT_NS::force_move(will);
+                state.will_delay = MQTT_NS::force_move(will_delay);
+                state.session_expiry_interval = MQTT_NS::force_move(session_expiry_interval);
                 non_act_sess_idx.erase(non_act_sess_it);
                 BOOST_ASSERT(non_act_sess_idx.end() == non_act_sess_idx.find(client_id));
 
@@ -568,19 +990,25 @@ private:
             // TODO: Verify from standard.
             {
                 auto & subs_idx = subs_.get<tag_con>();
-                {
-                    auto const& range = boost::make_iterator_range(subs_idx.equal_range(act_sess_it->con));
-                    for(auto it = range.begin(); it != range.end(); std::advance(it, 1)) {
-                        subs_idx.modify_key(it,
-                                            [&](con_sp_t & val) { val = spep; },
-                                            [](con_sp_t&) { BOOST_ASSERT(false); });
-                    }
+                // modify_key moves the element within the index, so the next
+                // subscription of the old connection is looked up each time.
+                for(auto it = subs_idx.find(act_sess_it->con); it != subs_idx.end(); it = subs_idx.find(act_sess_it->con)) {
+                    invalidate_match_cache(it->topic);
+                    subs_idx.modify_key(it,
+                                        [&](con_sp_t & val) { val = spep; },
+                                        [](con_sp_t&) { BOOST_ASSERT(false); });
                 }
                 BOOST_ASSERT(subs_idx.count(act_sess_it->con) == 0);
             }
             active_sessions_.get<tag_con>().modify_key(active_sessions_.project<tag_con>(act_sess_it),
                                                        [&](con_sp_t & val) { val = spep; },
                                                        [](con_sp_t&) { BOOST_ASSERT(false); });
+            act_sess_idx.modify(act_sess_it,
+                                [&](session_state & val) {
+                                    val.window = MQTT_NS::force_move(window);
+                                    if (clean_session) val.offline_messages.clear();
+                                },
+                                [](session_state&) { BOOST_ASSERT(false); });
         }
 
         if (clean_session) {
@@ -594,23 +1022,40 @@ private:
             auto & idx = saved_subs_.get<tag_client_id>();
             auto const& range = boost::make_iterator_range(idx.equal_range(client_id));
             for(auto const& item : range) {
-                // Send the saved messages out on the wire.
-                for (auto & d : item.messages) {
-                    // But *only* for this connection
-                    // Not every connection in the broker.
-                    ep.publish(
-                        as::buffer(item.topic),
-                        as::buffer(d.contents),
-                        // TODO: why is this 'retain'?
-                        std::min(item.qos_value, d.qos_value) | MQTT_NS::retain::yes,
-                        *(d.props),
-                        std::make_tuple(item.topic, d.contents, *(d.props))
-                        );
-                }
+                invalidate_match_cache(item.topic);
                 subs_.emplace(item.topic, spep, item.qos_value, item.rap_value);
             }
             idx.erase(range.begin(), range.end());
             BOOST_ASSERT(idx.count(client_id) == 0);
+
+            // Send the messages that were queued while the client was offline.
+            // But *only* for this connection
+            // Not every connection in the broker.
+            // The messages that don't fit into the window of the client stay queued.
+            act_sess_idx.modify(act_sess_it,
+                                [&](session_state & val) { send_queued(val); },
+                                [](session_state&) { BOOST_ASSERT(false); });
+        }
+
+        if (wal_) {
+            wal_record rec;
+            rec.type = wal_record_type::session;
+            rec.client_id = client_id;
+            // In v3_1_1, session_expiry_interval is not set. The session is kept unless it is clean.
+            rec.options = static_cast<std::uint8_t>(
+                (clean_session ? wal_session_clean : 0) |
+                ((!clean_session || act_sess_it->session_expiry_interval) ? wal_session_persistent : 0));
+            std::string expiry;
+            MQTT_NS::add_uint32_t_to_buf(
+                expiry,
+                act_sess_it->session_expiry_interval
+                ? static_cast<std::uint32_t>(
+                    std::chrono::duration_cast<std::chrono::seconds>(act_sess_it->session_expiry_interval.value()).count()
+                )
+                : 0
+            );
+            rec.contents = MQTT_NS::allocate_buffer(expiry);
+            wal_->append(rec);
         }
         return true;
     }
@@ -637,39 +1082,148 @@ private:
 
     bool publish_handler(
         con_sp_t spep,
+        publish_quota* quota,
         MQTT_NS::optional<packet_id_t> packet_id,
         MQTT_NS::publish_options pubopts,
         MQTT_NS::buffer topic_name,
         MQTT_NS::buffer contents,
         MQTT_NS::v5::properties props) {
 
-        auto& ep = *spep;
+        if (quota) {
+            auto pause = quota->charge(topic_name.size() + contents.size());
+            if (pause != std::chrono::steady_clock::duration::zero()) {
+                // Stop reading until the client is within the rate again.
+                resume_read_after(spep, pause);
+                if (publish_rate_limits_.reply_quota_exceeded &&
+                    spep->get_protocol_version() == MQTT_NS::protocol_version::v5 &&
+                    packet_id) {
+                    switch (pubopts.get_qos()) {
+                    case MQTT_NS::qos::at_least_once:
+                        spep->async_puback(packet_id.value(), MQTT_NS::v5::puback_reason_code::quota_exceeded, puback_props_);
+                        break;
+                    case MQTT_NS::qos::exactly_once:
+                        spep->async_pubrec(packet_id.value(), MQTT_NS::v5::pubrec_reason_code::quota_exceeded, pubrec_props_);
+                        break;
+                    default:
+                        break;
+                    }
+                    return false;
+                }
+                publish_handler(
+                    MQTT_NS::force_move(spep),
+                    nullptr,
+                    packet_id,
+                    pubopts,
+                    MQTT_NS::force_move(topic_name),
+                    MQTT_NS::force_move(contents),
+                    MQTT_NS::force_move(props)
+                );
+                return false;
+            }
+        }
+
+        count(stats_.messages_received, 1);
+        count(stats_.bytes_received, topic_name.size() + contents.size());
+        if (sys_topic_stats_) {
+            topic_stat* ts = nullptr;
+            if (topic_stats_.size() < max_topic_stats_) {
+                auto interned = topics_.intern(topic_name);
+                ts = &topic_stats_.emplace(interned.id(), topic_stat(interned)).first->second;
+            }
+            else if (auto interned = topics_.find(topic_name)) {
+                // The topic is not interned only for the statistics.
+                auto it = topic_stats_.find(interned.value().id());
+                if (it != topic_stats_.end()) ts = &it->second;
+            }
+            if (ts) {
+                ++ts->messages_received;
+                ts->bytes_received += topic_name.size() + contents.size();
+            }
+        }
+
+        // The message can't be made durable, so it is not accepted.
+        if (wal_ && wal_->failed() && pubopts.get_qos() != MQTT_NS::qos::at_most_once) {
+            spep->force_disconnect();
+            return false;
+        }
+
+        auto sp_props = MQTT_NS::v5::make_shared_properties(MQTT_NS::force_move(props));
+        bool logged = false;
+        if (wal_ && pubopts.get_qos() != MQTT_NS::qos::at_most_once) {
+            auto const& idx = active_sessions_.get<tag_con>();
+            auto it = idx.find(spep);
+            if (it != idx.end()) {
+                wal_record rec;
+                rec.type = wal_record_type::publish;
+                rec.client_id = it->client_id;
+                rec.packet_id = packet_id.value();
+                rec.options = static_cast<std::uint8_t>(pubopts.get_qos() | pubopts.get_retain());
+                rec.topic = topic_name;
+                rec.props = sp_props;
+                rec.contents = contents;
+                // The response tells the client that the message is stored by the broker.
+                // So it is sent after the record is durable.
+                wal_->append(
+                    rec,
+                    [this, wp = con_wp_t(spep), qos_value = pubopts.get_qos(), packet_id = packet_id.value()] {
+                        if (con_sp_t sp = wp.lock()) send_publish_response(*sp, qos_value, packet_id);
+                    }
+                );
+                logged = true;
+            }
+        }
+
         do_publish(
             MQTT_NS::force_move(topic_name),
             MQTT_NS::force_move(contents),
             pubopts.get_qos() | pubopts.get_retain(), // remove dup flag
-            MQTT_NS::force_move(props));
+            MQTT_NS::force_move(sp_props));
+
+        if (!logged && packet_id) send_publish_response(*spep, pubopts.get_qos(), packet_id.value());
+        return true;
+    }
+
+    /**
+     * @brief resume_read_after restarts reading from the connection after the delay.
+     *
+     * The PUBLISH handler must return false so that the endpoint doesn't read the next packet.
+     */
+    void resume_read_after(con_sp_t const& spep, std::chrono::steady_clock::duration delay) {
+        auto tim = std::make_shared<as::steady_timer>(ioc_);
+        tim->expires_after(delay);
+        tim->async_wait(
+            [tim, wp = con_wp_t(spep)]
+            (MQTT_NS::error_code ec) {
+                if (ec) return;
+                con_sp_t sp = wp.lock();
+                if (!sp || !sp->connected()) return;
+                auto& ep = *sp;
+                ep.async_read_next_message(MQTT_NS::force_move(sp));
+            }
+        );
+    }
 
+    void send_publish_response(endpoint_t& ep, MQTT_NS::qos qos_value, packet_id_t packet_id) {
         switch (ep.get_protocol_version()) {
         case MQTT_NS::protocol_version::v3_1_1:
-            switch (pubopts.get_qos()) {
+            switch (qos_value) {
             case MQTT_NS::qos::at_least_once:
-                ep.puback(packet_id.value());
+                ep.async_puback(packet_id);
                 break;
             case MQTT_NS::qos::exactly_once:
-                ep.pubrec(packet_id.value());
+                ep.async_pubrec(packet_id);
                 break;
             default:
                 break;
             }
             break;
         case MQTT_NS::protocol_version::v5:
-            switch (pubopts.get_qos()) {
+            switch (qos_value) {
             case MQTT_NS::qos::at_least_once:
-                ep.puback(packet_id.value(), MQTT_NS::v5::puback_reason_code::success, puback_props_);
+                ep.async_puback(packet_id, MQTT_NS::v5::puback_reason_code::success, puback_props_);
                 break;
             case MQTT_NS::qos::exactly_once:
-                ep.pubrec(packet_id.value(), MQTT_NS::v5::pubrec_reason_code::success, pubrec_props_);
+                ep.async_pubrec(packet_id, MQTT_NS::v5::pubrec_reason_code::success, pubrec_props_);
                 break;
             default:
                 break;
@@ -679,8 +1233,23 @@ private:
             BOOST_ASSERT(false);
             break;
         }
+    }
 
-        return true;
+    void pubrel_handler(con_sp_t spep, packet_id_t packet_id) {
+        auto& ep = *spep;
+        // The PUBLISH has been made durable before the PUBREC. The received QoS 2 state is not
+        // restored by recover(), so the PUBREL is not logged and the PUBCOMP is sent at once.
+        switch (ep.get_protocol_version()) {
+        case MQTT_NS::protocol_version::v3_1_1:
+            ep.async_pubcomp(packet_id);
+            break;
+        case MQTT_NS::protocol_version::v5:
+            ep.async_pubcomp(packet_id, MQTT_NS::v5::pubcomp_reason_code::success, pubcomp_props_);
+            break;
+        default:
+            BOOST_ASSERT(false);
+            break;
+        }
     }
 
     bool subscribe_handler(
@@ -702,15 +1271,17 @@ private:
             std::vector<MQTT_NS::suback_return_code> res;
             res.reserve(entries.size());
             for (auto const& e : entries) {
-                MQTT_NS::buffer topic = std::get<0>(e);
+                MQTT_NS::buffer const& topic = std::get<0>(e);
                 MQTT_NS::qos qos_value = std::get<1>(e).get_qos();
                 res.emplace_back(MQTT_NS::qos_to_suback_return_code(qos_value)); // converts to granted_qos_x
                 // TODO: This doesn't handle situations where we receive a new subscription for the same topic.
                 // MQTT 3.1.1 - 3.8.4 Response - paragraph 3.
-                subs_.emplace(MQTT_NS::force_move(topic), spep, qos_value);
+                auto interned = topics_.intern(topic);
+                invalidate_match_cache(interned);
+                subs_.emplace(MQTT_NS::force_move(interned), spep, qos_value);
             }
             // Acknowledge the subscriptions, and the registered QOS settings
-            ep.suback(packet_id, MQTT_NS::force_move(res));
+            ep.async_suback(packet_id, MQTT_NS::force_move(res));
             break;
         }
         case MQTT_NS::protocol_version::v5:
@@ -718,17 +1289,19 @@ private:
             std::vector<MQTT_NS::v5::suback_reason_code> res;
             res.reserve(entries.size());
             for (auto const& e : entries) {
-                MQTT_NS::buffer topic = std::get<0>(e);
+                MQTT_NS::buffer const& topic = std::get<0>(e);
                 MQTT_NS::qos qos_value = std::get<1>(e).get_qos();
                 MQTT_NS::rap rap_value = std::get<1>(e).get_rap();
                 res.emplace_back(MQTT_NS::v5::qos_to_suback_reason_code(qos_value)); // converts to granted_qos_x
                 // TODO: This doesn't handle situations where we receive a new subscription for the same topic.
                 // MQTT 3.1.1 - 3.8.4 Response - paragraph 3.
-                subs_.emplace(MQTT_NS::force_move(topic), spep, qos_value, rap_value);
+                auto interned = topics_.intern(topic);
+                invalidate_match_cache(interned);
+                subs_.emplace(MQTT_NS::force_move(interned), spep, qos_value, rap_value);
             }
             if (h_subscribe_props_) h_subscribe_props_(props);
             // Acknowledge the subscriptions, and the registered QOS settings
-            ep.suback(packet_id, MQTT_NS::force_move(res), suback_props_);
+            ep.async_suback(packet_id, MQTT_NS::force_move(res), suback_props_);
             break;
         }
         default:
@@ -736,18 +1309,32 @@ private:
             break;
         }
 
+        auto const& sess_idx = active_sessions_.get<tag_con>();
+        auto sess_it = sess_idx.find(spep);
+        inflight_window* window = sess_it == sess_idx.end() ? nullptr : sess_it->window.get();
         for (auto const& e : entries) {
             MQTT_NS::buffer const& topic = std::get<0>(e);
             MQTT_NS::subscribe_options options = std::get<1>(e);
+            if (wal_ && sess_it != sess_idx.end()) {
+                wal_record rec;
+                rec.type = wal_record_type::subscribe;
+                rec.client_id = sess_it->client_id;
+                rec.options = static_cast<std::uint8_t>(options.get_qos() | options.get_rap());
+                rec.topic = topic;
+                wal_->append(rec);
+            }
             // Publish any retained messages that match the newly subscribed topic.
-            auto it = retains_.find(topic);
+            auto it = retains_.find(topics_.intern(topic));
             if (it != retains_.end()) {
-                ep.publish(
-                    as::buffer(it->topic),
-                    as::buffer(it->contents),
-                    std::min(it->qos_value, options.get_qos()) | MQTT_NS::retain::yes,
-                    it->props,
-                    std::make_pair(it->topic, it->contents)
+                deliver(
+                    spep,
+                    window,
+                    offline_message(
+                        it->topic.str(),
+                        it->contents,
+                        it->props,
+                        std::min(it->qos_value, options.get_qos()) | MQTT_NS::retain::yes
+                    )
                 );
             }
         }
@@ -762,54 +1349,41 @@ private:
 
         auto& ep = *spep;
 
-        // For each subscription that this connection has
-        // Compare against the list of topics, and remove
-        // the subscription if the topic is in the list.
+        // Remove the subscription of this connection for each topic in the list.
+        // Each one is looked up directly, so the cost doesn't depend on how many
+        // subscriptions the connection has.
         {
-            auto & idx = subs_.get<tag_con>();
-            auto const& range = boost::make_iterator_range(idx.equal_range(spep));
-            for(auto it = range.begin(); it != range.end(); ) {
-                bool match = false;
-                for(auto const& topic : topics) {
-                    if(it->topic == topic) {
-                        /*
-                         * Advance the iterator using the return from erase.
-                         * The returned it may be equal to the next topic in
-                         * the list, so we continue comparing. When the loop
-                         * finishes, however, we can't blindly advance the
-                         * iterator, because that might result in skipping
-                         * an iterator that hasn't been checked. Further, we
-                         * can't only rely on the inner loop to advance the
-                         * iterator because we might not have a match, and
-                         * thus would infinitely loop on the current iterator.
-                         */
-                        it = idx.erase(it);
-                        match = true;
-                        break;
+            auto & idx = subs_.get<tag_con_topic>();
+            for(auto const& topic : topics) {
+                // Topics that are not registered in the table can't be subscribed.
+                auto interned = topics_.find(topic);
+                if (!interned) continue;
+                auto it = idx.find(std::forward_as_tuple(spep, interned.value()));
+                if (it == idx.end()) continue;
+                invalidate_match_cache(it->topic);
+                idx.erase(it);
+                BOOST_ASSERT(idx.count(std::forward_as_tuple(spep, interned.value())) == 0);
+                if (wal_) {
+                    auto const& sess_idx = active_sessions_.get<tag_con>();
+                    auto sess_it = sess_idx.find(spep);
+                    if (sess_it != sess_idx.end()) {
+                        wal_record rec;
+                        rec.type = wal_record_type::unsubscribe;
+                        rec.client_id = sess_it->client_id;
+                        rec.topic = topic;
+                        wal_->append(rec);
                     }
                 }
-                if( ! match)
-                {
-                    std::advance(it, 1);
-                }
-            }
-        }
-
-        for(auto const& item : boost::make_iterator_range( subs_.get<tag_con>().equal_range(spep))) {
-            (void)item;
-            for(auto const& topic : topics) {
-                (void)topic;
-                BOOST_ASSERT(item.topic != topic);
             }
         }
 
         switch (ep.get_protocol_version()) {
         case MQTT_NS::protocol_version::v3_1_1:
-            ep.unsuback(packet_id);
+            ep.async_unsuback(packet_id);
             break;
         case MQTT_NS::protocol_version::v5:
             if (h_unsubscribe_props_) h_unsubscribe_props_(props);
-            ep.unsuback(packet_id, std::vector<MQTT_NS::v5::unsuback_reason_code>(topics.size(), MQTT_NS::v5::unsuback_reason_code::success), unsuback_props_);
+            ep.async_unsuback(packet_id, std::vector<MQTT_NS::v5::unsuback_reason_code>(topics.size(), MQTT_NS::v5::unsuback_reason_code::success), unsuback_props_);
             break;
         default:
             BOOST_ASSERT(false);
@@ -832,53 +1406,64 @@ private:
         MQTT_NS::buffer contents,
         MQTT_NS::publish_options pubopts,
         MQTT_NS::v5::properties props) {
-        // For each active subscription registered for this topic
-        for(auto const& sub : boost::make_iterator_range(subs_.get<tag_topic>().equal_range(topic))) {
-            // publish the message to subscribers.
-            // TODO: Probably this should be switched to async_publish?
-            //       Given the async_client / sync_client seperation
-            //       and the way they have different function names,
-            //       it wouldn't be possible for test_broker.hpp to be
-            //       used with some hypothetical "async_server" in the future.
+        // The properties are encoded once, and shared by all the deliveries and the retained message.
+        do_publish(
+            MQTT_NS::force_move(topic),
+            MQTT_NS::force_move(contents),
+            pubopts,
+            MQTT_NS::v5::make_shared_properties(MQTT_NS::force_move(props)));
+    }
 
-            // retain is delivered as the original only if rap_value is rap::retain.
-            // On MQTT v3.1.1, rap_value is always rap::dont.
-            auto retain =
-                [&] {
-                    if (sub.rap_value == MQTT_NS::rap::retain) {
-                        return pubopts.get_retain();
-                    }
-                    return MQTT_NS::retain::no;
-                } ();
-            sub.con->publish(
-                topic,
-                contents,
-                std::min(sub.qos_value, pubopts.get_qos()) | retain,
-                props // TODO: Copying the properties vector for each subscription.
-            );
+    void do_publish(
+        MQTT_NS::buffer topic,
+        MQTT_NS::buffer contents,
+        MQTT_NS::publish_options pubopts,
+        MQTT_NS::v5::shared_properties sp_props) {
+        // If the topic is not registered, there is neither a subscription nor a retained message for it.
+        auto interned = topics_.find(topic);
+
+        auto expiry = message_expiry(sp_props->get());
+
+        // For each active subscription registered for this topic
+        // The list is held by shared_ptr, so it stays valid even if the cache is invalidated while publishing.
+        auto subscribers = interned ? find_subscribers(interned.value()) : nullptr;
+        if (fanout_chunk_size_ != 0 &&
+            (!fanout_queue_.empty() || (subscribers && subscribers->size() > fanout_chunk_size_))) {
+            // Large fan-outs are delivered chunk by chunk, so that the other connections
+            // are served in between. The jobs are processed in order, so each subscriber
+            // receives the messages in the order they are published. The messages for the
+            // saved subscriptions wait in the job too, because a subscriber can move between
+            // the active and the saved subscriptions while the preceding jobs are delivered.
+            fanout_job job { subscribers, 0, topic, contents, sp_props, pubopts, expiry, interned.value(), {} };
+            auto & idx = saved_subs_.get<tag_topic>();
+            auto range = boost::make_iterator_range(idx.equal_range(interned.value()));
+            for (auto const& item : range) job.saved.push_back(saved_subscriber { item.client_id, item.qos_value });
+            fanout_queue_.push_back(MQTT_NS::force_move(job));
+            if (fanout_queue_.size() == 1) as::post(ioc_, [this] { fanout_step(); });
         }
+        else if (interned) {
+            if (subscribers) {
+                fanout_job job { subscribers, 0, topic, contents, sp_props, pubopts, expiry, interned.value(), {} };
+                deliver_fanout(job, subscribers->size(), false);
+            }
 
-        {
             // For each saved subscription, add this message to
-            // the list to be sent out when a connection resumes
-            // a lost session.
+            // the queue of the session, to be sent out when a
+            // connection resumes a lost session.
             //
             // TODO: This does not properly handle wildcards!
             auto & idx = saved_subs_.get<tag_topic>();
-            auto range = boost::make_iterator_range(idx.equal_range(topic));
-            if( ! range.empty()) {
-                auto sp_props = std::make_shared<MQTT_NS::v5::properties>(props);
-                for(auto it = range.begin(); it != range.end(); std::advance(it, 1)) {
-                    idx.modify(it,
-                               [&](session_subscription & val)
-                               {
-                                   val.messages.emplace_back(
-                                       contents,
-                                       sp_props,
-                                       std::min(it->qos_value, pubopts.get_qos()));
-                               },
-                               [](session_subscription&) { BOOST_ASSERT(false); });
-                }
+            auto range = boost::make_iterator_range(idx.equal_range(interned.value()));
+            for(auto const& item : range) {
+                queue_offline_message(
+                    item.client_id,
+                    offline_message(
+                        topic,
+                        contents,
+                        sp_props,
+                        // TODO: why is this 'retain'?
+                        std::min(item.qos_value, pubopts.get_qos()) | MQTT_NS::retain::yes,
+                        expiry));
             }
         }
 
@@ -905,15 +1490,18 @@ private:
          */
         if (pubopts.get_retain() == MQTT_NS::retain::yes) {
             if (contents.empty()) {
-                retains_.erase(topic);
-                BOOST_ASSERT(retains_.count(topic) == 0);
+                if (interned) {
+                    retains_.erase(interned.value());
+                    BOOST_ASSERT(retains_.count(interned.value()) == 0);
+                }
             }
             else {
-                auto const& it = retains_.find(topic);
+                if (!interned) interned.emplace(topics_.intern(topic));
+                auto const& it = retains_.find(interned.value());
                 if(it == retains_.end()) {
-                    auto const& ret = retains_.emplace(MQTT_NS::force_move(topic),
+                    auto const& ret = retains_.emplace(MQTT_NS::force_move(interned.value()),
                                                        MQTT_NS::force_move(contents),
-                                                       MQTT_NS::force_move(props),
+                                                       MQTT_NS::force_move(sp_props),
                                                        pubopts.get_qos());
                     (void)ret;
                     BOOST_ASSERT(ret.second);
@@ -923,7 +1511,7 @@ private:
                                     [&](retain& val)
                                     {
                                         val.qos_value = pubopts.get_qos();
-                                        val.props = MQTT_NS::force_move(props);
+                                        val.props = MQTT_NS::force_move(sp_props);
                                         val.contents = MQTT_NS::force_move(contents);
                                     },
                                     [](retain&) { BOOST_ASSERT(false); });
@@ -958,6 +1546,10 @@ private:
             client_id = std::move(act_sess_it->client_id);
             will = std::move(act_sess_it->will);
 
+            // Remove the segment file of the messages that were waiting for the window.
+            act_sess_idx.modify(act_sess_it,
+                                [&](session_state & val) { val.offline_messages.clear(); },
+                                [](session_state&) { BOOST_ASSERT(false); });
             act_sess_idx.erase(act_sess_it);
 
             BOOST_ASSERT(active_sessions_.get<tag_client_id>().count(client_id) == 0);
@@ -970,12 +1562,30 @@ private:
             BOOST_ASSERT(non_active_sessions_.get<tag_client_id>().find(client_id) == non_active_sessions_.get<tag_client_id>().end());
         }
         else {
-            session_state state = std::move(*act_sess_it);
+            auto state = take_session_state(act_sess_idx, act_sess_it);
             client_id = state.client_id;
-            will = std::move(state.will);
+            if (send_will && state.will && state.will_delay) {
+                // The will is kept in the session, and sent when the will delay interval
+                // passes or the session ends, whichever happens first.
+                state.tim_will_delay = timers_.add(
+                    state.will_delay.value(),
+                    [this, client_id] { send_delayed_will(client_id); }
+                );
+            }
+            else {
+                will = std::move(state.will);
+                state.will = MQTT_NS::nullopt;
+            }
+            schedule_session_expiry(state);
 
             // TODO: Should yank out the messages from this connection object and store it in the session_state object??
             state.con.reset(); // clear the shared pointer, so it doesn't stay alive after this funciton ends.
+            state.window.reset();
+            // The messages that were waiting for the window are kept for the next connection.
+            if (!state.offline_messages.empty()) {
+                auto next = state.offline_messages.prune(std::chrono::steady_clock::now());
+                if (next) schedule_message_expiry(state, next.value());
+            }
 
             act_sess_idx.erase(act_sess_it);
             BOOST_ASSERT(active_sessions_.get<tag_client_id>().count(client_id) == 0);
@@ -1000,6 +1610,9 @@ private:
         {
             auto& idx = subs_.get<tag_con>();
             auto const& range = boost::make_iterator_range(idx.equal_range(spep));
+            for(auto const& item : range) {
+                invalidate_match_cache(item.topic);
+            }
             // In v3_1_1, session_expiry_interval is not set. So clean on close.
             if (ep.clean_session() && session_clear) {
                 // Remove all subscriptions for this clientid
@@ -1014,7 +1627,7 @@ private:
                                                           item.rap_value);
                     (void)ret;
                     BOOST_ASSERT(ret.second);
-                    BOOST_ASSERT(ret.first == saved_subs_.find(client_id));
+                    BOOST_ASSERT(ret.first->client_id == client_id);
                 }
                 idx.erase(range.begin(), range.end());
             }
@@ -1022,8 +1635,6 @@ private:
         }
 
         if(send_will && will) {
-            // TODO: This should be triggered by the will delay
-            // Not sent immediately.
             do_publish(
                 MQTT_NS::force_move(will.value().topic()),
                 MQTT_NS::force_move(will.value().message()),
@@ -1036,6 +1647,87 @@ private:
     struct tag_con {};
     struct tag_topic {};
     struct tag_client_id {};
+    struct tag_con_topic {};
+    struct tag_topic_client_id {};
+
+    // Hash of the client ids and the topics. It reads 8 bytes at a time.
+    struct buffer_hash {
+        std::size_t operator()(MQTT_NS::string_view s) const {
+            std::uint64_t h = 0x9e3779b97f4a7c15ULL ^ s.size();
+            auto p = s.data();
+            auto len = s.size();
+            for (; len >= 8; p += 8, len -= 8) {
+                std::uint64_t w;
+                std::memcpy(&w, p, 8);
+                h = (h ^ w) * 0xff51afd7ed558ccdULL;
+                h ^= h >> 32;
+            }
+            std::uint64_t w = 0;
+            std::memcpy(&w, p, len);
+            h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+            h ^= h >> 29;
+            return static_cast<std::size_t>(h);
+        }
+    };
+
+    // Connections are hashed by the address of the endpoint.
+    // The low bits are always zero because of the alignment, so they are mixed with the high bits.
+    struct con_hash {
+        std::size_t operator()(con_sp_t const& con) const {
+            auto p = reinterpret_cast<std::uintptr_t>(con.get());
+            return static_cast<std::size_t>(p ^ (p >> 4) ^ (p >> 16));
+        }
+    };
+
+    // Interned topics are hashed by the id.
+    struct topic_hash {
+        std::size_t operator()(interned_topic const& topic) const {
+            return std::hash<std::uint64_t>()(topic.id());
+        }
+    };
+
+    /*
+     * The keys of the containers below are looked up, but they are never iterated in order.
+     * If MQTT_TEST_BROKER_HASHED_INDEX is defined, hashed indices are used instead of ordered
+     * ones. Each lookup on CONNECT, disconnect, and (un)subscribe is then O(1) instead of
+     * O(log n) comparisons of the client ids.
+     */
+#if defined(MQTT_TEST_BROKER_HASHED_INDEX)
+    template <typename Tag, typename Key, typename Hash>
+    using unique_index = mi::hashed_unique<Tag, Key, Hash>;
+    template <typename Tag, typename Key, typename Hash>
+    using non_unique_index = mi::hashed_non_unique<Tag, Key, Hash>;
+#else  // defined(MQTT_TEST_BROKER_HASHED_INDEX)
+    template <typename Tag, typename Key, typename Hash>
+    using unique_index = mi::ordered_unique<Tag, Key>;
+    template <typename Tag, typename Key, typename Hash>
+    using non_unique_index = mi::ordered_non_unique<Tag, Key>;
+#endif // defined(MQTT_TEST_BROKER_HASHED_INDEX)
+
+    /**
+     * Flow control of the QoS 1 and QoS 2 messages that are sent to a connected client.
+     * The client receives at most receive_maximum of them at once. The rest are queued in
+     * the offline_messages of the session, and sent as the acknowledgements arrive.
+     * It is shared by the session and the cached subscribers, so the publish path doesn't
+     * need to look up the session unless the window is full.
+     */
+    struct inflight_window {
+        explicit inflight_window(std::size_t receive_maximum)
+            :receive_maximum(receive_maximum) {}
+
+        // Take a slot to send a new message. If it returns false, the message must be queued.
+        // QoS 1 and QoS 2 messages wait behind the queued ones to keep the order.
+        bool try_acquire(MQTT_NS::qos qos_value) {
+            if (qos_value == MQTT_NS::qos::at_most_once) return true;
+            if (queued || inflight >= receive_maximum) return false;
+            ++inflight;
+            return true;
+        }
+
+        std::size_t receive_maximum;
+        std::size_t inflight = 0; ///< QoS 1 and QoS 2 messages that are sent but not acknowledged.
+        bool queued = false; ///< The session has messages that wait for a slot.
+    };
 
     /**
      * http://docs.oasis-open.org/mqtt/mqtt/v5.0/cs02/mqtt-v5.0-cs02.html#_Session_State
@@ -1060,29 +1752,43 @@ private:
             con_sp_t con,
             MQTT_NS::buffer client_id,
             MQTT_NS::optional<MQTT_NS::will> will,
-            MQTT_NS::optional<std::chrono::steady_clock::duration> session_expiry_interval = MQTT_NS::nullopt)
+            MQTT_NS::optional<std::chrono::steady_clock::duration> session_expiry_interval = MQTT_NS::nullopt,
+            MQTT_NS::optional<std::chrono::steady_clock::duration> will_delay = MQTT_NS::nullopt,
+            std::shared_ptr<inflight_window> window = nullptr)
             :con(MQTT_NS::force_move(con)),
              client_id(MQTT_NS::force_move(client_id)),
+             window(MQTT_NS::force_move(window)),
              will(MQTT_NS::force_move(will)),
+             will_delay(MQTT_NS::force_move(will_delay)),
              session_expiry_interval(MQTT_NS::force_move(session_expiry_interval))
         {}
 
         session_state() = default;
         session_state(session_state &&) = default;
-        session_state(session_state const&) = default;
+        session_state(session_state const&) = delete;
         session_state& operator=(session_state &&) = default;
-        session_state& operator=(session_state const&) = default;
+        session_state& operator=(session_state const&) = delete;
 
         con_sp_t con;
         MQTT_NS::buffer client_id;
+        // Set only while the session is active.
+        std::shared_ptr<inflight_window> window;
 
         // TODO:
-        // Messages sent to client, but not acknowledged.
-        // Messages pending transmission to client
         // messages received from client, but not acknowledged
+
+        // Messages pending transmission to client while it is disconnected,
+        // or while its inflight window is full.
+        offline_message_queue offline_messages;
         MQTT_NS::optional<MQTT_NS::will> will;
         MQTT_NS::optional<std::chrono::steady_clock::duration> will_delay;
         MQTT_NS::optional<std::chrono::steady_clock::duration> session_expiry_interval;
+
+        // Timers on timers_. They are set only while the session is not active.
+        MQTT_NS::optional<MQTT_NS::timer_wheel::handle> tim_session_expiry;
+        MQTT_NS::optional<MQTT_NS::timer_wheel::handle> tim_will_delay;
+        MQTT_NS::optional<MQTT_NS::timer_wheel::handle> tim_message_expiry;
+        MQTT_NS::optional<std::chrono::steady_clock::time_point> next_message_expiry;
     };
 
     // The mi_active_sessions container holds the relevant data about an active connection with the broker.
@@ -1090,13 +1796,15 @@ private:
     using mi_active_sessions = mi::multi_index_container<
         session_state,
         mi::indexed_by<
-            mi::ordered_unique<
+            unique_index<
                 mi::tag<tag_con>,
-                BOOST_MULTI_INDEX_MEMBER(session_state, con_sp_t, con)
+                BOOST_MULTI_INDEX_MEMBER(session_state, con_sp_t, con),
+                con_hash
             >,
-            mi::ordered_unique<
+            unique_index<
                 mi::tag<tag_client_id>,
-                BOOST_MULTI_INDEX_MEMBER(session_state, MQTT_NS::buffer, client_id)
+                BOOST_MULTI_INDEX_MEMBER(session_state, MQTT_NS::buffer, client_id),
+                buffer_hash
             >
         >
     >;
@@ -1106,9 +1814,10 @@ private:
     using mi_non_active_sessions = mi::multi_index_container<
         session_state,
         mi::indexed_by<
-            mi::ordered_unique<
+            unique_index<
                 mi::tag<tag_client_id>,
-                BOOST_MULTI_INDEX_MEMBER(session_state, MQTT_NS::buffer, client_id)
+                BOOST_MULTI_INDEX_MEMBER(session_state, MQTT_NS::buffer, client_id),
+                buffer_hash
             >
         >
     >;
@@ -1116,12 +1825,12 @@ private:
     // Mapping between connection object and subscription topics
     struct sub_con {
         sub_con(
-            MQTT_NS::buffer topic,
+            interned_topic topic,
             con_sp_t con,
             MQTT_NS::qos qos_value,
             MQTT_NS::rap rap_value = MQTT_NS::rap::dont)
             :topic(MQTT_NS::force_move(topic)), con(MQTT_NS::force_move(con)), qos_value(qos_value), rap_value(rap_value) {}
-        MQTT_NS::buffer topic;
+        interned_topic topic;
         con_sp_t con;
         MQTT_NS::qos qos_value;
         MQTT_NS::rap rap_value;
@@ -1129,24 +1838,27 @@ private:
     using mi_sub_con = mi::multi_index_container<
         sub_con,
         mi::indexed_by<
-            mi::ordered_non_unique<
+            non_unique_index<
                 mi::tag<tag_topic>,
-                BOOST_MULTI_INDEX_MEMBER(sub_con, MQTT_NS::buffer, topic)
+                BOOST_MULTI_INDEX_MEMBER(sub_con, interned_topic, topic),
+                topic_hash
             >,
-            mi::ordered_non_unique<
+            non_unique_index<
                 mi::tag<tag_con>,
-                BOOST_MULTI_INDEX_MEMBER(sub_con, con_sp_t, con)
+                BOOST_MULTI_INDEX_MEMBER(sub_con, con_sp_t, con),
+                con_hash
             >,
             // Don't allow the same connection object to have the same topic multiple times.
-            // Note that this index does not get used by any code in the broker
-            // other than to enforce the uniqueness constraints.
-            // Potentially this can be enabled only in debug builds.
-            mi::ordered_unique<
+            // It is also used to find the subscription of the connection for the topic
+            // on unsubscribe.
+            unique_index<
+                mi::tag<tag_con_topic>,
                 mi::composite_key<
                     sub_con,
                     BOOST_MULTI_INDEX_MEMBER(sub_con, con_sp_t, con),
-                    BOOST_MULTI_INDEX_MEMBER(sub_con, MQTT_NS::buffer, topic)
-                >
+                    BOOST_MULTI_INDEX_MEMBER(sub_con, interned_topic, topic)
+                >,
+                mi::composite_key_hash<con_hash, topic_hash>
             >
         >
     >;
@@ -1155,57 +1867,43 @@ private:
     // case clients add a new subscription to the associated topics.
     struct retain {
         retain(
-            MQTT_NS::buffer topic,
+            interned_topic topic,
             MQTT_NS::buffer contents,
-            MQTT_NS::v5::properties props,
+            MQTT_NS::v5::shared_properties props,
             MQTT_NS::qos qos_value)
             :topic(MQTT_NS::force_move(topic)),
              contents(MQTT_NS::force_move(contents)),
              props(MQTT_NS::force_move(props)),
              qos_value(qos_value)
         { }
-        MQTT_NS::buffer topic;
+        interned_topic topic;
         MQTT_NS::buffer contents;
-        MQTT_NS::v5::properties props;
+        MQTT_NS::v5::shared_properties props;
         MQTT_NS::qos qos_value;
     };
     using mi_retain = mi::multi_index_container<
         retain,
         mi::indexed_by<
-            mi::ordered_unique<
+            unique_index<
                 mi::tag<tag_topic>,
-                BOOST_MULTI_INDEX_MEMBER(retain, MQTT_NS::buffer, topic)
+                BOOST_MULTI_INDEX_MEMBER(retain, interned_topic, topic),
+                topic_hash
             >
         >
     >;
 
-    // The saved_message structure holds messages that have been published on a
-    // topic that a not-currently-connected client is subscribed to.
-    // When a new connection is made with the client id for this saved data,
-    // these messages will be published to that client, and only that client.
-    struct saved_message {
-        saved_message(
-            MQTT_NS::buffer contents,
-            std::shared_ptr<MQTT_NS::v5::properties> props,
-            MQTT_NS::qos qos_value)
-            : contents(MQTT_NS::force_move(contents)), props(MQTT_NS::force_move(props)), qos_value(qos_value) {}
-        MQTT_NS::buffer contents;
-        std::shared_ptr<MQTT_NS::v5::properties> props;
-        MQTT_NS::qos qos_value;
-    };
-
-    // Each instance of session_subscription describes a subscription that the associated client id has made
-    // and a collection of data associated with that subscription to be sent when the client reconnects.
+    // Each instance of session_subscription describes a subscription that the associated client id has made.
+    // The messages that match the subscription are queued in the session_state of the client id
+    // to be sent when the client reconnects.
     struct session_subscription {
         session_subscription(
             MQTT_NS::buffer client_id,
-            MQTT_NS::buffer topic,
+            interned_topic topic,
             MQTT_NS::qos qos_value,
             MQTT_NS::rap rap_value)
             :client_id(MQTT_NS::force_move(client_id)), topic(MQTT_NS::force_move(topic)), qos_value(qos_value), rap_value(rap_value) {}
         MQTT_NS::buffer client_id;
-        MQTT_NS::buffer topic;
-        std::vector<saved_message> messages;
+        interned_topic topic;
         MQTT_NS::qos qos_value;
         MQTT_NS::rap rap_value;
     };
@@ -1214,38 +1912,702 @@ private:
         session_subscription,
         mi::indexed_by<
             // Allow multiple client id's for the same topic
-            mi::ordered_non_unique<
+            non_unique_index<
                 mi::tag<tag_client_id>,
-                BOOST_MULTI_INDEX_MEMBER(session_subscription, MQTT_NS::buffer, client_id)
+                BOOST_MULTI_INDEX_MEMBER(session_subscription, MQTT_NS::buffer, client_id),
+                buffer_hash
             >,
             // Allow multiple topics for the same client id
-            mi::ordered_non_unique<
+            non_unique_index<
                 mi::tag<tag_topic>,
-                BOOST_MULTI_INDEX_MEMBER(session_subscription, MQTT_NS::buffer, topic)
+                BOOST_MULTI_INDEX_MEMBER(session_subscription, interned_topic, topic),
+                topic_hash
             >,
             // Don't allow the same client id to have the same topic multiple times.
             // Note that this index does not get used by any code in the broker
             // other than to enforce the uniqueness constraints.
             // Potentially this can be enabled only in debug builds.
-            mi::ordered_unique<
+            unique_index<
+                mi::tag<tag_topic_client_id>,
                 mi::composite_key<
                     session_subscription,
-                    BOOST_MULTI_INDEX_MEMBER(session_subscription, MQTT_NS::buffer, topic),
+                    BOOST_MULTI_INDEX_MEMBER(session_subscription, interned_topic, topic),
                     BOOST_MULTI_INDEX_MEMBER(session_subscription, MQTT_NS::buffer, client_id)
-                >
+                >,
+                mi::composite_key_hash<topic_hash, buffer_hash>
             >
         >
     >;
 
+    // A subscriber of a topic, copied from subs_ to a contiguous list.
+    struct cached_subscriber {
+        cached_subscriber(con_sp_t con, MQTT_NS::buffer client_id, std::shared_ptr<inflight_window> window, MQTT_NS::qos qos_value, MQTT_NS::rap rap_value)
+            :con(MQTT_NS::force_move(con)), client_id(MQTT_NS::force_move(client_id)), window(MQTT_NS::force_move(window)), qos_value(qos_value), rap_value(rap_value) {}
+        con_sp_t con;
+        MQTT_NS::buffer client_id;
+        std::shared_ptr<inflight_window> window;
+        MQTT_NS::qos qos_value;
+        MQTT_NS::rap rap_value;
+    };
+    using subscriber_list = std::vector<cached_subscriber>;
+
+    // A client whose subscription is saved in its disconnected session.
+    struct saved_subscriber {
+        MQTT_NS::buffer client_id;
+        MQTT_NS::qos qos_value;
+    };
+
+    // A message that is being delivered to the cached subscribers of its topic.
+    struct fanout_job {
+        std::shared_ptr<subscriber_list const> subscribers; ///< nullptr if there is no active subscriber.
+        std::size_t next; ///< Index of the next subscriber to deliver to.
+        MQTT_NS::buffer topic;
+        MQTT_NS::buffer contents;
+        MQTT_NS::v5::shared_properties props;
+        MQTT_NS::publish_options pubopts;
+        MQTT_NS::optional<std::chrono::steady_clock::time_point> expiry;
+        interned_topic interned;
+        std::vector<saved_subscriber> saved; ///< The saved subscriptions when the message was published.
+    };
+
+    /**
+     * @brief deliver_fanout delivers the message to the next subscribers of the job.
+     *
+     * @param job - The fan-out. job.next is advanced.
+     * @param num - The maximum number of the subscribers to deliver to.
+     * @param deferred - Whether the job was queued. The subscribers of a queued job can have
+     *                   disconnected since it was published. Otherwise they are all active,
+     *                   because close_proc() invalidates the cached list.
+     */
+    void deliver_fanout(fanout_job& job, std::size_t num, bool deferred) {
+        if (!job.subscribers) return;
+        auto const& subscribers = *job.subscribers;
+        auto end = job.next + std::min(num, subscribers.size() - job.next);
+        std::size_t sent = 0;
+        for (; job.next != end; ++job.next) {
+            auto const& sub = subscribers[job.next];
+            // retain is delivered as the original only if rap_value is rap::retain.
+            // On MQTT v3.1.1, rap_value is always rap::dont.
+            auto retain =
+                [&] {
+                    if (sub.rap_value == MQTT_NS::rap::retain) {
+                        return job.pubopts.get_retain();
+                    }
+                    return MQTT_NS::retain::no;
+                } ();
+            auto sub_pubopts = std::min(sub.qos_value, job.pubopts.get_qos()) | retain;
+            if (deferred && !is_active(sub.con)) {
+                // The subscriber has disconnected since the fan-out was published.
+                // Its session has been saved, or resumed by a new connection.
+                deliver_to_session(sub.client_id, job.interned, offline_message(job.topic, job.contents, job.props, sub_pubopts, job.expiry));
+                continue;
+            }
+            if (sub.window && !sub.window->try_acquire(sub_pubopts.get_qos())) {
+                queue_message(sub.con, offline_message(job.topic, job.contents, job.props, sub_pubopts, job.expiry));
+                continue;
+            }
+            // publish the message to subscribers.
+            // Writes are queued on the endpoint, so a slow subscriber doesn't block the others.
+            sub.con->async_publish(job.topic, job.contents, sub_pubopts, job.props);
+            ++sent;
+        }
+        count(stats_.messages_sent, sent);
+        count(stats_.bytes_sent, sent * (job.topic.size() + job.contents.size()));
+    }
+
+    /**
+     * @brief fanout_step delivers one chunk of the oldest fan-out, and posts itself
+     *        while there are more chunks.
+     *        After the last chunk, the message is passed to the saved subscriptions of the job.
+     */
+    void fanout_step() {
+        BOOST_ASSERT(!fanout_queue_.empty());
+        auto& job = fanout_queue_.front();
+        deliver_fanout(job, fanout_chunk_size_, true);
+        if (!job.subscribers || job.next == job.subscribers->size()) {
+            for (auto const& item : job.saved) {
+                deliver_to_session(
+                    item.client_id,
+                    job.interned,
+                    // TODO: why is this 'retain'?
+                    offline_message(job.topic, job.contents, job.props, std::min(item.qos_value, job.pubopts.get_qos()) | MQTT_NS::retain::yes, job.expiry));
+            }
+            fanout_queue_.pop_front();
+        }
+        if (!fanout_queue_.empty()) as::post(ioc_, [this] { fanout_step(); });
+    }
+
+    /**
+     * @brief find_subscribers gets the subscribers of the topic via the match cache.
+     *        The list is built from subs_ and cached on the first publish to the topic.
+     *
+     * @param topic - The topic to publish.
+     * @return The subscribers of the topic, or nullptr if there is no subscriber.
+     */
+    std::shared_ptr<subscriber_list const> find_subscribers(interned_topic const& topic) {
+        auto it = match_cache_.find(topic.id());
+        if (it != match_cache_.end()) return it->second;
+
+        auto const& range = boost::make_iterator_range(subs_.get<tag_topic>().equal_range(topic));
+        // Topics without subscribers are not cached. This keeps the cache entries bound
+        // to the lifetime of the subscriptions, so invalidation alone keeps it clean.
+        if (range.empty()) return nullptr;
+        auto subscribers = std::make_shared<subscriber_list>();
+        subscribers->reserve(static_cast<std::size_t>(std::distance(range.begin(), range.end())));
+        auto const& sess_idx = active_sessions_.get<tag_con>();
+        for (auto const& sub : range) {
+            auto sess_it = sess_idx.find(sub.con);
+            subscribers->emplace_back(
+                sub.con,
+                sess_it == sess_idx.end() ? MQTT_NS::buffer() : sess_it->client_id,
+                sess_it == sess_idx.end() ? nullptr : sess_it->window,
+                sub.qos_value,
+                sub.rap_value
+            );
+        }
+        match_cache_.emplace(topic.id(), subscribers);
+        return subscribers;
+    }
+
+    /**
+     * @brief deliver sends the message to the connected client, or queues it in the session
+     *        if the inflight window of the client is full.
+     *
+     * @param spep - The connection of the client.
+     * @param window - The inflight window of the connection. nullptr means no limit.
+     * @param msg - The message to deliver.
+     */
+    void deliver(con_sp_t const& spep, inflight_window* window, offline_message msg) {
+        if (window && !window->try_acquire(msg.pubopts.get_qos())) {
+            queue_message(spep, MQTT_NS::force_move(msg));
+            return;
+        }
+        count(stats_.messages_sent, 1);
+        count(stats_.bytes_sent, msg.size());
+        spep->async_publish(
+            MQTT_NS::force_move(msg.topic),
+            MQTT_NS::force_move(msg.contents),
+            msg.pubopts,
+            MQTT_NS::force_move(msg.props)
+        );
+    }
+
+    /**
+     * @brief is_active checks whether the connection still has its active session.
+     *
+     * @param spep - The connection of the client.
+     */
+    bool is_active(con_sp_t const& spep) const {
+        auto const& idx = active_sessions_.get<tag_con>();
+        return idx.find(spep) != idx.end();
+    }
+
+    /**
+     * @brief deliver_to_session delivers the message of a queued fan-out to the session of the client.
+     *        The session can have been disconnected, or resumed by a new connection, since the
+     *        message was published. The message is dropped if the session has ended, or if it
+     *        no longer subscribes to the topic.
+     *
+     * @param client_id - The client id of the session.
+     * @param topic - The topic of the message.
+     * @param msg - The message to deliver.
+     */
+    void deliver_to_session(MQTT_NS::buffer const& client_id, interned_topic const& topic, offline_message msg) {
+        auto const& idx = active_sessions_.get<tag_client_id>();
+        auto it = idx.find(client_id);
+        if (it == idx.end()) {
+            queue_offline_message(client_id, MQTT_NS::force_move(msg));
+            return;
+        }
+        auto spep = it->con;
+        auto const& subs_idx = subs_.get<tag_con_topic>();
+        if (subs_idx.find(std::forward_as_tuple(spep, topic)) == subs_idx.end()) return;
+        deliver(spep, it->window.get(), MQTT_NS::force_move(msg));
+    }
+
+    /**
+     * @brief queue_offline_message holds the message in the disconnected session of the client,
+     *        to be sent out when a connection resumes the session.
+     *        The message is dropped if the client doesn't have a disconnected session.
+     *
+     * @param client_id - The client id of the session.
+     * @param msg - The message to queue.
+     */
+    void queue_offline_message(MQTT_NS::buffer const& client_id, offline_message msg) {
+        auto & sess_idx = non_active_sessions_.get<tag_client_id>();
+        auto sess_it = sess_idx.find(client_id);
+        if (sess_it == sess_idx.end()) return;
+        auto expiry = msg.expiry;
+        sess_idx.modify(sess_it,
+                        [&](session_state & val)
+                        {
+                            auto dropped = val.offline_messages.dropped();
+                            val.offline_messages.push(offline_queue_limits_, client_id, MQTT_NS::force_move(msg));
+                            count(stats_.messages_dropped, val.offline_messages.dropped() - dropped);
+                            if (expiry) schedule_message_expiry(val, expiry.value());
+                        },
+                        [](session_state&) { BOOST_ASSERT(false); });
+    }
+
+    /**
+     * @brief queue_message holds the message in the active session until its inflight window has room.
+     *
+     * @param spep - The connection of the client.
+     * @param msg - The message to queue.
+     */
+    void queue_message(con_sp_t const& spep, offline_message msg) {
+        auto & idx = active_sessions_.get<tag_con>();
+        auto it = idx.find(spep);
+        if (it == idx.end()) return;
+        idx.modify(it,
+                   [&](session_state & val) {
+                       auto dropped = val.offline_messages.dropped();
+                       val.offline_messages.push(offline_queue_limits_, val.client_id, MQTT_NS::force_move(msg));
+                       count(stats_.messages_dropped, val.offline_messages.dropped() - dropped);
+                       val.window->queued = !val.offline_messages.empty();
+                   },
+                   [](session_state&) { BOOST_ASSERT(false); });
+    }
+
+    /**
+     * @brief send_queued sends the queued messages of the active session as long as its inflight window has room.
+     *
+     * @param s - The active session.
+     */
+    void send_queued(session_state& s) {
+        auto& window = *s.window;
+        std::size_t sent = 0;
+        std::size_t bytes = 0;
+        s.offline_messages.drain_while(
+            offline_queue_limits_,
+            [&](offline_message const& msg) {
+                return msg.pubopts.get_qos() == MQTT_NS::qos::at_most_once || window.inflight < window.receive_maximum;
+            },
+            [&](offline_message msg) {
+                if (msg.pubopts.get_qos() != MQTT_NS::qos::at_most_once) ++window.inflight;
+                ++sent;
+                bytes += msg.size();
+                auto props = remaining_expiry_props(msg);
+                s.con->async_publish(
+                    MQTT_NS::force_move(msg.topic),
+                    MQTT_NS::force_move(msg.contents),
+                    msg.pubopts,
+                    MQTT_NS::force_move(props)
+                );
+            }
+        );
+        window.queued = !s.offline_messages.empty();
+        count(stats_.messages_sent, sent);
+        count(stats_.bytes_sent, bytes);
+    }
+
+    /**
+     * @brief release_inflight frees the slot of the acknowledged message, and sends the next queued one.
+     *        It is called when PUBACK or PUBCOMP is received.
+     *
+     * @param spep - The connection that received the acknowledgement.
+     */
+    void release_inflight(con_sp_t const& spep) {
+        auto & idx = active_sessions_.get<tag_con>();
+        auto it = idx.find(spep);
+        if (it == idx.end() || !it->window) return;
+        auto& window = *it->window;
+        if (window.inflight != 0) --window.inflight;
+        if (window.queued) {
+            idx.modify(it,
+                       [&](session_state & val) { send_queued(val); },
+                       [](session_state&) { BOOST_ASSERT(false); });
+        }
+    }
+
+    /**
+     * @brief invalidate_match_cache removes the cached subscribers of the topic.
+     *        It must be called whenever an element of subs_ with the topic is added,
+     *        removed, or modified.
+     *
+     * @param topic - The topic of the changed subscription.
+     */
+    void invalidate_match_cache(interned_topic const& topic) {
+        match_cache_.erase(topic.id());
+    }
+
+    // Counters of the whole broker. The broker runs on one thread, so they are only updated
+    // from that thread. They are relaxed atomics so that they can be read from other threads
+    // without adding any fence to the publish path.
+    struct broker_stats {
+        std::atomic<std::uint64_t> messages_received { 0 };
+        std::atomic<std::uint64_t> bytes_received { 0 };
+        std::atomic<std::uint64_t> messages_sent { 0 };
+        std::atomic<std::uint64_t> bytes_sent { 0 };
+        std::atomic<std::uint64_t> messages_dropped { 0 };
+    };
+
+    // Counters of a topic. They are only accessed from the broker thread.
+    struct topic_stat {
+        explicit topic_stat(interned_topic topic)
+            :topic(MQTT_NS::force_move(topic)) {}
+        interned_topic topic;
+        std::uint64_t messages_received = 0;
+        std::uint64_t bytes_received = 0;
+    };
+
+    static void count(std::atomic<std::uint64_t>& counter, std::size_t n) {
+        counter.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief publish_sys aggregates the statistics and publishes them on the $SYS topics.
+     */
+    void publish_sys() {
+        std::size_t queued = 0;
+        for (auto const& s : non_active_sessions_) queued += s.offline_messages.size();
+
+        std::vector<std::pair<std::string, std::uint64_t>> values {
+            { "$SYS/broker/messages/received", stats_.messages_received.load(std::memory_order_relaxed) },
+            { "$SYS/broker/messages/sent", stats_.messages_sent.load(std::memory_order_relaxed) },
+            { "$SYS/broker/messages/dropped", stats_.messages_dropped.load(std::memory_order_relaxed) },
+            { "$SYS/broker/bytes/received", stats_.bytes_received.load(std::memory_order_relaxed) },
+            { "$SYS/broker/bytes/sent", stats_.bytes_sent.load(std::memory_order_relaxed) },
+            { "$SYS/broker/clients/connected", active_sessions_.size() },
+            { "$SYS/broker/clients/disconnected", non_active_sessions_.size() },
+            { "$SYS/broker/subscriptions/count", subs_.size() + saved_subs_.size() },
+            { "$SYS/broker/retained messages/count", retains_.size() },
+            { "$SYS/broker/store/messages/count", queued },
+        };
+        for (auto const& e : topic_stats_) {
+            auto const& topic = e.second.topic.str();
+            auto prefix = "$SYS/broker/topics/" + std::string(topic.data(), topic.size());
+            values.emplace_back(prefix + "/messages/received", e.second.messages_received);
+            values.emplace_back(prefix + "/bytes/received", e.second.bytes_received);
+        }
+
+        // The values are taken before publishing, so the retained $SYS messages
+        // don't affect the counts of this round.
+        for (auto const& v : values) {
+            do_publish(
+                MQTT_NS::allocate_buffer(v.first),
+                MQTT_NS::allocate_buffer(std::to_string(v.second)),
+                MQTT_NS::qos::at_most_once | MQTT_NS::retain::yes,
+                MQTT_NS::v5::properties{});
+        }
+
+        tim_sys_ = timers_.add(sys_interval_, [this] { publish_sys(); });
+    }
+
+    // Move the state out of the element that is going to be erased.
+    // The keys are left in the element, so the containers stay consistent until it is erased.
+    template <typename Index>
+    static session_state take_session_state(Index& idx, typename Index::iterator it) {
+        session_state state;
+        idx.modify(it,
+                   [&](session_state & val) {
+                       state = MQTT_NS::force_move(val);
+                       val.con = state.con;
+                       val.client_id = state.client_id;
+                   },
+                   [](session_state&) { BOOST_ASSERT(false); });
+        return state;
+    }
+
+    void cancel_session_timers(session_state& s) {
+        if (s.tim_session_expiry) timers_.cancel(s.tim_session_expiry.value());
+        if (s.tim_will_delay) timers_.cancel(s.tim_will_delay.value());
+        if (s.tim_message_expiry) timers_.cancel(s.tim_message_expiry.value());
+        s.tim_session_expiry = MQTT_NS::nullopt;
+        s.tim_will_delay = MQTT_NS::nullopt;
+        s.tim_message_expiry = MQTT_NS::nullopt;
+        s.next_message_expiry = MQTT_NS::nullopt;
+    }
+
+    void schedule_session_expiry(session_state& s) {
+        // 0xFFFFFFFF means that the session does not expire.
+        if (s.session_expiry_interval &&
+            s.session_expiry_interval.value() != std::chrono::seconds(0xFFFFFFFFUL)) {
+            s.tim_session_expiry = timers_.add(
+                s.session_expiry_interval.value(),
+                [this, client_id = s.client_id] { expire_session(client_id); }
+            );
+        }
+    }
+
+    void periodic_snapshot() {
+        tim_snapshot_ = timers_.add(snapshot_interval_, [this] { periodic_snapshot(); });
+        if (snapshot_writing_.valid()) {
+            // Skip this time if the previous snapshot is still being written.
+            if (snapshot_writing_.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+            // The previous snapshot is durable, so the log doesn't need the records before it.
+            if (snapshot_writing_.get() && wal_) wal_->compact(snapshot_wal_offset_);
+        }
+        auto snap = make_snapshot();
+        snapshot_wal_offset_ = snap.wal_offset;
+        snapshot_writing_ = std::async(
+            std::launch::async,
+            [path = snapshot_path_, data = snapshot_store::encode(snap)] {
+                return snapshot_store::write(path, data);
+            }
+        );
+    }
+
+    /**
+     * @brief make_snapshot copies the persistent state.
+     *        The active sessions are included as if they were disconnected now.
+     */
+    broker_snapshot make_snapshot() const {
+        broker_snapshot snap;
+        // The records before the offset have been applied to the state.
+        if (wal_) snap.wal_offset = wal_->offset();
+
+        auto copy_messages =
+            [](session_state const& s, snapshot_session& ss) {
+                s.offline_messages.for_each(
+                    [&](offline_message const& msg) {
+                        ss.messages.push_back(msg);
+                    }
+                );
+            };
+        for (auto const& s : active_sessions_) {
+            if (s.con->clean_session() && !s.session_expiry_interval) continue;
+            snapshot_session ss{ s.client_id, s.session_expiry_interval, {}, {} };
+            auto const& idx = subs_.get<tag_con>();
+            for (auto const& sub : boost::make_iterator_range(idx.equal_range(s.con))) {
+                ss.subscriptions.push_back(snapshot_subscription{ sub.topic.str(), sub.qos_value, sub.rap_value });
+            }
+            copy_messages(s, ss);
+            snap.sessions.emplace_back(MQTT_NS::force_move(ss));
+        }
+        for (auto const& s : non_active_sessions_) {
+            snapshot_session ss{ s.client_id, s.session_expiry_interval, {}, {} };
+            auto const& idx = saved_subs_.get<tag_client_id>();
+            for (auto const& sub : boost::make_iterator_range(idx.equal_range(s.client_id))) {
+                ss.subscriptions.push_back(snapshot_subscription{ sub.topic.str(), sub.qos_value, sub.rap_value });
+            }
+            copy_messages(s, ss);
+            snap.sessions.emplace_back(MQTT_NS::force_move(ss));
+        }
+        for (auto const& r : retains_) {
+            snap.retains.push_back(snapshot_retain{ r.topic.str(), r.contents, r.props, r.qos_value });
+        }
+        return snap;
+    }
+
+    /**
+     * @brief restore adds the sessions of the snapshot as not active sessions,
+     *        and the retained messages of the snapshot.
+     */
+    void restore(broker_snapshot const& snap) {
+        for (auto const& ss : snap.sessions) {
+            session_state state(nullptr, ss.client_id, MQTT_NS::nullopt, ss.session_expiry_interval);
+            for (auto const& msg : ss.messages) {
+                state.offline_messages.push(offline_queue_limits_, ss.client_id, msg);
+            }
+            schedule_session_expiry(state);
+            auto next = state.offline_messages.prune(std::chrono::steady_clock::now());
+            if (next) schedule_message_expiry(state, next.value());
+            for (auto const& sub : ss.subscriptions) {
+                auto interned = topics_.intern(sub.topic);
+                invalidate_match_cache(interned);
+                saved_subs_.emplace(ss.client_id, MQTT_NS::force_move(interned), sub.qos_value, sub.rap_value);
+            }
+            non_active_sessions_.insert(MQTT_NS::force_move(state));
+        }
+        for (auto const& r : snap.retains) {
+            retains_.emplace(topics_.intern(r.topic), r.contents, r.props, r.qos_value);
+        }
+    }
+
+    /**
+     * @brief expire_session discards the non active session whose session expiry interval has passed.
+     *        If the will of the session is waiting for the will delay interval, it is sent now.
+     *
+     * @param client_id - The client id of the session.
+     */
+    void expire_session(MQTT_NS::buffer const& client_id) {
+        auto & idx = non_active_sessions_.get<tag_client_id>();
+        auto it = idx.find(client_id);
+        if (it == idx.end()) return;
+
+        MQTT_NS::optional<MQTT_NS::will> will;
+        idx.modify(it,
+                   [&](session_state & val) {
+                       if (val.tim_will_delay) will = MQTT_NS::force_move(val.will);
+                       cancel_session_timers(val);
+                       val.offline_messages.clear();
+                   },
+                   [](session_state&) { BOOST_ASSERT(false); });
+        idx.erase(it);
+        saved_subs_.get<tag_client_id>().erase(client_id);
+        BOOST_ASSERT(saved_subs_.get<tag_client_id>().count(client_id) == 0);
+        if (wal_) {
+            wal_record rec;
+            rec.type = wal_record_type::session_end;
+            rec.client_id = client_id;
+            wal_->append(rec);
+        }
+
+        if (will) {
+            do_publish(
+                MQTT_NS::force_move(will.value().topic()),
+                MQTT_NS::force_move(will.value().message()),
+                will.value().get_qos() | will.value().get_retain(),
+                MQTT_NS::force_move(will.value().props()));
+        }
+    }
+
+    /**
+     * @brief send_delayed_will sends the will of the non active session whose will delay interval has passed.
+     *
+     * @param client_id - The client id of the session.
+     */
+    void send_delayed_will(MQTT_NS::buffer const& client_id) {
+        auto & idx = non_active_sessions_.get<tag_client_id>();
+        auto it = idx.find(client_id);
+        if (it == idx.end()) return;
+
+        MQTT_NS::optional<MQTT_NS::will> will;
+        idx.modify(it,
+                   [&](session_state & val) {
+                       val.tim_will_delay = MQTT_NS::nullopt;
+                       will = MQTT_NS::force_move(val.will);
+                       val.will = MQTT_NS::nullopt;
+                   },
+                   [](session_state&) { BOOST_ASSERT(false); });
+
+        if (will) {
+            do_publish(
+                MQTT_NS::force_move(will.value().topic()),
+                MQTT_NS::force_move(will.value().message()),
+                will.value().get_qos() | will.value().get_retain(),
+                MQTT_NS::force_move(will.value().props()));
+        }
+    }
+
+    /**
+     * @brief schedule_message_expiry makes sure that the expired messages queued in the
+     *        session are removed at the expiry. Each session has at most one timer, which is
+     *        set to the earliest expiry of its queued messages.
+     *
+     * @param s - The non active session.
+     * @param expiry - The expiry of the message that is queued.
+     */
+    void schedule_message_expiry(session_state& s, std::chrono::steady_clock::time_point expiry) {
+        if (s.tim_message_expiry && s.next_message_expiry.value() <= expiry) return;
+        if (s.tim_message_expiry) timers_.cancel(s.tim_message_expiry.value());
+        s.next_message_expiry = expiry;
+        s.tim_message_expiry = timers_.add(
+            expiry - std::chrono::steady_clock::now(),
+            [this, client_id = s.client_id] { prune_offline_messages(client_id); }
+        );
+    }
+
+    void prune_offline_messages(MQTT_NS::buffer const& client_id) {
+        auto & idx = non_active_sessions_.get<tag_client_id>();
+        auto it = idx.find(client_id);
+        if (it == idx.end()) return;
+
+        idx.modify(it,
+                   [&](session_state & val) {
+                       val.tim_message_expiry = MQTT_NS::nullopt;
+                       val.next_message_expiry = MQTT_NS::nullopt;
+                       auto next = val.offline_messages.prune(std::chrono::steady_clock::now());
+                       if (next) schedule_message_expiry(val, next.value());
+                   },
+                   [](session_state&) { BOOST_ASSERT(false); });
+    }
+
+    /**
+     * @brief message_expiry gets the time when the message expires from its message expiry interval.
+     *
+     * @param props - The properties of the message.
+     * @return The expiry, or nullopt if the message doesn't expire.
+     */
+    static MQTT_NS::optional<std::chrono::steady_clock::time_point> message_expiry(MQTT_NS::v5::properties const& props) {
+        MQTT_NS::optional<std::chrono::steady_clock::time_point> expiry;
+        for (auto const& p : props) {
+            MQTT_NS::visit(
+                MQTT_NS::make_lambda_visitor(
+                    [&expiry](MQTT_NS::v5::property::message_expiry_interval const& t) {
+                        expiry.emplace(std::chrono::steady_clock::now() + std::chrono::seconds(t.val()));
+                    },
+                    [](auto&& ...) {
+                    }
+                ),
+                p
+            );
+        }
+        return expiry;
+    }
+
+    /**
+     * @brief remaining_expiry_props gets the properties to send the queued message with.
+     *        The message expiry interval is set to the time that remains.
+     *        http://docs.oasis-open.org/mqtt/mqtt/v5.0/cs02/mqtt-v5.0-cs02.html#_Toc514345348 [MQTT-3.3.2-6]
+     *
+     * @param msg - The queued message.
+     * @return The properties.
+     */
+    static MQTT_NS::v5::shared_properties remaining_expiry_props(offline_message const& msg) {
+        if (!msg.expiry) return msg.props;
+        auto remaining = std::chrono::duration_cast<std::chrono::seconds>(
+            msg.expiry.value() - std::chrono::steady_clock::now() + std::chrono::seconds(1) - std::chrono::steady_clock::duration(1)
+        ).count();
+        MQTT_NS::v5::properties props;
+        props.reserve(msg.props->get().size());
+        for (auto const& p : msg.props->get()) {
+            MQTT_NS::visit(
+                MQTT_NS::make_lambda_visitor(
+                    [&](MQTT_NS::v5::property::message_expiry_interval const&) {
+                        props.emplace_back(
+                            MQTT_NS::v5::property::message_expiry_interval(
+                                static_cast<std::uint32_t>(std::max<decltype(remaining)>(remaining, 1))
+                            )
+                        );
+                    },
+                    [&](auto const&) {
+                        props.push_back(p);
+                    }
+                ),
+                p
+            );
+        }
+        return MQTT_NS::v5::make_shared_properties(MQTT_NS::force_move(props));
+    }
+
     as::io_context& ioc_; ///< The boost asio context to run this broker on.
     as::steady_timer tim_disconnect_; ///< Used to delay disconnect handling for testing
     MQTT_NS::optional<std::chrono::steady_clock::duration> delay_disconnect_; ///< Used to delay disconnect handling for testing
+    MQTT_NS::timer_wheel timers_; ///< Drives session expiry, will delay, and message expiry of the non active sessions.
 
+    // The topic table must be declared before the containers that refer to it,
+    // because the handles unregister the topics from the table on destruction.
+    topic_table topics_; ///< Topics of the subscriptions and the retained messages. Shared between all the containers.
     mi_active_sessions active_sessions_; ///< Map of active client id and connections
     mi_non_active_sessions non_active_sessions_; ///< Storage for sessions not currently active. Indexed by client id.
     mi_sub_con subs_; ///< Map of topic subscriptions to client ids
     mi_session_subscription saved_subs_; ///< Topics and associated messages for clientids that are currently disconnected
     mi_retain retains_; ///< A list of messages retained so they can be sent to newly subscribed clients.
+    std::unordered_map<std::uint64_t, std::shared_ptr<subscriber_list const>> match_cache_; ///< Subscribers of the published topics. Keyed by interned topic id.
+    std::size_t fanout_chunk_size_ = 0; ///< 0 means that every fan-out is delivered at once.
+    std::deque<fanout_job> fanout_queue_; ///< Fan-outs that are being delivered chunk by chunk. The front one is in progress.
+    offline_queue_limits offline_queue_limits_; ///< Limits of the messages queued for each disconnected session.
+    std::size_t max_inflight_ = 0xffff; ///< Upper limit of the inflight window of each connection.
+    std::shared_ptr<MQTT_NS::token_bucket> connect_bucket_; ///< Budget of the CONNECT packets. nullptr if unlimited.
+    bool reply_server_busy_ = true;
+    std::size_t max_pending_connects_ = 0; ///< 0 means unlimited.
+    std::size_t pending_connects_ = 0; ///< Connections that are accepted and haven't sent CONNECT yet.
+    publish_rate_limits publish_rate_limits_;
+
+    broker_stats stats_; ///< Counters that are published on the $SYS topics.
+    std::unordered_map<std::uint64_t, topic_stat> topic_stats_; ///< Counters of each topic. Keyed by interned topic id.
+    bool sys_topic_stats_ = false;
+    std::size_t max_topic_stats_ = 1024; ///< The maximum number of the entries of topic_stats_.
+    std::chrono::steady_clock::duration sys_interval_ = std::chrono::steady_clock::duration::zero();
+    MQTT_NS::optional<MQTT_NS::timer_wheel::handle> tim_sys_;
+    std::unique_ptr<write_ahead_log> wal_; ///< Log of the accepted QoS1 and QoS2 messages. nullptr if durability is disabled.
+    std::string snapshot_path_;
+    std::chrono::steady_clock::duration snapshot_interval_ = std::chrono::steady_clock::duration::zero();
+    MQTT_NS::optional<MQTT_NS::timer_wheel::handle> tim_snapshot_;
+    std::future<bool> snapshot_writing_; ///< The snapshot that is being written. Its destructor waits for the write.
+    std::uint64_t snapshot_wal_offset_ = 0; ///< The write ahead log offset of snapshot_writing_.
 
     // MQTTv5 members
     MQTT_NS::v5::properties connack_props_;
@@ -48,8 +48,14 @@ public:
         return b_;
     }
 
+    MQTT_NS::server<>& server() {
+        return server_;
+    }
+
     void close() {
         server_.close();
+        // The pending timers of the broker would keep the io_context running.
+        b_.cancel_timers();
     }
 
 private:
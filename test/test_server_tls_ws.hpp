@@ -58,6 +58,8 @@ public:
 
     void close() {
         server_.close();
+        // The pending timers of the broker would keep the io_context running.
+        b_.cancel_timers();
     }
 
 private:
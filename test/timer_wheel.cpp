@@ -0,0 +1,100 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "test_main.hpp"
+
+#include <thread>
+#include <vector>
+
+#include <mqtt/timer_wheel.hpp>
+
+BOOST_AUTO_TEST_SUITE(test_timer_wheel)
+
+namespace as = boost::asio;
+
+BOOST_AUTO_TEST_CASE( order ) {
+    as::io_context ioc;
+    MQTT_NS::timer_wheel tw(ioc, std::chrono::milliseconds(1));
+    std::vector<int> fired;
+    auto start = std::chrono::steady_clock::now();
+    // level 1
+    tw.add(std::chrono::milliseconds(300), [&] { fired.push_back(3); });
+    // level 0
+    tw.add(std::chrono::milliseconds(5), [&] { fired.push_back(1); });
+    tw.add(std::chrono::milliseconds(100), [&] { fired.push_back(2); });
+    BOOST_TEST(tw.size() == 3);
+    ioc.run();
+    BOOST_TEST(fired == (std::vector<int>{ 1, 2, 3 }));
+    BOOST_TEST((std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(300)));
+    BOOST_TEST(tw.size() == 0);
+}
+
+BOOST_AUTO_TEST_CASE( cancel ) {
+    as::io_context ioc;
+    MQTT_NS::timer_wheel tw(ioc, std::chrono::milliseconds(1));
+    std::vector<int> fired;
+    auto h1 = tw.add(std::chrono::milliseconds(10), [&] { fired.push_back(1); });
+    auto h2 = tw.add(std::chrono::milliseconds(80), [&] { fired.push_back(2); });
+    tw.add(std::chrono::milliseconds(20), [&] { fired.push_back(3); });
+    BOOST_TEST(tw.cancel(h1));
+    BOOST_TEST(!tw.cancel(h1));
+    ioc.run();
+    BOOST_TEST(fired == (std::vector<int>{ 3, 2 }));
+    // Already expired.
+    BOOST_TEST(!tw.cancel(h2));
+}
+
+BOOST_AUTO_TEST_CASE( clear ) {
+    as::io_context ioc;
+    MQTT_NS::timer_wheel tw(ioc, std::chrono::milliseconds(1));
+    bool fired = false;
+    tw.add(std::chrono::hours(1), [&] { fired = true; });
+    tw.add(std::chrono::milliseconds(10), [&] { fired = true; });
+    tw.clear();
+    BOOST_TEST(tw.size() == 0);
+    // The io_context doesn't wait for the cancelled timers.
+    auto start = std::chrono::steady_clock::now();
+    ioc.run();
+    BOOST_TEST((std::chrono::steady_clock::now() - start < std::chrono::seconds(1)));
+    BOOST_TEST(!fired);
+}
+
+BOOST_AUTO_TEST_CASE( add_from_handler ) {
+    as::io_context ioc;
+    MQTT_NS::timer_wheel tw(ioc, std::chrono::milliseconds(1));
+    std::vector<int> fired;
+    MQTT_NS::timer_wheel::handle h2 = 0;
+    tw.add(
+        std::chrono::milliseconds(10),
+        [&] {
+            fired.push_back(1);
+            tw.add(std::chrono::milliseconds(10), [&] { fired.push_back(3); });
+            // Cancel a timer that expires on the same tick.
+            BOOST_TEST(tw.cancel(h2));
+        }
+    );
+    h2 = tw.add(std::chrono::milliseconds(10), [&] { fired.push_back(2); });
+    ioc.run();
+    BOOST_TEST(fired == (std::vector<int>{ 1, 3 }));
+}
+
+BOOST_AUTO_TEST_CASE( idle ) {
+    as::io_context ioc;
+    MQTT_NS::timer_wheel tw(ioc, std::chrono::milliseconds(1));
+    std::vector<int> fired;
+    tw.add(std::chrono::milliseconds(1), [&] { fired.push_back(1); });
+    ioc.run();
+    ioc.restart();
+    // The wheel catches up with the time that passed while it was empty.
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    auto start = std::chrono::steady_clock::now();
+    tw.add(std::chrono::milliseconds(20), [&] { fired.push_back(2); });
+    ioc.run();
+    BOOST_TEST(fired == (std::vector<int>{ 1, 2 }));
+    BOOST_TEST((std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,133 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "test_main.hpp"
+
+#include <mqtt/topic_router.hpp>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(test_topic_router)
+
+namespace {
+
+using router_t = MQTT_NS::topic_router<std::function<void(std::vector<std::string>&)>>;
+
+std::function<void(std::vector<std::string>&)> record(std::string name) {
+    return
+        [name = MQTT_NS::force_move(name)](std::vector<std::string>& called) {
+            called.push_back(name);
+        };
+}
+
+std::vector<std::string> dispatch(router_t const& r, MQTT_NS::string_view topic) {
+    std::vector<std::string> called;
+    r.dispatch(topic, called);
+    std::sort(called.begin(), called.end());
+    return called;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE( wildcards ) {
+    router_t r;
+    r.add("a/b/c", record("exact"));
+    r.add("a/+/c", record("plus"));
+    r.add("a/#", record("multi"));
+    r.add("#", record("all"));
+    r.add("+/+", record("two"));
+
+    BOOST_TEST((dispatch(r, "a/b/c") == std::vector<std::string>{ "all", "exact", "multi", "plus" }));
+    BOOST_TEST((dispatch(r, "a/x/c") == std::vector<std::string>{ "all", "multi", "plus" }));
+    // '#' matches the parent level.
+    BOOST_TEST((dispatch(r, "a") == std::vector<std::string>{ "all", "multi" }));
+    BOOST_TEST((dispatch(r, "a/b") == std::vector<std::string>{ "all", "multi", "two" }));
+    BOOST_TEST((dispatch(r, "b/c/d") == std::vector<std::string>{ "all" }));
+    // Empty levels are levels.
+    BOOST_TEST((dispatch(r, "/c") == std::vector<std::string>{ "all", "two" }));
+}
+
+BOOST_AUTO_TEST_CASE( system_topic ) {
+    router_t r;
+    r.add("#", record("all"));
+    r.add("+/info", record("plus"));
+    r.add("$SYS/#", record("sys"));
+
+    BOOST_TEST((dispatch(r, "$SYS/info") == std::vector<std::string>{ "sys" }));
+    BOOST_TEST((dispatch(r, "x/info") == std::vector<std::string>{ "all", "plus" }));
+}
+
+BOOST_AUTO_TEST_CASE( remove ) {
+    router_t r;
+    auto id1 = r.add("a/+", record("1"));
+    r.add("a/+", record("2"));
+    BOOST_TEST((dispatch(r, "a/b") == std::vector<std::string>{ "1", "2" }));
+    BOOST_TEST(r.remove(id1));
+    BOOST_TEST(!r.remove(id1));
+    BOOST_TEST(r.size() == 1);
+    BOOST_TEST((dispatch(r, "a/b") == std::vector<std::string>{ "2" }));
+}
+
+BOOST_AUTO_TEST_CASE( subscription_identifier ) {
+    router_t r;
+    r.add("a/+", record("plus"), 1);
+    r.add("x/y", record("other"), 1);
+    r.add("a/b", record("exact"), 2);
+    r.add("a/#", record("multi"));
+
+    std::vector<std::string> called;
+    // The handlers of the other identifiers are skipped. The handlers without an identifier are called.
+    // The identifier covers all filters of the SUBSCRIBE, so the topic is matched too.
+    BOOST_TEST(r.dispatch(MQTT_NS::v5::properties { MQTT_NS::v5::property::subscription_identifier(1) }, "a/b", called) == 2);
+    std::sort(called.begin(), called.end());
+    BOOST_TEST((called == std::vector<std::string>{ "multi", "plus" }));
+
+    called.clear();
+    BOOST_TEST(
+        r.dispatch(
+            MQTT_NS::v5::properties {
+                MQTT_NS::v5::property::subscription_identifier(1),
+                MQTT_NS::v5::property::subscription_identifier(2)
+            },
+            "a/b",
+            called
+        ) == 3
+    );
+
+    // The unknown identifier falls back to the topic matching.
+    called.clear();
+    BOOST_TEST(r.dispatch(MQTT_NS::v5::properties { MQTT_NS::v5::property::subscription_identifier(3) }, "a/b", called) == 3);
+
+    called.clear();
+    BOOST_TEST(r.dispatch(MQTT_NS::v5::properties {}, "a/c", called) == 2);
+}
+
+BOOST_AUTO_TEST_CASE( subscription_identifier_wildcards ) {
+    router_t r;
+    r.add("a/#", record("multi"), 1);
+    r.add("a/+/c", record("plus"), 1);
+    r.add("#", record("all"), 1);
+    r.add("b/+", record("other"), 2);
+
+    auto dispatch_id =
+        [&](MQTT_NS::string_view topic) {
+            std::vector<std::string> called;
+            r.dispatch(MQTT_NS::v5::properties { MQTT_NS::v5::property::subscription_identifier(1) }, topic, called);
+            std::sort(called.begin(), called.end());
+            return called;
+        };
+    BOOST_TEST((dispatch_id("a/b/c") == std::vector<std::string>{ "all", "multi", "plus" }));
+    // '#' matches the parent level.
+    BOOST_TEST((dispatch_id("a") == std::vector<std::string>{ "all", "multi" }));
+    BOOST_TEST((dispatch_id("a/b") == std::vector<std::string>{ "all", "multi" }));
+    BOOST_TEST((dispatch_id("a/b/c/d") == std::vector<std::string>{ "all", "multi" }));
+    BOOST_TEST((dispatch_id("b/c") == std::vector<std::string>{ "all" }));
+    BOOST_TEST((dispatch_id("$SYS/a") == std::vector<std::string>{}));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
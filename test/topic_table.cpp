@@ -0,0 +1,57 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "test_main.hpp"
+#include "topic_table.hpp"
+
+BOOST_AUTO_TEST_SUITE(test_topic_table)
+
+using namespace MQTT_NS::literals;
+
+BOOST_AUTO_TEST_CASE( intern_same_topic ) {
+    topic_table tt;
+    auto t1 = tt.intern("topic1"_mb);
+    auto t2 = tt.intern(MQTT_NS::allocate_buffer("topic1"));
+    auto t3 = tt.intern("topic2"_mb);
+    BOOST_TEST(tt.size() == 2);
+    BOOST_TEST((t1 == t2));
+    BOOST_TEST(t1.id() == t2.id());
+    BOOST_TEST((t1 != t3));
+    BOOST_TEST(t1.id() != t3.id());
+    BOOST_TEST(t1.str() == "topic1");
+    // The same allocation is shared.
+    BOOST_TEST(static_cast<void const*>(t1.str().data()) == static_cast<void const*>(t2.str().data()));
+}
+
+BOOST_AUTO_TEST_CASE( find ) {
+    topic_table tt;
+    BOOST_TEST(!tt.find("topic1"_mb));
+    auto t1 = tt.intern("topic1"_mb);
+    auto found = tt.find("topic1"_mb);
+    BOOST_TEST(found.has_value());
+    BOOST_TEST((found.value() == t1));
+    BOOST_TEST(tt.size() == 1);
+}
+
+BOOST_AUTO_TEST_CASE( release ) {
+    topic_table tt;
+    {
+        auto t1 = tt.intern("topic1"_mb);
+        {
+            auto t2 = t1;
+            BOOST_TEST(tt.size() == 1);
+        }
+        BOOST_TEST(tt.size() == 1);
+    }
+    BOOST_TEST(tt.size() == 0);
+    BOOST_TEST(!tt.find("topic1"_mb));
+    // A topic that is registered again gets a new id.
+    auto t1 = tt.intern("topic1"_mb);
+    auto t2 = tt.intern("topic2"_mb);
+    BOOST_TEST(t1.id() != t2.id());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,146 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_TEST_TOPIC_TABLE_HPP)
+#define MQTT_TEST_TOPIC_TABLE_HPP
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+#include <boost/assert.hpp>
+#include <boost/functional/hash.hpp>
+
+#include <mqtt/buffer.hpp>
+#include <mqtt/optional.hpp>
+#include <mqtt/string_view.hpp>
+
+class topic_table;
+
+/**
+ * @brief Reference counted handle of a topic that is registered in a topic_table.
+ *
+ * All the handles of the same topic share one entry, so the comparison is done by
+ * the id of the entry instead of the topic bytes.
+ * The entry is removed from the table when the last handle is destroyed.
+ */
+class interned_topic {
+public:
+    interned_topic() = default;
+
+    /**
+     * @brief Get the id of the topic.
+     *        The id is unique in the table while the topic is registered.
+     * @return id
+     */
+    std::uint64_t id() const {
+        BOOST_ASSERT(entry_);
+        return entry_->id;
+    }
+
+    /**
+     * @brief Get the topic.
+     * @return topic
+     */
+    MQTT_NS::buffer const& str() const {
+        BOOST_ASSERT(entry_);
+        return entry_->topic;
+    }
+
+    friend bool operator==(interned_topic const& lhs, interned_topic const& rhs) {
+        return lhs.entry_ == rhs.entry_;
+    }
+    friend bool operator!=(interned_topic const& lhs, interned_topic const& rhs) {
+        return !(lhs == rhs);
+    }
+    friend bool operator<(interned_topic const& lhs, interned_topic const& rhs) {
+        return lhs.id() < rhs.id();
+    }
+
+private:
+    friend class topic_table;
+
+    struct entry {
+        entry(MQTT_NS::buffer topic, std::uint64_t id)
+            :topic(MQTT_NS::force_move(topic)), id(id) {}
+        MQTT_NS::buffer topic;
+        std::uint64_t id;
+    };
+
+    explicit interned_topic(std::shared_ptr<entry const> e)
+        :entry_(MQTT_NS::force_move(e)) {}
+
+    std::shared_ptr<entry const> entry_;
+};
+
+/**
+ * @brief Broker wide table of the topics that are used by subscriptions and retained messages.
+ *
+ * Each distinct topic is allocated only once, and every container refers to it via
+ * interned_topic. The table must outlive all the handles that it returned.
+ */
+class topic_table {
+public:
+    topic_table() = default;
+    topic_table(topic_table const&) = delete;
+    topic_table& operator=(topic_table const&) = delete;
+
+    /**
+     * @brief Get the handle of the topic. The topic is registered if it is not registered yet.
+     * @param topic topic
+     * @return handle of the topic
+     */
+    interned_topic intern(MQTT_NS::string_view topic) {
+        auto it = entries_.find(topic);
+        if (it != entries_.end()) {
+            auto sp = it->second.lock();
+            BOOST_ASSERT(sp);
+            return interned_topic(MQTT_NS::force_move(sp));
+        }
+        // Copy the topic to its own allocation. The given topic could be a part of
+        // a received packet, and it shouldn't be kept alive by the table.
+        auto sp = std::shared_ptr<interned_topic::entry>(
+            new interned_topic::entry(MQTT_NS::allocate_buffer(topic), next_id_++),
+            [this](interned_topic::entry* e) {
+                entries_.erase(MQTT_NS::string_view(e->topic));
+                delete e;
+            }
+        );
+        // The key refers to the topic in the entry, so it is valid as long as the entry exists.
+        entries_.emplace(MQTT_NS::string_view(sp->topic), sp);
+        return interned_topic(MQTT_NS::force_move(sp));
+    }
+
+    /**
+     * @brief Get the handle of the topic if it is registered.
+     * @param topic topic
+     * @return handle of the topic, or nullopt if the topic is not registered
+     */
+    MQTT_NS::optional<interned_topic> find(MQTT_NS::string_view topic) const {
+        auto it = entries_.find(topic);
+        if (it == entries_.end()) return MQTT_NS::nullopt;
+        auto sp = it->second.lock();
+        BOOST_ASSERT(sp);
+        return interned_topic(MQTT_NS::force_move(sp));
+    }
+
+    // Number of the registered topics.
+    std::size_t size() const {
+        return entries_.size();
+    }
+
+private:
+    struct hasher {
+        std::size_t operator()(MQTT_NS::string_view s) const {
+            return boost::hash_range(s.begin(), s.end());
+        }
+    };
+
+    std::unordered_map<MQTT_NS::string_view, std::weak_ptr<interned_topic::entry const>, hasher> entries_;
+    std::uint64_t next_id_ = 0;
+};
+
+#endif // MQTT_TEST_TOPIC_TABLE_HPP
@@ -925,4 +925,150 @@ BOOST_AUTO_TEST_CASE( will_prop ) {
     th.join();
 }
 
+BOOST_AUTO_TEST_CASE( will_delay ) {
+    boost::asio::io_context iocb;
+    test_broker b(iocb);
+    MQTT_NS::optional<test_server_no_tls> s;
+    std::promise<void> p;
+    auto f = p.get_future();
+    std::thread th(
+        [&] {
+            s.emplace(iocb, b);
+            p.set_value();
+            iocb.run();
+        }
+    );
+    f.wait();
+    auto finish =
+        [&] {
+            as::post(
+                iocb,
+                [&] {
+                    s->close();
+                }
+            );
+        };
+
+    boost::asio::io_context ioc;
+
+    auto c1 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+    c1->set_client_id("cid1");
+    c1->set_clean_session(true);
+    c1->set_will(
+        MQTT_NS::will(
+            "topic1"_mb,
+            "will_contents"_mb,
+            MQTT_NS::qos::at_most_once,
+            MQTT_NS::v5::properties{
+                MQTT_NS::v5::property::will_delay_interval(1)
+            }
+        ));
+    int c1fd_count = 0;
+    std::chrono::steady_clock::time_point c1fd_time;
+    auto c1_force_disconnect = [&c1, &c1fd_count, &c1fd_time] {
+        if (++c1fd_count == 2) {
+            c1fd_time = std::chrono::steady_clock::now();
+            c1->force_disconnect();
+        }
+    };
+
+    auto c2 = MQTT_NS::make_client(ioc, broker_url, broker_notls_port, MQTT_NS::protocol_version::v5);
+    c2->set_client_id("cid2");
+    c2->set_clean_session(true);
+
+    using packet_id_t = typename std::remove_reference_t<decltype(*c1)>::packet_id_t;
+
+
+    checker chk = {
+        // connect
+        cont("h_connack_1"),
+        // force_disconnect
+        cont("h_error_1"),
+
+        // connect
+        deps("h_connack_2"),
+        // subscribe topic1 QoS0
+        cont("h_suback_2"),
+        cont("h_publish_2"), // will receive after the will delay interval
+        // disconnect
+        cont("h_close_2"),
+
+    };
+
+    c1->set_v5_connack_handler(
+        [&chk, &c1_force_disconnect]
+        (bool sp, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+            MQTT_CHK("h_connack_1");
+            BOOST_TEST(sp == false);
+            BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+            c1_force_disconnect();
+            return true;
+        });
+    c1->set_close_handler(
+        []
+        () {
+            BOOST_CHECK(false);
+        });
+    c1->set_error_handler(
+        [&chk]
+        (MQTT_NS::error_code) {
+            MQTT_CHK("h_error_1");
+        });
+
+    std::uint16_t pid_sub2;
+
+    c2->set_v5_connack_handler(
+        [&chk, &c2, &pid_sub2]
+        (bool sp, MQTT_NS::v5::connect_reason_code connack_return_code, MQTT_NS::v5::properties /*props*/) {
+            MQTT_CHK("h_connack_2");
+            BOOST_TEST(sp == false);
+            BOOST_TEST(connack_return_code == MQTT_NS::v5::connect_reason_code::success);
+            pid_sub2 = c2->subscribe("topic1", MQTT_NS::qos::at_most_once);
+            return true;
+        });
+    c2->set_close_handler(
+        [&chk, &finish]
+        () {
+            MQTT_CHK("h_close_2");
+            finish();
+        });
+    c2->set_error_handler(
+        []
+        (MQTT_NS::error_code) {
+            BOOST_CHECK(false);
+        });
+    c2->set_v5_suback_handler(
+        [&chk, &c1_force_disconnect, &pid_sub2]
+        (packet_id_t packet_id, std::vector<MQTT_NS::v5::suback_reason_code> reasons, MQTT_NS::v5::properties /*props*/) {
+            MQTT_CHK("h_suback_2");
+            BOOST_TEST(packet_id == pid_sub2);
+            BOOST_TEST(reasons.size() == 1U);
+            BOOST_TEST(reasons[0] == MQTT_NS::v5::suback_reason_code::granted_qos_0);
+            c1_force_disconnect();
+            return true;
+        });
+    c2->set_v5_publish_handler(
+        [&chk, &c2, &c1fd_time]
+        (MQTT_NS::optional<packet_id_t> /*packet_id*/,
+         MQTT_NS::publish_options /*pubopts*/,
+         MQTT_NS::buffer topic,
+         MQTT_NS::buffer contents,
+         MQTT_NS::v5::properties /*props*/) {
+            MQTT_CHK("h_publish_2");
+            BOOST_TEST(topic == "topic1");
+            BOOST_TEST(contents == "will_contents");
+            BOOST_TEST((std::chrono::steady_clock::now() - c1fd_time >= std::chrono::seconds(1)));
+            c2->disconnect();
+            return true;
+        });
+
+    // The session has to outlive the connection to delay the will.
+    c1->connect(MQTT_NS::v5::properties{ MQTT_NS::v5::property::session_expiry_interval(10) });
+    c2->connect();
+
+    ioc.run();
+    BOOST_TEST(chk.all());
+    th.join();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,214 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#include "test_main.hpp"
+#include "write_ahead_log.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(test_write_ahead_log)
+
+using namespace MQTT_NS::literals;
+
+namespace {
+
+wal_record make_publish(std::string const& contents, std::uint16_t packet_id) {
+    wal_record rec;
+    rec.type = wal_record_type::publish;
+    rec.client_id = "cid1"_mb;
+    rec.packet_id = packet_id;
+    rec.options = static_cast<std::uint8_t>(MQTT_NS::qos::at_least_once | MQTT_NS::retain::yes);
+    rec.topic = "topic1"_mb;
+    rec.props = MQTT_NS::v5::make_shared_properties(
+        MQTT_NS::v5::properties{
+            MQTT_NS::v5::property::content_type("text"_mb)
+        }
+    );
+    rec.contents = MQTT_NS::allocate_buffer(contents);
+    return rec;
+}
+
+std::vector<wal_record> read_all(std::string const& path) {
+    std::vector<wal_record> ret;
+    write_ahead_log::read(
+        path,
+        [&](wal_record rec) {
+            ret.emplace_back(MQTT_NS::force_move(rec));
+        }
+    );
+    return ret;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE( round_trip ) {
+    std::string path = "./wal_round_trip.log";
+    std::remove(path.c_str());
+
+    boost::asio::io_context ioc;
+    // run_one() waits for the handlers that are posted by the flusher thread.
+    auto guard = boost::asio::make_work_guard(ioc);
+    std::size_t called = 0;
+    {
+        write_ahead_log wal(ioc, wal_config{ path, std::chrono::milliseconds(1), 1024 * 1024 });
+        BOOST_TEST(wal.is_open());
+        wal.append(make_publish("1", 1), [&] { ++called; });
+        wal_record session_end;
+        session_end.type = wal_record_type::session_end;
+        session_end.client_id = "cid1"_mb;
+        session_end.packet_id = 2;
+        wal.append(session_end, [&] { ++called; });
+        // The handlers are called on the io_context after the records are durable.
+        while (called != 2) ioc.run_one();
+    }
+
+    auto recs = read_all(path);
+    BOOST_TEST(recs.size() == 2);
+    BOOST_TEST((recs[0].type == wal_record_type::publish));
+    BOOST_TEST(recs[0].client_id == "cid1");
+    BOOST_TEST(recs[0].packet_id == 1);
+    MQTT_NS::publish_options opts(recs[0].options);
+    BOOST_TEST(opts.get_qos() == MQTT_NS::qos::at_least_once);
+    BOOST_TEST(opts.get_retain() == MQTT_NS::retain::yes);
+    BOOST_TEST(recs[0].topic == "topic1");
+    BOOST_TEST(recs[0].props->get().size() == 1);
+    BOOST_TEST(recs[0].contents == "1");
+    BOOST_TEST((recs[1].type == wal_record_type::session_end));
+    BOOST_TEST(recs[1].packet_id == 2);
+    BOOST_TEST(recs[1].topic.empty());
+    std::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE( torn_tail ) {
+    std::string path = "./wal_torn_tail.log";
+    std::remove(path.c_str());
+
+    boost::asio::io_context ioc;
+    {
+        write_ahead_log wal(ioc, wal_config{ path, std::chrono::milliseconds(1), 1024 * 1024 });
+        wal.append(make_publish("1", 1));
+        wal.append(make_publish("2", 2));
+    }
+    std::size_t full_size = 0;
+    {
+        std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+        full_size = static_cast<std::size_t>(ifs.tellg());
+    }
+    // The second record is partially written.
+    {
+        std::ofstream ofs(path, std::ios::binary | std::ios::app);
+        ofs.write("\x00\x00\x00\x40\x12", 5);
+    }
+    std::size_t valid = write_ahead_log::read(path, [](wal_record) {});
+    BOOST_TEST(valid == full_size);
+    auto recs = read_all(path);
+    BOOST_TEST(recs.size() == 2);
+    BOOST_TEST(recs[1].contents == "2");
+    std::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE( group_commit ) {
+    std::string path = "./wal_group_commit.log";
+    std::remove(path.c_str());
+
+    boost::asio::io_context ioc;
+    // run_one() waits for the handlers that are posted by the flusher thread.
+    auto guard = boost::asio::make_work_guard(ioc);
+    std::size_t called = 0;
+    std::size_t const num = 100;
+    {
+        write_ahead_log wal(ioc, wal_config{ path, std::chrono::milliseconds(50), 1024 * 1024 });
+        for (std::size_t i = 0; i != num; ++i) {
+            wal.append(make_publish(std::to_string(i), static_cast<std::uint16_t>(i + 1)), [&] { ++called; });
+        }
+        while (called != num) ioc.run_one();
+        // Many records share one fsync.
+        BOOST_TEST(wal.commits() < num);
+    }
+    BOOST_TEST(read_all(path).size() == num);
+    std::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE( compact ) {
+    std::string path = "./wal_compact.log";
+    std::remove(path.c_str());
+
+    boost::asio::io_context ioc;
+    auto guard = boost::asio::make_work_guard(ioc);
+    std::size_t called = 0;
+    std::uint64_t snapshot_offset = 0;
+    std::uint64_t end_offset = 0;
+    {
+        write_ahead_log wal(ioc, wal_config{ path, std::chrono::milliseconds(1), 1024 * 1024 });
+        wal.append(make_publish("1", 1));
+        wal.append(make_publish("2", 2));
+        snapshot_offset = wal.offset();
+        wal.append(make_publish("3", 3), [&] { ++called; });
+        // The records before the offset are removed after they are written.
+        wal.compact(snapshot_offset);
+        while (called != 1) ioc.run_one();
+        for (int i = 0; i != 500 && read_all(path).size() != 1; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        BOOST_TEST(read_all(path).size() == 1);
+        // The log offsets continue after the compaction.
+        wal.append(make_publish("4", 4), [&] { ++called; });
+        while (called != 2) ioc.run_one();
+        end_offset = wal.offset();
+    }
+    auto recs = read_all(path);
+    BOOST_TEST(recs.size() == 2);
+    if (recs.size() == 2) {
+        BOOST_TEST(recs[0].contents == "3");
+        BOOST_TEST(recs[1].contents == "4");
+    }
+    std::uint64_t valid_end = 0;
+    recs = write_ahead_log::load(path, snapshot_offset, 2, &valid_end);
+    BOOST_TEST(recs.size() == 2);
+    BOOST_TEST(valid_end == end_offset);
+    {
+        // The reopened log continues from the end.
+        write_ahead_log wal(ioc, wal_config{ path, std::chrono::milliseconds(1), 1024 * 1024 });
+        BOOST_TEST(wal.offset() == end_offset);
+    }
+
+    // The records up to the end are removed from the closed log.
+    BOOST_TEST(write_ahead_log::compact(path, end_offset));
+    BOOST_TEST(read_all(path).empty());
+    BOOST_TEST(write_ahead_log::load(path, end_offset, 2, &valid_end).empty());
+    BOOST_TEST(valid_end == end_offset);
+    std::remove(path.c_str());
+}
+
+#if defined(__linux__)
+
+BOOST_AUTO_TEST_CASE( write_failure ) {
+    // Every write to /dev/full fails with ENOSPC.
+    boost::asio::io_context ioc;
+    auto guard = boost::asio::make_work_guard(ioc);
+    std::size_t called = 0;
+    bool failed = false;
+    write_ahead_log wal(ioc, wal_config{ "/dev/full", std::chrono::milliseconds(10), 1024 * 1024 });
+    BOOST_TEST(wal.is_open());
+    wal.set_failure_handler([&] { failed = true; });
+    wal.append(make_publish("1", 1), [&] { ++called; });
+    wal.append(make_publish("2", 2), [&] { ++called; });
+    while (!failed) ioc.run_one();
+    BOOST_TEST(wal.failed());
+    BOOST_TEST(wal.commits() == 0);
+
+    // The records after the failure are dropped.
+    wal.append(make_publish("3", 3), [&] { ++called; });
+    ioc.run_for(std::chrono::milliseconds(100));
+    BOOST_TEST(called == 0);
+}
+
+#endif // defined(__linux__)
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,613 @@
+// Copyright Takatoshi Kondo 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(MQTT_TEST_WRITE_AHEAD_LOG_HPP)
+#define MQTT_TEST_WRITE_AHEAD_LOG_HPP
+
+#include <mqtt/variant.hpp> // should be top to configure variant limit
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <io.h>
+#else  // defined(_WIN32)
+#include <unistd.h>
+#endif // defined(_WIN32)
+
+#include <boost/asio.hpp>
+#include <boost/crc.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <mqtt/buffer.hpp>
+#include <mqtt/four_byte_util.hpp>
+#include <mqtt/optional.hpp>
+#include <mqtt/property_parse.hpp>
+#include <mqtt/publish.hpp>
+#include <mqtt/shared_properties.hpp>
+#include <mqtt/two_byte_util.hpp>
+
+/**
+ * @brief Settings of the write ahead log.
+ *
+ * The records are made durable together (group commit) when commit_interval passes
+ * after the oldest pending record, or when the pending records reach commit_bytes.
+ */
+struct wal_config {
+    std::string path;
+    std::chrono::steady_clock::duration commit_interval = std::chrono::milliseconds(10);
+    std::size_t commit_bytes = 1024 * 1024;
+};
+
+enum class wal_record_type : std::uint8_t {
+    publish = 1,     ///< A QoS1 or QoS2 PUBLISH is accepted from client_id.
+    session = 3,     ///< client_id connected. options is wal_session_flags, and contents is the session expiry interval.
+    subscribe = 4,   ///< client_id subscribed topic. options is the qos and the rap of the subscription.
+    unsubscribe = 5, ///< client_id unsubscribed topic.
+    session_end = 6, ///< The session of client_id expired.
+    segment = 7,     ///< The first record of a compacted log file. contents is the log offset of the next record.
+};
+
+// options of wal_record_type::session.
+enum wal_session_flags : std::uint8_t {
+    wal_session_clean = 0x01,      ///< The previous session state is discarded.
+    wal_session_persistent = 0x02, ///< The session state outlives the connection.
+};
+
+// A record of the write ahead log. The fields that the type doesn't use are empty.
+struct wal_record {
+    wal_record_type type;
+    MQTT_NS::buffer client_id;
+    std::uint16_t packet_id = 0;
+    // publish_options of the PUBLISH.
+    std::uint8_t options = 0;
+    MQTT_NS::buffer topic;
+    MQTT_NS::v5::shared_properties props;
+    MQTT_NS::buffer contents;
+};
+
+/**
+ * @brief Append only log with group commit.
+ *
+ * append() only copies the record to the pending buffer. A flusher thread writes the pending
+ * records and syncs the file, so a single fsync covers all the records that were appended
+ * since the previous one. The handlers of the records are posted to the io_context after
+ * the records are durable.
+ * If writing or syncing the file fails, the log is failed. The handlers of the records that
+ * are not durable are never called, the later records are dropped, and the failure handler is
+ * posted to the io_context once.
+ *
+ * Record format (integers are big endian):
+ *   length(4) crc32(4) type(1) packet_id(2) options(1) client_id_len(4) client_id
+ *   topic_len(4) topic props_len(4) props contents_len(4) contents
+ * length is the size after crc32, and crc32 is calculated over the same bytes.
+ * A torn record at the tail of the file is detected by the length or the crc, and ignored.
+ *
+ * The log offset of a record is its position in the log since the log was created. compact()
+ * removes the records before an offset, and the file starts with a segment record that
+ * holds the offset of the next record. A file without the segment record starts at offset 0.
+ */
+class write_ahead_log {
+public:
+    /**
+     * @brief Constructor. Opens the log file for appending, and starts the flusher thread.
+     * @param ioc io_context to call the handlers on
+     * @param config settings of the log
+     */
+    write_ahead_log(boost::asio::io_context& ioc, wal_config config)
+        :ioc_(ioc),
+         config_(MQTT_NS::force_move(config)),
+         fp_(std::fopen(config_.path.c_str(), "ab")),
+         flusher_([this] { run(); }) {
+        auto seg = read_segment(config_.path);
+        if (fp_ && std::fseek(fp_, 0, SEEK_END) == 0) {
+            auto pos = std::ftell(fp_);
+            if (pos > 0 && static_cast<std::uint64_t>(pos) >= seg.length) {
+                base_ = seg.offset + static_cast<std::uint64_t>(pos) - seg.length;
+            }
+        }
+        written_ = base_;
+    }
+
+    write_ahead_log(write_ahead_log const&) = delete;
+    write_ahead_log& operator=(write_ahead_log const&) = delete;
+
+    /**
+     * @brief Destructor. The pending records are committed, but their handlers are not called.
+     */
+    ~write_ahead_log() {
+        {
+            std::lock_guard<std::mutex> g(mtx_);
+            stopped_ = true;
+        }
+        cv_.notify_one();
+        flusher_.join();
+        if (fp_) std::fclose(fp_);
+    }
+
+    bool is_open() const {
+        return fp_ != nullptr;
+    }
+
+    /**
+     * @brief Set the handler that is called on the io_context when the log fails.
+     * @param h handler
+     */
+    void set_failure_handler(std::function<void()> h) {
+        std::lock_guard<std::mutex> g(mtx_);
+        failure_handler_ = MQTT_NS::force_move(h);
+    }
+
+    // true if writing or syncing the file has failed. No more records are made durable.
+    bool failed() const {
+        std::lock_guard<std::mutex> g(mtx_);
+        return failed_;
+    }
+
+    /**
+     * @brief Append the record.
+     * @param rec record to append
+     * @param h handler that is called on the io_context after the record is durable.
+     *        It is not called if the log fails.
+     */
+    void append(wal_record const& rec, std::function<void()> h = {}) {
+        auto encoded = encode(rec);
+        bool notify;
+        {
+            std::lock_guard<std::mutex> g(mtx_);
+            if (failed_) return;
+            // The first pending record starts the commit interval.
+            bool first = pending_.empty();
+            if (first) oldest_ = std::chrono::steady_clock::now();
+            pending_ += encoded;
+            appended_ += encoded.size();
+            if (h) handlers_.emplace_back(MQTT_NS::force_move(h));
+            notify = first || pending_.size() >= config_.commit_bytes;
+        }
+        if (notify) cv_.notify_one();
+    }
+
+    // Number of the commits (fsync) so far.
+    std::size_t commits() const {
+        std::lock_guard<std::mutex> g(mtx_);
+        return commits_;
+    }
+
+    // The log offset where the next appended record will be written.
+    // The records before it include all the records that have been appended, even if they are not committed yet.
+    std::uint64_t offset() const {
+        std::lock_guard<std::mutex> g(mtx_);
+        return base_ + appended_;
+    }
+
+    /**
+     * @brief Remove the records before offset from the log file.
+     *
+     * Call this after a snapshot that includes the records before offset is durable.
+     * The flusher thread copies the records after offset to a new file that replaces the
+     * log file, once the records up to offset are written. If it fails, the log file is kept.
+     * @param offset log offset. The return value of offset() when the snapshot was taken.
+     */
+    void compact(std::uint64_t offset) {
+        {
+            std::lock_guard<std::mutex> g(mtx_);
+            if (compact_to_ && compact_to_.value() >= offset) return;
+            compact_to_.emplace(offset);
+        }
+        cv_.notify_one();
+    }
+
+    /**
+     * @brief Remove the records before offset from the log file. The log file must not be opened.
+     * @param path path of the log file
+     * @param offset log offset. The records after it are kept.
+     * @return true if success
+     */
+    static bool compact(std::string const& path, std::uint64_t offset) {
+        auto seg = read_segment(path);
+        if (offset < seg.offset) return false;
+        auto tmp = path + ".tmp";
+        std::FILE* out = std::fopen(tmp.c_str(), "wb");
+        if (!out) return false;
+        wal_record header;
+        header.type = wal_record_type::segment;
+        std::string offset_buf;
+        MQTT_NS::add_uint32_t_to_buf(offset_buf, static_cast<std::uint32_t>(offset >> 32));
+        MQTT_NS::add_uint32_t_to_buf(offset_buf, static_cast<std::uint32_t>(offset));
+        header.contents = MQTT_NS::allocate_buffer(offset_buf);
+        auto encoded = encode(header);
+        bool ok = std::fwrite(encoded.data(), 1, encoded.size(), out) == encoded.size();
+        if (std::FILE* in = std::fopen(path.c_str(), "rb")) {
+            ok = ok && std::fseek(in, static_cast<long>(seg.length + (offset - seg.offset)), SEEK_SET) == 0;
+            char buf[4096];
+            while (ok) {
+                auto len = std::fread(buf, 1, sizeof(buf), in);
+                if (len == 0) {
+                    ok = !std::ferror(in);
+                    break;
+                }
+                ok = std::fwrite(buf, 1, len, out) == len;
+            }
+            std::fclose(in);
+        }
+        ok = ok && std::fflush(out) == 0 && sync(out);
+        std::fclose(out);
+#if defined(_WIN32)
+        // rename() on Windows fails if the destination exists.
+        if (ok) std::remove(path.c_str());
+#endif // defined(_WIN32)
+        if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Read the records of the log file in order.
+     * @param path path of the log file
+     * @param f function that is called as f(wal_record&&)
+     * @return the size of the valid part of the file. The rest is a torn record.
+     */
+    template <typename Func>
+    static std::size_t read(std::string const& path, Func&& f) {
+        // The segment record is not passed to f.
+        std::ifstream ifs(path, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        std::size_t pos = 0;
+        while (data.size() - pos >= 8) {
+            auto len = MQTT_NS::make_uint32_t(data.data() + pos, data.data() + pos + 4);
+            auto crc = MQTT_NS::make_uint32_t(data.data() + pos + 4, data.data() + pos + 8);
+            if (data.size() - pos - 8 < len) break;
+            auto body = MQTT_NS::string_view(data.data() + pos + 8, len);
+            if (checksum(body) != crc) break;
+            auto rec = decode(body);
+            if (!rec) break;
+            if (rec.value().type != wal_record_type::segment) f(MQTT_NS::force_move(rec.value()));
+            pos += 8 + len;
+        }
+        return pos;
+    }
+
+    /**
+     * @brief Load the records after offset using memory mapping.
+     *
+     * Only the part of the file after offset is mapped. The record boundaries are found
+     * by a sequential scan of the length fields, and then the records are verified and
+     * decoded by the threads in parallel. The records after the first invalid one are not returned.
+     *
+     * @param path path of the log file
+     * @param offset log offset of the first record to load
+     * @param threads number of the threads that decode the records
+     * @param valid_end set to the log offset where the valid records end if it is not nullptr
+     * @return the records in the order of the file
+     */
+    static std::vector<wal_record> load(
+        std::string const& path,
+        std::uint64_t offset,
+        std::size_t threads,
+        std::uint64_t* valid_end = nullptr) {
+        namespace ip = boost::interprocess;
+
+        std::vector<wal_record> ret;
+        if (valid_end) *valid_end = 0;
+        std::uint64_t file_size = 0;
+        {
+            std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+            if (!ifs) return ret;
+            file_size = static_cast<std::uint64_t>(ifs.tellg());
+        }
+        auto seg = read_segment(path);
+        // The records before the segment have been removed. The snapshot must be newer than them.
+        if (offset < seg.offset) return ret;
+        auto start = seg.length + (offset - seg.offset);
+        if (file_size <= start) {
+            if (valid_end) *valid_end = seg.offset + (file_size - seg.length);
+            return ret;
+        }
+
+        // The mapping starts at a page boundary.
+        auto page_size = ip::mapped_region::get_page_size();
+        auto map_start = start - start % page_size;
+        ip::file_mapping fm(path.c_str(), ip::read_only);
+        ip::mapped_region region(fm, ip::read_only, static_cast<ip::offset_t>(map_start));
+        auto data = static_cast<char const*>(region.get_address()) + (start - map_start);
+        auto size = region.get_size() - static_cast<std::size_t>(start - map_start);
+
+        std::vector<std::size_t> positions;
+        std::size_t pos = 0;
+        while (size - pos >= 8) {
+            auto len = MQTT_NS::make_uint32_t(data + pos, data + pos + 4);
+            if (size - pos - 8 < len) break;
+            positions.push_back(pos);
+            pos += 8 + len;
+        }
+
+        std::vector<MQTT_NS::optional<wal_record>> decoded(positions.size());
+        parallel_for(
+            positions.size(),
+            threads,
+            [&](std::size_t i) {
+                auto p = positions[i];
+                auto len = MQTT_NS::make_uint32_t(data + p, data + p + 4);
+                auto crc = MQTT_NS::make_uint32_t(data + p + 4, data + p + 8);
+                auto body = MQTT_NS::string_view(data + p + 8, len);
+                if (checksum(body) == crc) decoded[i] = decode(body);
+            }
+        );
+
+        ret.reserve(decoded.size());
+        std::size_t end = 0;
+        for (std::size_t i = 0; i != decoded.size(); ++i) {
+            if (!decoded[i]) break;
+            ret.emplace_back(MQTT_NS::force_move(decoded[i].value()));
+            end = i + 1 == positions.size() ? pos : positions[i + 1];
+        }
+        if (valid_end) *valid_end = offset + end;
+        return ret;
+    }
+
+    /**
+     * @brief Cut the torn record at the tail of the log file, so that new records follow the valid ones.
+     * @param path path of the log file
+     * @param offset log offset where the valid records end. valid_end of load().
+     * @return true if success
+     */
+    static bool truncate(std::string const& path, std::uint64_t offset) {
+        auto seg = read_segment(path);
+        if (offset < seg.offset) return false;
+        auto size = seg.length + (offset - seg.offset);
+#if defined(_WIN32)
+        std::FILE* fp = std::fopen(path.c_str(), "r+b");
+        if (!fp) return false;
+        bool ret = _chsize_s(_fileno(fp), static_cast<__int64>(size)) == 0;
+        std::fclose(fp);
+        return ret;
+#else  // defined(_WIN32)
+        return ::truncate(path.c_str(), static_cast<off_t>(size)) == 0;
+#endif // defined(_WIN32)
+    }
+
+    /**
+     * @brief Call f(i) for i in [0, num) on the threads. Each thread takes a contiguous range.
+     * @param num number of the calls
+     * @param threads number of the threads. The calling thread is one of them.
+     * @param f function to call
+     */
+    template <typename Func>
+    static void parallel_for(std::size_t num, std::size_t threads, Func const& f) {
+        threads = std::max<std::size_t>(1, std::min(threads, num));
+        std::vector<std::thread> ths;
+        auto chunk = (num + threads - 1) / threads;
+        for (std::size_t t = 1; t < threads; ++t) {
+            ths.emplace_back(
+                [&f, begin = t * chunk, end = std::min(num, (t + 1) * chunk)] {
+                    for (auto i = begin; i < end; ++i) f(i);
+                }
+            );
+        }
+        for (std::size_t i = 0; i != std::min(num, chunk); ++i) f(i);
+        for (auto& th : ths) th.join();
+    }
+
+private:
+    // The segment record at the head of the log file.
+    struct segment_info {
+        std::uint64_t offset = 0; // log offset of the first record after the segment record
+        std::uint64_t length = 0; // size of the segment record in the file
+    };
+
+    static segment_info read_segment(std::string const& path) {
+        segment_info seg;
+        std::ifstream ifs(path, std::ios::binary);
+        char head[8];
+        if (!ifs.read(head, sizeof(head))) return seg;
+        auto len = MQTT_NS::make_uint32_t(head, head + 4);
+        auto crc = MQTT_NS::make_uint32_t(head + 4, head + 8);
+        // A segment record is small. Other records are not read.
+        if (len > 64) return seg;
+        std::string body(len, '\0');
+        if (!ifs.read(&body[0], static_cast<std::streamsize>(len))) return seg;
+        if (checksum(body) != crc) return seg;
+        auto rec = decode(body);
+        if (!rec || rec.value().type != wal_record_type::segment || rec.value().contents.size() != 8) return seg;
+        auto const& c = rec.value().contents;
+        seg.offset =
+            (static_cast<std::uint64_t>(MQTT_NS::make_uint32_t(c.data(), c.data() + 4)) << 32) |
+            MQTT_NS::make_uint32_t(c.data() + 4, c.data() + 8);
+        seg.length = 8 + len;
+        return seg;
+    }
+
+    static std::uint32_t checksum(MQTT_NS::string_view body) {
+        boost::crc_32_type crc;
+        crc.process_bytes(body.data(), body.size());
+        return crc.checksum();
+    }
+
+    static void add_field(std::string& buf, MQTT_NS::string_view field) {
+        MQTT_NS::add_uint32_t_to_buf(buf, static_cast<std::uint32_t>(field.size()));
+        buf.append(field.data(), field.size());
+    }
+
+    static std::string encode(wal_record const& rec) {
+        std::string body;
+        body.push_back(static_cast<char>(rec.type));
+        MQTT_NS::add_uint16_t_to_buf(body, rec.packet_id);
+        body.push_back(static_cast<char>(rec.options));
+        add_field(body, rec.client_id);
+        add_field(body, rec.topic);
+        if (rec.props) {
+            auto encoded = rec.props->encoded();
+            add_field(body, MQTT_NS::string_view(static_cast<char const*>(encoded.data()), encoded.size()));
+        }
+        else {
+            add_field(body, MQTT_NS::string_view());
+        }
+        add_field(body, rec.contents);
+
+        std::string ret;
+        ret.reserve(8 + body.size());
+        MQTT_NS::add_uint32_t_to_buf(ret, static_cast<std::uint32_t>(body.size()));
+        MQTT_NS::add_uint32_t_to_buf(ret, checksum(body));
+        ret += body;
+        return ret;
+    }
+
+    static MQTT_NS::optional<MQTT_NS::buffer> read_field(MQTT_NS::string_view& body) {
+        if (body.size() < 4) return MQTT_NS::nullopt;
+        auto len = MQTT_NS::make_uint32_t(body.data(), body.data() + 4);
+        body.remove_prefix(4);
+        if (body.size() < len) return MQTT_NS::nullopt;
+        auto ret = MQTT_NS::allocate_buffer(body.substr(0, len));
+        body.remove_prefix(len);
+        return ret;
+    }
+
+    static MQTT_NS::optional<wal_record> decode(MQTT_NS::string_view body) {
+        if (body.size() < 4) return MQTT_NS::nullopt;
+        wal_record rec;
+        rec.type = static_cast<wal_record_type>(body[0]);
+        rec.packet_id = MQTT_NS::make_uint16_t(body.data() + 1, body.data() + 3);
+        rec.options = static_cast<std::uint8_t>(body[3]);
+        body.remove_prefix(4);
+        auto client_id = read_field(body);
+        if (!client_id) return MQTT_NS::nullopt;
+        auto topic = read_field(body);
+        if (!topic) return MQTT_NS::nullopt;
+        auto props = read_field(body);
+        if (!props) return MQTT_NS::nullopt;
+        auto contents = read_field(body);
+        if (!contents) return MQTT_NS::nullopt;
+        rec.client_id = MQTT_NS::force_move(client_id.value());
+        rec.topic = MQTT_NS::force_move(topic.value());
+        rec.props = MQTT_NS::v5::make_shared_properties(MQTT_NS::v5::property::parse(MQTT_NS::force_move(props.value())));
+        rec.contents = MQTT_NS::force_move(contents.value());
+        return rec;
+    }
+
+    // The flusher thread.
+    void run() {
+        std::unique_lock<std::mutex> lk(mtx_);
+        while (true) {
+            // The records up to the offset of the compaction must be in the file.
+            if (compact_to_ && compact_to_.value() <= written_ && !failed_ && !stopped_) {
+                auto offset = compact_to_.value();
+                compact_to_ = MQTT_NS::nullopt;
+                lk.unlock();
+                compact_file(offset);
+                lk.lock();
+                continue;
+            }
+            if (pending_.empty()) {
+                if (stopped_) return;
+                cv_.wait(lk, [&] { return stopped_ || !pending_.empty() || compact_to_; });
+                continue;
+            }
+            // Wait for more records until the oldest one has waited for commit_interval.
+            cv_.wait_until(
+                lk,
+                oldest_ + config_.commit_interval,
+                [&] { return stopped_ || pending_.size() >= config_.commit_bytes; }
+            );
+            std::string data = MQTT_NS::force_move(pending_);
+            pending_.clear();
+            std::vector<std::function<void()>> handlers = MQTT_NS::force_move(handlers_);
+            handlers_.clear();
+            bool stopped = stopped_;
+            lk.unlock();
+
+            // New records are appended to pending_ while the file is synced.
+            // They are committed together by the next round.
+            bool durable =
+                fp_ &&
+                std::fwrite(data.data(), 1, data.size(), fp_) == data.size() &&
+                std::fflush(fp_) == 0 &&
+                sync(fp_);
+            if (durable) {
+                written_ += data.size();
+                if (!stopped) {
+                    boost::asio::post(
+                        ioc_,
+                        [handlers = MQTT_NS::force_move(handlers)] {
+                            for (auto const& h : handlers) h();
+                        }
+                    );
+                }
+                lk.lock();
+                ++commits_;
+                continue;
+            }
+
+            // The records are not durable, so their handlers are dropped.
+            // The tail of the file is unknown after the failure, so nothing is written any more.
+            lk.lock();
+            failed_ = true;
+            pending_.clear();
+            handlers_.clear();
+            if (!stopped_ && failure_handler_) {
+                boost::asio::post(ioc_, MQTT_NS::force_move(failure_handler_));
+            }
+        }
+    }
+
+    // Called on the flusher thread.
+    void compact_file(std::uint64_t offset) {
+        if (!fp_) return;
+        // The file is closed during the compaction, because it is replaced.
+        std::fclose(fp_);
+        compact(config_.path, offset);
+        fp_ = std::fopen(config_.path.c_str(), "ab");
+        if (fp_) return;
+        std::lock_guard<std::mutex> g(mtx_);
+        failed_ = true;
+        pending_.clear();
+        handlers_.clear();
+        if (!stopped_ && failure_handler_) boost::asio::post(ioc_, MQTT_NS::force_move(failure_handler_));
+    }
+
+    static bool sync(std::FILE* fp) {
+#if defined(_WIN32)
+        return _commit(_fileno(fp)) == 0;
+#else  // defined(_WIN32)
+        return ::fsync(fileno(fp)) == 0;
+#endif // defined(_WIN32)
+    }
+
+    boost::asio::io_context& ioc_;
+    wal_config config_;
+    std::FILE* fp_;
+
+    mutable std::mutex mtx_;
+    std::condition_variable cv_;
+    std::string pending_;
+    std::vector<std::function<void()>> handlers_;
+    std::chrono::steady_clock::time_point oldest_;
+    std::uint64_t base_ = 0;
+    std::uint64_t appended_ = 0;
+    // The log offset of the end of the file. Only the flusher thread updates it after the constructor.
+    std::uint64_t written_ = 0;
+    MQTT_NS::optional<std::uint64_t> compact_to_;
+    std::size_t commits_ = 0;
+    bool stopped_ = false;
+    bool failed_ = false;
+    std::function<void()> failure_handler_;
+
+    // The thread is started after all the members above are initialized.
+    std::thread flusher_;
+};
+
+#endif // MQTT_TEST_WRITE_AHEAD_LOG_HPP